@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "alpaca_broker.h"
+#include "alpaca_log.h"
+
+#define SUCCESS 0
+#define FAILURE 1
+
+// one connection per thread, the broker serves each as its own client
+static __thread int broker_sock = -1;
+static __thread pid_t broker_pid;
+
+int broker_enabled() {
+  const char *env = getenv("ALPACA_I2C_BROKER");
+  return env != NULL && strcmp(env, "0") != 0;
+}
+
+const char* broker_sock_path() {
+  const char *env = getenv("ALPACA_I2C_BROKER");
+  if (env == NULL || strcmp(env, "1") == 0) {
+    return BROKER_SOCK_PATH;
+  }
+  return env;
+}
+
+static int broker_connect() {
+  struct sockaddr_un sa;
+
+  // a forked child must not talk over its parent's connection
+  if (broker_sock >= 0 && broker_pid == getpid()) {
+    return broker_sock;
+  }
+
+  broker_sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (broker_sock < 0) {
+    return -1;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, broker_sock_path(), sizeof(sa.sun_path)-1);
+  if (connect(broker_sock, (struct sockaddr*) &sa, sizeof(sa)) < 0) {
+    LOG_ERROR("could not connect to the i2c broker at %s\n", sa.sun_path);
+    close(broker_sock);
+    broker_sock = -1;
+    return -1;
+  }
+  broker_pid = getpid();
+  return broker_sock;
+}
+
+/*
+ * Send one request and wait for its reply. `iov` holds what follows the
+ * request header, `rdata` receives what follows the reply header. Returns the
+ * reply `ret`, < 0 with errno set on failure.
+ */
+static int broker_call(BrokerReq *req, struct iovec *iov, int niov, BrokerRep *rep, uint8_t *rdata, int rlen) {
+  struct iovec siov[BROKER_MAX_MSGS+2];
+  struct iovec riov[2];
+  struct msghdr mh;
+  int sock = broker_connect();
+
+  if (sock < 0) {
+    errno = ECONNREFUSED;
+    return -1;
+  }
+
+  req->magic = BROKER_MAGIC;
+  req->prio = i2c_get_priority();
+  siov[0].iov_base = req;
+  siov[0].iov_len = sizeof(BrokerReq);
+  for (int i=0; i<niov; i++) {
+    siov[i+1] = iov[i];
+  }
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = siov;
+  mh.msg_iovlen = niov+1;
+  if (sendmsg(sock, &mh, MSG_NOSIGNAL) < 0) {
+    close(sock);
+    broker_sock = -1;
+    return -1;
+  }
+
+  riov[0].iov_base = rep;
+  riov[0].iov_len = sizeof(BrokerRep);
+  riov[1].iov_base = rdata;
+  riov[1].iov_len = rlen;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = riov;
+  mh.msg_iovlen = (rlen > 0) ? 2 : 1;
+  if (recvmsg(sock, &mh, 0) < (ssize_t) sizeof(BrokerRep)) {
+    close(sock);
+    broker_sock = -1;
+    errno = ECONNRESET;
+    return -1;
+  }
+
+  if (rep->ret < 0) {
+    errno = rep->err;
+  }
+  return rep->ret;
+}
+
+static int broker_open(const char *path) {
+  BrokerReq req = { 0 };
+  BrokerRep rep;
+  struct iovec iov = { (void*) path, strlen(path)+1 };
+
+  req.op = BROKER_OPEN;
+  if (broker_call(&req, &iov, 1, &rep, NULL, 0) < 0) {
+    return -1;
+  }
+  return BROKER_FD_BASE + rep.ret;
+}
+
+static int broker_close(int fd) {
+  BrokerReq req = { 0 };
+  BrokerRep rep;
+
+  req.op = BROKER_CLOSE;
+  req.handle = fd - BROKER_FD_BASE;
+  return broker_call(&req, NULL, 0, &rep, NULL, 0);
+}
+
+static int broker_rdwr(int fd, struct i2c_msg *msgs, int nmsgs) {
+  BrokerReq req = { 0 };
+  BrokerRep rep;
+  BrokerMsg bmsgs[BROKER_MAX_MSGS];
+  struct iovec iov[1+BROKER_MAX_MSGS];
+  uint8_t rdata[BROKER_MAX_DATA];
+  int niov = 1;
+  int wlen = 0, rlen = 0;
+  int ret;
+
+  if (nmsgs > BROKER_MAX_MSGS) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  req.op = BROKER_RDWR;
+  req.handle = fd - BROKER_FD_BASE;
+  req.nmsgs = nmsgs;
+  iov[0].iov_base = bmsgs;
+  iov[0].iov_len = nmsgs*sizeof(BrokerMsg);
+  for (int i=0; i<nmsgs; i++) {
+    bmsgs[i].addr = msgs[i].addr;
+    bmsgs[i].flags = msgs[i].flags;
+    bmsgs[i].len = msgs[i].len;
+    bmsgs[i].pad = 0;
+    if (msgs[i].flags & I2C_M_RD) {
+      rlen += msgs[i].len;
+    } else {
+      wlen += msgs[i].len;
+      iov[niov].iov_base = msgs[i].buf;
+      iov[niov].iov_len = msgs[i].len;
+      niov++;
+    }
+  }
+  if (wlen > BROKER_MAX_DATA || rlen > BROKER_MAX_DATA) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  ret = broker_call(&req, iov, niov, &rep, rdata, rlen);
+  if (ret < 0) {
+    return ret;
+  }
+
+  // read data comes back in message order
+  rlen = 0;
+  for (int i=0; i<nmsgs; i++) {
+    if (msgs[i].flags & I2C_M_RD) {
+      memcpy(msgs[i].buf, &rdata[rlen], msgs[i].len);
+      rlen += msgs[i].len;
+    }
+  }
+  return ret;
+}
+
+static int broker_funcs(int fd, unsigned long *funcs) {
+  BrokerReq req = { 0 };
+  BrokerRep rep;
+
+  req.op = BROKER_FUNCS;
+  req.handle = fd - BROKER_FD_BASE;
+  if (broker_call(&req, NULL, 0, &rep, NULL, 0) < 0) {
+    return -1;
+  }
+  *funcs = rep.funcs;
+  return 0;
+}
+
+static int broker_lock(int bus, int lock) {
+  BrokerReq req = { 0 };
+  BrokerRep rep;
+
+  req.op = lock ? BROKER_LOCK : BROKER_UNLOCK;
+  req.handle = bus;
+  return broker_call(&req, NULL, 0, &rep, NULL, 0);
+}
+
+const I2CTransport i2c_broker_transport = {
+  "broker", broker_open, broker_close, broker_rdwr, broker_funcs, broker_lock
+};
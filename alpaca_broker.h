@@ -0,0 +1,73 @@
+#ifndef ALPACA_BROKER_H_
+#define ALPACA_BROKER_H_
+
+#include <stdint.h>
+#include <linux/i2c-dev.h> // I2C_RDWR_IOCTL_MAX_MSGS
+#include "alpaca_i2c_utils.h"
+
+/*
+ * I2C bus broker
+ *
+ * i2c_brokerd is the one process with the physical buses open. Tools talk to
+ * it over a Unix SOCK_SEQPACKET socket through `i2c_broker_transport`, which
+ * `init_i2c_bus` selects when ALPACA_I2C_BROKER is set in the environment (to
+ * the socket path, or 1 for BROKER_SOCK_PATH).
+ *
+ * Through the broker a tool works like in I2C_MUX_KERNEL mode: it opens the
+ * mux child adapter of a device by path and the broker, owning every mux,
+ * selects the channel. The broker:
+ *
+ *   - runs the highest priority class first (I2CPriority, sent with every
+ *     request) and after a PLL class request keeps lower classes off that bus
+ *     for a short grace time, so a reprogram's next register write does not
+ *     queue behind a poll
+ *   - holds each client of a budgeted class to its share of bus time with a
+ *     token bucket charged by the measured transfer time
+ *   - coalesces queued requests of one class for one bus into a single
+ *     I2C_RDWR with a STOP between requests
+ *   - turns `i2c_lock_dev` into an exclusive session on the bus
+ *
+ * One socket per thread, so executor workers are separate clients.
+ */
+
+#define BROKER_SOCK_PATH "/run/alpaca-i2c-broker.sock"
+#define BROKER_MAGIC 0x4b524241 // "ABRK"
+#define BROKER_FD_BASE 2000     // transport fds handed to the library start here
+#define BROKER_MAX_MSGS I2C_RDWR_IOCTL_MAX_MSGS
+#define BROKER_MAX_DATA 8192    // write data in a request, read data in a reply
+
+typedef enum broker_op {
+  BROKER_OPEN,    // path in data, returns the handle
+  BROKER_CLOSE,
+  BROKER_RDWR,    // BrokerMsg[nmsgs] then the write data
+  BROKER_FUNCS,   // returns the adapter functionality in `funcs`
+  BROKER_LOCK,    // exclusive session on bus `handle`, returns once granted
+  BROKER_UNLOCK
+} BrokerOp;
+
+typedef struct broker_req {
+  uint32_t magic;
+  uint8_t op;
+  uint8_t prio;       // I2CPriority of the client thread
+  uint16_t nmsgs;
+  int32_t handle;     // from BROKER_OPEN, the bus for LOCK/UNLOCK
+} BrokerReq;
+
+typedef struct broker_msg {
+  uint16_t addr;
+  uint16_t flags;
+  uint16_t len;
+  uint16_t pad;
+} BrokerMsg;
+
+typedef struct broker_rep {
+  int32_t ret;        // < 0 on failure
+  int32_t err;        // errno on failure
+  uint64_t funcs;
+} BrokerRep;          // followed by the read data of a BROKER_RDWR
+
+int broker_enabled();
+const char* broker_sock_path();
+extern const I2CTransport i2c_broker_transport;
+
+#endif /* ALPACA_BROKER_H_ */
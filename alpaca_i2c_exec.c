@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h> // uint8_t, uint16_t
+
+#include <pthread.h>
+
+#include "alpaca_i2c_exec.h"
+#include "alpaca_log.h"
+
+#define SUCCESS 0
+#define FAILURE 1
+
+typedef struct i2c_worker {
+  pthread_t thread;
+  I2CJob *head;          // queued jobs, run in order
+  I2CJob *tail;
+  int running;
+} I2CWorker;
+
+static I2CWorker workers[I2C_EXEC_NUM_BUSES];
+static pthread_mutex_t exec_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t exec_work = PTHREAD_COND_INITIALIZER;  // a job was queued or stop was asked
+static pthread_cond_t exec_idle = PTHREAD_COND_INITIALIZER;  // a job finished
+static int exec_pending = 0;  // jobs queued or running
+static int exec_failed = 0;   // jobs that returned FAILURE since the last wait
+static int exec_stop = 0;
+
+static int run_job(I2CJob *job) {
+  switch (job->op) {
+    case I2C_OP_WRITE:
+      return i2c_write(job->dev, job->buf, job->len);
+    case I2C_OP_READ:
+      return i2c_read(job->dev, job->buf, job->len);
+    case I2C_OP_READ_REGS:
+      return i2c_read_regs(job->dev, job->offset, job->olen, job->buf, job->len);
+    case I2C_OP_FUNC:
+      return job->fn(job->arg);
+  }
+  return FAILURE;
+}
+
+static void* worker_main(void *arg) {
+  I2CWorker *w = (I2CWorker*) arg;
+  I2CJob *job;
+  int ret;
+
+  pthread_mutex_lock(&exec_lock);
+  while (1) {
+    while (w->head == NULL && !exec_stop) {
+      pthread_cond_wait(&exec_work, &exec_lock);
+    }
+    if (w->head == NULL) {
+      break;
+    }
+
+    job = w->head;
+    w->head = job->next;
+    if (w->head == NULL) {
+      w->tail = NULL;
+    }
+
+    // the bus is only touched by this worker, run without the queue lock
+    pthread_mutex_unlock(&exec_lock);
+    ret = run_job(job);
+    job->ret = ret;
+    if (job->done != NULL) {
+      job->done(job);
+    }
+    pthread_mutex_lock(&exec_lock);
+
+    // once DONE is seen the caller may reuse or free the job, it is not
+    // touched after the store
+    __atomic_store_n(&job->state, I2C_JOB_DONE, __ATOMIC_RELEASE);
+    if (ret != SUCCESS) {
+      exec_failed++;
+    }
+    exec_pending--;
+    pthread_cond_broadcast(&exec_idle);
+  }
+  pthread_mutex_unlock(&exec_lock);
+  return NULL;
+}
+
+/*
+ * Start one worker per bus. The buses and the devices used must already be
+ * initialized with `init_i2c_bus` and `init_i2c_dev`.
+ */
+int i2c_exec_start() {
+  exec_stop = 0;
+  exec_pending = 0;
+  exec_failed = 0;
+
+  for (int i=0; i<I2C_EXEC_NUM_BUSES; i++) {
+    workers[i].head = NULL;
+    workers[i].tail = NULL;
+    workers[i].running = 0;
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+      LOG_ERROR("could not start i2c worker for bus %d\n", i);
+      i2c_exec_stop();
+      return FAILURE;
+    }
+    workers[i].running = 1;
+  }
+  return SUCCESS;
+}
+
+int i2c_exec_submit(I2CJob *job) {
+  I2CWorker *w = &workers[i2c_dev_bus(job->dev)];
+
+  if (!w->running) {
+    LOG_ERROR("i2c executor not started\n");
+    return FAILURE;
+  }
+  // still queued or running, e.g., resubmitted from its own `done`
+  if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) == I2C_JOB_QUEUED) {
+    LOG_ERROR("i2c job submitted again before it was done\n");
+    return FAILURE;
+  }
+
+  job->next = NULL;
+  job->state = I2C_JOB_QUEUED;
+  pthread_mutex_lock(&exec_lock);
+  if (w->tail) {
+    w->tail->next = job;
+  } else {
+    w->head = job;
+  }
+  w->tail = job;
+  exec_pending++;
+  pthread_cond_broadcast(&exec_work);
+  pthread_mutex_unlock(&exec_lock);
+
+  return SUCCESS;
+}
+
+/*
+ * Wait for all submitted jobs to finish. Returns FAILURE if any of them
+ * failed, the per-job result is in `ret` of each job.
+ */
+int i2c_exec_wait() {
+  int failed;
+
+  pthread_mutex_lock(&exec_lock);
+  while (exec_pending > 0) {
+    pthread_cond_wait(&exec_idle, &exec_lock);
+  }
+  failed = exec_failed;
+  exec_failed = 0;
+  pthread_mutex_unlock(&exec_lock);
+
+  return (failed == 0) ? SUCCESS : FAILURE;
+}
+
+// finish the queued jobs and stop the workers
+int i2c_exec_stop() {
+  pthread_mutex_lock(&exec_lock);
+  exec_stop = 1;
+  pthread_cond_broadcast(&exec_work);
+  pthread_mutex_unlock(&exec_lock);
+
+  for (int i=0; i<I2C_EXEC_NUM_BUSES; i++) {
+    if (workers[i].running) {
+      pthread_join(workers[i].thread, NULL);
+      workers[i].running = 0;
+    }
+  }
+  return SUCCESS;
+}
+
+/*
+ * Asynchronous submission
+ */
+static pthread_mutex_t exec_start_lock = PTHREAD_MUTEX_INITIALIZER;
+
+I2CJob* i2c_submit(I2CJob *job) {
+  int ret = SUCCESS;
+
+  pthread_mutex_lock(&exec_start_lock);
+  if (!workers[0].running) {
+    ret = i2c_exec_start();
+  }
+  pthread_mutex_unlock(&exec_start_lock);
+
+  if (ret != SUCCESS || i2c_exec_submit(job) != SUCCESS) {
+    return NULL;
+  }
+  return job;
+}
+
+int i2c_job_poll(I2CJob *job) {
+  return __atomic_load_n(&job->state, __ATOMIC_ACQUIRE) == I2C_JOB_DONE;
+}
+
+int i2c_job_wait(I2CJob *job) {
+  pthread_mutex_lock(&exec_lock);
+  while (job->state != I2C_JOB_DONE) {
+    pthread_cond_wait(&exec_idle, &exec_lock);
+  }
+  pthread_mutex_unlock(&exec_lock);
+  return job->ret;
+}
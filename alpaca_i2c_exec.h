@@ -0,0 +1,79 @@
+#ifndef ALPACA_I2C_EXEC_H_
+#define ALPACA_I2C_EXEC_H_
+
+#include <stdint.h>
+#include "alpaca_i2c_utils.h"
+
+/*
+ * Per-bus transaction executor
+ *
+ * One worker thread is started for each physical i2c bus (fd_i2c0, fd_i2c1).
+ * Jobs are queued to the worker that owns the bus of the job's device and run
+ * in submission order on that bus, while jobs for different buses run at the
+ * same time.
+ *
+ * A job is either a single i2c_write/i2c_read/i2c_read_regs or a function run
+ * on the bus worker (e.g., a whole `prog_pll`), which lets a multi-transaction
+ * sequence for one bus run without interleaving with other jobs on that bus.
+ * The job memory belongs to the caller and must stay valid until
+ * `i2c_exec_wait` returns.
+ *
+ * Jobs can also be handled one at a time: `i2c_submit` queues a job, starting
+ * the workers on first use, and returns it as the handle to poll or wait on.
+ * A job's `done` callback (if set) runs on the bus worker right after the job,
+ * before waiters are woken, and may submit further jobs but not the job
+ * itself, which is still queued until `done` returns (a job is refused while
+ * it is queued). Copy it to resubmit from the callback. This lets a tool
+ * format or parse the next load while the bus works on the current one
+ * without managing threads of its own. Wait for outstanding jobs before
+ * exiting.
+ */
+
+#define I2C_EXEC_NUM_BUSES 2
+
+typedef enum i2c_op {
+  I2C_OP_WRITE,     // i2c_write(dev, buf, len)
+  I2C_OP_READ,      // i2c_read(dev, buf, len)
+  I2C_OP_READ_REGS, // i2c_read_regs(dev, offset, olen, buf, len)
+  I2C_OP_FUNC       // fn(arg) on the worker for the bus of dev
+} I2COp;
+
+typedef struct i2c_job {
+  I2COp op;
+  I2CDev dev;
+  uint8_t *buf;
+  uint16_t len;
+  uint8_t *offset;
+  uint16_t olen;
+  int (*fn)(void *arg);
+  void *arg;
+  int ret;               // SUCCESS/FAILURE result once run
+  void (*done)(struct i2c_job *job); // completion callback, NULL for none
+  void *ctx;             // for the caller, e.g., state for `done`
+  int state;             // I2CJobState, set by the executor
+  struct i2c_job *next;  // queue link, used by the executor
+} I2CJob;
+
+typedef enum i2c_job_state {
+  I2C_JOB_IDLE,     // not submitted
+  I2C_JOB_QUEUED,   // queued or running
+  I2C_JOB_DONE      // `ret` is valid and `done` has run
+} I2CJobState;
+
+// job initializers, e.g., I2CJob job = I2C_JOB_WRITE(I2C_DEV_IOX, pkt, 2);
+#define I2C_JOB_WRITE(d, b, l) { .op = I2C_OP_WRITE, .dev = (d), .buf = (b), .len = (l) }
+#define I2C_JOB_READ(d, b, l) { .op = I2C_OP_READ, .dev = (d), .buf = (b), .len = (l) }
+#define I2C_JOB_READ_REGS(d, o, ol, b, l) \
+  { .op = I2C_OP_READ_REGS, .dev = (d), .offset = (o), .olen = (ol), .buf = (b), .len = (l) }
+#define I2C_JOB_FUNC(d, f, a) { .op = I2C_OP_FUNC, .dev = (d), .fn = (f), .arg = (a) }
+
+int i2c_exec_start();
+int i2c_exec_submit(I2CJob *job);
+int i2c_exec_wait();
+int i2c_exec_stop();
+
+I2CJob* i2c_submit(I2CJob *job);
+int i2c_job_poll(I2CJob *job);  // 1 once the job is done, 0 before
+int i2c_job_wait(I2CJob *job);  // block until the job is done, returns its `ret`
+
+#endif /* ALPACA_I2C_EXEC_H_ */
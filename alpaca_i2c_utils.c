@@ -3,6 +3,9 @@
 #include <stdint.h> // uint8_t, uint16_t
 #include <unistd.h> // usleep
 
+#include <stdlib.h> // atexit, getenv
+#include <time.h>   // clock_gettime
+
 #include <errno.h>
 #include <assert.h>
 
@@ -12,59 +15,375 @@
 #include <linux/i2c-dev.h>
 
 #include "alpaca_i2c_utils.h"
+#include "alpaca_log.h"
+#include "alpaca_trace.h"
+#include "alpaca_sim.h"
+#include "alpaca_lock.h"
+#include "alpaca_broker.h"
 
-#define DELAY_100us 100
-#define NUM_I2C_RETRIES 5
-
-#define I2C0_DEV_PATH "/dev/i2c-0"
-#define I2C1_DEV_PATH "/dev/i2c-1"
 int fd_i2c0;
 int fd_i2c1;
 
 #define SUCCESS 0
 #define FAILURE 1
+#define MUX_MISMATCH 2 // transaction went through but the mux readback did not match
 
 #define X(name, dev) dev,
 static I2CSlave i2c_devs[] = { I2C_DEVICES_MAP };
 #undef X
 
-int i2c_write_bus(int fd, uint8_t addr, uint8_t *buf, uint16_t len) {
-  int ret = SUCCESS;
+#define X(name, dev) #name,
+static const char* i2c_dev_names[] = { I2C_DEVICES_MAP };
+#undef X
+
+// the executor runs one thread per parent bus, the counters are shared by all
+#define I2C_STAT_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+#define I2C_STAT_ADD(x, n) __atomic_add_fetch(&(x), (n), __ATOMIC_RELAXED)
+
+// per device transaction counters and latency histograms
+static I2CDevStats i2c_dev_stats[I2C_NUM_DEVS];
+
+/*
+ * Bus transport
+ */
+static int i2c_dev_open(const char *path) {
+  return open(path, O_RDWR);
+}
+
+static int i2c_dev_close(int fd) {
+  return close(fd);
+}
+
+static int i2c_dev_rdwr(int fd, struct i2c_msg *msgs, int nmsgs) {
   struct i2c_rdwr_ioctl_data packets;
+  packets.msgs = msgs;
+  packets.nmsgs = nmsgs;
+  return ioctl(fd, I2C_RDWR, &packets);
+}
+
+static int i2c_dev_funcs(int fd, unsigned long *funcs) {
+  return ioctl(fd, I2C_FUNCS, funcs);
+}
+
+static const I2CTransport i2c_dev_transport = {
+  "i2c-dev", i2c_dev_open, i2c_dev_close, i2c_dev_rdwr, i2c_dev_funcs, NULL
+};
+
+static const I2CTransport *i2c_transport = &i2c_dev_transport;
+
+void i2c_set_transport(const I2CTransport *transport) {
+  i2c_transport = transport;
+}
+
+const I2CTransport* i2c_get_transport() {
+  return i2c_transport;
+}
+
+/*
+ * Random numbers for fault injection and backoff jitter
+ *
+ * xorshift64 per thread, each thread's state is derived from the seed and the
+ * order in which threads first asked, so a single threaded run is repeatable.
+ * Setting a new seed restarts every thread's sequence.
+ */
+static uint64_t i2c_rng_seed = 1;
+static uint32_t i2c_rng_gen = 1;      // bumped when the seed changes
+static uint32_t i2c_rng_threads = 0;  // threads seeded in this generation
+static __thread uint64_t i2c_rng_state;
+static __thread uint32_t i2c_rng_state_gen;
+
+static uint32_t i2c_rand() {
+  uint32_t gen = __atomic_load_n(&i2c_rng_gen, __ATOMIC_ACQUIRE);
+  uint64_t x;
+
+  if (i2c_rng_state_gen != gen) {
+    // splitmix64 of the seed and the thread count
+    x = i2c_rng_seed + 0x9e3779b97f4a7c15ull*__atomic_add_fetch(&i2c_rng_threads, 1, __ATOMIC_RELAXED);
+    x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27))*0x94d049bb133111ebull;
+    x ^= x >> 31;
+    i2c_rng_state = (x != 0) ? x : 1;
+    i2c_rng_state_gen = gen;
+  }
+
+  x = i2c_rng_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  i2c_rng_state = x;
+  return x >> 32;
+}
+
+// 1 with probability `p`
+static int i2c_chance(double p) {
+  return p > 0 && i2c_rand() < p*4294967296.0;
+}
+
+/*
+ * Fault injection transport, wraps the selected transport
+ */
+static I2CFault i2c_fault;
+static I2CFaultStats i2c_fault_stats;
+static const I2CTransport *i2c_fault_inner;
+
+static int i2c_fault_open(const char *path) {
+  return i2c_fault_inner->open(path);
+}
+
+static int i2c_fault_close(int fd) {
+  return i2c_fault_inner->close(fd);
+}
+
+static int i2c_fault_rdwr(int fd, struct i2c_msg *msgs, int nmsgs) {
+  int rlen = 0;
+  int ret;
+
+  if (i2c_chance(i2c_fault.nack)) {
+    I2C_STAT_INC(i2c_fault_stats.nacks);
+    errno = ENXIO;
+    return -1;
+  }
+  if (i2c_chance(i2c_fault.busy)) {
+    I2C_STAT_INC(i2c_fault_stats.busy);
+    errno = EAGAIN;
+    return -1;
+  }
+  if (nmsgs > 1 && i2c_chance(i2c_fault.partial)) {
+    // the messages ahead of the NACKed one are on the bus
+    int k = 1 + i2c_rand() % (nmsgs - 1);
+    I2C_STAT_INC(i2c_fault_stats.partials);
+    if (i2c_fault_inner->rdwr(fd, msgs, k) >= 0) {
+      errno = ENXIO;
+    }
+    return -1;
+  }
+
+  ret = i2c_fault_inner->rdwr(fd, msgs, nmsgs);
+  if (ret < 0 || !i2c_chance(i2c_fault.corrupt)) {
+    return ret;
+  }
+
+  // flip one bit somewhere in the data read back
+  for (int i=0; i<nmsgs; i++) {
+    rlen += (msgs[i].flags & I2C_M_RD) ? msgs[i].len : 0;
+  }
+  if (rlen > 0) {
+    uint32_t r = i2c_rand();
+    int byte = r % rlen;
+    for (int i=0; i<nmsgs; i++) {
+      if (!(msgs[i].flags & I2C_M_RD)) {
+        continue;
+      }
+      if (byte < msgs[i].len) {
+        msgs[i].buf[byte] ^= 1 << ((r >> 24) & 0x7);
+        break;
+      }
+      byte -= msgs[i].len;
+    }
+    I2C_STAT_INC(i2c_fault_stats.corrupted);
+  }
+  return ret;
+}
+
+static int i2c_fault_funcs(int fd, unsigned long *funcs) {
+  return i2c_fault_inner->funcs(fd, funcs);
+}
+
+static int i2c_fault_lock(int bus, int lock) {
+  return i2c_fault_inner->lock(bus, lock);
+}
+
+static I2CTransport i2c_fault_transport = {
+  "fault", i2c_fault_open, i2c_fault_close, i2c_fault_rdwr, i2c_fault_funcs, NULL
+};
+
+// put the wrapper around the current transport while any fault is set
+static void i2c_fault_apply() {
+  int on = (i2c_fault.nack > 0 || i2c_fault.busy > 0 || i2c_fault.corrupt > 0 || i2c_fault.partial > 0);
+
+  if (on && i2c_transport != &i2c_fault_transport) {
+    i2c_fault_inner = i2c_transport;
+    i2c_fault_transport.lock = (i2c_fault_inner->lock != NULL) ? i2c_fault_lock : NULL;
+    i2c_transport = &i2c_fault_transport;
+  } else if (!on && i2c_transport == &i2c_fault_transport) {
+    i2c_transport = i2c_fault_inner;
+  }
+}
+
+void i2c_set_fault(const I2CFault *fault) {
+  i2c_fault = *fault;
+  if (fault->seed != 0) {
+    i2c_rng_seed = fault->seed;
+    i2c_rng_threads = 0;
+    __atomic_add_fetch(&i2c_rng_gen, 1, __ATOMIC_RELEASE);
+  }
+  i2c_fault_apply();
+}
+
+void i2c_get_fault_stats(I2CFaultStats *stats) {
+  *stats = i2c_fault_stats;
+}
+
+// nack=<f>,busy=<f>,corrupt=<f>,partial=<f>,seed=<n>
+static void i2c_parse_fault(const char *spec, I2CFault *fault) {
+  char buf[128];
+  char *save;
+
+  memset(fault, 0, sizeof(I2CFault));
+  strncpy(buf, spec, sizeof(buf)-1);
+  buf[sizeof(buf)-1] = '\0';
+  for (char *kv = strtok_r(buf, ",", &save); kv != NULL; kv = strtok_r(NULL, ",", &save)) {
+    char *val = strchr(kv, '=');
+    if (val == NULL) {
+      LOG_WARN("ignoring fault setting %s\n", kv);
+      continue;
+    }
+    *val++ = '\0';
+    if (strcmp(kv, "nack") == 0) {
+      fault->nack = atof(val);
+    } else if (strcmp(kv, "busy") == 0) {
+      fault->busy = atof(val);
+    } else if (strcmp(kv, "corrupt") == 0) {
+      fault->corrupt = atof(val);
+    } else if (strcmp(kv, "partial") == 0) {
+      fault->partial = atof(val);
+    } else if (strcmp(kv, "seed") == 0) {
+      fault->seed = strtoull(val, NULL, 0);
+    } else {
+      LOG_WARN("ignoring fault setting %s\n", kv);
+    }
+  }
+}
+
+static I2CPriority i2c_default_prio = I2C_PRIO_NORMAL;
+static __thread int i2c_prio = -1; // -1 until set on this thread
+
+void i2c_set_priority(I2CPriority prio) {
+  i2c_prio = prio;
+}
+
+I2CPriority i2c_get_priority() {
+  return (i2c_prio < 0) ? i2c_default_prio : i2c_prio;
+}
+
+// issue a set of messages as a single I2C_RDWR transaction on the bus
+int i2c_rdwr(int fd, struct i2c_msg *msgs, int nmsgs) {
+  uint64_t start;
+  int ret;
+
+  if (trace_hdr == NULL) {
+    return (i2c_transport->rdwr(fd, msgs, nmsgs) < 0) ? FAILURE : SUCCESS;
+  }
+
+  // traced, one record per message with the data read back
+  start = trace_now();
+  ret = (i2c_transport->rdwr(fd, msgs, nmsgs) < 0) ? FAILURE : SUCCESS;
+  for (int i=0; i<nmsgs; i++) {
+    uint8_t flags = (i > 0) ? TRACE_F_CONT : 0;
+    flags |= (msgs[i].flags & I2C_M_RD) ? TRACE_F_READ : 0;
+    flags |= (msgs[i].flags & I2C_M_STOP) ? TRACE_F_STOP : 0;
+    flags |= (ret == FAILURE) ? TRACE_F_FAIL : 0;
+    trace_record(TRACE_I2C, fd, msgs[i].addr, flags, msgs[i].buf, msgs[i].len, NULL, 0, start,
+                 (ret == FAILURE) ? errno : 0);
+  }
+  return ret;
+}
+
+/*
+ * Adapter handles
+ *
+ * Several table entries share one adapter, e.g., the A0h and A2h halves of an
+ * SFP cage, and a device not behind a mux can sit on the bus itself. Handles
+ * are pooled by adapter path: `init_i2c_bus` enters every path of the platform
+ * table with the buses already open, and the other adapters are opened the
+ * first time a transaction needs them (in user mux mode only devices not
+ * behind a mux do) and stay open until `close_i2c_bus`. Executor workers can
+ * race to open the same adapter, the loser closes its fd and takes the
+ * winner's.
+ */
+#define I2C_MAX_ADAPTERS (I2C_NUM_BUSES + I2C_NUM_DEVS)
+
+typedef struct i2c_adapter {
+  const char* path;
+  int fd;              // -1 until opened
+} I2CAdapter;
+
+static I2CAdapter i2c_adapters[I2C_MAX_ADAPTERS];
+static int i2c_adapter_cnt = 0;
+
+static I2CAdapter* i2c_adapter(const char *path) {
+  for (int i=0; i<i2c_adapter_cnt; i++) {
+    if (strcmp(i2c_adapters[i].path, path) == 0) {
+      return &i2c_adapters[i];
+    }
+  }
+  return NULL;
+}
+
+static void i2c_add_adapter(const char *path, int fd) {
+  if (i2c_adapter(path) == NULL) {
+    assert(i2c_adapter_cnt < I2C_MAX_ADAPTERS);
+    i2c_adapters[i2c_adapter_cnt].path = path;
+    i2c_adapters[i2c_adapter_cnt].fd = fd;
+    i2c_adapter_cnt++;
+  }
+}
+
+// the device's adapter fd, opening the adapter on first use
+static int i2c_dev_fd(I2CSlave *dev_ptr) {
+  int fd = __atomic_load_n(&dev_ptr->fd, __ATOMIC_ACQUIRE);
+  int expected = -1;
+  I2CAdapter *ad;
+
+  if (fd >= 0) {
+    return fd;
+  }
+
+  ad = i2c_adapter(dev_ptr->dev_path);
+  if (ad == NULL) {
+    LOG_ERROR("i2c dev %s is not in the adapter pool, was the bus initialized?\n", dev_ptr->dev_path);
+    return -1;
+  }
+
+  fd = __atomic_load_n(&ad->fd, __ATOMIC_ACQUIRE);
+  if (fd < 0) {
+    fd = i2c_transport->open(ad->path);
+    if (fd < 0) {
+      LOG_ERROR("could not open i2c dev %s\n", ad->path);
+      return -1;
+    }
+    if (__atomic_compare_exchange_n(&ad->fd, &expected, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      trace_add_stream(fd, ad->path, 0, 0, 0, 0);
+    } else {
+      i2c_transport->close(fd);
+      fd = expected;
+    }
+  }
+  __atomic_store_n(&dev_ptr->fd, fd, __ATOMIC_RELEASE);
+  return fd;
+}
+
+int i2c_write_bus(int fd, uint8_t addr, uint8_t *buf, uint16_t len) {
   struct i2c_msg messages;
   messages.addr = addr;
   messages.flags = 0;
   messages.len = len;
   messages.buf = buf;
-  packets.msgs = &messages;
-  packets.nmsgs = 1;
-  if (ioctl(fd, I2C_RDWR, &packets) < 0) {
-    ret = FAILURE;
-  }
-  return ret;
+  return i2c_rdwr(fd, &messages, 1);
 }
 
 int i2c_read_bus(int fd, uint8_t addr, uint8_t *buf, uint16_t len) {
-  int ret = SUCCESS;
-  struct i2c_rdwr_ioctl_data packets;
   struct i2c_msg messages;
   messages.addr = addr;
   messages.flags = I2C_M_RD;
   messages.len = len;
   messages.buf = buf;
-  packets.msgs = &messages;
-  packets.nmsgs = 1;
-  if (ioctl(fd, I2C_RDWR, &packets) < 0) {
-    ret = FAILURE;
-  }
-  return ret;
+  return i2c_rdwr(fd, &messages, 1);
 }
 
 // implementing repeated start to accomplish a register read a write is followed
 // by a read
 int i2c_read_regs_bus(int fd, uint8_t addr, uint8_t *offset, uint16_t olen, uint8_t *buf, uint16_t len) {
-  int ret = SUCCESS;
-  struct i2c_rdwr_ioctl_data packets;
   struct i2c_msg messages[2];
   messages[0].addr = addr;
   messages[0].flags = 0; // write
@@ -74,12 +393,66 @@ int i2c_read_regs_bus(int fd, uint8_t addr, uint8_t *offset, uint16_t olen, uint
   messages[1].flags = I2C_M_RD;
   messages[1].len = len;
   messages[1].buf = buf;
-  packets.msgs = messages;
-  packets.nmsgs = 2;
-  if (ioctl(fd, I2C_RDWR, &packets) < 0) {
-    ret = FAILURE;
+  return i2c_rdwr(fd, messages, 2);
+}
+
+/*
+ * Mux state cache
+ *
+ * Every PCA9548 mux seen in the platform device table gets an entry here the
+ * first time one of its devices is used. The entry remembers the last channel
+ * select byte written to that mux so back-to-back transactions to the same
+ * device (e.g., the 136 LMK register writes in `prog_pll`) only pay for one
+ * mux write instead of one per transaction.
+ *
+ * The readback check that the mux did not change under us runs after every
+ * transaction by default, so a select skipped on a stale cache is caught by
+ * the transaction itself. `i2c_set_mux_verify_period` can sample it instead,
+ * the period being the number of transactions between checks through the
+ * same mux, 0 turns it off. A failed transaction or a failed check drops the
+ * cached state so the next attempt re-selects the channel.
+ */
+#define I2C_MAX_MUXES 8 // more than the number of muxes on any supported board
+
+typedef struct i2c_mux_state {
+  int* parent_fd;      // parent i2c bus the mux lives on
+  uint8_t mux_addr;    // i2c address of the mux
+  uint8_t cur_sel;     // last channel select written to the mux
+  uint8_t valid;       // cur_sel is known to be what the mux holds
+  uint8_t stop_ok;     // parent adapter can force a STOP mid transaction (I2C_M_STOP)
+  uint32_t since_verify; // transactions since the last readback check
+} I2CMuxState;
+
+static I2CMuxState i2c_muxes[I2C_MAX_MUXES];
+static int i2c_mux_cnt = 0;
+static uint32_t i2c_mux_verify_period = I2C_MUX_VERIFY_PERIOD;
+static I2CMuxStats i2c_mux_stats;
+
+static I2CMuxState* i2c_mux_state(I2CSlave *dev_ptr) {
+  unsigned long funcs = 0;
+
+  for (int i=0; i<i2c_mux_cnt; i++) {
+    if (i2c_muxes[i].parent_fd == dev_ptr->parent_fd && i2c_muxes[i].mux_addr == dev_ptr->mux_addr) {
+      return &i2c_muxes[i];
+    }
   }
-  return ret;
+
+  assert(i2c_mux_cnt < I2C_MAX_MUXES);
+  I2CMuxState *mux = &i2c_muxes[i2c_mux_cnt++];
+  mux->parent_fd = dev_ptr->parent_fd;
+  mux->mux_addr = dev_ptr->mux_addr;
+  mux->cur_sel = 0;
+  mux->valid = 0;
+  mux->since_verify = 0;
+
+  // the PCA9548 only switches to a newly selected channel on a STOP, so the
+  // select can only share a transaction with the payload if the adapter can
+  // put a STOP between the two messages
+  mux->stop_ok = 0;
+  if (i2c_transport->funcs(*(dev_ptr->parent_fd), &funcs) == 0) {
+    mux->stop_ok = (funcs & I2C_FUNC_PROTOCOL_MANGLING) ? 1 : 0;
+  }
+  return mux;
 }
 
 int i2c_set_mux(I2CSlave *dev_ptr) {
@@ -121,155 +494,1070 @@ int i2c_get_mux(I2CSlave *dev_ptr, uint8_t *buf) {
   return ret;
 }
 
+/*
+ * Run a device transaction through its mux as one I2C_RDWR ioctl
+ *
+ * The mux channel select (only when the mux state cache says it is needed),
+ * the device messages and the mux readback (only when the sampling policy says
+ * a check is due) are put in a single i2c_rdwr_ioctl_data on the parent bus.
+ * The kernel holds the bus for the whole sequence so another process cannot
+ * switch the mux between the select, the payload and the readback.
+ *
+ * If the parent adapter cannot issue a STOP between messages the select is
+ * sent as its own ioctl first (the mux does not switch channels on a repeated
+ * start) and the payload and readback still share one.
+ *
+ * dev_ptr:
+ *   device to address
+ * payload:
+ *   device messages, their addr field is filled in with the slave address here
+ * npayload:
+ *   number of device messages, at most I2C_XFER_MAX_PAYLOAD so the two mux
+ *   messages still fit in I2C_RDWR_IOCTL_MAX_MSGS
+ *
+ * Returns SUCCESS, FAILURE if the ioctl failed or MUX_MISMATCH if the
+ * transaction went through with the mux readback showing a different channel.
+ */
+#define I2C_XFER_MAX_PAYLOAD (I2C_RDWR_IOCTL_MAX_MSGS-2)
+
+/*
+ * Mux management mode
+ *
+ * I2C_MUX_USER (default) has this library select and check the mux channel on
+ * the parent bus as described above. I2C_MUX_KERNEL trusts the kernel
+ * i2c-mux-pca954x driver instead. Transactions are sent on the device's own
+ * mux child adapter (`dev_path`, opened by `init_i2c_dev`) and the kernel
+ * selects the channel and holds the parent bus locked for the transaction, so
+ * no mux select or readback is issued from here. Build with -DI2C_KERNEL_MUX
+ * to make kernel mode the default.
+ */
+#ifdef I2C_KERNEL_MUX
+static I2CMuxMode i2c_mux_mode = I2C_MUX_KERNEL;
+#else
+static I2CMuxMode i2c_mux_mode = I2C_MUX_USER;
+#endif
+
+static int i2c_mux_xfer_bus(I2CSlave *dev_ptr, struct i2c_msg *payload, int npayload) {
+  struct i2c_msg msgs[I2C_XFER_MAX_PAYLOAD+2];
+  uint8_t curmux = 0;
+  int n = 0;
+  int sel;
+  int verify;
+
+  assert(npayload <= I2C_XFER_MAX_PAYLOAD);
+  for (int i=0; i<npayload; i++) {
+    payload[i].addr = dev_ptr->slave_addr;
+  }
+
+  // device is not addressed via mux, or the kernel manages the mux
+  if (dev_ptr->mux_addr == 0xff || i2c_mux_mode == I2C_MUX_KERNEL) {
+    int fd = i2c_dev_fd(dev_ptr);
+    return (fd < 0) ? FAILURE : i2c_rdwr(fd, payload, npayload);
+  }
+
+  I2CMuxState *mux = i2c_mux_state(dev_ptr);
+  sel = !(mux->valid && mux->cur_sel == dev_ptr->mux_sel);
+  verify = 0;
+  if (i2c_mux_verify_period != 0 && ++mux->since_verify >= i2c_mux_verify_period) {
+    verify = 1;
+    mux->since_verify = 0;
+  }
+
+  if (sel) {
+    I2C_STAT_INC(i2c_mux_stats.sel_writes);
+    if (mux->stop_ok) {
+      msgs[n].addr = dev_ptr->mux_addr;
+      msgs[n].flags = I2C_M_STOP;
+      msgs[n].len = 1;
+      msgs[n].buf = &(dev_ptr->mux_sel);
+      n++;
+    } else if (FAILURE == i2c_set_mux(dev_ptr)) {
+      mux->valid = 0;
+      return FAILURE;
+    }
+  } else {
+    I2C_STAT_INC(i2c_mux_stats.sel_skipped);
+  }
+
+  memcpy(&msgs[n], payload, npayload*sizeof(struct i2c_msg));
+  n += npayload;
+
+  if (verify) {
+    I2C_STAT_INC(i2c_mux_stats.verify_reads);
+    msgs[n].addr = dev_ptr->mux_addr;
+    msgs[n].flags = I2C_M_RD;
+    msgs[n].len = 1;
+    msgs[n].buf = &curmux;
+    n++;
+  } else {
+    I2C_STAT_INC(i2c_mux_stats.verify_skipped);
+  }
+
+  if (FAILURE == i2c_rdwr(*(dev_ptr->parent_fd), msgs, n)) {
+    mux->valid = 0;
+    return FAILURE;
+  }
+
+  mux->cur_sel = dev_ptr->mux_sel;
+  mux->valid = 1;
+
+  if (verify && curmux != dev_ptr->mux_sel) {
+    I2C_STAT_INC(i2c_mux_stats.mismatches);
+    mux->valid = 0;
+    return MUX_MISMATCH;
+  }
+  return SUCCESS;
+}
+
+/*
+ * Bus locks
+ *
+ * One lock per physical bus, named after its adapter (alpaca-i2c-1.lock for
+ * /dev/i2c-1). The lock fds and nesting depths are per thread, so executor
+ * workers and forked children each hold their own flock. When the lock comes
+ * back from another process the mux states on that bus are dropped, whatever
+ * the other process selected is what the mux holds now.
+ */
+static int i2c_bus_locking = 1;
+static __thread int i2c_lock_fds[I2C_NUM_BUSES] = { -1, -1 };
+static __thread uint32_t i2c_lock_depth[I2C_NUM_BUSES];
+static __thread pid_t i2c_lock_pid; // process the lock fds were opened in
+
+static const char* i2c_bus_paths[I2C_NUM_BUSES] = { I2C0_DEV_PATH, I2C1_DEV_PATH };
+
+void i2c_set_bus_locking(int enable) {
+  i2c_bus_locking = enable;
+}
+
+static int i2c_lock_bus(int bus) {
+  int handoff = 0;
+
+  if (!i2c_bus_locking || i2c_lock_depth[bus]++ > 0) {
+    return SUCCESS;
+  }
+
+  // the broker holds the bus for us, the muxes are its business
+  if (i2c_transport->lock != NULL) {
+    if (i2c_transport->lock(bus, 1) < 0) {
+      i2c_lock_depth[bus]--;
+      return FAILURE;
+    }
+    return SUCCESS;
+  }
+
+  // a forked child shares the parent's lock files, it needs its own
+  if (i2c_lock_pid != getpid()) {
+    for (int b=0; b<I2C_NUM_BUSES; b++) {
+      if (i2c_lock_fds[b] >= 0) {
+        close(i2c_lock_fds[b]);
+      }
+      i2c_lock_fds[b] = -1;
+    }
+    i2c_lock_pid = getpid();
+  }
+  if (i2c_lock_fds[bus] < 0) {
+    i2c_lock_fds[bus] = bus_lock_open(strrchr(i2c_bus_paths[bus], '/') + 1);
+    if (i2c_lock_fds[bus] < 0) {
+      // the next lock tries again, ALPACA_I2C_LOCK=0 runs without the locks
+      LOG_ERROR("could not lock %s\n", i2c_bus_paths[bus]);
+      i2c_lock_depth[bus]--;
+      return FAILURE;
+    }
+  }
+
+  if (bus_lock(i2c_lock_fds[bus], &handoff) != SUCCESS) {
+    i2c_lock_depth[bus]--;
+    return FAILURE;
+  }
+  if (handoff) {
+    I2C_STAT_INC(i2c_mux_stats.handoffs);
+    for (int i=0; i<i2c_mux_cnt; i++) {
+      if (i2c_muxes[i].parent_fd == ((bus == 0) ? &fd_i2c0 : &fd_i2c1)) {
+        i2c_muxes[i].valid = 0;
+      }
+    }
+  }
+  return SUCCESS;
+}
+
+static int i2c_unlock_bus(int bus) {
+  if (i2c_lock_depth[bus] == 0) {
+    return SUCCESS;
+  }
+  if (--i2c_lock_depth[bus] == 0) {
+    if (i2c_transport->lock != NULL) {
+      return (i2c_transport->lock(bus, 0) < 0) ? FAILURE : SUCCESS;
+    } else if (i2c_lock_fds[bus] >= 0) {
+      return bus_unlock(i2c_lock_fds[bus]);
+    }
+  }
+  return SUCCESS;
+}
+
+int i2c_lock_buses(uint32_t mask) {
+  for (int b=0; b<I2C_NUM_BUSES; b++) {
+    if ((mask & (1 << b)) && i2c_lock_bus(b) != SUCCESS) {
+      i2c_unlock_buses(mask & ((1 << b) - 1));
+      return FAILURE;
+    }
+  }
+  return SUCCESS;
+}
+
+int i2c_unlock_buses(uint32_t mask) {
+  for (int b=I2C_NUM_BUSES-1; b>=0; b--) {
+    if (mask & (1 << b)) {
+      i2c_unlock_bus(b);
+    }
+  }
+  return SUCCESS;
+}
+
+int i2c_lock_dev(I2CDev dev) {
+  return i2c_lock_bus(i2c_dev_bus(dev));
+}
+
+int i2c_unlock_dev(I2CDev dev) {
+  return i2c_unlock_bus(i2c_dev_bus(dev));
+}
+
+// `i2c_mux_xfer_bus` with the transaction counted in the device telemetry. The
+// bus lock is the caller's, held across a multi-transaction operation; a lone
+// transaction runs whole in one ioctl and the mux readback catches a switch
+// made by another tool in between.
+static int i2c_mux_xfer(I2CSlave *dev_ptr, struct i2c_msg *payload, int npayload) {
+  I2CDevStats *st = &i2c_dev_stats[dev_ptr - i2c_devs];
+  struct timespec start, end;
+  uint32_t bytes = 0;
+  uint64_t lat_us;
+  int bucket;
+  int ret;
+  int err;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ret = i2c_mux_xfer_bus(dev_ptr, payload, npayload);
+  err = errno; // for the retry engine, the clock read must not clobber it
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (int i=0; i<npayload; i++) {
+    bytes += payload[i].len;
+  }
+  lat_us = (end.tv_sec - start.tv_sec)*1000000ull + (end.tv_nsec - start.tv_nsec)/1000;
+  for (bucket=0; bucket < I2C_LAT_BUCKETS-1 && (lat_us >> (bucket+1)); bucket++);
+
+  I2C_STAT_INC(st->transactions);
+  I2C_STAT_ADD(st->bytes, bytes);
+  I2C_STAT_INC(st->lat_hist[bucket]);
+  if (ret == FAILURE) {
+    I2C_STAT_INC(st->failures);
+    if (err == ENXIO || err == EREMOTEIO) {
+      I2C_STAT_INC(st->nacks);
+    } else if (err == EAGAIN || err == EBUSY) {
+      I2C_STAT_INC(st->busy);
+    }
+  } else if (ret == MUX_MISMATCH) {
+    I2C_STAT_INC(st->mux_mismatches);
+  }
+  errno = err;
+  return ret;
+}
+
+/*
+ * Retry engine
+ */
+typedef enum i2c_err {
+  I2C_ERR_NACK,   // device did not ACK
+  I2C_ERR_MUX,    // mux readback mismatch
+  I2C_ERR_BUSY,   // arbitration lost or bus busy
+  I2C_ERR_BUS,    // controller or transport error worth another try
+  I2C_ERR_FATAL   // retrying will not help
+} I2CErr;
+
+static I2CRetryPolicy i2c_retry_default = I2C_RETRY_DEFAULT;
+static I2CRetryPolicy i2c_retry_dev[I2C_NUM_DEVS]; // tries == 0 uses the default
+
+static I2CErr i2c_err_class(int err) {
+  switch (err) {
+    case ENXIO:
+    case EREMOTEIO:
+      return I2C_ERR_NACK;
+    case EAGAIN:
+    case EBUSY:
+      return I2C_ERR_BUSY;
+    case EIO:
+    case ETIMEDOUT:
+    case EINTR:
+    case ECONNRESET:
+      return I2C_ERR_BUS;
+    default:
+      return I2C_ERR_FATAL;
+  }
+}
+
+// delay before the next attempt after `n` failed ones
+static uint32_t i2c_backoff_us(const I2CRetryPolicy *p, int n) {
+  uint64_t d;
+
+  switch (p->backoff) {
+    case I2C_BACKOFF_IMMEDIATE:
+      return 0;
+    case I2C_BACKOFF_LINEAR:
+      d = (uint64_t) p->base_us*n;
+      break;
+    default:
+      d = (uint64_t) p->base_us << ((n-1 < 20) ? n-1 : 20);
+      break;
+  }
+  if (p->max_us != 0 && d > p->max_us) {
+    d = p->max_us;
+  }
+  if (p->backoff == I2C_BACKOFF_JITTER) {
+    d = (uint64_t) (d*(i2c_rand()/4294967296.0));
+  }
+  return d;
+}
+
+const I2CRetryPolicy* i2c_get_retry_policy(I2CDev dev) {
+  return (i2c_retry_dev[dev].tries != 0) ? &i2c_retry_dev[dev] : &i2c_retry_default;
+}
+
+void i2c_set_retry_policy(I2CDev dev, const I2CRetryPolicy *policy) {
+  if (policy == NULL) {
+    i2c_retry_dev[dev].tries = 0;
+    return;
+  }
+  i2c_retry_dev[dev] = *policy;
+  if (i2c_retry_dev[dev].tries == 0) {
+    i2c_retry_dev[dev].tries = 1;
+  }
+}
+
+void i2c_set_default_retry_policy(const I2CRetryPolicy *policy) {
+  I2CRetryPolicy def = I2C_RETRY_DEFAULT;
+  i2c_retry_default = (policy != NULL) ? *policy : def;
+  if (i2c_retry_default.tries == 0) {
+    i2c_retry_default.tries = 1;
+  }
+}
+
+// <backoff>[:tries[:base_us[:max_us]]], fields left out keep the default's
+int i2c_parse_retry_policy(const char *spec, I2CRetryPolicy *policy) {
+  static const char* names[] = { "immediate", "linear", "exp", "jitter" };
+  I2CRetryPolicy p = I2C_RETRY_DEFAULT;
+  const char *f = strchr(spec, ':');
+  size_t len = (f != NULL) ? (size_t) (f - spec) : strlen(spec);
+  int b;
+
+  for (b=0; b<4; b++) {
+    if (strlen(names[b]) == len && strncmp(spec, names[b], len) == 0) {
+      break;
+    }
+  }
+  if (b == 4) {
+    return FAILURE;
+  }
+  p.backoff = b;
+
+  if (f != NULL) {
+    unsigned tries = 0, base_us = p.base_us, max_us = p.max_us;
+    if (sscanf(f+1, "%u:%u:%u", &tries, &base_us, &max_us) < 1 || tries == 0 || tries > 255) {
+      return FAILURE;
+    }
+    p.tries = tries;
+    p.base_us = base_us;
+    p.max_us = max_us;
+  }
+  *policy = p;
+  return SUCCESS;
+}
+
+// `i2c_mux_xfer` retried under the device's policy, `what` names the
+// transaction in the error logged when it gives up
+static int i2c_xfer_retry(I2CSlave *dev_ptr, struct i2c_msg *msgs, int nmsgs, const char *what) {
+  I2CDev dev = dev_ptr - i2c_devs;
+  const I2CRetryPolicy *p = i2c_get_retry_policy(dev);
+  uint32_t delay;
+  I2CErr cls;
+  int ret;
+
+  for (int n=1; ; n++) {
+    ret = i2c_mux_xfer(dev_ptr, msgs, nmsgs);
+    if (ret == SUCCESS) {
+      return SUCCESS;
+    }
+
+    cls = (ret == MUX_MISMATCH) ? I2C_ERR_MUX : i2c_err_class(errno);
+    if (cls == I2C_ERR_FATAL) {
+      LOG_ERROR("could not %s %s: %s\n", what, i2c_dev_names[dev], strerror(errno));
+      return FAILURE;
+    }
+    if (n >= p->tries) {
+      LOG_ERROR("could not %s %s, reached number of retries...\n", what, i2c_dev_names[dev]);
+      return FAILURE;
+    }
+
+    if (cls == I2C_ERR_MUX) {
+      LOG_WARN("mux status changed during transaction\n");
+    }
+    I2C_STAT_INC(i2c_dev_stats[dev].retries);
+    delay = (cls == I2C_ERR_BUSY) ? 0 : i2c_backoff_us(p, n);
+    if (delay > 0) {
+      usleep(delay);
+    }
+  }
+}
+
+/*
+ * Batched transactions
+ *
+ * `i2c_batch_begin` starts collecting write messages for one device,
+ * `i2c_batch_add` copies each message into the batch and `i2c_batch_commit`
+ * sends what is left. Messages go out I2C_XFER_MAX_PAYLOAD at a time so each
+ * I2C_RDWR ioctl carries up to I2C_RDWR_IOCTL_MAX_MSGS (42) messages counting
+ * the mux select and readback. Adding to a full batch sends it first.
+ *
+ * If a chunk fails as a whole its messages are resent one at a time with the
+ * device's retry policy, which both covers devices that need a gap between messages
+ * (e.g., the SC18IS602 NACKs while it is still clocking out the previous SPI
+ * transfer) and finds the message that fails. Messages ahead of it in the
+ * chunk are written a second time, so batches should only hold writes that
+ * are safe to repeat in order. On a paged register map (Si534x/Si538x page
+ * register 0x01, 8A34001 0xfc) a page write in the failed chunk may already
+ * have been applied, so with the page register named by `i2c_batch_page_reg`
+ * the last page write queued before the chunk is sent again ahead of the
+ * resend and the chunk's registers land on the page they were queued for.
+ */
+#define I2C_BATCH_BUF_SIZE 4096
+#define I2C_BATCH_PAGE_MAX 8  // page register write, register byte and page value(s)
+
+// one batch per thread so executor workers can each build their own
+static __thread struct {
+  I2CSlave *dev_ptr;                           // device the batch is for
+  struct i2c_msg msgs[I2C_XFER_MAX_PAYLOAD];   // queued messages
+  uint8_t data[I2C_BATCH_BUF_SIZE];            // copies of the queued message data
+  int nmsgs;                                   // number of queued messages
+  int nbytes;                                  // bytes used in `data`
+  int base;                                    // batch index of msgs[0]
+  int failed;                                  // batch index of the failed message, -1 if none
+  int page_reg;                                // page register of the device, -1 if not paged
+  struct i2c_msg page_msg;                     // last page write sent before msgs[0], len 0 if none
+  uint8_t page_data[I2C_BATCH_PAGE_MAX];
+} i2c_batch;
+
+static int i2c_batch_is_page(struct i2c_msg *msg) {
+  return i2c_batch.page_reg >= 0 && msg->len >= 2 && msg->len <= I2C_BATCH_PAGE_MAX
+      && msg->buf[0] == i2c_batch.page_reg;
+}
+
+static int i2c_batch_flush() {
+  int ret;
+  I2CSlave *dev_ptr = i2c_batch.dev_ptr;
+
+  if (i2c_batch.nmsgs == 0) {
+    return SUCCESS;
+  }
+
+  ret = i2c_mux_xfer(dev_ptr, i2c_batch.msgs, i2c_batch.nmsgs);
+  if (ret != SUCCESS) {
+    LOG_WARN("batch of %d messages failed, resending one at a time\n", i2c_batch.nmsgs);
+    // back to the page the chunk started on, a page write in it may have landed
+    if (i2c_batch.page_msg.len > 0 && !i2c_batch_is_page(&i2c_batch.msgs[0])
+        && FAILURE == i2c_xfer_retry(dev_ptr, &i2c_batch.page_msg, 1, "restore the page of")) {
+      i2c_batch.failed = i2c_batch.base;
+      LOG_ERROR("batch failed at message %d\n", i2c_batch.failed);
+      return FAILURE;
+    }
+    for (int m=0; m<i2c_batch.nmsgs; m++) {
+      if (FAILURE == i2c_xfer_retry(dev_ptr, &i2c_batch.msgs[m], 1, "write batch message to")) {
+        i2c_batch.failed = i2c_batch.base + m;
+        LOG_ERROR("batch failed at message %d\n", i2c_batch.failed);
+        return FAILURE;
+      }
+    }
+  }
+
+  // the page the next chunk starts on
+  for (int m=i2c_batch.nmsgs-1; m>=0; m--) {
+    if (i2c_batch_is_page(&i2c_batch.msgs[m])) {
+      memcpy(i2c_batch.page_data, i2c_batch.msgs[m].buf, i2c_batch.msgs[m].len);
+      i2c_batch.page_msg.len = i2c_batch.msgs[m].len;
+      break;
+    }
+  }
+
+  i2c_batch.base += i2c_batch.nmsgs;
+  i2c_batch.nmsgs = 0;
+  i2c_batch.nbytes = 0;
+  return SUCCESS;
+}
+
+int i2c_batch_begin(I2CDev dev) {
+  i2c_batch.dev_ptr = &i2c_devs[dev];
+  i2c_batch.nmsgs = 0;
+  i2c_batch.nbytes = 0;
+  i2c_batch.base = 0;
+  i2c_batch.failed = -1;
+  i2c_batch.page_reg = -1;
+  i2c_batch.page_msg.addr = 0;
+  i2c_batch.page_msg.flags = 0;
+  i2c_batch.page_msg.len = 0;
+  i2c_batch.page_msg.buf = i2c_batch.page_data;
+  return SUCCESS;
+}
+
+int i2c_batch_page_reg(uint8_t reg) {
+  if (i2c_batch.dev_ptr == NULL || i2c_batch.nmsgs > 0 || i2c_batch.base > 0) {
+    return FAILURE;
+  }
+  i2c_batch.page_reg = reg;
+  return SUCCESS;
+}
+
+int i2c_batch_add(uint8_t *buf, uint16_t len) {
+  if (i2c_batch.dev_ptr == NULL || i2c_batch.failed >= 0 || len > I2C_BATCH_BUF_SIZE) {
+    return FAILURE;
+  }
+
+  if (i2c_batch.nmsgs == I2C_XFER_MAX_PAYLOAD || i2c_batch.nbytes + len > I2C_BATCH_BUF_SIZE) {
+    if (FAILURE == i2c_batch_flush()) {
+      return FAILURE;
+    }
+  }
+
+  struct i2c_msg *msg = &i2c_batch.msgs[i2c_batch.nmsgs++];
+  msg->flags = 0;
+  msg->len = len;
+  msg->buf = &i2c_batch.data[i2c_batch.nbytes];
+  memcpy(msg->buf, buf, len);
+  i2c_batch.nbytes += len;
+  return SUCCESS;
+}
+
+int i2c_batch_commit(int *failed) {
+  int ret = FAILURE;
+
+  if (i2c_batch.dev_ptr != NULL && i2c_batch.failed < 0) {
+    i2c_cache_invalidate(i2c_batch.dev_ptr - i2c_devs);
+    ret = i2c_batch_flush();
+  }
+
+  if (failed != NULL) {
+    *failed = i2c_batch.failed;
+  }
+  i2c_batch.dev_ptr = NULL;
+  return ret;
+}
+
+void i2c_set_mux_mode(I2CMuxMode mode) {
+  i2c_mux_mode = mode;
+  // whatever we knew about the mux may be stale once the kernel has used it
+  for (int i=0; i<i2c_mux_cnt; i++) {
+    i2c_muxes[i].valid = 0;
+  }
+}
+
+I2CMuxMode i2c_get_mux_mode() {
+  return i2c_mux_mode;
+}
+
+void i2c_set_mux_verify_period(uint32_t period) {
+  i2c_mux_verify_period = period;
+}
+
+void i2c_get_mux_stats(I2CMuxStats *stats) {
+  *stats = i2c_mux_stats;
+}
+
+int i2c_dev_bus(I2CDev dev) {
+  return (i2c_devs[dev].parent_fd == &fd_i2c0) ? 0 : 1;
+}
+
+const char* i2c_dev_name(I2CDev dev) {
+  return i2c_dev_names[dev];
+}
+
+/*
+ * Telemetry
+ *
+ * Every bus transaction made for a device (a single transfer, a batch chunk,
+ * each retry) is counted in that device's I2CDevStats along with its payload
+ * bytes and its latency, in a histogram with log2 microsecond buckets (bucket
+ * k holds latencies in [2^k, 2^(k+1)) us, bucket 0 also holds < 1 us).
+ */
+void i2c_get_dev_stats(I2CDev dev, I2CDevStats *stats) {
+  *stats = i2c_dev_stats[dev];
+}
+
+void i2c_reset_stats() {
+  memset(i2c_dev_stats, 0, sizeof(i2c_dev_stats));
+  memset(&i2c_mux_stats, 0, sizeof(i2c_mux_stats));
+  memset(&i2c_fault_stats, 0, sizeof(i2c_fault_stats));
+}
+
+void i2c_dump_stats(FILE *f) {
+  fprintf(f, "i2c telemetry:\n");
+  for (int d=0; d<I2C_NUM_DEVS; d++) {
+    I2CDevStats *st = &i2c_dev_stats[d];
+    if (st->transactions == 0) {
+      continue;
+    }
+    fprintf(f, "  %-24s txn: %llu, bytes: %llu, retries: %u, mux mismatches: %u, failures: %u (%u nack, %u busy)\n",
+            i2c_dev_names[d], (unsigned long long) st->transactions, (unsigned long long) st->bytes,
+            st->retries, st->mux_mismatches, st->failures, st->nacks, st->busy);
+    if (st->cache_hits || st->cache_fills) {
+      fprintf(f, "    cache: %u hits, %u fills\n", st->cache_hits, st->cache_fills);
+    }
+    for (int b=0; b<I2C_LAT_BUCKETS; b++) {
+      if (st->lat_hist[b]) {
+        fprintf(f, "    %8u-%-8u us: %u\n", (b == 0) ? 0 : (1u << b), (1u << (b+1)) - 1, st->lat_hist[b]);
+      }
+    }
+  }
+  fprintf(f, "  mux: %u select writes (%u skipped), %u readbacks (%u skipped), %u mismatches, %u lock handoffs\n",
+          i2c_mux_stats.sel_writes, i2c_mux_stats.sel_skipped, i2c_mux_stats.verify_reads,
+          i2c_mux_stats.verify_skipped, i2c_mux_stats.mismatches, i2c_mux_stats.handoffs);
+  if (i2c_transport == &i2c_fault_transport) {
+    fprintf(f, "  injected faults: %u nack, %u busy, %u corrupted, %u partial\n",
+            i2c_fault_stats.nacks, i2c_fault_stats.busy, i2c_fault_stats.corrupted, i2c_fault_stats.partials);
+  }
+}
+
+static void i2c_dump_stats_stderr() {
+  i2c_dump_stats(stderr);
+}
+
+void i2c_dump_stats_on_exit() {
+  static int registered = 0;
+  if (!registered) {
+    atexit(i2c_dump_stats_stderr);
+    registered = 1;
+  }
+}
+
 int init_i2c_bus() {
   // initialize i2c buses
 
+  // ALPACA_TRACE in the environment records all bus traffic to a trace file
+  trace_open_env();
+
+  // ALPACA_SIM in the environment runs against the simulated platform
+  if (sim_enabled()) {
+    i2c_transport = &i2c_sim_transport;
+  }
+
+  // ALPACA_I2C_BROKER in the environment sends everything through i2c_brokerd,
+  // which owns the buses and the muxes
+  if (broker_enabled()) {
+    i2c_transport = &i2c_broker_transport;
+    i2c_mux_mode = I2C_MUX_KERNEL;
+  }
+
+  if (getenv("ALPACA_I2C_PRIO") != NULL) {
+    const char *prio = getenv("ALPACA_I2C_PRIO");
+    i2c_default_prio = (strcmp(prio, "pll") == 0) ? I2C_PRIO_PLL
+                     : (strcmp(prio, "poll") == 0) ? I2C_PRIO_POLL : I2C_PRIO_NORMAL;
+  }
+
+  // ALPACA_I2C_LOCK=0 in the environment runs without the cross-process bus locks
+  if (getenv("ALPACA_I2C_LOCK") != NULL && strcmp(getenv("ALPACA_I2C_LOCK"), "0") == 0) {
+    i2c_bus_locking = 0;
+  }
+
+  // ALPACA_I2C_RETRY in the environment replaces the default retry policy
+  if (getenv("ALPACA_I2C_RETRY") != NULL) {
+    I2CRetryPolicy policy;
+    if (i2c_parse_retry_policy(getenv("ALPACA_I2C_RETRY"), &policy) == SUCCESS) {
+      i2c_set_default_retry_policy(&policy);
+    } else {
+      LOG_WARN("ignoring ALPACA_I2C_RETRY=%s\n", getenv("ALPACA_I2C_RETRY"));
+    }
+  }
+
+  // ALPACA_I2C_FAULT in the environment injects transaction faults, the
+  // transport chosen above is wrapped
+  if (getenv("ALPACA_I2C_FAULT") != NULL) {
+    I2CFault fault;
+    i2c_parse_fault(getenv("ALPACA_I2C_FAULT"), &fault);
+    i2c_set_fault(&fault);
+  }
+  i2c_fault_apply();
+
+  // ALPACA_I2C_STATS in the environment dumps the telemetry when the tool exits
+  if (getenv("ALPACA_I2C_STATS") != NULL) {
+    i2c_dump_stats_on_exit();
+  }
+
   // TODO: Most MPSOC designs enable both I2C buses, but this may not be the
   // case, probably a smarter way to to initialize a bus of interest
-  fd_i2c1 = open(I2C1_DEV_PATH, O_RDWR);
+  fd_i2c1 = i2c_transport->open(I2C1_DEV_PATH);
   if (fd_i2c1 < 0) {
-    printf("ERROR: could not open I2C bus 1\n");
+    LOG_ERROR("could not open I2C bus 1\n");
     return FAILURE;
   }
+  trace_add_stream(fd_i2c1, I2C1_DEV_PATH, 0, 0, 0, 0);
 
-  fd_i2c0 = open(I2C0_DEV_PATH, O_RDWR);
+  fd_i2c0 = i2c_transport->open(I2C0_DEV_PATH);
   if (fd_i2c0 < 0) {
-    printf("ERROR: could not open I2C bus 0\n");
+    LOG_ERROR("could not open I2C bus 0\n");
     return FAILURE;
   }
+  trace_add_stream(fd_i2c0, I2C0_DEV_PATH, 0, 0, 0, 0);
+
+  // fill in the mux state table and the adapter pool up front so threads
+  // working on different buses never add to them at the same time
+  i2c_add_adapter(I2C1_DEV_PATH, fd_i2c1);
+  i2c_add_adapter(I2C0_DEV_PATH, fd_i2c0);
+  for (int i=0; i<sizeof(i2c_devs)/sizeof(I2CSlave); i++) {
+    if (i2c_devs[i].mux_addr != 0xff) {
+      i2c_mux_state(&i2c_devs[i]);
+    }
+    i2c_add_adapter(i2c_devs[i].dev_path, -1);
+  }
   return SUCCESS;
 }
 
 int close_i2c_bus() {
   if (fd_i2c1 > 0) {
-    close(fd_i2c1);
+    trace_remove_stream(fd_i2c1);
+    i2c_transport->close(fd_i2c1);
   }
 
   if (fd_i2c0 > 0) {
-    close(fd_i2c0);
+    trace_remove_stream(fd_i2c0);
+    i2c_transport->close(fd_i2c0);
+  }
+
+  // the adapters opened on demand, the buses were closed above
+  for (int i=0; i<i2c_adapter_cnt; i++) {
+    if (i2c_adapters[i].fd >= 0 && i2c_adapters[i].fd != fd_i2c0 && i2c_adapters[i].fd != fd_i2c1) {
+      trace_remove_stream(i2c_adapters[i].fd);
+      i2c_transport->close(i2c_adapters[i].fd);
+    }
+  }
+  i2c_adapter_cnt = 0;
+  for (int i=0; i<sizeof(i2c_devs)/sizeof(I2CSlave); i++) {
+    i2c_devs[i].fd = -1;
+  }
+
+  // forget the mux states, the fds they were learned on are gone
+  i2c_mux_cnt = 0;
+
+  for (int i=0; i<I2C_NUM_DEVS; i++) {
+    i2c_cache_disable(i);
   }
 
   return SUCCESS;
 }
 
+// nothing to open here, the device's adapter is opened through the pool the
+// first time a transaction needs it
 int init_i2c_dev(I2CDev dev) {
-  I2CSlave* i2c_devptr = &i2c_devs[dev];
+  return (i2c_adapter(i2c_devs[dev].dev_path) == NULL) ? FAILURE : SUCCESS;
+}
 
-  i2c_devptr->fd = open(i2c_devptr->dev_path, O_RDWR);
-  if (i2c_devptr->fd < 0) {
-    printf("ERROR: could not open i2c dev\n");
-    return FAILURE;
-  }
+// adapters stay open in the pool until `close_i2c_bus`
+int close_i2c_dev(I2CDev dev) {
   return SUCCESS;
 }
 
-int close_i2c_dev(I2CDev dev) {
-  I2CSlave* i2c_devptr = &i2c_devs[dev];
+int i2c_write(I2CDev dev, uint8_t *buf, uint16_t len) {
+  struct i2c_msg msg = { 0, 0, len, buf };
 
-  if (i2c_devptr->fd > 0) {
-    close(i2c_devptr->fd);
+  i2c_cache_invalidate(dev);
+  // set mux, write, read switch status
+  return i2c_xfer_retry(&i2c_devs[dev], &msg, 1, "write");
+}
+
+int i2c_read(I2CDev dev, uint8_t *buf, uint16_t len) {
+  struct i2c_msg msg = { 0, I2C_M_RD, len, buf };
+
+  // set mux, read, read switch status
+  return i2c_xfer_retry(&i2c_devs[dev], &msg, 1, "read");
+}
+
+int i2c_read_regs(I2CDev dev, uint8_t *offset, uint16_t olen, uint8_t *buf, uint16_t len) {
+  // implementing repeated start to accomplish a register read a write is
+  // followed by a read
+  struct i2c_msg msgs[2] = {
+    { 0, 0, olen, offset },
+    { 0, I2C_M_RD, len, buf }
+  };
+
+  // set mux, write offset and read, read switch status
+  return i2c_xfer_retry(&i2c_devs[dev], msgs, 2, "read registers of");
+}
+
+/*
+ * EEPROM block I/O
+ *
+ * A page write is one message, the memory address then at most a page of data
+ * that does not cross a page boundary. While the part runs its write cycle it
+ * NACKs its address, so the next page (or the read after it) is simply retried
+ * until it goes through, and after the last page an address-only write is
+ * polled the same way. Each attempt takes a few bus cycles, so a write
+ * finishes as soon as the part does instead of after a worst case t_WR per
+ * page.
+ */
+#define X(name, geom) { name, geom },
+static const struct {
+  I2CDev dev;
+  I2CEeprom geom;
+} i2c_eeproms[] = { PLATFORM_I2C_EEPROMS { I2C_NUM_DEVS, { 0, 0, 0 } } };
+#undef X
+
+const I2CEeprom* i2c_eeprom_geom(I2CDev dev) {
+  for (int i=0; i2c_eeproms[i].dev != I2C_NUM_DEVS; i++) {
+    if (i2c_eeproms[i].dev == dev) {
+      return &i2c_eeproms[i].geom;
+    }
   }
+  return NULL;
+}
 
-  return SUCCESS;
+static uint64_t i2c_now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000ull + ts.tv_nsec/1000;
 }
 
-int i2c_write(I2CDev dev, uint8_t *buf, uint16_t len) {
-  uint8_t curmux = 0;
-  int i;
-  I2CSlave *dev_ptr = &i2c_devs[dev];
-
-  for (i=0; i < NUM_I2C_RETRIES; i++) {
-    // set mux
-    if (FAILURE == i2c_set_mux(dev_ptr)) { continue; }
-    // write
-    if (FAILURE == i2c_write_bus(dev_ptr->fd, dev_ptr->slave_addr, buf, len)) { continue; }
-    // read switch status
-    if (FAILURE == i2c_get_mux(dev_ptr, &curmux)) { continue; }
-    // make sure it was as expected
-    if (curmux == dev_ptr->mux_sel) {
-      // read successful
-      break;
-    } else {
-      // delay and attempt again
-      printf("WARNING: mux status changed during transaction\n");
-      usleep(DELAY_100us*(i+1));
+// `i2c_mux_xfer` repeated while the part NACKs, up to the write cycle timeout.
+// Any other error is returned at once, it is not the part being busy
+static int i2c_eeprom_xfer(I2CDev dev, struct i2c_msg *msgs, int nmsgs) {
+  uint64_t deadline = i2c_now_us() + I2C_EEPROM_TWR_TIMEOUT_US;
+  int ret;
+
+  while ((ret = i2c_mux_xfer(&i2c_devs[dev], msgs, nmsgs)) != SUCCESS) {
+    if (ret == MUX_MISMATCH) {
+      LOG_ERROR("eeprom %s: mux readback did not match\n", i2c_dev_names[dev]);
+      return FAILURE;
+    }
+    if (i2c_err_class(errno) != I2C_ERR_NACK) {
+      LOG_ERROR("eeprom %s: %s\n", i2c_dev_names[dev], strerror(errno));
+      return FAILURE;
     }
+    if (i2c_now_us() > deadline) {
+      LOG_ERROR("eeprom %s did not ACK within %d us\n", i2c_dev_names[dev], I2C_EEPROM_TWR_TIMEOUT_US);
+      return FAILURE;
+    }
+    I2C_STAT_INC(i2c_dev_stats[dev].retries);
   }
-  if (i < NUM_I2C_RETRIES) {
-    return SUCCESS;
-  } else {
-    printf("ERROR: could not write, reached number of retries...\n");
+  return SUCCESS;
+}
+
+static void i2c_eeprom_addr(const I2CEeprom *geom, uint32_t offset, uint8_t *buf) {
+  for (int i=0; i<geom->addr_len; i++) {
+    buf[i] = offset >> (8*(geom->addr_len-1-i));
+  }
+}
+
+int i2c_eeprom_read(I2CDev dev, uint32_t offset, uint8_t *buf, uint32_t len) {
+  const I2CEeprom *geom = i2c_eeprom_geom(dev);
+  uint8_t addr[4];
+  int ret = SUCCESS;
+
+  if (geom == NULL || offset + len > geom->size) {
+    LOG_ERROR("eeprom read of %u bytes at 0x%x out of range\n", len, offset);
     return FAILURE;
   }
+
+  i2c_lock_dev(dev);
+  while (len > 0 && ret == SUCCESS) {
+    uint16_t n = (len > I2C_MAX_MSG_LEN) ? I2C_MAX_MSG_LEN : len;
+    struct i2c_msg msgs[2] = {
+      { 0, 0, geom->addr_len, addr },
+      { 0, I2C_M_RD, n, buf }
+    };
+
+    i2c_eeprom_addr(geom, offset, addr);
+    ret = i2c_eeprom_xfer(dev, msgs, 2);
+    offset += n;
+    buf += n;
+    len -= n;
+  }
+  i2c_unlock_dev(dev);
+  return ret;
 }
 
-int i2c_read(I2CDev dev, uint8_t *buf, uint16_t len) {
-  uint8_t curmux = 0;
-  int i;
-  I2CSlave *dev_ptr = &i2c_devs[dev];
-
-  for (i=0; i < NUM_I2C_RETRIES; i++) {
-    // set mux
-    if (FAILURE == i2c_set_mux(dev_ptr)) { continue; }
-    // write
-    if (FAILURE == i2c_read_bus(dev_ptr->fd, dev_ptr->slave_addr, buf, len)) { continue; }
-    // read switch status
-    if (FAILURE == i2c_get_mux(dev_ptr, &curmux)) { continue; }
-    // make sure it was as expected
-    if (curmux == dev_ptr->mux_sel) {
-      // read successful
-      break;
+int i2c_eeprom_write(I2CDev dev, uint32_t offset, const uint8_t *buf, uint32_t len) {
+  const I2CEeprom *geom = i2c_eeprom_geom(dev);
+  uint8_t pkt[4 + I2C_MAX_MSG_LEN];
+  struct i2c_msg msg = { 0, 0, 0, pkt };
+  int ret = SUCCESS;
+
+  if (geom == NULL || offset + len > geom->size) {
+    LOG_ERROR("eeprom write of %u bytes at 0x%x out of range\n", len, offset);
+    return FAILURE;
+  }
+
+  i2c_cache_invalidate(dev);
+  i2c_lock_dev(dev);
+  while (len > 0 && ret == SUCCESS) {
+    // up to the end of the page, and what fits in one message
+    uint32_t n = geom->page - (offset % geom->page);
+    n = (n > len) ? len : n;
+    n = (n > I2C_MAX_MSG_LEN - geom->addr_len) ? I2C_MAX_MSG_LEN - geom->addr_len : n;
+
+    i2c_eeprom_addr(geom, offset, pkt);
+    memcpy(&pkt[geom->addr_len], buf, n);
+    msg.len = geom->addr_len + n;
+    ret = i2c_eeprom_xfer(dev, &msg, 1);
+    offset += n;
+    buf += n;
+    len -= n;
+  }
+
+  // the last page is committed once the part ACKs again
+  if (ret == SUCCESS) {
+    msg.len = geom->addr_len;
+    ret = i2c_eeprom_xfer(dev, &msg, 1);
+  }
+  i2c_unlock_dev(dev);
+  return ret;
+}
+
+/*
+ * Register read cache
+ *
+ * The register space of a cached device is split into windows. A read fills
+ * the stale windows it covers with block reads (consecutive stale windows in
+ * one read, up to I2C_MAX_MSG_LEN per transaction) and is then copied out of
+ * the image, so every field read within a window until the TTL runs out costs
+ * no bus traffic. A write to the device through this library (i2c_write, a
+ * batch, EEPROM writes) drops the whole image, since it may have changed the
+ * registers or a page select.
+ */
+typedef struct i2c_reg_cache {
+  uint8_t *data;         // register image, NULL when the device is not cached
+  uint64_t *filled_us;   // per window, when it was read, 0 if it is not valid
+  uint32_t size;
+  uint16_t window;
+  uint8_t addr_len;
+  uint32_t ttl_us;
+} I2CRegCache;
+
+static I2CRegCache i2c_caches[I2C_NUM_DEVS];
+
+int i2c_cache_enable(I2CDev dev, uint32_t size, uint16_t window, uint32_t ttl_us) {
+  I2CRegCache *c = &i2c_caches[dev];
+  const I2CEeprom *geom = i2c_eeprom_geom(dev);
+  uint32_t nwin;
+
+  if (size == 0 || window == 0) {
+    return FAILURE;
+  }
+  i2c_cache_disable(dev);
+
+  nwin = (size + window - 1)/window;
+  c->data = malloc(size);
+  c->filled_us = calloc(nwin, sizeof(uint64_t));
+  if (c->data == NULL || c->filled_us == NULL) {
+    LOG_ERROR("could not allocate the register cache for %s\n", i2c_dev_names[dev]);
+    i2c_cache_disable(dev);
+    return FAILURE;
+  }
+  c->size = size;
+  c->window = window;
+  c->addr_len = (geom != NULL) ? geom->addr_len : (size > 256) ? 2 : 1;
+  c->ttl_us = ttl_us;
+  return SUCCESS;
+}
+
+void i2c_cache_disable(I2CDev dev) {
+  I2CRegCache *c = &i2c_caches[dev];
+
+  free(c->data);
+  free(c->filled_us);
+  c->data = NULL;
+  c->filled_us = NULL;
+}
+
+void i2c_cache_invalidate(I2CDev dev) {
+  I2CRegCache *c = &i2c_caches[dev];
+
+  if (c->data != NULL) {
+    memset(c->filled_us, 0, ((c->size + c->window - 1)/c->window)*sizeof(uint64_t));
+  }
+}
+
+static int i2c_cache_fresh(I2CRegCache *c, uint32_t w, uint64_t now) {
+  return c->filled_us[w] != 0 && (c->ttl_us == 0 || now - c->filled_us[w] < c->ttl_us);
+}
+
+// block read of [start, end) into the image
+static int i2c_cache_fill(I2CDev dev, I2CRegCache *c, uint32_t start, uint32_t end) {
+  uint8_t addr[2];
+
+  for (uint32_t off=start; off<end; ) {
+    uint16_t n = (end - off > I2C_MAX_MSG_LEN) ? I2C_MAX_MSG_LEN : end - off;
+    if (c->addr_len == 2) {
+      addr[0] = (off >> 8) & 0xff;
+      addr[1] = off & 0xff;
     } else {
-      // delay and attempt again
-      printf("WARNING: mux status changed during transaction\n");
-      usleep(DELAY_100us*(i+1));
+      addr[0] = off & 0xff;
     }
+    if (FAILURE == i2c_read_regs(dev, addr, c->addr_len, &c->data[off], n)) {
+      return FAILURE;
+    }
+    off += n;
   }
-  if (i < NUM_I2C_RETRIES) {
+  return SUCCESS;
+}
+
+int i2c_read_cached(I2CDev dev, uint32_t reg, uint8_t *buf, uint16_t len) {
+  I2CRegCache *c = &i2c_caches[dev];
+  uint64_t now = i2c_now_us();
+  uint32_t first, last;
+  int filled = 0;
+
+  if (len == 0) {
     return SUCCESS;
-  } else {
-    printf("ERROR: could not read, reached number of retries...\n");
-    return FAILURE;
   }
-}
 
-int i2c_read_regs(I2CDev dev, uint8_t *offset, uint16_t olen, uint8_t *buf, uint16_t len) {
-  uint8_t curmux = 0;
-  int i;
-  I2CSlave *dev_ptr = &i2c_devs[dev];
+  // not cached, a plain register read
+  if (c->data == NULL) {
+    uint8_t addr[2] = { reg & 0xff, 0 };
+    if (reg > 0xff) {
+      addr[0] = (reg >> 8) & 0xff;
+      addr[1] = reg & 0xff;
+    }
+    return i2c_read_regs(dev, addr, (reg > 0xff) ? 2 : 1, buf, len);
+  }
 
-  for (i=0; i < NUM_I2C_RETRIES; i++) {
-    // set mux
-    if (FAILURE == i2c_set_mux(dev_ptr)) {
-      printf("could not set mux\n");
+  if (reg + len > c->size) {
+    LOG_ERROR("cached read of %u bytes at 0x%x out of range\n", len, reg);
+    return FAILURE;
+  }
+
+  first = reg/c->window;
+  last = (reg + len - 1)/c->window;
+  for (uint32_t w=first; w<=last; ) {
+    uint32_t e = w;
+    if (i2c_cache_fresh(c, w, now)) {
+      w++;
       continue;
     }
-    // write
-    if (FAILURE==i2c_read_regs_bus(dev_ptr->fd, dev_ptr->slave_addr, offset, olen, buf, len)) {
-      printf("could not run low level i2c_read_regs() %d\n", i);
-      continue;
+
+    // read the run of stale windows at once
+    while (e < last && !i2c_cache_fresh(c, e+1, now)) {
+      e++;
     }
-    // read switch status
-    if (FAILURE == i2c_get_mux(dev_ptr, &curmux)) {
-      printf("could not read mux status\n");
-      continue;
+    if (FAILURE == i2c_cache_fill(dev, c, w*c->window, ((e+1)*c->window < c->size) ? (e+1)*c->window : c->size)) {
+      for (uint32_t k=w; k<=e; k++) {
+        c->filled_us[k] = 0;
+      }
+      return FAILURE;
     }
-    // make sure it was as expected
-    if (curmux == dev_ptr->mux_sel) {
-      // read successful
-      printf("read successful\n");
-      break;
-    } else {
-      // delay and attempt again
-      printf("WARNING: mux status changed during transaction\n");
-      usleep(DELAY_100us*(i+1));
+    for (uint32_t k=w; k<=e; k++) {
+      c->filled_us[k] = (now != 0) ? now : 1;
     }
+    I2C_STAT_INC(i2c_dev_stats[dev].cache_fills);
+    filled = 1;
+    w = e+1;
   }
-  if (i < NUM_I2C_RETRIES) {
-    return SUCCESS;
-  } else {
-    printf("ERROR: could not read, reached number of retries...\n");
-    return FAILURE;
+
+  if (!filled) {
+    I2C_STAT_INC(i2c_dev_stats[dev].cache_hits);
   }
+  memcpy(buf, &c->data[reg], len);
+  return SUCCESS;
 }
-
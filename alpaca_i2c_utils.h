@@ -1,9 +1,17 @@
 #ifndef ALPACA_I2C_UTILS_H_
 #define ALPACA_I2C_UTILS_H_
 
+#include <stdio.h>
 #include <stdint.h>
+#include <linux/i2c.h>
 #include "alpaca_platform.h"
 
+// physical buses, the devices in the platform table hang off these
+#define I2C0_DEV_PATH "/dev/i2c-0"
+#define I2C1_DEV_PATH "/dev/i2c-1"
+extern int fd_i2c0;
+extern int fd_i2c1;
+
 #define DEVICE_STRUCT(dp, ma, ms, sa, fd, pfd) {dp, ma, ms, sa, fd, pfd}
 typedef struct i2c_slave {
   const char* dev_path;      // linux device file path
@@ -14,6 +22,44 @@ typedef struct i2c_slave {
   int* parent_fd;            // parent i2c bus that the mux-ed slave lives on, fd_i2c0 or fd_i2c1
 } I2CSlave;
 
+// how the library reaches the buses: the linux i2c-dev driver by default, the
+// simulator in alpaca_sim.c or the bus broker in alpaca_broker.c. `rdwr` and
+// `funcs` return < 0 with errno set on failure like the ioctls they stand for.
+// A transport that serializes the buses itself provides `lock`, which then
+// replaces the cross-process lock files.
+typedef struct i2c_transport {
+  const char* name;
+  int (*open)(const char *path);
+  int (*close)(int fd);
+  int (*rdwr)(int fd, struct i2c_msg *msgs, int nmsgs);
+  int (*funcs)(int fd, unsigned long *funcs);
+  int (*lock)(int bus, int lock);
+} I2CTransport;
+
+// priority class of the calling thread's transactions, used by the bus broker
+typedef enum i2c_prio {
+  I2C_PRIO_PLL,     // time critical programming
+  I2C_PRIO_NORMAL,  // everything else (default)
+  I2C_PRIO_POLL,    // background monitoring
+  I2C_NUM_PRIOS
+} I2CPriority;
+
+// who selects the mux channel for a transaction
+typedef enum i2c_mux_mode {
+  I2C_MUX_USER,   // this library writes and checks the mux on the parent bus
+  I2C_MUX_KERNEL  // the kernel i2c-mux-pca954x driver, through the child adapters
+} I2CMuxMode;
+
+// counts of mux transactions issued and skipped by the mux state cache
+typedef struct i2c_mux_stats {
+  uint32_t sel_writes;     // channel select writes put on the bus
+  uint32_t sel_skipped;    // channel select writes skipped, mux already set
+  uint32_t verify_reads;   // mux status readbacks put on the bus
+  uint32_t verify_skipped; // mux status readbacks skipped by sampling
+  uint32_t mismatches;     // readbacks that found the mux changed under us
+  uint32_t handoffs;       // bus locks taken after another process used the bus
+} I2CMuxStats;
+
 
 /* Generally, device file paths for i2c cannot be assumed as by default they are
  * dynamically allocated and assigned. Therefore they can be different boot to
@@ -111,14 +157,213 @@ typedef struct i2c_slave {
 #define I2C_DEVICES_MAP PLATFORM_I2C_DEVICES
 
 #define X(name, dev) name,
-typedef enum dev { I2C_DEVICES_MAP } I2CDev;
+typedef enum dev { I2C_DEVICES_MAP I2C_NUM_DEVS } I2CDev;
 #undef X
 
+/*
+ * EEPROM-class devices, addressed by memory offset with page writes and a
+ * write cycle (t_WR) during which the part NACKs its address. The geometry
+ * drives the block I/O below.
+ */
+#define EEPROM_STRUCT(sz, pg, al) {sz, pg, al}
+typedef struct i2c_eeprom {
+  uint32_t size;      // bytes
+  uint16_t page;      // page write size, a write wraps within its page
+  uint8_t addr_len;   // memory address bytes sent ahead of the data, msb first
+} I2CEeprom;
+
+#if PLATFORM == ZCU216 || PLATFORM == ZCU208 || PLATFORM == ZCU111
+  #define PLATFORM_I2C_EEPROMS \
+    X(I2C_DEV_EEPROM, EEPROM_STRUCT(16384, 64, 2)) /* M24128 board EEPROM */
+#elif PLATFORM == RFSoC2x2
+  #define PLATFORM_I2C_EEPROMS \
+    X(I2C_DEV_EEPROM, EEPROM_STRUCT(256, 16, 1))   /* 2 Kbit board EEPROM */
+#else
+  #define PLATFORM_I2C_EEPROMS
+#endif
+
+// per device telemetry, latency histogram bucket k counts [2^k, 2^(k+1)) us
+#define I2C_LAT_BUCKETS 24
+typedef struct i2c_dev_stats {
+  uint64_t transactions;    // bus transactions issued for the device
+  uint64_t bytes;           // payload bytes written and read
+  uint32_t retries;         // transactions repeated after a failure
+  uint32_t mux_mismatches;  // transactions where the mux readback did not match
+  uint32_t failures;        // transactions where the ioctl failed
+  uint32_t nacks;           // failures where the device NACKed (ENXIO, EREMOTEIO)
+  uint32_t busy;            // failures where the bus was busy or arbitration lost (EAGAIN, EBUSY)
+  uint32_t cache_hits;      // cached reads served without a bus transaction
+  uint32_t cache_fills;     // block reads made to fill the register cache
+  uint32_t lat_hist[I2C_LAT_BUCKETS];
+} I2CDevStats;
+
+// set before `init_i2c_bus`, ALPACA_SIM in the environment selects the simulator
+void i2c_set_transport(const I2CTransport *transport);
+const I2CTransport* i2c_get_transport();
+
+// ALPACA_I2C_PRIO=pll|normal|poll in the environment sets the initial class
+void i2c_set_priority(I2CPriority prio);
+I2CPriority i2c_get_priority();
+
 int init_i2c_bus();
 int close_i2c_bus();
+// device adapters are pooled by path and opened on first use, so these are
+// optional and only check that the device is known after `init_i2c_bus`
 int init_i2c_dev(I2CDev dev);
 int close_i2c_dev(I2CDev dev);
 int i2c_write(I2CDev dev, uint8_t *buf, uint16_t len);
 int i2c_read(I2CDev dev, uint8_t *buf, uint16_t len);
 int i2c_read_regs(I2CDev dev, uint8_t *offset, uint16_t olen, uint8_t *buf, uint16_t len);
+// one I2C_RDWR transaction through the transport, SUCCESS or FAILURE
+int i2c_rdwr(int fd, struct i2c_msg *msgs, int nmsgs);
+// physical bus a device lives on, 0 for fd_i2c0 and 1 for fd_i2c1
+int i2c_dev_bus(I2CDev dev);
+const char* i2c_dev_name(I2CDev dev);
+
+// telemetry, ALPACA_I2C_STATS set in the environment dumps it on exit
+void i2c_get_dev_stats(I2CDev dev, I2CDevStats *stats);
+void i2c_reset_stats();
+void i2c_dump_stats(FILE *f);
+void i2c_dump_stats_on_exit();
+
+/*
+ * Retry policies
+ *
+ * i2c_write/i2c_read/i2c_read_regs and the one-at-a-time resend of a failed
+ * batch run each transaction under the retry policy of its device. A failed
+ * attempt is classified by its error:
+ *
+ *   NACK (ENXIO, EREMOTEIO)  device busy (e.g., a bridge still shifting SPI),
+ *                            retried after the policy's backoff
+ *   mux mismatch             another master moved the mux, retried after the
+ *                            backoff with the mux reselected
+ *   busy (EAGAIN, EBUSY)     arbitration lost, retried at once since the bus
+ *                            is free again once the other master stops
+ *   bus error (EIO, ...)     retried after the backoff
+ *   anything else            (EBADF, ENOENT, ...) not retried
+ *
+ * Devices start out with the default policy, ALPACA_I2C_RETRY=<backoff>[:tries
+ * [:base_us[:max_us]]] in the environment replaces it, with <backoff> one of
+ * immediate, linear, exp or jitter.
+ */
+typedef enum i2c_backoff {
+  I2C_BACKOFF_IMMEDIATE,   // no delay between attempts
+  I2C_BACKOFF_LINEAR,      // base_us * n before attempt n+1
+  I2C_BACKOFF_EXPONENTIAL, // base_us * 2^(n-1) before attempt n+1
+  I2C_BACKOFF_JITTER       // uniform in [0, exponential delay], spreads out masters retrying together
+} I2CBackoff;
+
+typedef struct i2c_retry_policy {
+  I2CBackoff backoff;
+  uint8_t tries;           // attempts including the first
+  uint32_t base_us;
+  uint32_t max_us;         // cap on a single delay
+} I2CRetryPolicy;
+
+// linear 100 us steps, 5 tries
+#define I2C_RETRY_DEFAULT { I2C_BACKOFF_LINEAR, 5, 100, 1000 }
+
+const I2CRetryPolicy* i2c_get_retry_policy(I2CDev dev);
+// per device, NULL goes back to the default
+void i2c_set_retry_policy(I2CDev dev, const I2CRetryPolicy *policy);
+void i2c_set_default_retry_policy(const I2CRetryPolicy *policy);
+int i2c_parse_retry_policy(const char *spec, I2CRetryPolicy *policy);
+
+/*
+ * Fault injection
+ *
+ * With any fraction set the transport is wrapped so that of all transactions
+ * `nack` fail with ENXIO and `busy` with EAGAIN without reaching the bus, and
+ * `corrupt` go through with one bit flipped in the data read back (writes are
+ * never altered). A flipped mux readback shows up as a mux mismatch. Of the
+ * transactions with more than one message `partial` are NACKed part way, the
+ * messages ahead of a random one reach the bus and it fails with ENXIO as a
+ * NACK in the middle of an I2C_RDWR does. For testing the retry policies and
+ * batch recovery, on the simulator or on hardware.
+ * ALPACA_I2C_FAULT=nack=<f>,busy=<f>,corrupt=<f>,partial=<f>[,seed=<n>] in the
+ * environment sets it up in `init_i2c_bus`.
+ */
+typedef struct i2c_fault {
+  double nack;
+  double busy;
+  double corrupt;
+  double partial;
+  uint64_t seed;           // injection and jitter random sequence, 0 keeps the current one
+} I2CFault;
+
+typedef struct i2c_fault_stats {
+  uint32_t nacks;          // transactions failed with ENXIO
+  uint32_t busy;           // transactions failed with EAGAIN
+  uint32_t corrupted;      // transactions with read data altered
+  uint32_t partials;       // transactions NACKed part way
+} I2CFaultStats;
+
+void i2c_set_fault(const I2CFault *fault);
+void i2c_get_fault_stats(I2CFaultStats *stats);
+
+// batched writes to one device, up to 42 messages per I2C_RDWR ioctl. The
+// message data is copied so `buf` can be reused between adds. On failure
+// `failed` is set to the index (counted from begin) of the message that could
+// not be written, otherwise -1. For a paged register map `i2c_batch_page_reg`
+// (after begin) names the page register so a resend restores the page first.
+// For register-mapped parts only: the messages are joined by repeated STARTs,
+// and an i2c-spi bridge shifts its packet out on STOP and NACKs meanwhile.
+int i2c_batch_begin(I2CDev dev);
+int i2c_batch_page_reg(uint8_t reg);
+int i2c_batch_add(uint8_t *buf, uint16_t len);
+int i2c_batch_commit(int *failed);
+
+// page-aware EEPROM block I/O for the devices in PLATFORM_I2C_EEPROMS. Reads
+// are chunked to I2C_MAX_MSG_LEN, writes split at page boundaries, and the
+// write cycle is waited out by polling the part for an ACK (up to
+// I2C_EEPROM_TWR_TIMEOUT_US) rather than with a fixed sleep. Only a NACK is
+// polled through, any other error fails the call at once. `i2c_eeprom_write`
+// returns once the last page is committed. The bus is held for the whole call.
+#ifndef I2C_MAX_MSG_LEN
+#define I2C_MAX_MSG_LEN 255 // transfer size limit of the ZynqMP i2c controller
+#endif
+#define I2C_EEPROM_TWR_TIMEOUT_US 20000
+const I2CEeprom* i2c_eeprom_geom(I2CDev dev); // NULL if not an EEPROM
+int i2c_eeprom_read(I2CDev dev, uint32_t offset, uint8_t *buf, uint32_t len);
+int i2c_eeprom_write(I2CDev dev, uint32_t offset, const uint8_t *buf, uint32_t len);
+
+// register read cache for devices with auto-incrementing register reads (SFP
+// A0h/A2h, EEPROMs, Si534x/Si538x and 8A34001 pages). `i2c_cache_enable`
+// caches a `size` byte register space in `window` sized blocks, each read
+// whole when a read first touches it and kept for `ttl_us` (0 for registers
+// that never change, e.g., an SFP id block). Writes to the device through
+// this library invalidate it. `i2c_read_cached` reads `len` registers from
+// `reg`, through the cache if the device has one. A device's cache is not
+// shared between threads. The caches are dropped by `close_i2c_bus`.
+#define I2C_CACHE_WINDOW 128
+int i2c_cache_enable(I2CDev dev, uint32_t size, uint16_t window, uint32_t ttl_us);
+void i2c_cache_disable(I2CDev dev);
+void i2c_cache_invalidate(I2CDev dev);
+int i2c_read_cached(I2CDev dev, uint32_t reg, uint8_t *buf, uint16_t len);
+
+// cross-process bus locks (see alpaca_lock.h). Holding the lock of a bus across
+// a multi-transaction operation keeps other tools off the bus in between, a
+// single transaction does not take it. Locks nest, `i2c_lock_buses` takes the
+// buses in `mask` (bit n for bus n) in bus order. The lock calls return
+// FAILURE when the lock file cannot be opened or taken. ALPACA_I2C_LOCK=0 in
+// the environment turns locking off.
+#define I2C_NUM_BUSES 2
+#define I2C_ALL_BUSES ((1 << I2C_NUM_BUSES) - 1)
+int i2c_lock_dev(I2CDev dev);
+int i2c_unlock_dev(I2CDev dev);
+int i2c_lock_buses(uint32_t mask);
+int i2c_unlock_buses(uint32_t mask);
+void i2c_set_bus_locking(int enable);
+
+void i2c_set_mux_mode(I2CMuxMode mode);
+I2CMuxMode i2c_get_mux_mode();
+
+// mux readback check every `period` transactions per mux, 1 (the default)
+// checks every transaction and 0 disables the check. A longer period only
+// suits a bus no other master or tool switches the mux on.
+#ifndef I2C_MUX_VERIFY_PERIOD
+#define I2C_MUX_VERIFY_PERIOD 1
+#endif
+void i2c_set_mux_verify_period(uint32_t period);
+void i2c_get_mux_stats(I2CMuxStats *stats);
 #endif /* ALPACA_I2C_UTILS_H_ */
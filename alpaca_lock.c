@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // strerror
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/file.h> // flock
+
+#include "alpaca_lock.h"
+#include "alpaca_log.h"
+
+#define SUCCESS 0
+#define FAILURE 1
+
+/*
+ * Open (creating it if needed) the lock file for bus `name`, e.g., "i2c-1" or
+ * "spidev0.0". Returns the fd or -1, the caller decides whether to run unlocked.
+ */
+int bus_lock_open(const char *name) {
+  char path[128];
+  const char *dir = getenv("ALPACA_LOCK_DIR");
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/alpaca-%s.lock", (dir != NULL) ? dir : BUS_LOCK_DIR, name);
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    LOG_WARN("could not open bus lock %s: %s\n", path, strerror(errno));
+  }
+  return fd;
+}
+
+/*
+ * Block until the lock is held. `handoff` (if not NULL) is set to 1 when a
+ * different process held the lock last, 0 otherwise.
+ */
+int bus_lock(int fd, int *handoff) {
+  uint32_t owner = 0;
+  uint32_t pid = getpid();
+
+  while (flock(fd, LOCK_EX) < 0) {
+    if (errno != EINTR) {
+      LOG_WARN("could not take bus lock\n");
+      return FAILURE;
+    }
+  }
+
+  if (pread(fd, &owner, sizeof(owner), 0) != sizeof(owner) || owner != pid) {
+    if (pwrite(fd, &pid, sizeof(pid), 0) != sizeof(pid)) {
+      LOG_DEBUG("could not record bus lock owner\n");
+    }
+    if (handoff != NULL) {
+      *handoff = 1;
+    }
+  } else if (handoff != NULL) {
+    *handoff = 0;
+  }
+  return SUCCESS;
+}
+
+int bus_unlock(int fd) {
+  return (flock(fd, LOCK_UN) < 0) ? FAILURE : SUCCESS;
+}
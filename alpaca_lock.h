@@ -0,0 +1,28 @@
+#ifndef ALPACA_LOCK_H_
+#define ALPACA_LOCK_H_
+
+/*
+ * Cross-process advisory bus locks
+ *
+ * prg_pll, reset_pll, the SFP probes and the status tools can all run at the
+ * same time on one board. The kernel keeps a single i2c or spi transfer whole
+ * but not a sequence of them, so another tool can switch a mux, a device page
+ * or a readback select in between. Each bus (i2c adapter or spidev) gets a lock
+ * file, BUS_LOCK_DIR/alpaca-<name>.lock, that tools flock for the length of a
+ * multi-transaction operation. ALPACA_LOCK_DIR in the environment overrides the
+ * directory.
+ *
+ * The lock file holds the pid of the last holder so `bus_lock` can tell when
+ * another process had the bus since this one last held it, and cached bus state
+ * (the i2c mux cache) has to be dropped.
+ *
+ * flock locks belong to the open file, callers open one lock fd per thread (and
+ * again after a fork) so threads and child processes exclude each other too.
+ */
+#define BUS_LOCK_DIR "/run"
+
+int bus_lock_open(const char *name);
+int bus_lock(int fd, int *handoff);
+int bus_unlock(int fd);
+
+#endif /* ALPACA_LOCK_H_ */
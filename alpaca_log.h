@@ -0,0 +1,53 @@
+#ifndef ALPACA_LOG_H_
+#define ALPACA_LOG_H_
+
+#include <stdio.h>
+
+/*
+ * Leveled logging for the library hot paths
+ *
+ * Messages at or below ALPACA_LOG_LEVEL are written to stderr, anything above
+ * it is compiled out. The default is warnings and errors, VERBOSE builds add
+ * info and debug messages and release builds (NDEBUG) keep only errors.
+ */
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef ALPACA_LOG_LEVEL
+  #if defined(VERBOSE)
+    #define ALPACA_LOG_LEVEL LOG_LEVEL_DEBUG
+  #elif defined(NDEBUG)
+    #define ALPACA_LOG_LEVEL LOG_LEVEL_ERROR
+  #else
+    #define ALPACA_LOG_LEVEL LOG_LEVEL_WARN
+  #endif
+#endif
+
+#if ALPACA_LOG_LEVEL >= LOG_LEVEL_ERROR
+  #define LOG_ERROR(...) fprintf(stderr, "ERROR: " __VA_ARGS__)
+#else
+  #define LOG_ERROR(...) do {} while (0)
+#endif
+
+#if ALPACA_LOG_LEVEL >= LOG_LEVEL_WARN
+  #define LOG_WARN(...) fprintf(stderr, "WARNING: " __VA_ARGS__)
+#else
+  #define LOG_WARN(...) do {} while (0)
+#endif
+
+#if ALPACA_LOG_LEVEL >= LOG_LEVEL_INFO
+  #define LOG_INFO(...) fprintf(stderr, __VA_ARGS__)
+#else
+  #define LOG_INFO(...) do {} while (0)
+#endif
+
+#if ALPACA_LOG_LEVEL >= LOG_LEVEL_DEBUG
+  #define LOG_DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+  #define LOG_DEBUG(...) do {} while (0)
+#endif
+
+#endif /* ALPACA_LOG_H_ */
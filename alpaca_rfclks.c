@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdint.h> // uint8_t, uint16_t
 #include <unistd.h> // write
+#include <time.h>   // clock_gettime
 
 #include <errno.h>
 #include <assert.h>
@@ -11,6 +12,8 @@
 #include <sys/ioctl.h>
 
 #include "alpaca_rfclks.h"
+#include "alpaca_trace.h"
+#include "alpaca_sim.h"
 
 /*
  * Format i2c packet to write to rfpll
@@ -99,8 +102,12 @@ uint32_t* readtcs(FILE* tcsfile, uint16_t len, uint8_t pll_type) {
   return rp;
 }
 
+#ifdef SPI_COM_BUS
+static void spi_rfpll_check_speed(spi_dev_t *dev);
+#endif
+
 /*
- * Program rfpll from a sequence of register data values
+ * Write a sequence of register data values to an rfpll
  *
  * dev:
  *   i2c device struct used to communicate with the rfpll (e.g., spi bridge)
@@ -113,89 +120,712 @@ uint32_t* readtcs(FILE* tcsfile, uint16_t len, uint8_t pll_type) {
  *   data bytes} (5) and LMK04828B/04832/LMX2594 are {sdo byte, 3 data bytes} (4)
  */
 #ifdef I2C_COM_BUS
-int prog_pll(I2CDev dev, uint8_t spi_sdosel, uint32_t* buf, uint16_t len, uint8_t pkt_len) {
+static int prog_regs(I2CDev dev, uint8_t spi_sdosel, uint32_t* buf, uint16_t len, uint8_t pkt_len) {
 #else
-int prog_pll(spi_dev_t *dev, uint32_t* buf, uint16_t len, uint8_t pkt_len) {
+static int prog_regs(spi_dev_t *dev, uint32_t* buf, uint16_t len, uint8_t pkt_len) {
 #endif
   int res = RFCLK_SUCCESS;
 
   uint8_t* rfclk_pkt_buffer;
   rfclk_pkt_buffer = malloc(sizeof(uint8_t)*pkt_len);
+#ifdef SPI_COM_BUS
+  // the whole plan is formatted up front and goes out as SPI_IOC_MESSAGE
+  // transfers with the gaps between packets included
+  uint8_t* plan = malloc(sizeof(uint8_t)*pkt_len*len);
+  if (plan == NULL && len > 0) {
+    free(rfclk_pkt_buffer);
+    rfclk_pkt_buffer = NULL;
+  }
+#endif
+  if (rfclk_pkt_buffer == NULL) {
+    printf("out of memory programming pll\n");
+    return RFCLK_FAILURE;
+  }
+
+  trace_phase("prog_pll");
+
+  // hold the bus for the whole load so another tool cannot switch the mux or
+  // use the bridge between the register writes. Through the bus broker the
+  // load also runs ahead of background polling.
+#ifdef I2C_COM_BUS
+  I2CPriority prio = i2c_get_priority();
+  i2c_set_priority(I2C_PRIO_PLL);
+  i2c_lock_dev(dev);
+#else
+  spi_lock_dev(dev);
+  spi_rfpll_check_speed(dev);
+#endif
+
+#ifdef SPI_COM_BUS
+  int failed = -1;
+#endif
 
   for (int i=0; i<len; i++) {
 #ifdef I2C_COM_BUS
+    // one transaction per register, the bridge shifts a packet out on the
+    // STOP and NACKs until it is done, so packets cannot be batched
     format_rfclk_pkt(spi_sdosel, buf[i], rfclk_pkt_buffer, pkt_len);
     res = i2c_write(dev, rfclk_pkt_buffer, pkt_len);
 #else
-    format_rfclk_pkt(buf[i], rfclk_pkt_buffer, pkt_len);
-    res = write_spi_pkt(dev, rfclk_pkt_buffer, pkt_len);
+    format_rfclk_pkt(buf[i], &plan[i*pkt_len], pkt_len);
+    if (i < len-1) {
+      continue;
+    }
+    if (dev->timing->final_delay_us == 0) {
+      res = spi_write_seq(dev, plan, pkt_len, len, &failed);
+    } else {
+      // the kernel holds the controller through a transfer delay, the wait
+      // before the last register is slept here instead so the other spidevs
+      // on the controller (the other LMX) can use it meanwhile
+      res = spi_write_seq(dev, plan, pkt_len, len-1, &failed);
+      if (res == RFCLK_SUCCESS) {
+        usleep(dev->timing->final_delay_us);
+        res = spi_write_seq(dev, &plan[(len-1)*pkt_len], pkt_len, 1, &failed);
+        failed = (failed < 0) ? failed : len-1;
+      }
+    }
 #endif
     if (res == RFCLK_FAILURE) {
-      printf("i2c failed to program pll\n"); // TODO: move printf()s to stderr;
+#ifdef I2C_COM_BUS
+      printf("i2c failed to program pll at register %d\n", i); // TODO: move printf()s to stderr;
+#else
+      printf("spi failed to program pll at register %d\n", failed); // TODO: move printf()s to stderr;
+#endif
       free(rfclk_pkt_buffer);
+#ifdef I2C_COM_BUS
+      i2c_unlock_dev(dev);
+      i2c_set_priority(prio);
+#else
+      free(plan);
+      spi_unlock_dev(dev);
+#endif
+      trace_phase_end();
       return res;
     }
 
     // wait 1 ms before programming last register. This is required for the
-    // LMX2594 to ensure VCO calibration runs from a stable state.
+    // LMX2594 to ensure VCO calibration runs from a stable state. On spi the
+    // part's timing profile says whether it needs the wait.
+#ifdef I2C_COM_BUS
     if (i== len-2) { usleep(1000); }
+#endif
   }
 
   free(rfclk_pkt_buffer);
 
+#ifdef I2C_COM_BUS
+  i2c_unlock_dev(dev);
+  i2c_set_priority(prio);
+#else
+  free(plan);
+  spi_settle(dev);
+  spi_unlock_dev(dev);
+#endif
+  trace_phase_end();
+  return res;
+}
+
+/*
+ * Register shadows
+ *
+ * The last sequence written to each rfpll is kept in a small state file,
+ * /run/alpaca-rfpll-<bridge>-ss<sdo select> (or -<spidev>), ALPACA_SHADOW_DIR
+ * in the environment overrides the directory. On the simulator it defaults to
+ * SIM_STATE_DIR so a simulated load is never taken for the board's. A load
+ * removes it first and writes the new one once the whole sequence went out,
+ * so a failed load or a reset (see `rfpll_shadow_clear`) leaves no shadow and
+ * the next diff load programs everything.
+ */
+static const char* rfpll_shadow_dir() {
+  if (getenv("ALPACA_SHADOW_DIR") != NULL) {
+    return getenv("ALPACA_SHADOW_DIR");
+  }
+  return sim_enabled() ? sim_state_dir() : RFPLL_SHADOW_DIR;
+}
+
+#ifdef I2C_COM_BUS
+static void rfpll_shadow_path(char* path, int n, I2CDev dev, uint8_t spi_sdosel) {
+  snprintf(path, n, "%s/alpaca-rfpll-%s-ss%u", rfpll_shadow_dir(), i2c_dev_name(dev), spi_sdosel);
+}
+#else
+static void rfpll_shadow_path(char* path, int n, spi_dev_t *dev) {
+  const char* dir = rfpll_shadow_dir();
+  const char* name = strrchr(dev->device, '/') ? strrchr(dev->device, '/') + 1 : dev->device;
+  snprintf(path, n, "%s/alpaca-rfpll-%s", dir, name);
+}
+#endif
+
+// the shadow sequence into `shadow` (at most `len` words), returns its length
+// or -1 when there is no usable shadow
+static int rfpll_shadow_load(const char* path, uint32_t* shadow, uint16_t len) {
+  char ln[64];
+  int platform = -1;
+  int n = 0;
+  FILE* f = fopen(path, "r");
+
+  if (f == NULL) {
+    return -1;
+  }
+  while (fgets(ln, sizeof(ln), f) != NULL) {
+    if (sscanf(ln, "platform %d", &platform) == 1 || ln[0] == '#') {
+      continue;
+    }
+    if (n >= len || sscanf(ln, "%x", &shadow[n]) != 1) {
+      n = -1;
+      break;
+    }
+    n++;
+  }
+  fclose(f);
+  return (platform == PLATFORM) ? n : -1;
+}
+
+static void rfpll_shadow_save(const char* path, uint32_t* buf, uint16_t len) {
+  char tmp[256];
+  FILE* f;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  f = fopen(tmp, "w");
+  if (f == NULL) {
+    printf("WARN: could not write register shadow %s\n", tmp);
+    return;
+  }
+  fprintf(f, "# alpaca rfpll register shadow, the last sequence programmed\n");
+  fprintf(f, "platform %d\n", PLATFORM);
+  for (int i=0; i<len; i++) {
+    fprintf(f, "0x%08x\n", buf[i]);
+  }
+  if (fclose(f) != 0 || rename(tmp, path) != 0) {
+    printf("WARN: could not write register shadow %s\n", path);
+    remove(tmp);
+  }
+}
+
+#ifdef I2C_COM_BUS
+void rfpll_shadow_clear(I2CDev dev, uint8_t spi_sdosel) {
+  char path[256];
+  rfpll_shadow_path(path, sizeof(path), dev, spi_sdosel);
+#else
+void rfpll_shadow_clear(spi_dev_t *dev) {
+  char path[256];
+  rfpll_shadow_path(path, sizeof(path), dev);
+#endif
+  remove(path);
+}
+
+/*
+ * Program rfpll from a sequence of register data values
+ *
+ * dev:
+ *   i2c device struct used to communicate with the rfpll (e.g., spi bridge)
+ * buf:
+ *   buffer containing rfpll register values
+ * len:
+ *   length of `buffer`
+ * pkt_len:
+ *   number of bytes per rfpll write transactions, e.g., LMK04208={sdo byte, 4
+ *   data bytes} (5) and LMK04828B/04832/LMX2594 are {sdo byte, 3 data bytes} (4)
+ */
+#ifdef I2C_COM_BUS
+int prog_pll(I2CDev dev, uint8_t spi_sdosel, uint32_t* buf, uint16_t len, uint8_t pkt_len) {
+#else
+int prog_pll(spi_dev_t *dev, uint32_t* buf, uint16_t len, uint8_t pkt_len) {
+#endif
+  char path[256];
+  int res;
+
+#ifdef I2C_COM_BUS
+  rfpll_shadow_path(path, sizeof(path), dev, spi_sdosel);
+  remove(path);
+  res = prog_regs(dev, spi_sdosel, buf, len, pkt_len);
+#else
+  rfpll_shadow_path(path, sizeof(path), dev);
+  remove(path);
+  res = prog_regs(dev, buf, len, pkt_len);
+#endif
+  if (res == RFCLK_SUCCESS) {
+    rfpll_shadow_save(path, buf, len);
+  }
+  return res;
+}
+
+/*
+ * Part programming rules for diff loads
+ *
+ * Writing the register at `trigger` recalibrates the part's VCO. It is
+ * rewritten last, after the 1 ms wait, whenever a register in [lo, hi]
+ * changed: R0 with FCAL_EN for any change on the LMX2594, PLL2_N (R360) for
+ * a change to the PLL2 registers on the LMK04828/LMK04832, and R30 (PLL2_N)
+ * for any change on the LMK04208.
+ */
+typedef struct rfpll_rules {
+  uint32_t addr_shift;  // register address of a sequence word, (d >> addr_shift) & addr_mask
+  uint32_t addr_mask;
+  uint32_t trigger;
+  uint32_t lo;
+  uint32_t hi;
+} RfpllRules;
+
+static const RfpllRules lmx2594_rules = { 16, 0x7f, 0, 0, 0x7f };
+#if PLATFORM == ZCU111
+static const RfpllRules lmk_rules = { 0, 0x1f, 30, 0, 0x1f };
+#else
+static const RfpllRules lmk_rules = { 8, 0x1fff, 0x168, 0x160, 0x16e };
+#endif
+
+/*
+ * Program only the registers that differ from the rfpll's shadow
+ *
+ * Same as `prog_pll` with the part (`pll_type`, lmk=0 and lmx2594=anything
+ * else) to apply its rules. The sequence is compared word by word with the
+ * last one programmed, the changed words are written in sequence order
+ * without the resets and the part's calibration trigger last (see
+ * RfpllRules). With no usable shadow, or a sequence laid out differently
+ * from it, the whole sequence is programmed as `prog_pll` does.
+ */
+#ifdef I2C_COM_BUS
+int prog_pll_diff(I2CDev dev, uint8_t spi_sdosel, uint8_t pll_type, uint32_t* buf, uint16_t len, uint8_t pkt_len) {
+#else
+int prog_pll_diff(spi_dev_t *dev, uint8_t pll_type, uint32_t* buf, uint16_t len, uint8_t pkt_len) {
+#endif
+  const RfpllRules *r = (pll_type == 0) ? &lmk_rules : &lmx2594_rules;
+  uint32_t* shadow = malloc(sizeof(uint32_t)*len);
+  uint32_t* diff = malloc(sizeof(uint32_t)*(len+1));
+  char path[256];
+  int trigger = -1; // sequence index of the last write of the trigger register
+  int recal = 0;
+  int n = 0;
+  int res;
+
+  if (shadow == NULL || diff == NULL) {
+    printf("out of memory programming pll\n");
+    free(shadow);
+    free(diff);
+    return RFCLK_FAILURE;
+  }
+
+#ifdef I2C_COM_BUS
+  rfpll_shadow_path(path, sizeof(path), dev, spi_sdosel);
+#else
+  rfpll_shadow_path(path, sizeof(path), dev);
+#endif
+
+  if (rfpll_shadow_load(path, shadow, len) != len) {
+    n = -1;
+  }
+  for (int i=0; i<len && n >= 0; i++) {
+    uint32_t addr = (buf[i] >> r->addr_shift) & r->addr_mask;
+    if (addr != ((shadow[i] >> r->addr_shift) & r->addr_mask)) {
+      n = -1;
+      break;
+    }
+    if (addr == r->trigger) {
+      trigger = i;
+    }
+    if (buf[i] != shadow[i]) {
+      recal |= (addr >= r->lo && addr <= r->hi);
+      diff[n++] = buf[i];
+    }
+  }
+  free(shadow);
+
+  if (n < 0) {
+    printf("no register shadow for this sequence, programming all %d registers\n", len);
+    free(diff);
+#ifdef I2C_COM_BUS
+    return prog_pll(dev, spi_sdosel, buf, len, pkt_len);
+#else
+    return prog_pll(dev, buf, len, pkt_len);
+#endif
+  }
+  if (n == 0) {
+    printf("all %d registers match the shadow, nothing to program\n", len);
+    free(diff);
+    return RFCLK_SUCCESS;
+  }
+
+  // the trigger goes last, once more when it changed itself
+  if (recal && trigger >= 0) {
+    diff[n++] = buf[trigger];
+  }
+  printf("programming %d of %d registers that differ from the shadow\n", n, len);
+
+  remove(path);
+#ifdef I2C_COM_BUS
+  res = prog_regs(dev, spi_sdosel, diff, n, pkt_len);
+#else
+  // the part is running the shadowed load, its readback output is not
+  // switched to check the clock again (see `spi_rfpll_check_speed`)
+  dev->speed_verified = 1;
+  res = prog_regs(dev, diff, n, pkt_len);
+#endif
+  if (res == RFCLK_SUCCESS) {
+    rfpll_shadow_save(path, buf, len);
+  }
+  free(diff);
+  return res;
+}
+
+/*
+ * LMX2594 fast retune
+ *
+ * The fields that set the output frequency and where they live. A retune
+ * starts from the rfpll's register shadow (the last full or diff load), sets
+ * these fields in it and writes only the words that changed, in sequence
+ * order, then R0 with FCAL_EN after the 1 ms wait, with no reset and no
+ * reload of the other registers. PFD_DLY_SEL (R37), the MASH order and the
+ * reference path are kept as loaded, a retune that needs them changed (or
+ * from integer to fractional mode) takes a full plan. A VCO forced from the
+ * calibration cache (see `lmx2594_prog_cached`) is released so the new
+ * frequency calibrates.
+ */
+#define LMX_R_VCO_FORCE  8   // R8[14] VCO_DACISET_FORCE, R8[11] VCO_CAPCTRL_FORCE
+#define LMX_R_VCO_SEL    20  // R20[13:11] VCO_SEL, R20[10] VCO_SEL_FORCE
+#define LMX_R_CHDIV_DIV2 31  // R31[14], on when the channel divider divides by more than 2
+#define LMX_R_PLL_N_HI   34  // R34[2:0] PLL_N[18:16]
+#define LMX_R_PLL_N      36  // PLL_N[15:0]
+#define LMX_R_PLL_DEN_HI 38
+#define LMX_R_PLL_DEN    39
+#define LMX_R_PLL_NUM_HI 42
+#define LMX_R_PLL_NUM    43
+#define LMX_R_OUTA_MUX   45  // R45[12:11]
+#define LMX_R_OUTB_MUX   46  // R46[1:0]
+#define LMX_R_CHDIV      75  // R75[10:6]
+#define LMX_FCAL_EN      0x8 // R0[3]
+
+// `d` with the bits in `mask` replaced by `v`, the address byte kept
+static uint32_t lmx_field(uint32_t d, uint16_t mask, uint16_t v) {
+  return (d & ~(uint32_t) mask) | (v & mask);
+}
+
+static uint32_t lmx_retune_word(uint32_t d, const LMX2594Freq *f) {
+  uint8_t chdiv_used = (f->outa_mux == LMX_OUT_MUX_CHDIV) || (f->outb_mux == LMX_OUT_MUX_CHDIV);
+
+  switch ((d >> 16) & 0x7f) {
+    case LMX_R_VCO_FORCE:  return lmx_field(d, (1 << 14) | (1 << 11), 0);
+    case LMX_R_VCO_SEL:    return lmx_field(d, 1 << 10, 0);
+    case LMX_R_CHDIV_DIV2: return lmx_field(d, 1 << 14, (chdiv_used && f->chdiv > 0) << 14);
+    case LMX_R_PLL_N_HI:   return lmx_field(d, 0x0007, f->n >> 16);
+    case LMX_R_PLL_N:      return lmx_field(d, 0xffff, f->n);
+    case LMX_R_PLL_DEN_HI: return lmx_field(d, 0xffff, f->den >> 16);
+    case LMX_R_PLL_DEN:    return lmx_field(d, 0xffff, f->den);
+    case LMX_R_PLL_NUM_HI: return lmx_field(d, 0xffff, f->num >> 16);
+    case LMX_R_PLL_NUM:    return lmx_field(d, 0xffff, f->num);
+    case LMX_R_OUTA_MUX:   return lmx_field(d, 0x3 << 11, f->outa_mux << 11);
+    case LMX_R_OUTB_MUX:   return lmx_field(d, 0x3, f->outb_mux);
+    case LMX_R_CHDIV:      return lmx_field(d, 0x1f << 6, f->chdiv << 6);
+    default:               return d;
+  }
+}
+
+int lmx2594_get_freq(const uint32_t* buf, uint16_t len, LMX2594Freq *f) {
+  uint32_t r[LMX_R_CHDIV+1];
+  uint32_t seen = 0;
+
+  memset(r, 0, sizeof(r));
+  for (int i=0; i<len; i++) {
+    uint32_t addr = (buf[i] >> 16) & 0x7f;
+    if (addr <= LMX_R_CHDIV) {
+      r[addr] = buf[i] & 0xffff;
+      seen |= (addr == LMX_R_PLL_N) | (addr == LMX_R_CHDIV) << 1;
+    }
+  }
+  if (seen != 0x3) {
+    return RFCLK_FAILURE;
+  }
+  f->n = ((r[LMX_R_PLL_N_HI] & 0x7) << 16) | r[LMX_R_PLL_N];
+  f->den = (r[LMX_R_PLL_DEN_HI] << 16) | r[LMX_R_PLL_DEN];
+  f->num = (r[LMX_R_PLL_NUM_HI] << 16) | r[LMX_R_PLL_NUM];
+  f->chdiv = (r[LMX_R_CHDIV] >> 6) & 0x1f;
+  f->outa_mux = (r[LMX_R_OUTA_MUX] >> 11) & 0x3;
+  f->outb_mux = r[LMX_R_OUTB_MUX] & 0x3;
+  return RFCLK_SUCCESS;
+}
+
+#ifdef I2C_COM_BUS
+int lmx2594_retune(I2CDev dev, uint8_t spi_sdosel, const LMX2594Freq *f) {
+#else
+int lmx2594_retune(spi_dev_t *dev, const LMX2594Freq *f) {
+#endif
+  uint32_t shadow[LMX2594_REG_CNT];
+  uint32_t seq[LMX2594_REG_CNT];
+  char path[256];
+  int n = 0;
+  int res;
+
+  if (f->n >= (1 << 19) || f->chdiv > LMX_CHDIV_MAX || f->outa_mux > LMX_OUT_MUX_HIZ || f->outb_mux > LMX_OUT_MUX_HIZ) {
+    printf("lmx2594 retune out of range: N %u, CHDIV %u, OUTA_MUX %u, OUTB_MUX %u\n", f->n, f->chdiv, f->outa_mux,
+           f->outb_mux);
+    return RFCLK_FAILURE;
+  }
+
+#ifdef I2C_COM_BUS
+  rfpll_shadow_path(path, sizeof(path), dev, spi_sdosel);
+#else
+  rfpll_shadow_path(path, sizeof(path), dev);
+#endif
+  if (rfpll_shadow_load(path, shadow, LMX2594_REG_CNT) != LMX2594_REG_CNT) {
+    printf("no lmx2594 register shadow, program a full plan before retuning\n");
+    return RFCLK_FAILURE;
+  }
+
+  // the frequency words that change, the reset words at the start left out
+  for (int i=2; i<LMX2594_REG_CNT-1; i++) {
+    uint32_t d = lmx_retune_word(shadow[i], f);
+    if (d != shadow[i]) {
+      shadow[i] = d;
+      seq[n++] = d;
+    }
+  }
+  // R0 once more to start the VCO calibration at the new frequency
+  shadow[LMX2594_REG_CNT-1] |= LMX_FCAL_EN;
+  seq[n++] = shadow[LMX2594_REG_CNT-1];
+  printf("retuning lmx2594 with %d register writes\n", n);
+
+  remove(path);
+#ifdef I2C_COM_BUS
+  res = prog_regs(dev, spi_sdosel, seq, n, LMX_PKT_SIZE);
+#else
+  // running part, as in `prog_pll_diff` the clock is not checked again
+  dev->speed_verified = 1;
+  res = prog_regs(dev, seq, n, LMX_PKT_SIZE);
+#endif
+  if (res == RFCLK_SUCCESS) {
+    rfpll_shadow_save(path, shadow, LMX2594_REG_CNT);
+  }
   return res;
 }
 
 #ifdef SPI_COM_BUS
-int spi_get_lmk04828_config(spi_dev_t *dev, uint32_t* regbuf) {
-  printf("Reading LMK04828 register config\n");
+/*
+ * Full duplex register readback over spidev
+ *
+ * `frames` are the 24-bit words shifted out, one per register frame: the
+ * write turning the part's readback output on, a read frame (address with
+ * REG_RW_BIT set) per register, and the write turning it back off. All of
+ * them go out in one SPI_IOC_MESSAGE with chip select dropped between frames
+ * and `vals[i]` is the 24 bits the part drove back during frame i, so the
+ * register value is in the low bits of the read frames' entries.
+ *
+ * `vals` holds `n` words, the same as `frames`, and `n` must be positive.
+ */
+static int spi_readback_regs(spi_dev_t *dev, const uint32_t* frames, uint32_t* vals, int n) {
+  uint8_t* tx;
+  uint8_t* rx;
+  int failed = -1;
+  int res;
+
+  if (n <= 0) {
+    printf("spi readback of %d frames\n", n);
+    return RFCLK_FAILURE;
+  }
+  tx = malloc(sizeof(uint8_t)*SPI_RB_PKT_SIZE*n);
+  rx = malloc(sizeof(uint8_t)*SPI_RB_PKT_SIZE*n);
+  if (tx == NULL || rx == NULL) {
+    printf("spi readback of %d frames: out of memory\n", n);
+    free(tx);
+    free(rx);
+    return RFCLK_FAILURE;
+  }
 
-  uint8_t R366[LMK_PKT_SIZE];
-  // hardcoded readback value computed from R366 to config spi readback
-  // RFSoC4x2 STATUS_LD2 is connected to SDO rather than STATUS_LD1
-  // Need to then configure PLL2_LD_MUX for spi readback (register 0x16E, R366)
-  format_rfclk_pkt(0x00016e3b, R366, LMK_PKT_SIZE); // lmk04828 spi packets are 3 bytes
-  if(RFCLK_FAILURE==write_spi_pkt(dev, R366, LMK_PKT_SIZE)) {
-    printf("error setting R366 for readback on LMK04828\n");
+  for (int i=0; i<n; i++) {
+    format_rfclk_pkt(frames[i], &tx[i*SPI_RB_PKT_SIZE], SPI_RB_PKT_SIZE);
+  }
+  res = spi_transfer_seq(dev, tx, rx, SPI_RB_PKT_SIZE, n, &failed);
+  if (res == RFCLK_FAILURE) {
+    printf("spi readback failed at frame %d of %d\n", failed, n);
+  } else {
+    for (int i=0; i<n; i++) {
+      uint8_t* f = &rx[i*SPI_RB_PKT_SIZE];
+      vals[i] = (f[0] << 16) | (f[1] << 8) | f[2];
+    }
+  }
+
+  free(tx);
+  free(rx);
+  return res;
+}
+
+/*
+ * SPI clock calibration
+ *
+ * The clock is checked with reads only: a block of configuration registers is
+ * read back at the base speed for reference, then again at the speed under
+ * test, which passes when every value matches. The LMK04828 reads its clock
+ * output block (R256-R319) and the LMX2594 R0-R78, leaving out the readback
+ * only status registers above. The only writes turn the readback output on
+ * before and off after, at the base speed, on the LMX without FCAL_EN as
+ * `lmx_read_regs` does so the check does not start a VCO calibration.
+ */
+typedef struct spi_rfpll_port {
+  uint32_t rb_on;     // write turning the readback output on
+  uint32_t rb_off;    // and off again
+  uint16_t first;     // first register of the reference block
+  uint16_t count;     // number of registers in it
+  uint8_t data_bits;  // register width, 8 on the LMK and 16 on the LMX
+} SPIRfpllPort;
+
+#define SPI_PORT_MAX_REGS 79
+
+static const SPIRfpllPort spi_lmk_port = { 0x00016e3b, 0x00016e13, 0x0100, 64, 8 };
+static const SPIRfpllPort spi_lmx_port = { 0x00002418 & ~LMX_FCAL_EN, 0x0000241c & ~LMX_FCAL_EN, 0, 79, 16 };
+
+static const SPIRfpllPort* spi_rfpll_port(spi_dev_t *dev) {
+  return (strcmp(dev->device, LMK_SPIDEV) == 0) ? &spi_lmk_port : &spi_lmx_port;
+}
+
+// read the reference block into `vals` at the current speed, with `rb_on`
+// ahead of the reads when it is not 0
+static int spi_port_read(spi_dev_t *dev, uint32_t rb_on, uint32_t* vals) {
+  const SPIRfpllPort *p = spi_rfpll_port(dev);
+  uint32_t frames[SPI_PORT_MAX_REGS+1], rb[SPI_PORT_MAX_REGS+1];
+  int m = 0;
+
+  if (rb_on) {
+    frames[m++] = rb_on;
+  }
+  for (int i=0; i<p->count; i++) {
+    frames[m++] = ((uint32_t) (p->first + i) << p->data_bits) | (REG_RW_BIT << 16);
+  }
+  if (spi_readback_regs(dev, frames, rb, m) == RFCLK_FAILURE) {
     return RFCLK_FAILURE;
   }
+  for (int i=0; i<p->count; i++) {
+    vals[i] = rb[i + (rb_on != 0)] & ((1 << p->data_bits) - 1);
+  }
+  return RFCLK_SUCCESS;
+}
 
-  uint32_t lmk_config_data[256]; // arbitrary size of 256
-  uint32_t* lmk_cd = lmk_config_data;
+// turn readback on and read the reference block (off=0), or turn readback
+// off again (off=1), at the base speed
+static int spi_port_setup(spi_dev_t *dev, uint32_t* ref, int off) {
+  const SPIRfpllPort *p = spi_rfpll_port(dev);
+  uint32_t speed = dev->speed;
+  uint32_t vals[1];
+  int res;
+  int same = 1;
 
-  uint8_t lmk_tx_read[LMK_PKT_SIZE] = {0x0};
-  uint8_t lmk_reg_read[LMK_PKT_SIZE] = {0x0};
-  for (int i=0; i<LMK_REG_CNT; i++, lmk_cd++) {
-    // LMK address to read do not simply increment as with the LMX so we pull
-    // out of valid addresses from the LMK and use those, end up double counting
-    // registers that are part of the reset sequence
+  if (spi_set_speed(dev, dev->base_speed) == RFCLK_FAILURE) {
+    return RFCLK_FAILURE;
+  }
+  if (off) {
+    res = spi_readback_regs(dev, &p->rb_off, vals, 1);
+  } else {
+    res = spi_port_read(dev, p->rb_on, ref);
+    for (int i=1; i<p->count && res == RFCLK_SUCCESS; i++) {
+      same &= (ref[i] == ref[0]);
+    }
+    // a stuck data line reads the same for every register and would match at any speed
+    if (res == RFCLK_SUCCESS && same) {
+      printf("%s reads back 0x%x for every register, cannot check the clock\n", dev->device, ref[0]);
+      res = RFCLK_FAILURE;
+    }
+  }
+  spi_set_speed(dev, speed);
+  return res;
+}
 
-    lmk_tx_read[0] = (0xff & (regbuf[i] >> 16)) | REG_RW_BIT;
-    lmk_tx_read[1] =  0xff & (regbuf[i] >> 8);
+// `iters` reads of the reference block at the current speed
+static int spi_port_compare(spi_dev_t *dev, const uint32_t* ref, int iters) {
+  const SPIRfpllPort *p = spi_rfpll_port(dev);
+  uint32_t vals[SPI_PORT_MAX_REGS];
 
-    lmk_reg_read[0] = 0x0;
-    lmk_reg_read[1] = 0x0;
-    lmk_reg_read[2] = 0x0;
+  for (int n=0; n<iters; n++) {
+    if (spi_port_read(dev, 0, vals) == RFCLK_FAILURE) {
+      return RFCLK_FAILURE;
+    }
+    if (memcmp(vals, ref, sizeof(uint32_t)*p->count) != 0) {
+      return RFCLK_FAILURE;
+    }
+  }
+  return RFCLK_SUCCESS;
+}
 
-    spi_transfer(dev, lmk_tx_read, lmk_reg_read, LMK_PKT_SIZE);
+int spi_rfpll_verify_speed(spi_dev_t *dev, int iters) {
+  uint32_t ref[SPI_PORT_MAX_REGS];
+  int res;
 
-    *lmk_cd = (regbuf[i] & 0xffff00) + lmk_reg_read[2];
+  res = spi_port_setup(dev, ref, 0);
+  if (res == RFCLK_SUCCESS) {
+    res = spi_port_compare(dev, ref, iters);
+  }
+  if (spi_port_setup(dev, NULL, 1) == RFCLK_FAILURE) {
+    return RFCLK_FAILURE;
+  }
+  return res;
+}
+
+int spi_rfpll_calibrate(spi_dev_t *dev, const uint32_t* rates, int nrates, int iters, uint32_t* best) {
+  uint32_t ref[SPI_PORT_MAX_REGS];
+  int res;
+
+  *best = 0;
+  res = spi_port_setup(dev, ref, 0);
+  // rates go up until the first that does not read back right
+  for (int i=0; i<nrates && res == RFCLK_SUCCESS; i++) {
+    if (spi_set_speed(dev, rates[i]) == RFCLK_FAILURE || spi_port_compare(dev, ref, iters) == RFCLK_FAILURE) {
+      break;
+    }
+    *best = rates[i];
+  }
+  if (spi_port_setup(dev, NULL, 1) == RFCLK_FAILURE) {
+    return RFCLK_FAILURE;
+  }
+  spi_set_speed(dev, (*best > 0) ? *best : dev->base_speed);
+  dev->speed_verified = 1;
+  return (*best > 0) ? RFCLK_SUCCESS : RFCLK_FAILURE;
+}
+
+// a profiled clock is checked once before it is used to program the part.
+// Loads onto a running part (diff, retune) mark it checked beforehand, the
+// check switches the readback output through R0/R366 of the running config.
+static void spi_rfpll_check_speed(spi_dev_t *dev) {
+  if (dev->speed_verified) {
+    return;
   }
+  dev->speed_verified = 1;
+  if (spi_rfpll_verify_speed(dev, 1) == RFCLK_FAILURE) {
+    printf("WARN: %s does not verify at the profiled %u Hz, using %u Hz\n", dev->device, dev->speed,
+           dev->base_speed);
+    spi_set_speed(dev, dev->base_speed);
+  }
+}
+
+int spi_get_lmk04828_config(spi_dev_t *dev, uint32_t* regbuf) {
+  trace_phase("get_lmk04828_config");
+  printf("Reading LMK04828 register config\n");
 
+  uint32_t frames[LMK_REG_CNT+2];
+  uint32_t vals[LMK_REG_CNT+2];
+
+  // hardcoded readback value computed from R366 to config spi readback
+  // RFSoC4x2 STATUS_LD2 is connected to SDO rather than STATUS_LD1
+  // Need to then configure PLL2_LD_MUX for spi readback (register 0x16E, R366)
+  frames[0] = 0x00016e3b;
+  for (int i=0; i<LMK_REG_CNT; i++) {
+    // LMK address to read do not simply increment as with the LMX so we pull
+    // out of valid addresses from the LMK and use those, end up double counting
+    // registers that are part of the reset sequence
+    frames[i+1] = (regbuf[i] & 0xffff00) | (REG_RW_BIT << 16);
+  }
   // revert PLL2_LD_MUX/PLL2_LD_TYPE reg back (register 0x16E, R366)
-  format_rfclk_pkt(0x00016e13, R366, LMK_PKT_SIZE);
-  if(RFCLK_FAILURE==write_spi_pkt(dev, R366, LMK_PKT_SIZE)) {
-    printf("error setting R366 for readback on LMK04828\n");
+  frames[LMK_REG_CNT+1] = 0x00016e13;
+
+  if (spi_readback_regs(dev, frames, vals, LMK_REG_CNT+2) == RFCLK_FAILURE) {
+    printf("error reading back LMK04828\n");
+    trace_phase_end();
     return RFCLK_FAILURE;
   }
+  trace_phase_end();
 
   // display lmk config info
   printf("LMK04828 readback config data are:\n");
   for (int i=0; i<LMK_REG_CNT; i++) {
+    uint32_t reg = (regbuf[i] & 0xffff00) + (vals[i+1] & 0xff);
     if (i%9==8) {
-      printf("0x%06x,\n", lmk_config_data[i]);
+      printf("0x%06x,\n", reg);
     } else {
-      printf("0x%06x, ", lmk_config_data[i]);
+      printf("0x%06x, ", reg);
     }
   }
   printf("\n");
@@ -203,7 +833,475 @@ int spi_get_lmk04828_config(spi_dev_t *dev, uint32_t* regbuf) {
   return RFCLK_SUCCESS;
 
 }
+
+int spi_get_lmx2594_config(spi_dev_t *dev, uint32_t* regbuf) {
+  trace_phase("get_lmx2594_config");
+  printf("\nReading LMX2594 register config\n");
+
+  uint32_t frames[LMX_RB_REG_CNT+2];
+  uint32_t vals[LMX_RB_REG_CNT+2];
+
+  // set MUX_OUT_LD_SEL of lmx register R0 for readback, hardcoded R0 from LMX
+  // config array determined as (R0 & ~LMX_MUXOUT_LD_SEL)
+  frames[0] = 0x00002418;
+  for (int i=0; i<LMX_RB_REG_CNT; i++) {
+    frames[i+1] = (i | REG_RW_BIT) << 16;
+  }
+  // revert the MUX_OUT_LD_SEL bit
+  frames[LMX_RB_REG_CNT+1] = 0x0000241C;
+
+  if (spi_readback_regs(dev, frames, vals, LMX_RB_REG_CNT+2) == RFCLK_FAILURE) {
+    printf("error reading back LMX2594\n");
+    trace_phase_end();
+    return RFCLK_FAILURE;
+  }
+  trace_phase_end();
+
+  // display lmx config info
+  printf("LMX2594 config data are:\n");
+  for (int i=LMX_RB_REG_CNT-1, j=0; i>=0; i--, j++) {
+    uint32_t reg = (i << 16) + (vals[i+1] & 0xffff);
+    if (j%9==8) {
+      printf("0x%06x,\n", reg);
+    } else {
+      printf("0x%06x, ", reg);
+    }
+  }
+  printf("\n");
+
+  return RFCLK_SUCCESS;
+}
+#endif
+
+/*
+ * LMX2594 VCO calibration cache
+ *
+ * Once a load locks, the VCO core, band capacitor and amplitude the
+ * calibration settled on are read back (R110-R112) and kept next to the
+ * rfpll's register shadow, one file per plan, <shadow>-vco-<plan hash>. A
+ * later load of the same plan starts from them: partial assist writes them to
+ * the calibration start values (VCO_SEL, VCO_CAPCTRL_STRT, VCO_DACISET_STRT)
+ * so the search begins where it ended last time, full assist forces them
+ * (VCO_SEL_FORCE, VCO_CAPCTRL_FORCE, VCO_DACISET_FORCE) and the part skips
+ * the search. A forced load that does not lock is programmed again without
+ * assist and its entry rewritten.
+ */
+#define LMX_R_VCO_DACISET      16  // R16[8:0], forced amplitude
+#define LMX_R_VCO_DACISET_STRT 17  // R17[8:0]
+#define LMX_R_VCO_CAPCTRL      19  // R19[7:0], forced capacitor
+#define LMX_R_VCO_CAPCTRL_STRT 78  // R78[8:1]
+#define LMX_R_RB_LD_VTUNE      110 // R110[10:9] rb_LD_VTUNE, R110[7:5] rb_VCO_SEL
+#define LMX_R_RB_CAPCTRL       111 // R111[7:0]
+#define LMX_R_RB_DACISET       112 // R112[8:0]
+#define LMX_LD_VTUNE_LOCKED    2
+#define LMX_MUXOUT_LD_SEL      0x4 // R0[2], MUXOUT is lock detect instead of readback
+
+static const char* lmx_assist_names[] = { "no", "partial", "full" };
+
+// FNV-1a over the plan's words
+static uint32_t lmx_plan_hash(const uint32_t* buf, uint16_t len) {
+  uint32_t h = 2166136261u;
+
+  for (int i=0; i<len; i++) {
+    for (int b=0; b<32; b+=8) {
+      h = (h ^ ((buf[i] >> b) & 0xff)) * 16777619u;
+    }
+  }
+  return h;
+}
+
+static int lmx_vco_cal_load(const char* path, LMX2594VcoCal *cal) {
+  unsigned int sel, cap, dac;
+  int platform = -1;
+  int n;
+  FILE* f = fopen(path, "r");
+
+  if (f == NULL) {
+    return RFCLK_FAILURE;
+  }
+  n = fscanf(f, "platform %d vco_sel %u capctrl %u daciset %u", &platform, &sel, &cap, &dac);
+  fclose(f);
+  if (n != 4 || platform != PLATFORM) {
+    return RFCLK_FAILURE;
+  }
+  cal->vco_sel = sel;
+  cal->capctrl = cap;
+  cal->daciset = dac;
+  return RFCLK_SUCCESS;
+}
+
+static void lmx_vco_cal_save(const char* path, const LMX2594VcoCal *cal) {
+  char tmp[320];
+  FILE* f;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  f = fopen(tmp, "w");
+  if (f == NULL) {
+    printf("WARN: could not write VCO calibration cache %s\n", tmp);
+    return;
+  }
+  fprintf(f, "platform %d\nvco_sel %u\ncapctrl %u\ndaciset %u\n", PLATFORM, cal->vco_sel, cal->capctrl,
+          cal->daciset);
+  if (fclose(f) != 0 || rename(tmp, path) != 0) {
+    printf("WARN: could not write VCO calibration cache %s\n", path);
+    remove(tmp);
+  }
+}
+
+// set the cached calibration in `seq` as start values or forced
+static void lmx_vco_assist(uint32_t* seq, uint16_t len, const LMX2594VcoCal *cal, uint8_t assist) {
+  uint16_t full = (assist == LMX_VCO_ASSIST_FULL);
+
+  for (int i=0; i<len; i++) {
+    uint32_t d = seq[i];
+    switch ((d >> 16) & 0x7f) {
+      case LMX_R_VCO_FORCE:
+        d = lmx_field(d, (1 << 14) | (1 << 11), full ? (1 << 14) | (1 << 11) : 0);
+        break;
+      case LMX_R_VCO_DACISET:
+        d = full ? lmx_field(d, 0x1ff, cal->daciset) : d;
+        break;
+      case LMX_R_VCO_DACISET_STRT:
+        d = lmx_field(d, 0x1ff, cal->daciset);
+        break;
+      case LMX_R_VCO_CAPCTRL:
+        d = full ? lmx_field(d, 0xff, cal->capctrl) : d;
+        break;
+      case LMX_R_VCO_SEL:
+        d = lmx_field(d, (0x7 << 11) | (1 << 10), (cal->vco_sel << 11) | (full << 10));
+        break;
+      case LMX_R_VCO_CAPCTRL_STRT:
+        d = lmx_field(d, 0xff << 1, cal->capctrl << 1);
+        break;
+    }
+    seq[i] = d;
+  }
+}
+
+/*
+ * Read LMX2594 registers `addrs` into `vals`
+ *
+ * `r0` is the R0 the part was loaded with. When it has MUXOUT on lock detect
+ * the readback output is switched on around the reads, both writes without
+ * FCAL_EN so the calibration is not started again.
+ */
+#ifdef I2C_COM_BUS
+static int lmx_read_regs(I2CDev dev, uint8_t spi_sdosel, uint32_t r0, const uint8_t* addrs, uint16_t* vals, int n) {
+  uint8_t pkt[LMX_PKT_SIZE];
+  uint8_t rd[LMX_PKT_SIZE];
+  uint8_t ld = (r0 & LMX_MUXOUT_LD_SEL) != 0;
+  int res = RFCLK_SUCCESS;
+
+  i2c_lock_dev(dev);
+  if (ld) {
+    format_rfclk_pkt(spi_sdosel, r0 & ~(LMX_FCAL_EN | LMX_MUXOUT_LD_SEL), pkt, LMX_PKT_SIZE);
+    res = i2c_write(dev, pkt, LMX_PKT_SIZE);
+  }
+  for (int i=0; i<n && res == RFCLK_SUCCESS; i++) {
+    format_rfclk_pkt(spi_sdosel, (addrs[i] | REG_RW_BIT) << 16, pkt, LMX_PKT_SIZE);
+    memset(rd, 0, sizeof(rd));
+    res = i2c_write(dev, pkt, LMX_PKT_SIZE);
+    if (res == RFCLK_SUCCESS) {
+      res = i2c_read(dev, rd, LMX_PKT_SIZE);
+    }
+    vals[i] = (rd[1] << 8) | rd[2];
+  }
+  if (ld) {
+    format_rfclk_pkt(spi_sdosel, r0 & ~LMX_FCAL_EN, pkt, LMX_PKT_SIZE);
+    res |= i2c_write(dev, pkt, LMX_PKT_SIZE);
+  }
+  i2c_unlock_dev(dev);
+  return res;
+}
+#else
+static int lmx_read_regs(spi_dev_t *dev, uint32_t r0, const uint8_t* addrs, uint16_t* vals, int n) {
+  uint32_t frames[n+2];
+  uint32_t rb[n+2];
+  uint8_t ld = (r0 & LMX_MUXOUT_LD_SEL) != 0;
+  int m = 0;
+  int res;
+
+  if (ld) {
+    frames[m++] = r0 & ~(LMX_FCAL_EN | LMX_MUXOUT_LD_SEL);
+  }
+  for (int i=0; i<n; i++) {
+    frames[m++] = (addrs[i] | REG_RW_BIT) << 16;
+  }
+  if (ld) {
+    frames[m++] = r0 & ~LMX_FCAL_EN;
+  }
+  if (m == 0) {
+    return RFCLK_FAILURE;
+  }
+
+  spi_lock_dev(dev);
+  res = spi_readback_regs(dev, frames, rb, m);
+  spi_unlock_dev(dev);
+  if (res == RFCLK_FAILURE) {
+    return res;
+  }
+  for (int i=0; i<n; i++) {
+    vals[i] = rb[i+ld] & 0xffff;
+  }
+  return res;
+}
+#endif
+
+/*
+ * Lock detect
+ *
+ * Wait for the parts to report lock instead of sleeping a worst case. The
+ * status is polled back to back and the wait returns as soon as it reads
+ * locked, RFCLK_FAILURE when it has not after `timeout_us` or the readback
+ * fails. `lock_us` (may be NULL) is how long the wait took. The
+ * LMK04828/LMK04832 report RB_PLL1_LD and RB_PLL2_LD (bit 1 of R386 and R387)
+ * through the SPI readback, the LMX2594 rb_LD_VTUNE (R110). On the i2c
+ * platforms the sdo select must already route the part to its bridge.
+ */
+#define LMK_R_PLL1_PD     0x140 // R320[7], PLL1 powered down (single loop plans)
+#define LMK_R_RB_PLL1_LD  0x182 // R386[1]
+#define LMK_R_RB_PLL2_LD  0x183 // R387[1]
+#ifdef I2C_COM_BUS
+#define LMK_RB_ON  0x00015f3b   // PLL1_LD_MUX (R351) to SPI readback
+#define LMK_RB_OFF 0x00015f3e
+#else
+#define LMK_RB_ON  0x00016e3b   // PLL2_LD_MUX (R366), STATUS_LD2 is SDO on the RFSoC4x2
+#define LMK_RB_OFF 0x00016e13
+#endif
+
+static uint32_t elapsed_us(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec)*1000000 + (now.tv_nsec - start->tv_nsec)/1000;
+}
+
+#if PLATFORM != ZCU111
+// read LMK0482x registers `addrs` into `vals`, readback output on around the reads
+#ifdef I2C_COM_BUS
+static int lmk_read_regs(I2CDev dev, uint8_t spi_sdosel, const uint16_t* addrs, uint8_t* vals, int n) {
+  uint8_t pkt[LMK_PKT_SIZE];
+  uint8_t rd[LMK_PKT_SIZE];
+  int res;
+
+  i2c_lock_dev(dev);
+  format_rfclk_pkt(spi_sdosel, LMK_RB_ON, pkt, LMK_PKT_SIZE);
+  res = i2c_write(dev, pkt, LMK_PKT_SIZE);
+  for (int i=0; i<n && res == RFCLK_SUCCESS; i++) {
+    format_rfclk_pkt(spi_sdosel, (REG_RW_BIT << 16) | (addrs[i] << 8), pkt, LMK_PKT_SIZE);
+    memset(rd, 0, sizeof(rd));
+    res = i2c_write(dev, pkt, LMK_PKT_SIZE);
+    if (res == RFCLK_SUCCESS) {
+      res = i2c_read(dev, rd, 3);
+    }
+    vals[i] = rd[2];
+  }
+  format_rfclk_pkt(spi_sdosel, LMK_RB_OFF, pkt, LMK_PKT_SIZE);
+  res |= i2c_write(dev, pkt, LMK_PKT_SIZE);
+  i2c_unlock_dev(dev);
+  return res;
+}
+#else
+static int lmk_read_regs(spi_dev_t *dev, const uint16_t* addrs, uint8_t* vals, int n) {
+  uint32_t frames[n+2];
+  uint32_t rb[n+2];
+  int res;
+
+  frames[0] = LMK_RB_ON;
+  for (int i=0; i<n; i++) {
+    frames[i+1] = (REG_RW_BIT << 16) | (addrs[i] << 8);
+  }
+  frames[n+1] = LMK_RB_OFF;
+
+  spi_lock_dev(dev);
+  res = spi_readback_regs(dev, frames, rb, n+2);
+  spi_unlock_dev(dev);
+  for (int i=0; i<n; i++) {
+    vals[i] = rb[i+1] & 0xff;
+  }
+  return res;
+}
+#endif
+
+uint8_t lmk0482x_plan_plls(const uint32_t* buf, uint16_t len) {
+  uint8_t plls = LMK_PLL1 | LMK_PLL2;
+
+  for (int i=0; i<len; i++) {
+    if (((buf[i] >> 8) & 0x1fff) == LMK_R_PLL1_PD && (buf[i] & 0x80)) {
+      plls &= ~LMK_PLL1;
+    }
+  }
+  return plls;
+}
+
+#ifdef I2C_COM_BUS
+int lmk0482x_wait_lock(I2CDev dev, uint8_t spi_sdosel, uint8_t plls, uint32_t timeout_us, uint32_t* lock_us) {
+#else
+int lmk0482x_wait_lock(spi_dev_t *dev, uint8_t plls, uint32_t timeout_us, uint32_t* lock_us) {
+#endif
+  static const uint16_t addrs[2] = { LMK_R_RB_PLL1_LD, LMK_R_RB_PLL2_LD };
+  uint8_t vals[2] = { 0 };
+  uint8_t locked = 0;
+  uint32_t us = 0;
+  struct timespec start;
+  int res;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+#ifdef I2C_COM_BUS
+    res = lmk_read_regs(dev, spi_sdosel, addrs, vals, 2);
+#else
+    res = lmk_read_regs(dev, addrs, vals, 2);
+#endif
+    us = elapsed_us(&start);
+    locked = ((vals[0] & 0x2) ? LMK_PLL1 : 0) | ((vals[1] & 0x2) ? LMK_PLL2 : 0);
+  } while (res == RFCLK_SUCCESS && (locked & plls) != plls && us < timeout_us);
+
+  if (lock_us != NULL) {
+    *lock_us = us;
+  }
+  if (res == RFCLK_FAILURE) {
+    printf("lmk lock status readback failed\n");
+    return res;
+  }
+  if ((locked & plls) != plls) {
+    printf("lmk did not lock within %u us:%s%s\n", timeout_us, (plls & ~locked & LMK_PLL1) ? " PLL1" : "",
+           (plls & ~locked & LMK_PLL2) ? " PLL2" : "");
+    return RFCLK_FAILURE;
+  }
+  printf("lmk%s%s locked after %u us\n", (plls & LMK_PLL1) ? " PLL1" : "", (plls & LMK_PLL2) ? " PLL2" : "", us);
+  return RFCLK_SUCCESS;
+}
+#endif
+
+#ifdef I2C_COM_BUS
+int lmx2594_wait_lock(I2CDev dev, uint8_t spi_sdosel, uint32_t r0, uint32_t timeout_us, uint32_t* lock_us) {
+#else
+int lmx2594_wait_lock(spi_dev_t *dev, uint32_t r0, uint32_t timeout_us, uint32_t* lock_us) {
+#endif
+  static const uint8_t addr = LMX_R_RB_LD_VTUNE;
+  uint16_t r110 = 0;
+  uint32_t us = 0;
+  struct timespec start;
+  int res;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+#ifdef I2C_COM_BUS
+    res = lmx_read_regs(dev, spi_sdosel, r0, &addr, &r110, 1);
+#else
+    res = lmx_read_regs(dev, r0, &addr, &r110, 1);
+#endif
+    us = elapsed_us(&start);
+  } while (res == RFCLK_SUCCESS && ((r110 >> 9) & 0x3) != LMX_LD_VTUNE_LOCKED && us < timeout_us);
+
+  if (lock_us != NULL) {
+    *lock_us = us;
+  }
+  if (res == RFCLK_FAILURE) {
+    printf("lmx2594 lock status readback failed\n");
+    return res;
+  }
+  if (((r110 >> 9) & 0x3) != LMX_LD_VTUNE_LOCKED) {
+    printf("lmx2594 did not lock within %u us\n", timeout_us);
+    return RFCLK_FAILURE;
+  }
+  printf("lmx2594 locked after %u us\n", us);
+  return RFCLK_SUCCESS;
+}
+
+/*
+ * Program an LMX2594 with the VCO calibration cache
+ *
+ * `assist` (LMX_VCO_ASSIST_*) says how a cached calibration for this plan
+ * is used, with none cached the part calibrates from the plan as usual.
+ * The load is `prog_pll` (or `prog_pll_diff` with `diff`), then
+ * `lmx2594_wait_lock` waits up to LMX_LOCK_TIMEOUT_US for the part to lock
+ * and the calibration it locked with is cached for the next load. `lock_us`
+ * is the time from the end of the load to lock.
+ */
+#ifdef I2C_COM_BUS
+int lmx2594_prog_cached(I2CDev dev, uint8_t spi_sdosel, uint32_t* buf, uint16_t len, uint8_t assist, int diff,
+                        uint32_t* lock_us) {
+#else
+int lmx2594_prog_cached(spi_dev_t *dev, uint32_t* buf, uint16_t len, uint8_t assist, int diff, uint32_t* lock_us) {
+#endif
+  static const uint8_t rb_addrs[3] = { LMX_R_RB_LD_VTUNE, LMX_R_RB_CAPCTRL, LMX_R_RB_DACISET };
+  uint32_t* seq = malloc(sizeof(uint32_t)*len);
+  LMX2594VcoCal cal;
+  char path[256];
+  char cal_path[300];
+  uint16_t rb[3] = { 0 };
+  int res;
+
+  if (seq == NULL) {
+    printf("out of memory programming lmx2594\n");
+    return RFCLK_FAILURE;
+  }
+
+#ifdef I2C_COM_BUS
+  rfpll_shadow_path(path, sizeof(path), dev, spi_sdosel);
+#else
+  rfpll_shadow_path(path, sizeof(path), dev);
+#endif
+  snprintf(cal_path, sizeof(cal_path), "%s-vco-%08x", path, lmx_plan_hash(buf, len));
+
+  memcpy(seq, buf, sizeof(uint32_t)*len);
+  if (assist != LMX_VCO_ASSIST_NONE && lmx_vco_cal_load(cal_path, &cal) == RFCLK_SUCCESS) {
+    printf("lmx2594 %s assist, cached VCO_SEL %u, VCO_CAPCTRL %u, VCO_DACISET %u\n", lmx_assist_names[assist],
+           cal.vco_sel, cal.capctrl, cal.daciset);
+    lmx_vco_assist(seq, len, &cal, assist);
+  } else {
+    if (assist != LMX_VCO_ASSIST_NONE) {
+      printf("no VCO calibration cached for this plan, calibrating without assist\n");
+    }
+    assist = LMX_VCO_ASSIST_NONE;
+  }
+
+#ifdef I2C_COM_BUS
+  res = diff ? prog_pll_diff(dev, spi_sdosel, 1, seq, len, LMX_PKT_SIZE)
+             : prog_pll(dev, spi_sdosel, seq, len, LMX_PKT_SIZE);
+#else
+  res = diff ? prog_pll_diff(dev, 1, seq, len, LMX_PKT_SIZE) : prog_pll(dev, seq, len, LMX_PKT_SIZE);
 #endif
+  free(seq);
+  if (res == RFCLK_FAILURE) {
+    return res;
+  }
+
+#ifdef I2C_COM_BUS
+  res = lmx2594_wait_lock(dev, spi_sdosel, buf[len-1], LMX_LOCK_TIMEOUT_US, lock_us);
+#else
+  res = lmx2594_wait_lock(dev, buf[len-1], LMX_LOCK_TIMEOUT_US, lock_us);
+#endif
+  if (res == RFCLK_FAILURE) {
+    if (assist == LMX_VCO_ASSIST_FULL) {
+      printf("lmx2594 did not lock on the forced VCO, calibrating without assist\n");
+      remove(cal_path);
+#ifdef I2C_COM_BUS
+      return lmx2594_prog_cached(dev, spi_sdosel, buf, len, LMX_VCO_ASSIST_NONE, diff, lock_us);
+#else
+      return lmx2594_prog_cached(dev, buf, len, LMX_VCO_ASSIST_NONE, diff, lock_us);
+#endif
+    }
+    return res;
+  }
+
+  // the calibration the part locked with, for the next load of this plan
+#ifdef I2C_COM_BUS
+  res = lmx_read_regs(dev, spi_sdosel, buf[len-1], rb_addrs, rb, 3);
+#else
+  res = lmx_read_regs(dev, buf[len-1], rb_addrs, rb, 3);
+#endif
+  if (res == RFCLK_SUCCESS) {
+    cal.vco_sel = (rb[0] >> 5) & 0x7;
+    cal.capctrl = rb[1] & 0xff;
+    cal.daciset = rb[2] & 0x1ff;
+    lmx_vco_cal_save(cal_path, &cal);
+    printf("lmx2594 locked with %s assist, cached VCO_SEL %u, VCO_CAPCTRL %u, VCO_DACISET %u\n",
+           lmx_assist_names[assist], cal.vco_sel, cal.capctrl, cal.daciset);
+  }
+  return RFCLK_SUCCESS;
+}
 
 /*
  * Readback lmk config info
@@ -228,6 +1326,7 @@ int get_lmk04828_config(spi_dev_t *dev, uint32_t* regbuf) {
 
   // at this point we assume sdo mux has already been set to correctly read back
 
+  trace_phase("get_lmk04828_config");
   printf("Reading LMK04828 register config\n");
   uint8_t R351[LMK_PKT_SIZE];
   // hardcoded readback value computed from R531 to config spi readback
@@ -336,6 +1435,7 @@ int get_lmx2594_config(spi_dev_t *dev, uint32_t* regbuf) {
   // at this point we assume sdo mux (*_MUX_SEL*) has already been set to
   // correctly read back (using *_SDO_*) here
 
+  trace_phase("get_lmx2594_config");
   printf("\nReading LMX2594 register config\n");
   // set MUX_OUT_LD_SEL of lmx register R0 for readback
   uint8_t R0[LMX_PKT_SIZE];
@@ -431,9 +1531,9 @@ int get_lmx2594_config(spi_dev_t *dev, uint32_t* regbuf) {
  *
  */
 #ifdef I2C_COM_BUS
-int get_pll_config(uint8_t pll_type, uint32_t* regbuf) {
+static int read_pll_config(uint8_t pll_type, uint32_t* regbuf) {
 #else
-int get_pll_config(spi_dev_t *dev, uint8_t pll_type, uint32_t* regbuf) {
+static int read_pll_config(spi_dev_t *dev, uint8_t pll_type, uint32_t* regbuf) {
 #endif
   int res = RFCLK_SUCCESS;
 
@@ -448,8 +1548,9 @@ int get_pll_config(spi_dev_t *dev, uint8_t pll_type, uint32_t* regbuf) {
     // set mux for sdo readback
     #if (PLATFORM == ZCU216) | (PLATFORM == ZCU208)
     // use fabric gpio to select chip
+    // the gpio value writes drive the select before they return, the first
+    // readback frame can follow straight away
     res = set_sdo_mux(LMK_MUX_SEL);
-    usleep(0.5e6);
     if (res == RFCLK_FAILURE) {
       printf("gpio sdo mux not set correctly\n");
       return res;
@@ -493,7 +1594,6 @@ int get_pll_config(spi_dev_t *dev, uint8_t pll_type, uint32_t* regbuf) {
     #if (PLATFORM == ZCU216) | (PLATFORM == ZCU208)
     // use fabric gpio to select chip
     res = set_sdo_mux(LMX_MUX_SEL_224_225);
-    usleep(0.5e6);
     if (res == RFCLK_FAILURE) {
       printf("gpio sdo mux not set correctly\n");
       return res;
@@ -534,7 +1634,7 @@ int get_pll_config(spi_dev_t *dev, uint8_t pll_type, uint32_t* regbuf) {
     #elif PLATFORM == RFSoC2x2
     res = get_lmx2594_config(I2C_DEV_PLL_SPI_BRIDGE, regbuf);
     #elif PLATFORM == RFSoC4x2
-    printf("LMX register readback not yet implemented for rfsoc4x2, only LED status is shown\n");
+    res = spi_get_lmx2594_config(dev, regbuf);
     #else
     printf("platform does not support lmx readback\n");
     #endif
@@ -543,11 +1643,34 @@ int get_pll_config(spi_dev_t *dev, uint8_t pll_type, uint32_t* regbuf) {
   return res;
 }
 
+// the readback select (iox or fabric gpio) and the readback run with every bus
+// locked so no other tool moves the select or the mux in the middle
+#ifdef I2C_COM_BUS
+int get_pll_config(uint8_t pll_type, uint32_t* regbuf) {
+  int res;
+  i2c_lock_buses(I2C_ALL_BUSES);
+  res = read_pll_config(pll_type, regbuf);
+  i2c_unlock_buses(I2C_ALL_BUSES);
+  return res;
+}
+#else
+int get_pll_config(spi_dev_t *dev, uint8_t pll_type, uint32_t* regbuf) {
+  int res;
+  spi_lock_dev(dev);
+  res = read_pll_config(dev, pll_type, regbuf);
+  spi_unlock_dev(dev);
+  return res;
+}
+#endif
+
 /*
  * Use the fabric GPIO in zcu216/208 to switch SDO select for readback
  *
  */
 #if (PLATFORM == ZCU216) | (PLATFORM == ZCU208)
+char CLK104_GPIO_MUX_SEL0[4];
+char CLK104_GPIO_MUX_SEL1[4];
+
 int set_sdo_mux(int mux_sel) {
   // TODO: move printf()s to stderr
   int fd_value;
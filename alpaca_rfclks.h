@@ -41,8 +41,8 @@
   #define LMX_MUX_SEL_224_225 0    /* ADC LMX2594 PLL */
   #define LMX_MUX_SEL_226_227 -1   /* no LMX2594 PLL connected  to these tiles */
   #define LMX_MUX_SEL_228_229 1    /* DAC LMX2594 PLL */
-  char CLK104_GPIO_MUX_SEL0[4];
-  char CLK104_GPIO_MUX_SEL1[4];
+  extern char CLK104_GPIO_MUX_SEL0[4]; // gpio ids of the mux selects, set by `init_clk104_gpio`
+  extern char CLK104_GPIO_MUX_SEL1[4];
 
   #define LMK_REG_CNT 136 // zcu216/208 (128 (0-127) works, but seems to be a
                           // discrepencey as all tics outputs have 135 values (0-134))? Or have I just been
@@ -168,6 +168,8 @@
 /* common platform definitions */
 #define REG_RW_BIT 0x80          /* the 8th bit of the address section of the LMK/LMX indicates Read/Write to the register */
 
+#define RFPLL_SHADOW_DIR "/run"   /* where the last sequence programmed to each rfpll is kept */
+
 #define LMX2594_REG_CNT 116      /* {apply rst, remove rst, prgm 113 registers, program R0 a second time} */
 #define LMX2594_RST_VAL 0x000002 /* write to R0, assert rst bit */
 #ifdef I2C_COM_BUS
@@ -178,6 +180,8 @@
 #define LMX_MUXOUT_REG_ADDR 0x0  /* LMX MUXOUT reg. address (R0) */
 #define LMX_MUXOUT_REG_VAL  0x0  /* LMX MUXOUT reg. value */
 #define LMX_MUXOUT_LD_SEL   0x4  /* idea here was that instead this would be the bit we toggle on and off to achive readback */
+#define LMX_RB_REG_CNT 113       /* registers R0-R112 read back, LMX2594_REG_CNT is the programming sequence */
+#define SPI_RB_PKT_SIZE 3        /* spi readback frame, {8/16-bit address, 16/8-bit data} for the LMX/LMK */
 
 #define LMK04208_RST_VAL 0x20000
 #define LMK04828_RST_VAL 0x80
@@ -196,9 +200,77 @@
 
 uint32_t* readtcs(FILE* tcsfile, uint16_t len, uint8_t pll_type);
 
+/*
+ * LMX2594 output frequency, the fields a retune rewrites (see
+ * `lmx2594_retune`): f_vco = f_pd*(n + num/den), the outputs take the VCO or
+ * the channel divider (CHDIV code 0-17 for /2, /4, /6, /8, /12, /16, /24,
+ * /32, ... /192)
+ */
+#define LMX_OUT_MUX_CHDIV 0
+#define LMX_OUT_MUX_VCO   1
+#define LMX_OUT_MUX_HIZ   3
+#define LMX_CHDIV_MAX     17
+
+typedef struct lmx2594_freq {
+  uint32_t n;        // PLL_N, 19 bits
+  uint32_t num;      // PLL_NUM
+  uint32_t den;      // PLL_DEN
+  uint8_t chdiv;     // CHDIV code
+  uint8_t outa_mux;  // LMX_OUT_MUX_*
+  uint8_t outb_mux;  // LMX_OUT_MUX_*, 2 is SYSREF
+} LMX2594Freq;
+
+// the frequency fields of an LMX2594 sequence (from `readtcs`)
+int lmx2594_get_freq(const uint32_t* buf, uint16_t len, LMX2594Freq *f);
+
+/*
+ * LMX2594 VCO calibration cache (see `lmx2594_prog_cached`): the VCO core,
+ * band capacitor and amplitude a calibration settled on (rb_VCO_SEL,
+ * rb_VCO_CAPCTRL, rb_VCO_DACISET in R110-R112), kept per plan and per rfpll
+ * and handed back to the part on later loads of the same plan
+ */
+#define LMX_VCO_ASSIST_NONE    0 // full calibration from the plan's start values
+#define LMX_VCO_ASSIST_PARTIAL 1 // calibration starts from the cached values
+#define LMX_VCO_ASSIST_FULL    2 // cached values forced, no calibration search
+#define LMX_LOCK_TIMEOUT_US 100000
+
+typedef struct lmx2594_vco_cal {
+  uint8_t vco_sel;   // VCO core, 1-7
+  uint8_t capctrl;   // band capacitor
+  uint16_t daciset;  // amplitude DAC, 9 bits
+} LMX2594VcoCal;
+
+/*
+ * Lock wait (see alpaca_rfclks.c): poll the parts' lock status and return as
+ * soon as they report lock, RFCLK_FAILURE after `timeout_us`
+ */
+#define LMK_LOCK_TIMEOUT_US 1000000 // PLL1's narrow loop can take hundreds of ms
+#define LMK_PLL1 0x1
+#define LMK_PLL2 0x2
+
+#if PLATFORM != ZCU111
+// the LMK_PLL* a plan runs, PLL1 is left out of single loop plans (PLL1_PD)
+uint8_t lmk0482x_plan_plls(const uint32_t* buf, uint16_t len);
+#endif
+
 #ifdef I2C_COM_BUS
 void format_rfclk_pkt(uint8_t sdoselect, uint32_t d, uint8_t* buffer, uint8_t len);
 int prog_pll(I2CDev dev, uint8_t spi_sdosel, uint32_t* buf, uint16_t len, uint8_t pkt_len);
+// only the registers that changed since the last load, see alpaca_rfclks.c
+int prog_pll_diff(I2CDev dev, uint8_t spi_sdosel, uint8_t pll_type, uint32_t* buf, uint16_t len, uint8_t pkt_len);
+// forget the last load, for after a reset
+void rfpll_shadow_clear(I2CDev dev, uint8_t spi_sdosel);
+// rewrite only the frequency registers and start a VCO calibration
+int lmx2594_retune(I2CDev dev, uint8_t spi_sdosel, const LMX2594Freq *f);
+// program an LMX2594 with the calibration cache, wait for lock and record it.
+// The sdo select (iox/fabric gpio) must already route this LMX for readback
+int lmx2594_prog_cached(I2CDev dev, uint8_t spi_sdosel, uint32_t* buf, uint16_t len, uint8_t assist, int diff,
+                        uint32_t* lock_us);
+// wait for lock, `r0` is the R0 the LMX was loaded with (the plan's last word)
+int lmx2594_wait_lock(I2CDev dev, uint8_t spi_sdosel, uint32_t r0, uint32_t timeout_us, uint32_t* lock_us);
+#if PLATFORM != ZCU111
+int lmk0482x_wait_lock(I2CDev dev, uint8_t spi_sdosel, uint8_t plls, uint32_t timeout_us, uint32_t* lock_us);
+#endif
 // TODO: may be worth while having a more general readback structure and it
 // seems like it could be cool to have a struct for the pll that had a pointer
 // to the readback method, but that seems liek a lot of work to implement now
@@ -217,12 +289,30 @@ int init_clk104_gpio(int gpio_id);
 
 void format_rfclk_pkt(uint32_t d, uint8_t* buffer, uint8_t len);
 int prog_pll(spi_dev_t *dev, uint32_t* buf, uint16_t len, uint8_t pkt_len);
+// only the registers that changed since the last load, see alpaca_rfclks.c
+int prog_pll_diff(spi_dev_t *dev, uint8_t pll_type, uint32_t* buf, uint16_t len, uint8_t pkt_len);
+// forget the last load, for after a reset
+void rfpll_shadow_clear(spi_dev_t *dev);
+// rewrite only the frequency registers and start a VCO calibration
+int lmx2594_retune(spi_dev_t *dev, const LMX2594Freq *f);
+// program an LMX2594 with the calibration cache, wait for lock and record it
+int lmx2594_prog_cached(spi_dev_t *dev, uint32_t* buf, uint16_t len, uint8_t assist, int diff, uint32_t* lock_us);
+// wait for lock, `r0` is the R0 the LMX was loaded with (the plan's last word)
+int lmx2594_wait_lock(spi_dev_t *dev, uint32_t r0, uint32_t timeout_us, uint32_t* lock_us);
+int lmk0482x_wait_lock(spi_dev_t *dev, uint8_t plls, uint32_t timeout_us, uint32_t* lock_us);
 // TODO: may be worth while having a more general readback structure and it
 // seems like it could be cool to have a struct for the pll that had a pointer
 // to the readback method, but that seems liek a lot of work to implement now
 // and so just hardcoding most readback methods
 int get_pll_config(spi_dev_t *dev, uint8_t pll_type, uint32_t* regbuf);
+// whole register map read back in one full duplex spi message
 int spi_get_lmk04828_config(spi_dev_t *dev, uint32_t* regbuf);
+int spi_get_lmx2594_config(spi_dev_t *dev, uint32_t* regbuf);
+// read-only check of the spi clock against a readback at the base speed, see alpaca_rfclks.c.
+// calibrate steps through `rates` (ascending) and leaves `best` the fastest
+// that passed `iters` rounds and the device running at it
+int spi_rfpll_verify_speed(spi_dev_t *dev, int iters);
+int spi_rfpll_calibrate(spi_dev_t *dev, const uint32_t* rates, int nrates, int iters, uint32_t* best);
 int get_lmk04828_config(spi_dev_t *dev, uint32_t* regbuf);
 int get_lmx2594_config(spi_dev_t *dev, uint32_t* regbuf);
 
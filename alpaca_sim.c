@@ -0,0 +1,995 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h> // uint8_t, uint16_t
+#include <time.h>   // clock_gettime, nanosleep
+#include <sched.h>  // sched_yield
+
+#include <sys/mman.h>
+#include <sys/stat.h> // mkdir
+
+#include <errno.h>
+
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <linux/spi/spidev.h>
+
+#include "alpaca_sim.h"
+#include "alpaca_log.h"
+
+#define SUCCESS 0
+#define FAILURE 1
+
+#define SIM_MAX_FDS 64
+#define SIM_MAX_MUXES 8
+#define SIM_BRIDGE_BUF 200       // SC18IS602 data buffer
+#define SIM_EEPROM_WRITE_NS 5000000ull // EEPROM write cycle time (t_WR)
+#define SIM_LMX_FCAL_NS   250000ull // LMX2594 VCO calibration searching every core from the plan's start values
+#define SIM_LMX_ASSIST_NS  60000ull // starting from the right core, capacitor and amplitude (partial assist)
+#define SIM_LMX_LOCK_NS    10000ull // loop settling alone, the VCO forced (full assist)
+#define SIM_LMK_PLL2_LOCK_NS  2000000ull // LMK0482x PLL2 VCO calibration and lock after PLL2_N
+#define SIM_LMK_PLL1_LOCK_NS 40000000ull // PLL1, the narrow jitter cleaning loop
+
+static uint32_t sim_xfer_us = 0;
+static uint32_t sim_i2c_hz = 0;
+static uint32_t sim_spi_hz = 0;   // ALPACA_SIM_SPI_HZ, overrides the parts' own clock limits
+
+// a ticket lock, the per-bus executor threads drive different buses at once and
+// forked processes share the buses. Waiters get the bus in turn like they do
+// on the kernel adapter lock.
+typedef struct sim_lock {
+  uint32_t next;
+  uint32_t serving;
+} SimLock;
+
+static void sim_lock(SimLock *l) {
+  uint32_t ticket = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+  while (__atomic_load_n(&l->serving, __ATOMIC_ACQUIRE) != ticket) {
+    sched_yield();
+  }
+}
+
+static void sim_unlock(SimLock *l) {
+  __atomic_store_n(&l->serving, l->serving + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t sim_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+// sleep through most of a delay and spin the rest, transfers are often shorter
+// than the timer slack
+static void sim_delay(uint64_t ns) {
+  uint64_t end = sim_now() + ns;
+
+  if (ns == 0) {
+    return;
+  }
+  if (ns > 200000) {
+    struct timespec ts = { (ns - 100000)/1000000000ull, (ns - 100000)%1000000000ull };
+    nanosleep(&ts, NULL);
+  }
+  while (sim_now() < end);
+}
+
+int sim_enabled() {
+  const char *env = getenv("ALPACA_SIM");
+  return env != NULL && strcmp(env, "0") != 0;
+}
+
+const char* sim_state_dir() {
+  if (mkdir(SIM_STATE_DIR, 0755) < 0 && errno != EEXIST) {
+    LOG_WARN("could not create %s\n", SIM_STATE_DIR);
+  }
+  return SIM_STATE_DIR;
+}
+
+void sim_set_timing(uint32_t xfer_us, uint32_t i2c_hz) {
+  sim_xfer_us = xfer_us;
+  sim_i2c_hz = i2c_hz;
+}
+
+/*
+ * SPI parts
+ *
+ * The LMK/LMX register files, shifted one word at a time. `rx` gets what the
+ * part drives on SDO during the word.
+ */
+typedef enum sim_chip_kind {
+  SIM_SPI_SINK,  // anything else on a spidev (e.g., the OLED), accepts everything
+  SIM_LMK0482X,  // LMK04828/LMK04832, {r/w + 15-bit addr, 8-bit data}
+  SIM_LMK04208,  // uWire {27-bit data, 5-bit addr}
+  SIM_LMX2594    // {r/w + 7-bit addr, 16-bit data}
+} SimChipKind;
+
+typedef struct sim_chip {
+  SimChipKind kind;
+  SimLock lock;
+  uint8_t locked;        // LMX2594 VCO calibrated and locked
+  uint64_t lock_at;      // LMX2594 time (sim_now) the calibration started last finishes, LMK0482x PLL2 locks
+  uint64_t pll1_lock_at; // LMK0482x time PLL1 locks
+  uint32_t max_hz;       // spi: fastest clock SDO is sampled right at, 0 any
+  uint32_t regs[0x2000];
+} SimChip;
+
+static void sim_chip_reset(SimChip *c) {
+  memset(c->regs, 0, sizeof(c->regs));
+  c->locked = 0;
+  if (c->kind == SIM_LMK0482X) {
+    c->regs[0x003] = 0x06; // ID_DEVICE_TYPE
+    c->regs[0x00c] = 0x51; // ID_VNDR
+    c->regs[0x00d] = 0x04;
+    // DCLKoutX_DIV 2 and DCLKoutX_DDLY_CNTH/CNTL 5 on each clock output pair
+    for (int a=0x100; a<0x138; a+=8) {
+      c->regs[a] = 0x02;
+      c->regs[a+1] = 0x55;
+    }
+  }
+}
+
+static SimChip* sim_chip_new(SimChipKind kind) {
+  SimChip *c = calloc(1, sizeof(SimChip));
+  c->kind = kind;
+  sim_chip_reset(c);
+  return c;
+}
+
+static int sim_chip_word(SimChip *c) {
+  return (c->kind == SIM_LMK04208) ? 4 : 3;
+}
+
+/*
+ * LMX2594 VCO calibration
+ *
+ * The result is a made up but repeatable function of the N divider. It takes
+ * SIM_LMX_FCAL_NS from the plan's start values, SIM_LMX_ASSIST_NS when
+ * VCO_SEL (R20), VCO_CAPCTRL_STRT (R78) and VCO_DACISET_STRT (R17) already
+ * hold the result and SIM_LMX_LOCK_NS with all three forced (VCO_SEL_FORCE
+ * R20[10], VCO_CAPCTRL_FORCE R8[11], VCO_DACISET_FORCE R8[14]), in which case
+ * the forced VCO_SEL, VCO_CAPCTRL (R19) and VCO_DACISET (R16) are the result
+ * and the loop only locks when they are the ones a calibration finds.
+ * rb_LD_VTUNE and the lock detect read unlocked until the time is up.
+ */
+static void sim_lmx_calibrate(SimChip *c) {
+  uint32_t n = c->regs[36] | ((c->regs[34] & 0x7) << 16);
+  uint32_t sel = 1 + n % 7;
+  uint32_t cap = (n * 37) % 183;
+  uint32_t dac = (n * 11) % 512;
+  uint64_t ns = SIM_LMX_FCAL_NS;
+
+  c->locked = 1;
+  if ((c->regs[20] & (1 << 10)) && (c->regs[8] & (1 << 11)) && (c->regs[8] & (1 << 14))) {
+    c->locked = ((c->regs[20] >> 11) & 0x7) == sel && (c->regs[19] & 0xff) == cap && (c->regs[16] & 0x1ff) == dac;
+    sel = (c->regs[20] >> 11) & 0x7;
+    cap = c->regs[19] & 0xff;
+    dac = c->regs[16] & 0x1ff;
+    ns = SIM_LMX_LOCK_NS;
+  } else if (((c->regs[20] >> 11) & 0x7) == sel && ((c->regs[78] >> 1) & 0xff) == cap
+             && (c->regs[17] & 0x1ff) == dac) {
+    ns = SIM_LMX_ASSIST_NS;
+  }
+
+  // rb_LD_VTUNE locked (2) or vtune low (0), rb_VCO_SEL
+  c->regs[110] = (c->regs[110] & ~((3 << 9) | (7 << 5))) | ((c->locked ? 2 : 0) << 9) | (sel << 5);
+  c->regs[111] = cap;  // rb_VCO_CAPCTRL
+  c->regs[112] = dac;  // rb_VCO_DACISET
+  c->lock_at = sim_now() + ns;
+}
+
+static int sim_lmx_locked(SimChip *c) {
+  return c->locked && sim_now() >= c->lock_at;
+}
+
+static void sim_chip_xfer(SimChip *c, const uint8_t *tx, uint8_t *rx) {
+  uint32_t addr, data;
+  int rd = tx[0] & 0x80;
+
+  switch (c->kind) {
+    case SIM_LMK0482X:
+      addr = ((tx[0] & 0x1f) << 8) | tx[1];
+      if (rd && (addr == 0x182 || addr == 0x183)) {
+        // RB_PLL1_LD/RB_PLL2_LD, both loops relock from the PLL2_N write
+        // that ends a load
+        uint64_t at = (addr == 0x182) ? c->pll1_lock_at : c->lock_at;
+        rx[2] = (c->regs[addr] & ~0x2) | ((c->locked && sim_now() >= at) ? 0x2 : 0);
+      } else if (rd) {
+        rx[2] = c->regs[addr] & 0xff;
+      } else if (addr == 0 && (tx[2] & 0x80)) {
+        sim_chip_reset(c);
+      } else {
+        c->regs[addr] = tx[2];
+        if (addr == 0x168) {
+          c->locked = 1;
+          c->lock_at = sim_now() + SIM_LMK_PLL2_LOCK_NS;
+          c->pll1_lock_at = sim_now() + SIM_LMK_PLL1_LOCK_NS;
+        }
+      }
+      break;
+
+    case SIM_LMK04208:
+      data = (tx[0] << 24) | (tx[1] << 16) | (tx[2] << 8) | tx[3];
+      addr = data & 0x1f;
+      if (addr == 0 && (data & 0x20000)) {
+        sim_chip_reset(c);
+      } else {
+        c->regs[addr] = data;
+      }
+      break;
+
+    case SIM_LMX2594:
+      addr = tx[0] & 0x7f;
+      data = (tx[1] << 8) | tx[2];
+      if (rd) {
+        if (c->regs[0] & 0x4) {
+          // MUXOUT_LD_SEL set, SDO is lock detect instead of readback
+          rx[1] = rx[2] = sim_lmx_locked(c) ? 0xff : 0x00;
+        } else if (addr == 110 && !sim_lmx_locked(c)) {
+          rx[1] = (c->regs[addr] & ~(3 << 9)) >> 8;
+          rx[2] = c->regs[addr] & 0xff;
+        } else {
+          rx[1] = (c->regs[addr] >> 8) & 0xff;
+          rx[2] = c->regs[addr] & 0xff;
+        }
+      } else if (addr == 0 && (data & 0x2)) {
+        sim_chip_reset(c);
+        c->regs[0] = data & ~0x2;
+      } else {
+        c->regs[addr] = data;
+        if (addr == 0 && (data & 0x8)) { // FCAL_EN
+          sim_lmx_calibrate(c);
+        }
+      }
+      break;
+
+    case SIM_SPI_SINK:
+      break;
+  }
+}
+
+// shift `len` bytes through a part, a trailing partial word is ignored
+static void sim_chip_shift(SimChip *c, const uint8_t *tx, uint8_t *rx, int len) {
+  int w = sim_chip_word(c);
+  uint8_t word_rx[4];
+
+  for (int off=0; off+w <= len; off+=w) {
+    memset(word_rx, 0, sizeof(word_rx));
+    sim_chip_xfer(c, tx+off, word_rx);
+    if (rx) {
+      for (int b=0; b<w; b++) {
+        rx[off+b] |= word_rx[b];
+      }
+    }
+  }
+}
+
+/*
+ * Simulated fds, for i2c the physical buses and the kernel mux adapters, and
+ * the spidevs
+ */
+typedef struct sim_fd {
+  uint8_t used;
+  uint8_t spi;
+  int bus;          // i2c: physical bus
+  int child;        // i2c: device whose kernel mux adapter this is, -1 for the bus itself
+  SimChip *chip;    // spi: part on the spidev
+  uint32_t speed;
+  uint8_t mode;
+  uint8_t bits;
+  uint8_t last_rx[SIM_BRIDGE_BUF]; // spi: data clocked in by the last write, returned by read
+} SimFd;
+
+static SimFd sim_fds[SIM_MAX_FDS];
+static SimLock sim_fd_lock;
+
+static int sim_fd_alloc() {
+  sim_lock(&sim_fd_lock);
+  for (int i=0; i<SIM_MAX_FDS; i++) {
+    if (!sim_fds[i].used) {
+      memset(&sim_fds[i], 0, sizeof(SimFd));
+      sim_fds[i].used = 1;
+      sim_fds[i].child = -1;
+      sim_unlock(&sim_fd_lock);
+      return SIM_FD_BASE + i;
+    }
+  }
+  sim_unlock(&sim_fd_lock);
+  errno = EMFILE;
+  return -1;
+}
+
+static SimFd* sim_fd(int fd) {
+  if (fd < SIM_FD_BASE || fd >= SIM_FD_BASE + SIM_MAX_FDS || !sim_fds[fd - SIM_FD_BASE].used) {
+    errno = EBADF;
+    return NULL;
+  }
+  return &sim_fds[fd - SIM_FD_BASE];
+}
+
+static int sim_close(int fd) {
+  SimFd *f = sim_fd(fd);
+  if (f == NULL) {
+    return -1;
+  }
+  f->used = 0;
+  return 0;
+}
+
+static void sim_timing_env() {
+  const char *env;
+
+  if ((env = getenv("ALPACA_SIM_LATENCY_US")) != NULL) {
+    sim_xfer_us = atoi(env);
+  }
+  if ((env = getenv("ALPACA_SIM_I2C_HZ")) != NULL) {
+    sim_i2c_hz = atoi(env);
+  }
+  if ((env = getenv("ALPACA_SIM_SPI_HZ")) != NULL) {
+    sim_spi_hz = atoi(env);
+  }
+}
+
+#ifdef I2C_COM_BUS
+/*
+ * I2C parts
+ */
+typedef enum sim_dev_kind {
+  SIM_ABSENT,   // no slave at the address, NACKs
+  SIM_MEM,      // 256 byte register file or memory (SFP/QSFP A0/A2, si570, ...)
+  SIM_EEPROM,   // board EEPROM, page writes and write cycle
+  SIM_IOX,      // TCA6408 (TCA6416 on the zcu111)
+  SIM_SI53XX,   // Si534x/Si538x, page register at 0x01
+  SIM_8A34001,  // 8A34001, page register at 0xfc-0xff
+  SIM_BRIDGE    // SC18IS602 i2c to spi bridge
+} SimDevKind;
+
+typedef struct sim_dev {
+  const char *name;
+  const char *dev_path;
+  int bus;
+  uint8_t mux_addr;
+  uint8_t mux_sel;
+  uint8_t addr;
+  SimDevKind kind;
+  uint8_t *mem;
+  uint32_t memsz;
+  uint8_t ptr;              // register pointer set by the first byte of a write
+  uint32_t eptr;            // EEPROM memory address
+  const I2CEeprom *geom;    // EEPROM geometry from PLATFORM_I2C_EEPROMS
+  uint8_t page[4];          // Si53xx page (page[0]), 8A34001 page register
+  uint64_t busy_until;      // NACKs until then (EEPROM write cycle, bridge shifting)
+  SimChip *ss[4];           // bridge: parts on SS0-SS3
+  uint8_t rxbuf[SIM_BRIDGE_BUF];
+  uint8_t txbuf[SIM_BRIDGE_BUF+1]; // bridge: function byte and data, shifted out on STOP
+  int txlen;
+  uint32_t spi_hz;
+} SimDev;
+
+typedef struct sim_mux {
+  int bus;
+  uint8_t addr;
+  uint8_t reg;       // channels connected
+  uint8_t pending;   // channels written, connected on the next STOP
+  uint8_t has_pending;
+} SimMux;
+
+#define X(name, dev) { #name, dev },
+static const struct { const char *name; I2CSlave slave; } sim_table[] = { I2C_DEVICES_MAP };
+#undef X
+#define SIM_NUM_DEVS (sizeof(sim_table)/sizeof(sim_table[0]))
+
+// the muxes and buses are shared with forked children, like the real ones are
+// shared by every process on the board
+typedef struct sim_shared {
+  SimLock bus_lock[2];
+  SimMux muxes[SIM_MAX_MUXES];
+} SimShared;
+
+static SimDev sim_devs[SIM_NUM_DEVS];
+static SimShared *sim_shared;
+static SimMux *sim_muxes;
+static int sim_nmux = 0;
+static SimLock *sim_bus_lock;
+static int sim_ready = 0;
+
+static void sim_set_str(uint8_t *mem, int off, int len, const char *str) {
+  memset(mem + off, ' ', len);
+  memcpy(mem + off, str, strlen(str) < len ? strlen(str) : len);
+}
+
+static void sim_dev_fill(SimDev *d) {
+  switch (d->kind) {
+    case SIM_EEPROM:
+      d->memsz = d->geom->size;
+      d->mem = malloc(d->memsz);
+      memset(d->mem, 0xff, d->memsz);
+      break;
+
+    case SIM_IOX:
+      d->memsz = 8;
+      d->mem = calloc(1, d->memsz);
+      // outputs high, all pins inputs after reset
+      memset(d->mem + ((PLATFORM == ZCU111) ? 2 : 1), 0xff, (PLATFORM == ZCU111) ? 2 : 1);
+      memset(d->mem + ((PLATFORM == ZCU111) ? 6 : 3), 0xff, (PLATFORM == ZCU111) ? 2 : 1);
+      break;
+
+    case SIM_SI53XX:
+      d->memsz = 65536;
+      d->mem = calloc(1, d->memsz);
+      // PN_BASE, e.g. 0x5341
+      d->mem[0x02] = strstr(d->name, "5382") ? 0x82 : strstr(d->name, "5340") ? 0x40 : 0x41;
+      d->mem[0x03] = 0x53;
+      break;
+
+    case SIM_8A34001:
+      d->memsz = 65536;
+      d->mem = calloc(1, d->memsz);
+      break;
+
+    case SIM_MEM:
+      d->memsz = 256;
+      d->mem = calloc(1, d->memsz);
+      if (strstr(d->name, "QSFP") && d->addr == 0x50) {
+        // SFF-8636 lower page and upper page 00h
+        d->mem[0] = 0x11;   // QSFP28
+        d->mem[1] = 0x07;
+        d->mem[22] = 25;    // 25 C
+        d->mem[128] = 0x11;
+        sim_set_str(d->mem, 148, 16, "ALPACA SIM");
+        sim_set_str(d->mem, 168, 16, "SIM-QSFP28-100G");
+      } else if (strstr(d->name, "SFP") && d->addr == 0x50) {
+        // SFF-8472 A0h
+        d->mem[0] = 0x03;   // SFP/SFP+
+        d->mem[1] = 0x04;
+        d->mem[2] = 0x07;   // LC
+        sim_set_str(d->mem, 20, 16, "ALPACA SIM");
+        sim_set_str(d->mem, 40, 16, "SIM-SFP-10G");
+        sim_set_str(d->mem, 68, 16, "SIM0000001");
+      } else if (strstr(d->name, "SFP") && d->addr == 0x51) {
+        // SFF-8472 A2h diagnostics
+        d->mem[96] = 25;    // 25 C
+        d->mem[98] = 0x80;  // 3.3 V
+        d->mem[99] = 0xe8;
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+static void sim_bridge_attach(SimDev *d) {
+  d->spi_hz = 1843000; // SC18IS602 default SPI clock
+#if (PLATFORM == ZCU216) | (PLATFORM == ZCU208)
+  // CLK104: LMK04828 on SS1, DAC LMX2594 on SS2, ADC LMX2594 on SS3
+  d->ss[1] = sim_chip_new(SIM_LMK0482X);
+  d->ss[2] = sim_chip_new(SIM_LMX2594);
+  d->ss[3] = sim_chip_new(SIM_LMX2594);
+#elif PLATFORM == ZCU111
+  // LMK04208 on SS1, DAC LMX2594 on SS0 and ADC LMX2594s on SS2 and SS3
+  d->ss[0] = sim_chip_new(SIM_LMX2594);
+  d->ss[1] = sim_chip_new(SIM_LMK04208);
+  d->ss[2] = sim_chip_new(SIM_LMX2594);
+  d->ss[3] = sim_chip_new(SIM_LMX2594);
+#elif PLATFORM == ZRF16
+  // LMK04832 alone on its bridge, four LMX2594 on the other
+  if (strstr(d->name, "LMK")) {
+    d->ss[0] = sim_chip_new(SIM_LMK0482X);
+  } else {
+    for (int i=0; i<4; i++) {
+      d->ss[i] = sim_chip_new(SIM_LMX2594);
+    }
+  }
+#elif PLATFORM == RFSoC2x2
+  // ADC LMX2594 on SS0, DAC LMX2594 on SS1, LMK04832 on SS3
+  d->ss[0] = sim_chip_new(SIM_LMX2594);
+  d->ss[1] = sim_chip_new(SIM_LMX2594);
+  d->ss[3] = sim_chip_new(SIM_LMK0482X);
+#endif
+}
+
+static SimDevKind sim_dev_kind(const char *name, uint8_t addr) {
+  if (addr == 0xff) {
+    return SIM_ABSENT;
+  } else if (strstr(name, "SPI_BRIDGE") || strstr(name, "CLK104")) {
+    return SIM_BRIDGE;
+  } else if (strstr(name, "IOX")) {
+    return SIM_IOX;
+  } else if (strstr(name, "SI53") || strstr(name, "S153")) {
+    return SIM_SI53XX;
+  } else if (strstr(name, "8A34001")) {
+    return SIM_8A34001;
+  } else if (strstr(name, "EEPROM")) {
+    return SIM_EEPROM;
+  }
+  return SIM_MEM;
+}
+
+static SimMux* sim_mux_find(int bus, uint8_t addr) {
+  for (int i=0; i<sim_nmux; i++) {
+    if (sim_muxes[i].bus == bus && sim_muxes[i].addr == addr) {
+      return &sim_muxes[i];
+    }
+  }
+  return NULL;
+}
+
+static void sim_i2c_init() {
+  sim_shared = mmap(NULL, sizeof(SimShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (sim_shared == MAP_FAILED) {
+    sim_shared = calloc(1, sizeof(SimShared));
+  }
+  sim_muxes = sim_shared->muxes;
+  sim_bus_lock = sim_shared->bus_lock;
+
+  for (int i=0; i<SIM_NUM_DEVS; i++) {
+    SimDev *d = &sim_devs[i];
+    const I2CSlave *s = &sim_table[i].slave;
+
+    d->name = sim_table[i].name;
+    d->dev_path = s->dev_path;
+    d->bus = (s->parent_fd == &fd_i2c0) ? 0 : 1;
+    d->mux_addr = s->mux_addr;
+    d->mux_sel = s->mux_sel;
+    d->addr = s->slave_addr;
+    d->kind = sim_dev_kind(d->name, d->addr);
+    d->geom = i2c_eeprom_geom(i);
+    if (d->kind == SIM_EEPROM && d->geom == NULL) {
+      d->kind = SIM_MEM;
+    }
+    sim_dev_fill(d);
+    if (d->kind == SIM_BRIDGE) {
+      sim_bridge_attach(d);
+    }
+
+    if (d->mux_addr != 0xff && sim_mux_find(d->bus, d->mux_addr) == NULL && sim_nmux < SIM_MAX_MUXES) {
+      sim_muxes[sim_nmux].bus = d->bus;
+      sim_muxes[sim_nmux].addr = d->mux_addr;
+      sim_nmux++;
+    }
+  }
+}
+
+// the slave answering `addr` through the channels currently connected
+static SimDev* sim_dev_find(int bus, uint8_t addr) {
+  for (int i=0; i<SIM_NUM_DEVS; i++) {
+    SimDev *d = &sim_devs[i];
+    if (d->bus != bus || d->addr != addr || d->kind == SIM_ABSENT) {
+      continue;
+    }
+    if (d->mux_addr == 0xff) {
+      return d;
+    }
+    SimMux *m = sim_mux_find(bus, d->mux_addr);
+    if (m && (m->reg & d->mux_sel)) {
+      return d;
+    }
+  }
+  return NULL;
+}
+
+// the muxes connect the channels written to them on a STOP
+static void sim_mux_stop(int bus) {
+  for (int i=0; i<sim_nmux; i++) {
+    if (sim_muxes[i].bus == bus && sim_muxes[i].has_pending) {
+      sim_muxes[i].reg = sim_muxes[i].pending;
+      sim_muxes[i].has_pending = 0;
+    }
+  }
+}
+
+static void sim_iox_write(SimDev *d, uint8_t b) {
+  int wide = (PLATFORM == ZCU111); // TCA6416, register pairs
+
+  if (d->ptr >= (wide ? 2 : 1)) { // input port registers are read only
+    d->mem[d->ptr] = b;
+  }
+  if (wide) {
+    d->ptr ^= 1;
+  }
+}
+
+static uint8_t sim_iox_read(SimDev *d) {
+  int wide = (PLATFORM == ZCU111);
+  uint8_t v;
+
+  if (d->ptr < (wide ? 2 : 1)) {
+    // input port, pins configured as inputs read high
+    uint8_t out = d->mem[d->ptr + (wide ? 2 : 1)];
+    uint8_t cfg = d->mem[d->ptr + (wide ? 6 : 3)];
+    v = (out & ~cfg) | cfg;
+  } else {
+    v = d->mem[d->ptr];
+  }
+  if (wide) {
+    d->ptr ^= 1;
+  }
+  return v;
+}
+
+// the bridge only latches an SPI write into its buffer, the transfer starts on
+// the STOP. A later write in the same transaction (after a repeated START)
+// overwrites the buffer, so only the last one goes out.
+static void sim_bridge_write(SimDev *d, const uint8_t *buf, int len) {
+  uint8_t fn = buf[0];
+
+  if (fn < 0x10) {
+    d->txlen = (len > SIM_BRIDGE_BUF+1) ? SIM_BRIDGE_BUF+1 : len;
+    memcpy(d->txbuf, buf, d->txlen);
+  } else if (fn == 0xf0 && len > 1) {
+    // configure SPI interface, SPR1:0 pick the clock
+    static const uint32_t spr_hz[4] = { 1843000, 461000, 115000, 58000 };
+    d->spi_hz = spr_hz[buf[1] & 0x3];
+  }
+}
+
+// SPI transfer of the latched write to the parts selected by the SS bits of
+// its function byte, the bridge NACKs while it shifts
+static void sim_bridge_stop(SimDev *d) {
+  uint8_t fn = d->txbuf[0];
+  int n = d->txlen - 1;
+
+  if (d->txlen == 0) {
+    return;
+  }
+  d->txlen = 0;
+  memset(d->rxbuf, 0, sizeof(d->rxbuf));
+  for (int s=0; s<4; s++) {
+    if ((fn & (1 << s)) && d->ss[s]) {
+      sim_lock(&d->ss[s]->lock);
+      sim_chip_shift(d->ss[s], d->txbuf+1, d->rxbuf, n);
+      sim_unlock(&d->ss[s]->lock);
+    }
+  }
+  if (sim_i2c_hz) {
+    d->busy_until = sim_now() + (uint64_t) n*8*1000000000ull/d->spi_hz;
+  }
+}
+
+// a STOP on `bus` connects pending mux channels and starts latched bridge transfers
+static void sim_bus_stop(int bus) {
+  sim_mux_stop(bus);
+  for (int i=0; i<SIM_NUM_DEVS; i++) {
+    if (sim_devs[i].bus == bus && sim_devs[i].kind == SIM_BRIDGE) {
+      sim_bridge_stop(&sim_devs[i]);
+    }
+  }
+}
+
+static int sim_dev_write(SimDev *d, const uint8_t *buf, int len) {
+  if (len == 0) {
+    return SUCCESS;
+  }
+
+  if (d->kind == SIM_BRIDGE) {
+    sim_bridge_write(d, buf, len);
+    return SUCCESS;
+  }
+
+  if (d->kind == SIM_EEPROM) {
+    const I2CEeprom *g = d->geom;
+    if (len < g->addr_len) {
+      return SUCCESS;
+    }
+    d->eptr = 0;
+    for (int i=0; i<g->addr_len; i++) {
+      d->eptr = (d->eptr << 8) | buf[i];
+    }
+    d->eptr %= g->size;
+    // page writes wrap within the page
+    for (int i=g->addr_len; i<len; i++) {
+      d->mem[d->eptr] = buf[i];
+      d->eptr = (d->eptr - d->eptr % g->page) + (d->eptr + 1) % g->page;
+    }
+    if (len > g->addr_len && sim_i2c_hz) {
+      d->busy_until = sim_now() + SIM_EEPROM_WRITE_NS;
+    }
+    return SUCCESS;
+  }
+
+  d->ptr = buf[0];
+  for (int i=1; i<len; i++) {
+    uint8_t b = buf[i];
+    switch (d->kind) {
+      case SIM_IOX:
+        sim_iox_write(d, b);
+        break;
+      case SIM_SI53XX:
+        if (d->ptr == 0x01) {
+          d->page[0] = b;
+        } else {
+          d->mem[(d->page[0] << 8) | d->ptr] = b;
+        }
+        d->ptr++;
+        break;
+      case SIM_8A34001:
+        if (d->ptr >= 0xfc) {
+          d->page[d->ptr - 0xfc] = b;
+        } else {
+          d->mem[(d->page[1] << 8) | d->ptr] = b;
+        }
+        d->ptr++;
+        break;
+      default:
+        d->mem[d->ptr++] = b;
+        break;
+    }
+  }
+
+  return SUCCESS;
+}
+
+static int sim_dev_read(SimDev *d, uint8_t *buf, int len) {
+  for (int i=0; i<len; i++) {
+    switch (d->kind) {
+      case SIM_BRIDGE:
+        buf[i] = (i < SIM_BRIDGE_BUF) ? d->rxbuf[i] : 0;
+        break;
+      case SIM_IOX:
+        buf[i] = sim_iox_read(d);
+        break;
+      case SIM_SI53XX:
+        buf[i] = (d->ptr == 0x01) ? d->page[0] : d->mem[(d->page[0] << 8) | d->ptr];
+        d->ptr++;
+        break;
+      case SIM_8A34001:
+        buf[i] = (d->ptr >= 0xfc) ? d->page[d->ptr - 0xfc] : d->mem[(d->page[1] << 8) | d->ptr];
+        d->ptr++;
+        break;
+      case SIM_EEPROM:
+        // sequential reads roll over the whole memory
+        buf[i] = d->mem[d->eptr];
+        d->eptr = (d->eptr + 1) % d->memsz;
+        break;
+      default:
+        buf[i] = d->mem[d->ptr++];
+        break;
+    }
+  }
+  return SUCCESS;
+}
+
+static int sim_i2c_open(const char *path) {
+  int fd, child = -1, bus = -1;
+
+  if (!sim_ready) {
+    sim_timing_env();
+    sim_i2c_init();
+    sim_ready = 1;
+  }
+
+  // kernel mux adapters first, on some boards their numbers overlap the buses
+  for (int i=0; i<SIM_NUM_DEVS; i++) {
+    if (sim_devs[i].mux_addr != 0xff && strcmp(sim_devs[i].dev_path, path) == 0) {
+      child = i;
+      bus = sim_devs[i].bus;
+      break;
+    }
+  }
+  if (child < 0) {
+    if (strcmp(path, I2C0_DEV_PATH) == 0) {
+      bus = 0;
+    } else if (strcmp(path, I2C1_DEV_PATH) == 0) {
+      bus = 1;
+    } else {
+      errno = ENOENT;
+      return -1;
+    }
+  }
+
+  fd = sim_fd_alloc();
+  if (fd >= 0) {
+    sim_fds[fd - SIM_FD_BASE].bus = bus;
+    sim_fds[fd - SIM_FD_BASE].child = child;
+  }
+  return fd;
+}
+
+static int sim_i2c_rdwr(int fd, struct i2c_msg *msgs, int nmsgs) {
+  SimFd *f = sim_fd(fd);
+  uint64_t bits = 0;
+  int ret = nmsgs;
+  int bus;
+
+  if (f == NULL || f->spi) {
+    errno = EBADF;
+    return -1;
+  }
+  bus = f->bus;
+
+  sim_lock(&sim_bus_lock[bus]);
+
+  if (f->child >= 0) {
+    // the kernel mux driver connects the adapter's channel first
+    SimDev *c = &sim_devs[f->child];
+    SimMux *m = sim_mux_find(bus, c->mux_addr);
+    if (m) {
+      m->reg = c->mux_sel;
+      m->has_pending = 0;
+      bits += 18;
+    }
+  }
+
+  for (int i=0; i<nmsgs; i++) {
+    struct i2c_msg *msg = &msgs[i];
+    SimMux *m = sim_mux_find(bus, msg->addr);
+    bits += 9*(msg->len + 1);
+
+    if (m) {
+      if (msg->flags & I2C_M_RD) {
+        memset(msg->buf, m->reg, msg->len);
+      } else if (msg->len > 0) {
+        m->pending = msg->buf[msg->len-1];
+        m->has_pending = 1;
+      }
+    } else {
+      SimDev *d = sim_dev_find(bus, msg->addr);
+      if (d == NULL || sim_now() < d->busy_until) {
+        // address NACK ends the transaction with a STOP
+        errno = ENXIO;
+        ret = -1;
+        sim_bus_stop(bus);
+        break;
+      }
+      if (msg->flags & I2C_M_RD) {
+        sim_dev_read(d, msg->buf, msg->len);
+      } else {
+        sim_dev_write(d, msg->buf, msg->len);
+      }
+    }
+
+    if ((msg->flags & I2C_M_STOP) || i == nmsgs-1) {
+      sim_bus_stop(bus);
+    }
+  }
+
+  sim_delay(sim_xfer_us*1000ull + (sim_i2c_hz ? bits*1000000000ull/sim_i2c_hz : 0));
+  sim_unlock(&sim_bus_lock[bus]);
+  return ret;
+}
+
+static int sim_i2c_funcs(int fd, unsigned long *funcs) {
+  if (sim_fd(fd) == NULL) {
+    return -1;
+  }
+  *funcs = I2C_FUNC_I2C | I2C_FUNC_PROTOCOL_MANGLING;
+  return 0;
+}
+
+const I2CTransport i2c_sim_transport = {
+  "sim", sim_i2c_open, sim_close, sim_i2c_rdwr, sim_i2c_funcs, NULL
+};
+#endif // I2C_COM_BUS
+
+/*
+ * spidevs, the RFSoC4x2 LMK04828 and LMX2594s
+ */
+static SimChip *sim_spi_lmk, *sim_spi_lmx_adc, *sim_spi_lmx_dac, *sim_spi_sink;
+// the spidevs are chip selects of one controller, a message has it to itself
+// from its first transfer to the end of its last delay
+static SimLock sim_spi_ctlr;
+
+static int sim_spi_open(const char *path) {
+  SimChip *chip;
+  int fd;
+
+  if (sim_spi_sink == NULL) {
+    sim_timing_env();
+    sim_spi_lmk = sim_chip_new(SIM_LMK0482X);
+    sim_spi_lmx_adc = sim_chip_new(SIM_LMX2594);
+    sim_spi_lmx_dac = sim_chip_new(SIM_LMX2594);
+    sim_spi_sink = sim_chip_new(SIM_SPI_SINK);
+    // SDO valid time limits the readback clock, the LMK's SPI is rated to 20 MHz
+    sim_spi_lmk->max_hz = sim_spi_hz ? sim_spi_hz : 20000000;
+    sim_spi_lmx_adc->max_hz = sim_spi_hz ? sim_spi_hz : 50000000;
+    sim_spi_lmx_dac->max_hz = sim_spi_lmx_adc->max_hz;
+  }
+
+  if (strcmp(path, LMK_SPIDEV) == 0) {
+    chip = sim_spi_lmk;
+  } else if (strcmp(path, ADC_RFPLL_SPIDEV) == 0) {
+    chip = sim_spi_lmx_adc;
+  } else if (strcmp(path, DAC_RFPLL_SPIDEV) == 0) {
+    chip = sim_spi_lmx_dac;
+  } else {
+    chip = sim_spi_sink;
+  }
+
+  fd = sim_fd_alloc();
+  if (fd >= 0) {
+    sim_fds[fd - SIM_FD_BASE].spi = 1;
+    sim_fds[fd - SIM_FD_BASE].chip = chip;
+    sim_fds[fd - SIM_FD_BASE].speed = 500000;
+    sim_fds[fd - SIM_FD_BASE].bits = 8;
+  }
+  return fd;
+}
+
+static void sim_spi_shift(SimFd *f, const uint8_t *tx, uint8_t *rx, int len, uint32_t speed) {
+  sim_lock(&f->chip->lock);
+  if (rx) {
+    memset(rx, 0, len);
+  }
+  sim_chip_shift(f->chip, tx, rx, len);
+  // clocked faster than the part drives SDO the last bit of each byte is lost
+  if (rx && f->chip->max_hz && (speed ? speed : f->speed) > f->chip->max_hz) {
+    for (int i=0; i<len; i++) {
+      rx[i] ^= 0x01;
+    }
+  }
+  sim_delay(sim_xfer_us*1000ull + (uint64_t) len*8*1000000000ull/(speed ? speed : f->speed));
+  sim_unlock(&f->chip->lock);
+}
+
+static int sim_spi_ioctl(int fd, unsigned long req, void *arg) {
+  SimFd *f = sim_fd(fd);
+
+  if (f == NULL || !f->spi) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (req == SPI_IOC_WR_MODE) {
+    f->mode = *(uint8_t*) arg;
+  } else if (req == SPI_IOC_WR_BITS_PER_WORD) {
+    f->bits = *(uint8_t*) arg;
+  } else if (req == SPI_IOC_WR_MAX_SPEED_HZ) {
+    f->speed = *(uint32_t*) arg;
+  } else if (req == SPI_IOC_RD_MAX_SPEED_HZ) {
+    *(uint32_t*) arg = f->speed;
+  } else if (_IOC_TYPE(req) == SPI_IOC_MAGIC && _IOC_NR(req) == 0) {
+    // SPI_IOC_MESSAGE(n), full duplex transfers back to back
+    struct spi_ioc_transfer *xfer = arg;
+    int n = _IOC_SIZE(req)/sizeof(struct spi_ioc_transfer);
+    int total = 0;
+    sim_lock(&sim_spi_ctlr);
+    for (int i=0; i<n; i++) {
+      sim_spi_shift(f, (const uint8_t*) (uintptr_t) xfer[i].tx_buf, (uint8_t*) (uintptr_t) xfer[i].rx_buf,
+                    xfer[i].len, xfer[i].speed_hz);
+      total += xfer[i].len;
+      if (xfer[i].delay_usecs) {
+        sim_delay(xfer[i].delay_usecs*1000ull);
+      }
+    }
+    sim_unlock(&sim_spi_ctlr);
+    return total;
+  } else {
+    errno = ENOTTY;
+    return -1;
+  }
+  return 0;
+}
+
+static int sim_spi_write(int fd, const uint8_t *buf, int len) {
+  SimFd *f = sim_fd(fd);
+
+  if (f == NULL || !f->spi) {
+    return -1;
+  }
+  if (len > SIM_BRIDGE_BUF) {
+    len = SIM_BRIDGE_BUF;
+  }
+  sim_lock(&sim_spi_ctlr);
+  sim_spi_shift(f, buf, f->last_rx, len, 0);
+  sim_unlock(&sim_spi_ctlr);
+  return len;
+}
+
+// half duplex read, returns what the part drove during the last write
+static int sim_spi_read(int fd, uint8_t *buf, int len) {
+  SimFd *f = sim_fd(fd);
+
+  if (f == NULL || !f->spi) {
+    return -1;
+  }
+  if (len > SIM_BRIDGE_BUF) {
+    len = SIM_BRIDGE_BUF;
+  }
+  memcpy(buf, f->last_rx, len);
+  return len;
+}
+
+const SPITransport spi_sim_transport = {
+  "sim", sim_spi_open, sim_close, sim_spi_ioctl, sim_spi_write, sim_spi_read
+};
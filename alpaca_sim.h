@@ -0,0 +1,64 @@
+#ifndef ALPACA_SIM_H_
+#define ALPACA_SIM_H_
+
+#include <stdint.h>
+#include "alpaca_platform.h"
+
+/*
+ * Simulated platform
+ *
+ * An in-process model of the parts behind the buses of the selected PLATFORM
+ * so every tool can be run and timed on a host without a board. It is built
+ * from the platform device table (PLATFORM_I2C_DEVICES) and models:
+ *
+ *   - PCA9548 muxes, the new channel taking effect on STOP
+ *   - SC18IS602 i2c to spi bridges: SS function byte, SPI clock config and
+ *     the read buffer, NACKing while an SPI transfer is still shifting out
+ *   - TCA6408/TCA6416 io expanders
+ *   - LMK04828/LMK04832/LMK04208 and LMX2594 register files behind the
+ *     bridges (or spidevs on the RFSoC4x2) with readback, reset and LMX2594
+ *     VCO calibration, timed with and without assist, and LMK0482x PLL1/PLL2
+ *     lock times (see alpaca_sim.c)
+ *   - Si534x/Si538x paged register maps, the 8A34001 paged map, SFP/QSFP
+ *     A0/A2 memories and the board EEPROM
+ *
+ * ALPACA_SIM=1 in the environment makes `init_i2c_bus` and `init_spi_dev`
+ * use the simulator transports. Timing:
+ *
+ *   ALPACA_SIM_LATENCY_US=<us>  fixed cost of every transaction (default 0)
+ *   ALPACA_SIM_I2C_HZ=<hz>      model wire time at this i2c clock along with
+ *                               the bridge busy time and EEPROM write cycle,
+ *                               0 (default) completes transfers immediately
+ *   ALPACA_SIM_SPI_HZ=<hz>      fastest spi clock the spidev parts read back
+ *                               right at (default 20 MHz LMK, 50 MHz LMX),
+ *                               above it the last bit of every byte is lost
+ *
+ * SPI wire time is always modelled from the speed set on the spidev.
+ *
+ * The mux and bus state is kept in shared memory so processes forked after
+ * `init_i2c_bus` see one board, as concurrent tools do on hardware.
+ *
+ * The state files the tools keep about the parts (register shadows, the
+ * LMX2594 VCO cache and the spi speed profile) go to SIM_STATE_DIR instead of
+ * next to the board's, unless ALPACA_SHADOW_DIR/ALPACA_SPI_PROFILE name a
+ * place, so a simulated run never leaves state a later run on the board
+ * would trust.
+ */
+
+#define SIM_FD_BASE 1000 // simulated fds are numbered from here
+#define SIM_STATE_DIR "/run/alpaca-sim"
+
+int sim_enabled();
+// SIM_STATE_DIR, created if it does not exist yet
+const char* sim_state_dir();
+void sim_set_timing(uint32_t xfer_us, uint32_t i2c_hz);
+
+#ifdef I2C_COM_BUS
+#include "alpaca_i2c_utils.h"
+extern const I2CTransport i2c_sim_transport;
+#endif
+
+#include "alpaca_spi.h"
+extern const SPITransport spi_sim_transport;
+
+#endif /* ALPACA_SIM_H_ */
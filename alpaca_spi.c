@@ -9,46 +9,149 @@
 #include <linux/spi/spidev.h>
 
 #include "alpaca_spi.h"
-
-#define SLEEP_TIME_uS 10000
+#include "alpaca_trace.h"
+#include "alpaca_sim.h"
+#include "alpaca_lock.h"
 
 #define SUCCESS 0
 #define FAILURE 1
 
+/*
+ * Timing profiles
+ */
+// 20 MHz SPI, CS only has to go high between words (t_CS 20 ns)
+const SPITiming spi_timing_lmk0482x = { "lmk0482x", 0, 20, 0, 0 };
+// CS high at least 100 ns, R0 with FCAL_EN is written 1 ms after the rest of
+// the load so the VCO calibration starts from a stable state
+const SPITiming spi_timing_lmx2594 = { "lmx2594", 0, 100, 1000, 0 };
+// instructions execute within 100 us, clear display and return home take up
+// to 2 ms
+const SPITiming spi_timing_us2066 = { "us2066", 100, 0, 0, 2000 };
+const SPITiming spi_timing_legacy = { "legacy", 10000, 0, 0, 0 };
+
+static const SPITiming* spi_default_timing(const char *device) {
+  if (strcmp(device, LMK_SPIDEV) == 0) {
+    return &spi_timing_lmk0482x;
+  } else if (strcmp(device, ADC_RFPLL_SPIDEV) == 0 || strcmp(device, DAC_RFPLL_SPIDEV) == 0) {
+    return &spi_timing_lmx2594;
+  }
+  return &spi_timing_legacy;
+}
+
+void spi_set_timing(spi_dev_t *spidev, const SPITiming *timing) {
+  spidev->timing = timing;
+}
+
+// gap after a packet
+static void spi_word_delay(spi_dev_t *spidev) {
+  uint32_t us = spidev->timing->word_delay_us;
+  uint32_t cs_us = (spidev->timing->cs_hold_ns + 999)/1000;
+
+  if (spidev->timing->cs_hold_ns >= 1000 && cs_us > us) {
+    us = cs_us;
+  }
+  if (us > 0) {
+    usleep(us);
+  }
+}
+
+void spi_settle(spi_dev_t *spidev) {
+  if (spidev->timing->settle_us > 0) {
+    usleep(spidev->timing->settle_us);
+  }
+}
+
+static int spidev_open(const char *path) {
+  return open(path, O_RDWR | O_SYNC);
+}
+
+static int spidev_close(int fd) {
+  return close(fd);
+}
+
+static int spidev_ioctl(int fd, unsigned long req, void *arg) {
+  return ioctl(fd, req, arg);
+}
+
+static int spidev_write(int fd, const uint8_t *buf, int len) {
+  return write(fd, buf, len);
+}
+
+static int spidev_read(int fd, uint8_t *buf, int len) {
+  return read(fd, buf, len);
+}
+
+static const SPITransport spidev_transport = {
+  "spidev", spidev_open, spidev_close, spidev_ioctl, spidev_write, spidev_read
+};
+
+static const SPITransport *spi_transport = &spidev_transport;
+
+void spi_set_transport(const SPITransport *transport) {
+  spi_transport = transport;
+}
+
+const SPITransport* spi_get_transport() {
+  return spi_transport;
+}
+
 int init_spi_dev(spi_dev_t *spidev) {
   int ret = SUCCESS;
   int status = 0;
 
-  spidev->fd = open(spidev->device, O_RDWR | O_SYNC);
+  // ALPACA_TRACE in the environment records all bus traffic to a trace file
+  trace_open_env();
+
+  // ALPACA_SIM in the environment runs against the simulated platform
+  if (sim_enabled()) {
+    spi_transport = &spi_sim_transport;
+  }
+
+  spidev->lock_fd = -1;
+  spidev->lock_depth = 0;
+  spidev->timing = spi_default_timing(spidev->device);
+
+  spidev->fd = spi_transport->open(spidev->device);
   if (spidev->fd < 0) {
     printf("failed to open spi device %s\n", spidev->device);
     return FAILURE;
   }
 
-  status = ioctl(spidev->fd, SPI_IOC_WR_MODE, &(spidev->mode));
+  status = spi_transport->ioctl(spidev->fd, SPI_IOC_WR_MODE, &(spidev->mode));
   if (status < 0) {
     printf("failed to set SPI_IOC_WR_MODE\n");
     return FAILURE;
   }
 
-  status = ioctl(spidev->fd, SPI_IOC_WR_BITS_PER_WORD, &(spidev->bits));
+  status = spi_transport->ioctl(spidev->fd, SPI_IOC_WR_BITS_PER_WORD, &(spidev->bits));
   if (status < 0) {
     printf("failed to set SPI_IOC_WR_BITS_PER_WORD\n");
     return FAILURE;
   }
 
-  status = ioctl(spidev->fd, SPI_IOC_WR_MAX_SPEED_HZ, &(spidev->speed));
+  // a calibrated clock from the speed profile, verified by the first user
+  uint32_t profiled;
+  spidev->base_speed = spidev->speed;
+  spidev->speed_verified = 1;
+  if (spi_speed_load(spidev->device, &profiled) == SUCCESS && profiled != spidev->speed) {
+    spidev->speed = profiled;
+    spidev->speed_verified = 0;
+  }
+
+  status = spi_transport->ioctl(spidev->fd, SPI_IOC_WR_MAX_SPEED_HZ, &(spidev->speed));
   if (status < 0) {
     printf("failed to set SPI_IOC_WR_MAX_SPEED_HZ\n");
     return FAILURE;
   }
 
-  status = ioctl(spidev->fd, SPI_IOC_RD_MAX_SPEED_HZ, &(spidev->speed));
+  status = spi_transport->ioctl(spidev->fd, SPI_IOC_RD_MAX_SPEED_HZ, &(spidev->speed));
   if (status < 0) {
     printf("failed to set SPI_IOC_WR_MAX_SPEED_HZ\n");
     return FAILURE;
   }
 
+  trace_add_stream(spidev->fd, spidev->device, 1, spidev->mode, spidev->bits, spidev->speed);
+
 #ifdef VERBOSE
   printf("spi info:\n");
   printf("\t spi mode: 0x%x\n", spidev->mode);
@@ -59,17 +162,131 @@ int init_spi_dev(spi_dev_t *spidev) {
   return ret;
 }
 
+int spi_set_speed(spi_dev_t *spidev, uint32_t hz) {
+  if (spi_transport->ioctl(spidev->fd, SPI_IOC_WR_MAX_SPEED_HZ, &hz) < 0) {
+    printf("failed to set SPI_IOC_WR_MAX_SPEED_HZ to %u Hz\n", hz);
+    return FAILURE;
+  }
+  spidev->speed = hz;
+  return SUCCESS;
+}
+
+static const char* spi_speed_path() {
+  if (getenv("ALPACA_SPI_PROFILE") != NULL) {
+    return getenv("ALPACA_SPI_PROFILE");
+  }
+  // the simulator's parts are profiled separately from the board's
+  if (sim_enabled()) {
+    sim_state_dir();
+    return SIM_STATE_DIR "/alpaca-spi-speed";
+  }
+  return SPI_SPEED_PROFILE_PATH;
+}
+
+int spi_speed_load(const char *device, uint32_t *hz) {
+  char line[128], dev[64];
+  unsigned int v;
+  int ret = FAILURE;
+  FILE *f = fopen(spi_speed_path(), "r");
+
+  if (f == NULL) {
+    return FAILURE;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "%63s %u", dev, &v) == 2 && strcmp(dev, device) == 0 && v > 0) {
+      *hz = v;
+      ret = SUCCESS;
+    }
+  }
+  fclose(f);
+  return ret;
+}
+
+// the entries of the other devices are kept, written to a temporary file and
+// renamed so readers never see half of it
+int spi_speed_save(const char *device, uint32_t hz) {
+  const char *path = spi_speed_path();
+  char line[128], dev[64], tmp[256];
+  unsigned int v;
+  FILE *in, *out;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  out = fopen(tmp, "w");
+  if (out == NULL) {
+    printf("could not write spi speed profile %s\n", tmp);
+    return FAILURE;
+  }
+  fprintf(out, "# alpaca spi speed profile: <spidev> <hz>\n");
+  in = fopen(path, "r");
+  if (in != NULL) {
+    while (fgets(line, sizeof(line), in) != NULL) {
+      if (sscanf(line, "%63s %u", dev, &v) == 2 && dev[0] != '#' && strcmp(dev, device) != 0) {
+        fprintf(out, "%s %u\n", dev, v);
+      }
+    }
+    fclose(in);
+  }
+  fprintf(out, "%s %u\n", device, hz);
+  if (fclose(out) != 0 || rename(tmp, path) != 0) {
+    printf("could not write spi speed profile %s\n", path);
+    remove(tmp);
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
 int close_spi_dev(spi_dev_t *spidev) {
-  close(spidev->fd);
+  trace_remove_stream(spidev->fd);
+  spi_transport->close(spidev->fd);
   spidev->fd = -1;
+  if (spidev->lock_fd >= 0) {
+    close(spidev->lock_fd);
+    spidev->lock_fd = -1;
+  }
+  spidev->lock_depth = 0;
+  return SUCCESS;
+}
+
+int spi_lock_dev(spi_dev_t *spidev) {
+  if (spidev->lock_depth++ > 0) {
+    return SUCCESS;
+  }
+  if (spidev->lock_fd == -1) {
+    spidev->lock_fd = bus_lock_open(strrchr(spidev->device, '/') ? strrchr(spidev->device, '/') + 1 : spidev->device);
+    if (spidev->lock_fd < 0) {
+      spidev->lock_fd = -2; // no lock directory, run unlocked from now on
+    }
+  }
+  if (spidev->lock_fd < 0) {
+    return SUCCESS;
+  }
+  if (bus_lock(spidev->lock_fd, NULL) != SUCCESS) {
+    spidev->lock_depth--;
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+int spi_unlock_dev(spi_dev_t *spidev) {
+  if (spidev->lock_depth == 0) {
+    return SUCCESS;
+  }
+  if (--spidev->lock_depth == 0 && spidev->lock_fd >= 0) {
+    return bus_unlock(spidev->lock_fd);
+  }
   return SUCCESS;
 }
 
 int read_spi_pkt(spi_dev_t *spidev, uint8_t *buf, uint8_t len) {
 
   int num_rd;
-  num_rd = read(spidev->fd, buf, len);
-  usleep(SLEEP_TIME_uS);
+  uint64_t start = (trace_hdr != NULL) ? trace_now() : 0;
+  num_rd = spi_transport->read(spidev->fd, buf, len);
+  if (trace_hdr != NULL) {
+    trace_record(TRACE_SPI_RD, spidev->fd, 0, (num_rd < 0) ? TRACE_F_FAIL : 0, buf, len, NULL, 0, start,
+                 (num_rd < 0) ? errno : 0);
+  }
+  spi_word_delay(spidev);
   return num_rd;
 }
 
@@ -77,9 +294,14 @@ int write_spi_pkt(spi_dev_t *spidev, uint8_t *buf, uint8_t len) {
 
   int ret = SUCCESS;
   int num_wr;
+  uint64_t start = (trace_hdr != NULL) ? trace_now() : 0;
 
-  num_wr = write(spidev->fd, buf, len);
-  usleep(SLEEP_TIME_uS);
+  num_wr = spi_transport->write(spidev->fd, buf, len);
+  if (trace_hdr != NULL) {
+    trace_record(TRACE_SPI_WR, spidev->fd, 0, (num_wr < 0) ? TRACE_F_FAIL : 0, buf, len, NULL, 0, start,
+                 (num_wr < 0) ? errno : 0);
+  }
+  spi_word_delay(spidev);
   return ret;
 }
 
@@ -95,7 +317,12 @@ int spi_transfer(spi_dev_t *spidev, uint8_t const *tx, uint8_t const *rx, uint8_
   xfer.bits_per_word = spidev->bits;
   xfer.len = len; // each transfer is only 1 byte long
   xfer.delay_usecs = spidev->delay;
-  ret = ioctl(spidev->fd, SPI_IOC_MESSAGE(1), xfer);
+  uint64_t start = (trace_hdr != NULL) ? trace_now() : 0;
+  ret = spi_transport->ioctl(spidev->fd, SPI_IOC_MESSAGE(1), &xfer);
+  if (trace_hdr != NULL) {
+    trace_record(TRACE_SPI_XFER, spidev->fd, 0, (ret < 1) ? TRACE_F_FAIL : 0, tx, len, rx, len, start,
+                 (ret < 1) ? errno : 0);
+  }
 
   if (ret < 1) {
     printf("ioctl failed and returned errno %s\n", strerror(errno));
@@ -104,3 +331,82 @@ int spi_transfer(spi_dev_t *spidev, uint8_t const *tx, uint8_t const *rx, uint8_
   return ret;
 
 }
+
+/*
+ * Shift `npkts` packets of `pkt_len` bytes from `tx` through the part as
+ * SPI_IOC_MESSAGE transfers, chip select going high between packets
+ * (cs_change), and what the part drove back into `rx` frame by frame when
+ * `rx` is not NULL. The gap the timing profile asks for after each packet is
+ * a transfer delay the kernel waits out inside the message. The wait before
+ * the last register of a load is the caller's, see `prog_regs`. A sequence goes out in as few messages as
+ * SPI_SEQ_MAX_XFERS and the spidev buffer (SPI_SEQ_MAX_BYTES) allow, so a
+ * whole register load or readback is one or two system calls. On failure
+ * `failed` (if not NULL) is the index of the first packet of the message
+ * that did not go out.
+ */
+static int spi_seq(spi_dev_t *spidev, const uint8_t *tx, uint8_t *rx, uint8_t pkt_len, uint16_t npkts,
+                   int *failed) {
+  struct spi_ioc_transfer xfers[SPI_SEQ_MAX_XFERS];
+  uint32_t gap_us = spidev->timing->word_delay_us;
+  uint32_t cs_us = (spidev->timing->cs_hold_ns + 999)/1000;
+  int per_msg = SPI_SEQ_MAX_BYTES/pkt_len;
+  int ret;
+
+  if (spidev->timing->cs_hold_ns >= 1000 && cs_us > gap_us) {
+    gap_us = cs_us;
+  }
+  per_msg = (per_msg > SPI_SEQ_MAX_XFERS) ? SPI_SEQ_MAX_XFERS : per_msg;
+  if (failed != NULL) {
+    *failed = -1;
+  }
+
+  for (int base=0; base<npkts; base+=per_msg) {
+    int n = (npkts - base > per_msg) ? per_msg : npkts - base;
+
+    memset(xfers, 0, n*sizeof(struct spi_ioc_transfer));
+    for (int i=0; i<n; i++) {
+      int pkt = base + i;
+      xfers[i].tx_buf = (unsigned long) &tx[pkt*pkt_len];
+      xfers[i].rx_buf = (rx != NULL) ? (unsigned long) &rx[pkt*pkt_len] : 0;
+      xfers[i].len = pkt_len;
+      xfers[i].speed_hz = spidev->speed;
+      xfers[i].bits_per_word = spidev->bits;
+      xfers[i].delay_usecs = (gap_us > 0xffff) ? 0xffff : gap_us;
+      // deselect between packets, the last one ends the message anyway
+      xfers[i].cs_change = (i < n-1);
+    }
+
+    uint64_t start = (trace_hdr != NULL) ? trace_now() : 0;
+    ret = spi_transport->ioctl(spidev->fd, SPI_IOC_MESSAGE(n), xfers);
+    if (trace_hdr != NULL) {
+      for (int i=0; i<n; i++) {
+        int off = (base+i)*pkt_len;
+        trace_record((rx != NULL) ? TRACE_SPI_XFER : TRACE_SPI_WR, spidev->fd, 0, (ret < 0) ? TRACE_F_FAIL : 0,
+                     &tx[off], pkt_len, (rx != NULL) ? &rx[off] : NULL, (rx != NULL) ? pkt_len : 0, start,
+                     (ret < 0) ? errno : 0);
+      }
+    }
+    if (ret < 0) {
+      printf("spi message of %d packets failed: %s\n", n, strerror(errno));
+      if (failed != NULL) {
+        *failed = base;
+      }
+      return FAILURE;
+    }
+
+    // a message boundary is a packet boundary too
+    if (base + n < npkts) {
+      spi_word_delay(spidev);
+    }
+  }
+  return SUCCESS;
+}
+
+int spi_write_seq(spi_dev_t *spidev, const uint8_t *buf, uint8_t pkt_len, uint16_t npkts, int *failed) {
+  return spi_seq(spidev, buf, NULL, pkt_len, npkts, failed);
+}
+
+int spi_transfer_seq(spi_dev_t *spidev, const uint8_t *tx, uint8_t *rx, uint8_t pkt_len, uint16_t npkts,
+                     int *failed) {
+  return spi_seq(spidev, tx, rx, pkt_len, npkts, failed);
+}
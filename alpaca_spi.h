@@ -13,6 +13,29 @@
 #define ADC_RFPLL_SPIDEV "/dev/spidev0.2"
 #define DAC_RFPLL_SPIDEV "/dev/spidev0.1"
 
+/*
+ * Per-part SPI timing
+ *
+ * What a part needs between and after packets, from its datasheet. The gap
+ * after each packet (write_spi_pkt, read_spi_pkt) is `word_delay_us`, or the
+ * CS high time `cs_hold_ns` if that is longer and reaches a microsecond (a
+ * shorter one is always met by the system call between packets).
+ * `final_delay_us` is waited before the last packet of a register load and
+ * `settle_us` once the whole load (or sequence) is done, see `spi_settle`.
+ */
+typedef struct spi_timing {
+  const char* name;
+  uint32_t word_delay_us;
+  uint32_t cs_hold_ns;
+  uint32_t final_delay_us;
+  uint32_t settle_us;
+} SPITiming;
+
+extern const SPITiming spi_timing_lmk0482x; // LMK04828/LMK04832
+extern const SPITiming spi_timing_lmx2594;
+extern const SPITiming spi_timing_us2066;   // US2066 OLED controller
+extern const SPITiming spi_timing_legacy;   // 10 ms after every packet, for parts without a profile
+
 typedef struct SPIDevice {
   char device[32];  // Large enouch for something like:  "/dev/spidev32767.0"
   uint32_t fd;      // linux file descriptor
@@ -20,14 +43,72 @@ typedef struct SPIDevice {
   uint8_t bits;
   uint32_t speed;
   uint16_t delay;
+  int lock_fd;      // cross-process lock file, set up by `init_spi_dev`
+  uint32_t lock_depth;
+  const SPITiming *timing; // set by `init_spi_dev` from the device path, see `spi_set_timing`
+  uint32_t base_speed;      // the speed asked for, the fallback when a profiled clock fails to verify
+  uint8_t speed_verified;   // `speed` is the base speed or has passed a verify since `init_spi_dev`
   // Some sane defaults for the int types would be {-1, SPI_MODE_0 | SPI_CS_HIGH, 8, 500000, 0}
 } spi_dev_t;
 
+// how the library reaches a spidev: the linux spidev driver by default, or the
+// simulator in alpaca_sim.c. Calls return < 0 with errno set on failure.
+typedef struct spi_transport {
+  const char* name;
+  int (*open)(const char *path);
+  int (*close)(int fd);
+  int (*ioctl)(int fd, unsigned long req, void *arg);
+  int (*write)(int fd, const uint8_t *buf, int len);
+  int (*read)(int fd, uint8_t *buf, int len);
+} SPITransport;
+
+// set before `init_spi_dev`, ALPACA_SIM in the environment selects the simulator
+void spi_set_transport(const SPITransport *transport);
+const SPITransport* spi_get_transport();
+
 int init_spi_dev(spi_dev_t *spidev);
 int close_spi_dev(spi_dev_t *spidev);
 
+// `init_spi_dev` picks the profile of the part at LMK_SPIDEV, ADC_RFPLL_SPIDEV
+// or DAC_RFPLL_SPIDEV and spi_timing_legacy for any other device, call this
+// after it to use another
+void spi_set_timing(spi_dev_t *spidev, const SPITiming *timing);
+// wait out the part's settle time after a sequence
+void spi_settle(spi_dev_t *spidev);
+
 int read_spi_pkt(spi_dev_t *spidev, uint8_t *buf, uint8_t len);
 int write_spi_pkt(spi_dev_t *spidev, uint8_t *buf, uint8_t len);
 int spi_transfer(spi_dev_t *spidev, uint8_t const *tx, uint8_t const *rx, uint8_t len);
 
+/*
+ * SPI clock profile
+ *
+ * The fastest clock each spidev passed calibration at (see spi_cal), kept in
+ * SPI_SPEED_PROFILE_PATH, ALPACA_SPI_PROFILE in the environment overrides it
+ * (on the simulator the default is in SIM_STATE_DIR, see alpaca_sim.h).
+ * `init_spi_dev` starts a device with a profile entry at the profiled clock
+ * instead of `speed`, which it keeps in `base_speed`; the first user that can
+ * verify the part (prog_pll) drops back to `base_speed` if the profiled clock
+ * does not read back right.
+ */
+#define SPI_SPEED_PROFILE_PATH "/run/alpaca-spi-speed"
+int spi_set_speed(spi_dev_t *spidev, uint32_t hz);
+// SUCCESS and the profiled clock in `hz`, FAILURE when the device has no entry
+int spi_speed_load(const char *device, uint32_t *hz);
+int spi_speed_save(const char *device, uint32_t hz);
+
+// a sequence of packets in SPI_IOC_MESSAGE(N) transfers, see alpaca_spi.c.
+// spi_transfer_seq is full duplex, frame i of `rx` is what the part drove
+// while frame i of `tx` went out
+#define SPI_SEQ_MAX_XFERS 256   // transfers per message, the ioctl size field allows 511
+#define SPI_SEQ_MAX_BYTES 4096  // spidev's default bufsiz, the data of one message
+int spi_write_seq(spi_dev_t *spidev, const uint8_t *buf, uint8_t pkt_len, uint16_t npkts, int *failed);
+int spi_transfer_seq(spi_dev_t *spidev, const uint8_t *tx, uint8_t *rx, uint8_t pkt_len, uint16_t npkts,
+                     int *failed);
+
+// cross-process lock on the spidev (see alpaca_lock.h) held across a multi
+// transfer operation such as programming or a readback, locks nest
+int spi_lock_dev(spi_dev_t *spidev);
+int spi_unlock_dev(spi_dev_t *spidev);
+
 #endif // ALPACA_SPI_H
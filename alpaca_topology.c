@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <linux/i2c.h>
+
+#include "alpaca_topology.h"
+#include "alpaca_log.h"
+
+#define SUCCESS 0
+#define FAILURE 1
+
+// the range i2cdetect scans, the rest is reserved
+#define TOPO_FIRST_ADDR 0x08
+#define TOPO_LAST_ADDR  0x77
+
+#define X(name, dev) dev,
+static I2CSlave topo_devs[] = { I2C_DEVICES_MAP };
+#undef X
+
+#define TOPO_NUM_DEVS (sizeof(topo_devs)/sizeof(I2CSlave))
+
+static int topo_bus(const I2CSlave *d) {
+  return (d->parent_fd == &fd_i2c0) ? 0 : 1;
+}
+
+static uint8_t topo_channel(uint8_t mux_sel) {
+  return (mux_sel == 0) ? TOPO_ROOT : __builtin_ctz(mux_sel);
+}
+
+static void topo_add(TopoEntry *tab, int *n, int max, int bus, uint8_t mux, uint8_t ch, uint8_t addr) {
+  if (*n >= max) {
+    LOG_WARN("topology table full, dropping bus %d mux 0x%02x channel %d address 0x%02x\n", bus, mux, ch, addr);
+    return;
+  }
+  tab[*n] = (TopoEntry) { bus, mux, ch, addr };
+  (*n)++;
+}
+
+// quick write where the adapter has it and it is safe, a byte read otherwise
+static int topo_probe(int fd, uint8_t addr, unsigned long funcs, uint32_t *probes) {
+  uint8_t b;
+  struct i2c_msg msg = { addr, I2C_M_RD, 1, &b };
+
+  if ((funcs & I2C_FUNC_SMBUS_QUICK) && !(addr >= 0x30 && addr <= 0x37) && !(addr >= 0x50 && addr <= 0x5f)) {
+    msg.flags = 0;
+    msg.len = 0;
+  }
+  (*probes)++;
+  return i2c_rdwr(fd, &msg, 1) == SUCCESS;
+}
+
+// probe every address through `fd`, skipping what already answered on the bus itself
+static void topo_scan_fd(int fd, int bus, uint8_t mux, uint8_t ch, const uint8_t *root, Topology *topo) {
+  unsigned long funcs = 0;
+
+  if (i2c_get_transport()->funcs(fd, &funcs) < 0) {
+    funcs = 0;
+  }
+  topo_add(topo->scans, &topo->nscans, TOPO_MAX_CHANNELS*I2C_NUM_BUSES, bus, mux, ch, 0);
+  for (int addr=TOPO_FIRST_ADDR; addr<=TOPO_LAST_ADDR; addr++) {
+    if (root != NULL && root[addr]) {
+      continue;
+    }
+    if (topo_probe(fd, addr, funcs, &topo->probes)) {
+      topo_add(topo->devs, &topo->ndevs, TOPO_MAX_ENTRIES, bus, mux, ch, addr);
+    }
+  }
+}
+
+static int topo_mux_write(int fd, uint8_t mux, uint8_t sel) {
+  struct i2c_msg msg = { mux, 0, 1, &sel };
+  return i2c_rdwr(fd, &msg, 1);
+}
+
+int topo_scan_bus(int bus, Topology *topo) {
+  int fd = (bus == 0) ? fd_i2c0 : fd_i2c1;
+  uint8_t muxes[TOPO_NUM_DEVS];
+  uint8_t root[TOPO_LAST_ADDR+1] = { 0 };
+  int nmux = 0;
+
+  memset(topo, 0, sizeof(Topology));
+  topo->platform = PLATFORM;
+  topo->scanned = time(NULL);
+
+  // the muxes on this bus, from the platform table
+  for (int i=0; i<TOPO_NUM_DEVS; i++) {
+    int known = 0;
+    if (topo_bus(&topo_devs[i]) != bus || topo_devs[i].mux_addr == 0xff) {
+      continue;
+    }
+    for (int m=0; m<nmux; m++) {
+      known |= (muxes[m] == topo_devs[i].mux_addr);
+    }
+    if (!known) {
+      muxes[nmux++] = topo_devs[i].mux_addr;
+    }
+  }
+
+  if (i2c_lock_buses(1 << bus) != SUCCESS) {
+    return FAILURE;
+  }
+
+  // the bus itself, with the muxes disconnected when they are ours to switch
+  if (i2c_get_mux_mode() == I2C_MUX_USER) {
+    for (int m=0; m<nmux; m++) {
+      topo_mux_write(fd, muxes[m], 0);
+    }
+  }
+  topo_scan_fd(fd, bus, TOPO_ROOT, TOPO_ROOT, NULL, topo);
+  for (int i=0; i<topo->ndevs; i++) {
+    root[topo->devs[i].addr] = 1;
+  }
+
+  if (i2c_get_mux_mode() == I2C_MUX_USER) {
+    // every channel of every mux, one at a time
+    for (int m=0; m<nmux; m++) {
+      for (int ch=0; ch<8; ch++) {
+        if (topo_mux_write(fd, muxes[m], 1 << ch) != SUCCESS) {
+          LOG_WARN("could not select channel %d of mux 0x%02x on bus %d\n", ch, muxes[m], bus);
+          continue;
+        }
+        topo_scan_fd(fd, bus, muxes[m], ch, root, topo);
+      }
+      topo_mux_write(fd, muxes[m], 0);
+    }
+    // what the library knew about the muxes is gone
+    i2c_set_mux_mode(I2C_MUX_USER);
+  } else {
+    // the channels with a child adapter, the kernel driver switches the mux
+    for (int i=0; i<TOPO_NUM_DEVS; i++) {
+      I2CSlave *d = &topo_devs[i];
+      int seen = 0;
+      int cfd;
+      if (topo_bus(d) != bus || d->mux_addr == 0xff) {
+        continue;
+      }
+      for (int j=0; j<i; j++) {
+        seen |= (strcmp(topo_devs[j].dev_path, d->dev_path) == 0);
+      }
+      if (seen) {
+        continue;
+      }
+      cfd = i2c_get_transport()->open(d->dev_path);
+      if (cfd < 0) {
+        LOG_WARN("could not open %s\n", d->dev_path);
+        continue;
+      }
+      topo_scan_fd(cfd, bus, d->mux_addr, topo_channel(d->mux_sel), root, topo);
+      i2c_get_transport()->close(cfd);
+    }
+  }
+
+  i2c_unlock_buses(1 << bus);
+  return SUCCESS;
+}
+
+void topo_merge(Topology *topo, const Topology *other) {
+  for (int i=0; i<other->nscans; i++) {
+    const TopoEntry *e = &other->scans[i];
+    topo_add(topo->scans, &topo->nscans, TOPO_MAX_CHANNELS*I2C_NUM_BUSES, e->bus, e->mux_addr, e->channel, 0);
+  }
+  for (int i=0; i<other->ndevs; i++) {
+    const TopoEntry *e = &other->devs[i];
+    topo_add(topo->devs, &topo->ndevs, TOPO_MAX_ENTRIES, e->bus, e->mux_addr, e->channel, e->addr);
+  }
+  topo->probes += other->probes;
+}
+
+static const char* topo_path(const char *path) {
+  if (path != NULL) {
+    return path;
+  }
+  return (getenv("ALPACA_TOPOLOGY") != NULL) ? getenv("ALPACA_TOPOLOGY") : TOPO_CACHE_PATH;
+}
+
+// written to a temporary file and renamed so readers never see half of it
+int topo_save(const Topology *topo, const char *path) {
+  char tmp[256];
+  FILE *f;
+
+  path = topo_path(path);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  f = fopen(tmp, "w");
+  if (f == NULL) {
+    LOG_ERROR("could not write topology cache %s\n", tmp);
+    return FAILURE;
+  }
+  fprintf(f, "# alpaca i2c topology: scan <bus> <mux> <channel>, dev <bus> <mux> <channel> <addr>\n");
+  fprintf(f, "platform %d\n", topo->platform);
+  fprintf(f, "scanned %llu\n", (unsigned long long) topo->scanned);
+  for (int i=0; i<topo->nscans; i++) {
+    const TopoEntry *e = &topo->scans[i];
+    fprintf(f, "scan %u 0x%02x 0x%02x\n", e->bus, e->mux_addr, e->channel);
+  }
+  for (int i=0; i<topo->ndevs; i++) {
+    const TopoEntry *e = &topo->devs[i];
+    fprintf(f, "dev %u 0x%02x 0x%02x 0x%02x\n", e->bus, e->mux_addr, e->channel, e->addr);
+  }
+  if (fclose(f) != 0 || rename(tmp, path) != 0) {
+    LOG_ERROR("could not write topology cache %s\n", path);
+    remove(tmp);
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+int topo_load(Topology *topo, const char *path) {
+  char line[128];
+  unsigned bus, mux, ch, addr;
+  unsigned long long scanned;
+  FILE *f;
+
+  memset(topo, 0, sizeof(Topology));
+  topo->platform = -1;
+  f = fopen(topo_path(path), "r");
+  if (f == NULL) {
+    return FAILURE;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "dev %u %x %x %x", &bus, &mux, &ch, &addr) == 4) {
+      topo_add(topo->devs, &topo->ndevs, TOPO_MAX_ENTRIES, bus, mux, ch, addr);
+    } else if (sscanf(line, "scan %u %x %x", &bus, &mux, &ch) == 3) {
+      topo_add(topo->scans, &topo->nscans, TOPO_MAX_CHANNELS*I2C_NUM_BUSES, bus, mux, ch, 0);
+    } else if (sscanf(line, "scanned %llu", &scanned) == 1) {
+      topo->scanned = scanned;
+    } else {
+      sscanf(line, "platform %d", &topo->platform);
+    }
+  }
+  fclose(f);
+  return SUCCESS;
+}
+
+static Topology topo_cache;
+static int topo_cache_state = 0; // 0 not loaded yet, 1 loaded, -1 no usable cache
+
+int topo_dev_present(I2CDev dev) {
+  const I2CSlave *d = &topo_devs[dev];
+  int bus = topo_bus(d);
+  uint8_t mux = d->mux_addr;
+  uint8_t ch = (mux == 0xff) ? TOPO_ROOT : topo_channel(d->mux_sel);
+  int scanned = 0;
+
+  if (topo_cache_state == 0) {
+    topo_cache_state = (topo_load(&topo_cache, NULL) == SUCCESS && topo_cache.platform == PLATFORM) ? 1 : -1;
+  }
+  if (topo_cache_state < 0 || d->slave_addr < TOPO_FIRST_ADDR || d->slave_addr > TOPO_LAST_ADDR) {
+    return -1;
+  }
+
+  for (int i=0; i<topo_cache.nscans; i++) {
+    const TopoEntry *e = &topo_cache.scans[i];
+    scanned |= (e->bus == bus && e->mux_addr == mux && e->channel == ch);
+  }
+  if (!scanned) {
+    return -1;
+  }
+
+  // a device on the bus itself answers on every channel too
+  for (int i=0; i<topo_cache.ndevs; i++) {
+    const TopoEntry *e = &topo_cache.devs[i];
+    if (e->bus == bus && e->addr == d->slave_addr &&
+        ((e->mux_addr == mux && e->channel == ch) || e->mux_addr == TOPO_ROOT)) {
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef ALPACA_TOPOLOGY_H_
+#define ALPACA_TOPOLOGY_H_
+
+#include <stdint.h>
+#include "alpaca_i2c_utils.h"
+
+/*
+ * i2c topology scan and cache
+ *
+ * `topo_scan_bus` walks one physical bus: the devices answering on the bus
+ * itself with every mux disconnected, then each channel of each PCA9548 in the
+ * platform table. In user mux mode all 8 channels are selected in turn on the
+ * parent bus and the muxes are left disconnected afterwards; in kernel mux
+ * mode only the channels with a child adapter in the table are scanned,
+ * through those adapters, so the kernel's view of the mux stays right. An
+ * address is probed with a zero-length write (SMBus quick) where the adapter
+ * supports it, and with a one byte read otherwise and in the EEPROM and
+ * 0x30-0x37 ranges, as i2cdetect does. Devices seen on the bus itself answer
+ * on every channel and are only listed once.
+ *
+ * The scan of both buses is saved to TOPO_CACHE_PATH (ALPACA_TOPOLOGY in the
+ * environment overrides it) and `topo_dev_present` answers from that file, so
+ * tools can skip their trial writes. Rescan after changing modules; for
+ * hot-plug cages the tools only trust a "present" answer and still probe a
+ * cage the cache lists as empty.
+ */
+#define TOPO_CACHE_PATH "/run/alpaca-i2c-topology"
+#define TOPO_MAX_ENTRIES 512
+#define TOPO_MAX_CHANNELS 32
+#define TOPO_ROOT 0xff          // mux_addr/channel of the bus itself
+
+typedef struct topo_entry {
+  uint8_t bus;
+  uint8_t mux_addr;             // TOPO_ROOT on the bus itself
+  uint8_t channel;              // 0-7, TOPO_ROOT on the bus itself
+  uint8_t addr;
+} TopoEntry;
+
+typedef struct topology {
+  int platform;
+  uint64_t scanned;             // unix time of the scan
+  int nscans;
+  TopoEntry scans[TOPO_MAX_CHANNELS*I2C_NUM_BUSES]; // channels scanned, addr unused
+  int ndevs;
+  TopoEntry devs[TOPO_MAX_ENTRIES];                 // addresses that answered
+  uint32_t probes;              // bus transactions made by the scan
+} Topology;
+
+// scan one bus into `topo` (the caller holds no locks, the bus lock is taken)
+int topo_scan_bus(int bus, Topology *topo);
+// merge the scan of another bus into `topo`
+void topo_merge(Topology *topo, const Topology *other);
+
+// NULL for the default path
+int topo_save(const Topology *topo, const char *path);
+int topo_load(Topology *topo, const char *path);
+
+// 1 present, 0 absent, -1 not known (no cache or the channel was not scanned)
+int topo_dev_present(I2CDev dev);
+
+#endif /* ALPACA_TOPOLOGY_H_ */
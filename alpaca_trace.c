@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include "alpaca_trace.h"
+#include "alpaca_log.h"
+
+#define SUCCESS 0
+#define FAILURE 1
+
+TraceHdr *trace_hdr = NULL;
+
+static size_t trace_size = 0;
+static TraceStream *trace_streams;
+static TraceRec *trace_ring;
+static int trace_fds[TRACE_MAX_STREAMS];  // fd of the open a stream entry stands for, -1 once closed
+static int trace_nstreams;
+static pthread_mutex_t trace_stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t trace_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Create the trace file `path` with a ring of `nrecs` records and map it.
+ * Streams registered after this call are recorded in its stream table.
+ */
+int trace_open(const char *path, uint32_t nrecs) {
+  int fd;
+  void *map;
+
+  if (trace_hdr != NULL) {
+    return SUCCESS;
+  }
+
+  trace_size = sizeof(TraceHdr) + TRACE_MAX_STREAMS*sizeof(TraceStream) + (size_t) nrecs*sizeof(TraceRec);
+
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    LOG_ERROR("could not create trace file %s\n", path);
+    return FAILURE;
+  }
+  if (ftruncate(fd, trace_size) < 0) {
+    LOG_ERROR("could not size trace file %s\n", path);
+    close(fd);
+    return FAILURE;
+  }
+  map = mmap(NULL, trace_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    LOG_ERROR("could not map trace file %s\n", path);
+    return FAILURE;
+  }
+
+  trace_streams = (TraceStream*) ((uint8_t*) map + sizeof(TraceHdr));
+  trace_ring = (TraceRec*) (trace_streams + TRACE_MAX_STREAMS);
+  for (int i=0; i<TRACE_MAX_STREAMS; i++) {
+    trace_fds[i] = -1;
+  }
+  trace_nstreams = 0;
+
+  TraceHdr *hdr = (TraceHdr*) map;
+  hdr->magic = TRACE_MAGIC;
+  hdr->version = TRACE_VERSION;
+  hdr->rec_size = sizeof(TraceRec);
+  hdr->nrecs = nrecs;
+  hdr->head = 0;
+  hdr->t0_ns = trace_now();
+
+  // publish last, the hooks start recording as soon as this is set
+  __atomic_store_n(&trace_hdr, hdr, __ATOMIC_RELEASE);
+  return SUCCESS;
+}
+
+static void trace_close_atexit() {
+  trace_close();
+}
+
+// open the trace named by ALPACA_TRACE if set, called from the bus init functions
+int trace_open_env() {
+  static int registered = 0;
+  const char *path = getenv("ALPACA_TRACE");
+  const char *recs = getenv("ALPACA_TRACE_RECS");
+  uint32_t nrecs = TRACE_DEFAULT_RECS;
+
+  if (path == NULL || trace_hdr != NULL) {
+    return SUCCESS;
+  }
+  if (recs != NULL && atoi(recs) > 0) {
+    nrecs = atoi(recs);
+  }
+  if (trace_open(path, nrecs) != SUCCESS) {
+    return FAILURE;
+  }
+  if (!registered) {
+    atexit(trace_close_atexit);
+    registered = 1;
+  }
+  return SUCCESS;
+}
+
+int trace_close() {
+  TraceHdr *hdr = trace_hdr;
+
+  if (hdr == NULL) {
+    return SUCCESS;
+  }
+  __atomic_store_n(&trace_hdr, NULL, __ATOMIC_RELEASE);
+  msync(hdr, trace_size, MS_SYNC);
+  munmap(hdr, trace_size);
+  return SUCCESS;
+}
+
+/*
+ * Name the device behind `fd` in the stream table, call on every open of a
+ * device and `trace_remove_stream` before closing it. Each open gets its own
+ * entry so records made before a close keep naming their device when the fd
+ * number comes back for another one. A retired entry is only taken again by
+ * an open of the same device with the same settings, so tools reopening a
+ * device do not fill the table. Records for an fd that was never added carry
+ * TRACE_NO_STREAM and are skipped by the replay tool.
+ */
+int trace_add_stream(int fd, const char *path, uint8_t spi, uint8_t mode, uint8_t bits, uint32_t speed) {
+  TraceStream *ts;
+  int s;
+
+  if (trace_hdr == NULL) {
+    return SUCCESS;
+  }
+
+  pthread_mutex_lock(&trace_stream_lock);
+  for (s=0; s<trace_nstreams; s++) {
+    ts = &trace_streams[s];
+    if (trace_fds[s] < 0 && strncmp(ts->path, path, sizeof(ts->path)-1) == 0 && ts->spi == spi
+        && ts->mode == mode && ts->bits == bits && ts->speed == speed) {
+      break;
+    }
+  }
+  if (s == TRACE_MAX_STREAMS) {
+    pthread_mutex_unlock(&trace_stream_lock);
+    LOG_WARN("trace stream table full, not tracing %s\n", path);
+    return FAILURE;
+  }
+
+  if (s == trace_nstreams) {
+    ts = &trace_streams[s];
+    strncpy(ts->path, path, sizeof(ts->path)-1);
+    ts->spi = spi;
+    ts->mode = mode;
+    ts->bits = bits;
+    ts->speed = speed;
+    __atomic_store_n(&trace_nstreams, s+1, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&trace_fds[s], fd, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&trace_stream_lock);
+  return SUCCESS;
+}
+
+// retire the entry of `fd`, the fd is about to be closed
+int trace_remove_stream(int fd) {
+  if (trace_hdr == NULL) {
+    return SUCCESS;
+  }
+
+  pthread_mutex_lock(&trace_stream_lock);
+  for (int s=0; s<trace_nstreams; s++) {
+    if (trace_fds[s] == fd) {
+      __atomic_store_n(&trace_fds[s], -1, __ATOMIC_RELEASE);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&trace_stream_lock);
+  return SUCCESS;
+}
+
+static uint8_t trace_stream_id(int fd) {
+  int n = __atomic_load_n(&trace_nstreams, __ATOMIC_ACQUIRE);
+
+  for (int s=0; s<n; s++) {
+    if (__atomic_load_n(&trace_fds[s], __ATOMIC_ACQUIRE) == fd) {
+      return s;
+    }
+  }
+  return TRACE_NO_STREAM;
+}
+
+/*
+ * Append one record holding `data` followed by `data2` (the rx bytes of a full
+ * duplex transfer, NULL otherwise). Data that does not fit in the record goes
+ * into TRACE_EXT records in the slots right after it, all slots are reserved
+ * at once so records from different threads do not interleave.
+ */
+void trace_record(uint8_t type, int fd, uint8_t addr, uint8_t flags, const uint8_t *data, uint16_t len,
+                  const uint8_t *data2, uint16_t len2, uint64_t start, int err) {
+  TraceHdr *hdr = __atomic_load_n(&trace_hdr, __ATOMIC_ACQUIRE);
+  uint64_t end = trace_now();
+  uint32_t total = len + len2;
+  uint32_t next = 0;
+  uint32_t copied, n;
+  uint64_t slot;
+  TraceRec *rec;
+
+  if (hdr == NULL) {
+    return;
+  }
+
+  if (total > TRACE_REC_DATA) {
+    next = (total - TRACE_REC_DATA + TRACE_EXT_DATA - 1)/TRACE_EXT_DATA;
+  }
+  slot = __atomic_fetch_add(&hdr->head, next+1, __ATOMIC_RELAXED);
+
+  rec = &trace_ring[slot % hdr->nrecs];
+  rec->type = type;
+  rec->stream = (fd < 0) ? TRACE_NO_STREAM : trace_stream_id(fd);
+  rec->addr = addr;
+  rec->flags = flags;
+  rec->len = len;
+  rec->next = next;
+  rec->dur_ns = end - start;
+  rec->err = err;
+  rec->t_ns = start - hdr->t0_ns;
+
+  // copy data then data2 across the record and its extensions
+  uint8_t *dst = rec->data;
+  uint32_t room = TRACE_REC_DATA;
+  for (copied=0; copied<total; copied+=n) {
+    if (room == 0) {
+      TraceExt *ext = (TraceExt*) &trace_ring[++slot % hdr->nrecs];
+      ext->type = TRACE_EXT;
+      dst = ext->data;
+      room = TRACE_EXT_DATA;
+    }
+    if (copied < len) {
+      n = (len - copied < room) ? len - copied : room;
+      memcpy(dst, data + copied, n);
+    } else {
+      n = (total - copied < room) ? total - copied : room;
+      memcpy(dst, data2 + (copied - len), n);
+    }
+    dst += n;
+    room -= n;
+  }
+}
+
+// mark the start of a named phase, e.g. "lmk" or "lmx adc"
+void trace_phase(const char *name) {
+  if (trace_hdr == NULL) {
+    return;
+  }
+  trace_record(TRACE_PHASE, -1, 0, 0, (const uint8_t*) name, strnlen(name, TRACE_REC_DATA), NULL, 0, trace_now(), 0);
+}
+
+void trace_phase_end() {
+  if (trace_hdr == NULL) {
+    return;
+  }
+  trace_record(TRACE_PHASE, -1, 0, 0, NULL, 0, NULL, 0, trace_now(), 0);
+}
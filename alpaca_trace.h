@@ -0,0 +1,106 @@
+#ifndef ALPACA_TRACE_H_
+#define ALPACA_TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Binary bus transaction trace
+ *
+ * When enabled every message put on an i2c bus (`i2c_rdwr`) or a spidev
+ * (`write_spi_pkt`, `read_spi_pkt`, `spi_transfer`) is recorded with its
+ * timestamp, duration and data into a ring of fixed size records in a file
+ * mapped with mmap, so recording costs a clock read and a memcpy and no
+ * system calls. When the ring is full the oldest records are overwritten.
+ *
+ * Tracing is enabled by setting ALPACA_TRACE=<file> in the environment
+ * (ALPACA_TRACE_RECS=<n> sets the ring size, default TRACE_DEFAULT_RECS) or
+ * by calling `trace_open`. `trace_phase` drops a named marker in the trace
+ * that lasts until the next marker or `trace_phase_end`, the replay tool
+ * (trace_replay) reports timing per phase.
+ *
+ * File layout: TraceHdr, TRACE_MAX_STREAMS TraceStream entries naming the
+ * devices the records refer to, one per open of a device, then the ring of
+ * TraceRec.
+ */
+
+#define TRACE_MAGIC   0x52544c41 // "ALTR"
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_RECS 65536  // 4 MiB ring
+#define TRACE_MAX_STREAMS 16
+#define TRACE_NO_STREAM 0xff
+
+typedef enum trace_type {
+  TRACE_NONE = 0,  // slot never written
+  TRACE_I2C,       // one i2c_msg of an I2C_RDWR transaction
+  TRACE_SPI_WR,    // write() to a spidev
+  TRACE_SPI_RD,    // read() from a spidev
+  TRACE_SPI_XFER,  // full duplex SPI_IOC_MESSAGE, data holds tx then rx
+  TRACE_PHASE,     // phase marker, data holds the name (empty ends the phase)
+  TRACE_EXT        // continuation of the data of the previous record
+} TraceType;
+
+// TraceRec flags
+#define TRACE_F_READ 0x01  // i2c read message
+#define TRACE_F_STOP 0x02  // i2c message with I2C_M_STOP
+#define TRACE_F_CONT 0x04  // same i2c transaction as the previous message
+#define TRACE_F_FAIL 0x08  // the transfer failed
+
+#define TRACE_REC_SIZE 64
+#define TRACE_REC_DATA 40
+#define TRACE_EXT_DATA (TRACE_REC_SIZE-1)
+
+typedef struct trace_hdr {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t rec_size;
+  uint32_t nrecs;     // ring capacity in records
+  uint32_t pad;
+  uint64_t head;      // records written so far, the next slot is head % nrecs
+  uint64_t t0_ns;     // CLOCK_MONOTONIC when the trace was opened
+  uint8_t reserved[32];
+} TraceHdr;
+
+typedef struct trace_stream {
+  char path[32];      // device node, empty if unused
+  uint8_t spi;        // 1 for a spidev, 0 for an i2c adapter
+  uint8_t mode;       // spidev settings to replay with
+  uint8_t bits;
+  uint8_t pad;
+  uint32_t speed;
+} TraceStream;
+
+typedef struct trace_rec {
+  uint8_t type;       // TraceType
+  uint8_t stream;     // index in the stream table
+  uint8_t addr;       // i2c slave address
+  uint8_t flags;
+  uint16_t len;       // bytes transferred
+  uint16_t next;      // TRACE_EXT records following with the rest of the data
+  uint32_t dur_ns;    // duration of the system call
+  int32_t err;        // errno on failure
+  uint64_t t_ns;      // start, relative to TraceHdr.t0_ns
+  uint8_t data[TRACE_REC_DATA];
+} TraceRec;
+
+typedef struct trace_ext {
+  uint8_t type;       // TRACE_EXT
+  uint8_t data[TRACE_EXT_DATA];
+} TraceExt;
+
+// the recorder hooks are a single test of this pointer when tracing is off
+extern TraceHdr *trace_hdr;
+
+int trace_open(const char *path, uint32_t nrecs);
+int trace_open_env();
+int trace_close();
+
+int trace_add_stream(int fd, const char *path, uint8_t spi, uint8_t mode, uint8_t bits, uint32_t speed);
+int trace_remove_stream(int fd);
+void trace_phase(const char *name);
+void trace_phase_end();
+
+uint64_t trace_now();
+void trace_record(uint8_t type, int fd, uint8_t addr, uint8_t flags, const uint8_t *data, uint16_t len,
+                  const uint8_t *data2, uint16_t len2, uint64_t start, int err);
+
+#endif /* ALPACA_TRACE_H_ */
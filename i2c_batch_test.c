@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h> // uint8_t, uint16_t
+
+#include "alpaca_i2c_utils.h"
+#include "alpaca_sim.h"
+
+/*
+ * Test the recovery of a failed i2c batch on a paged register map
+ *
+ * Writes a register pattern spread over several pages of the platform's
+ * Si534x/Si538x (page register 0x01) through an i2c batch the way the clock
+ * chip loads do, with a fraction of the multi-message transactions NACKed
+ * part way (see the `partial` fault of `i2c_set_fault`) so chunks fail after
+ * some of their page writes were applied. Alternate pages use different
+ * register ranges, as the chips' pages hold different registers, so a write
+ * resent on the wrong page is not covered by a later one. Then, without
+ * faults, every register in both ranges is read back and compared with the
+ * pattern, or with zero for the range the page does not use. Returns 0 if all
+ * match, 1 otherwise.
+ *
+ * -nopage leaves the page register undeclared to show the resend writing to
+ * the wrong page. Runs on the simulator only (ALPACA_SIM=1), on hardware it
+ * would overwrite the clock chip's configuration.
+ */
+
+#if (PLATFORM == ZRF16) | (PLATFORM == ZCU216)
+  #define TEST_DEV I2C_DEV_SI5341
+#elif PLATFORM == ZCU111
+  #define TEST_DEV I2C_DEV_SI5382
+#endif
+
+#define DEFAULT_PARTIAL 0.2
+#define DEFAULT_SEED 1
+#define DEFAULT_RUNS 10
+#define TEST_PAGE_REG 0x01
+#define TEST_FIRST_PAGE 0x02
+#define TEST_PAGES 8
+#define TEST_FIRST_REG 0x10
+#define TEST_REGS 48
+#define TEST_RANGE 0x40   // odd pages use the registers one range up
+
+void usage(char* name) {
+  printf("%s [-n <runs>] [-partial <fraction>] [-s <seed>] [-nopage]\n", name);
+}
+
+static uint8_t test_value(int run, int page, int reg) {
+  return (uint8_t) (run*73 + page*31 + reg*7 + 1);
+}
+
+// first register of the range page `page` uses
+static int test_base(int page) {
+  return TEST_FIRST_REG + (page % 2)*TEST_RANGE;
+}
+
+// queue the pattern page by page, returns 0 if the batch was written
+static int write_pattern(int run, int paged) {
+  uint8_t pkt[2];
+  int failed;
+
+  i2c_batch_begin(TEST_DEV);
+  if (paged) {
+    i2c_batch_page_reg(TEST_PAGE_REG);
+  }
+  for (int p=0; p<TEST_PAGES; p++) {
+    pkt[0] = TEST_PAGE_REG;
+    pkt[1] = TEST_FIRST_PAGE + p;
+    if (i2c_batch_add(pkt, 2) != 0) {
+      break;
+    }
+    for (int r=0; r<TEST_REGS; r++) {
+      pkt[0] = test_base(p) + r;
+      pkt[1] = test_value(run, p, r);
+      if (i2c_batch_add(pkt, 2) != 0) {
+        break;
+      }
+    }
+  }
+  if (i2c_batch_commit(&failed) != 0) {
+    printf("batch failed at message %d\n", failed);
+    return 1;
+  }
+  return 0;
+}
+
+// read both ranges of every page back, returns the number of mismatches
+static int check_pattern(int run) {
+  uint8_t pkt[2];
+  uint8_t val, want;
+  int bad = 0;
+
+  for (int p=0; p<TEST_PAGES; p++) {
+    pkt[0] = TEST_PAGE_REG;
+    pkt[1] = TEST_FIRST_PAGE + p;
+    if (i2c_write(TEST_DEV, pkt, 2) != 0) {
+      return 2*TEST_PAGES*TEST_REGS;
+    }
+    for (int r=0; r<TEST_RANGE + TEST_REGS; r++) {
+      int reg = TEST_FIRST_REG + r;
+      if (reg - test_base(p) >= 0 && reg - test_base(p) < TEST_REGS) {
+        want = test_value(run, p, reg - test_base(p));
+      } else if (r < TEST_REGS || r >= TEST_RANGE) {
+        want = 0;
+      } else {
+        continue;
+      }
+      pkt[0] = reg;
+      if (i2c_read_regs(TEST_DEV, pkt, 1, &val, 1) != 0) {
+        return 2*TEST_PAGES*TEST_REGS;
+      }
+      if (val != want) {
+        if (bad < 4) {
+          printf("page 0x%02x reg 0x%02x: read 0x%02x, expected 0x%02x\n", TEST_FIRST_PAGE + p, reg, val,
+                 want);
+        }
+        bad++;
+      }
+    }
+  }
+  return bad;
+}
+
+int main(int argc, char**argv) {
+  I2CFault fault = { 0.0, 0.0, 0.0, DEFAULT_PARTIAL, DEFAULT_SEED };
+  I2CFault none = { 0.0, 0.0, 0.0, 0.0, DEFAULT_SEED };
+  I2CFaultStats fst;
+  int runs = DEFAULT_RUNS;
+  int paged = 1;
+  int fails = 0;
+
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-partial") == 0 && i+1 < argc) {
+      fault.partial = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+      fault.seed = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-nopage") == 0) {
+      paged = 0;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (runs < 1 || fault.seed == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (!sim_enabled()) {
+    printf("run with ALPACA_SIM=1, this overwrites the clock chip's registers\n");
+    return 1;
+  }
+
+  if (init_i2c_bus() != 0) {
+    return 1;
+  }
+  init_i2c_dev(TEST_DEV);
+
+  printf("writing %d registers on %d pages %d times, %.3f of transactions NACKed part way%s\n",
+         TEST_REGS, TEST_PAGES, runs, fault.partial, paged ? "" : ", page register not declared");
+  for (int run=0; run<runs; run++) {
+    int bad;
+
+    i2c_set_fault(&fault);
+    if (write_pattern(run, paged) != 0) {
+      fails++;
+      continue;
+    }
+    i2c_set_fault(&none);
+    bad = check_pattern(run);
+    if (bad > 0) {
+      printf("run %d: %d of %d registers wrong\n", run, bad, 2*TEST_PAGES*TEST_REGS);
+      fails++;
+    }
+    // the next run draws new faults
+    fault.seed++;
+  }
+  i2c_get_fault_stats(&fst);
+  printf("%d/%d runs failed, %u transactions NACKed part way\n", fails, runs, fst.partials);
+
+  close_i2c_dev(TEST_DEV);
+  close_i2c_bus();
+
+  return fails ? 1 : 0;
+}
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h> // uint8_t, uint16_t
+#include <time.h>   // clock_gettime
+
+#include "alpaca_i2c_utils.h"
+#include "alpaca_i2c_exec.h"
+
+/*
+ * Benchmark i2c transaction rate through the platform mux table
+ *
+ * Times back-to-back single byte reads from one device with the mux managed
+ * from user space (checking the mux on every transaction, the default, and
+ * with the check sampled every BENCH_VERIFY_PERIOD transactions) and
+ * delegated to the kernel i2c-mux-pca954x driver.
+ *
+ * With a second device (-p) on the other physical bus the same reads are also
+ * timed for both devices one after the other and then at the same time
+ * through the per-bus executor.
+ *
+ * With -w each read is paired with that many microseconds of CPU work (e.g.,
+ * formatting the next packet) done in line and then while the read runs
+ * asynchronously on the executor.
+ *
+ * The per device telemetry (latency histogram, retries, mux mismatches) for
+ * all runs is printed at the end.
+ */
+
+#define DEFAULT_ITERS 1000
+#define BENCH_VERIFY_PERIOD 8
+
+void usage(char* name) {
+  printf("%s [-d <device>] [-p <device on other bus>] [-n <iterations>] [-w <us of work per read>]\n", name);
+  printf("devices:\n");
+  for (int i=0; i<I2C_NUM_DEVS; i++) {
+    printf("  %s\n", i2c_dev_name(i));
+  }
+}
+
+double elapsed_s(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec)*1e-9;
+}
+
+typedef struct {
+  I2CDev dev;
+  int iters;
+  int fails;
+} ReadLoop;
+
+int read_loop(void *arg) {
+  ReadLoop *rl = (ReadLoop*) arg;
+  uint8_t rd;
+
+  rl->fails = 0;
+  for (int i=0; i<rl->iters; i++) {
+    if (i2c_read(rl->dev, &rd, 1)) {
+      rl->fails++;
+    }
+  }
+  return 0;
+}
+
+// time reads from two devices on different buses, serial then in parallel
+void run_parallel(I2CDev dev, I2CDev pdev, int iters) {
+  struct timespec start, end;
+  ReadLoop rl[2] = { {dev, iters, 0}, {pdev, iters, 0} };
+  I2CJob jobs[2];
+  double t;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  read_loop(&rl[0]);
+  read_loop(&rl[1]);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  t = elapsed_s(&start, &end);
+  printf("%-24s %6d txn in %8.3f s, %10.1f txn/s, %d failed\n", "two buses, serial", 2*iters, t, 2*iters/t, rl[0].fails+rl[1].fails);
+
+  i2c_exec_start();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i=0; i<2; i++) {
+    memset(&jobs[i], 0, sizeof(I2CJob));
+    jobs[i].op = I2C_OP_FUNC;
+    jobs[i].dev = rl[i].dev;
+    jobs[i].fn = read_loop;
+    jobs[i].arg = &rl[i];
+    i2c_exec_submit(&jobs[i]);
+  }
+  i2c_exec_wait();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  i2c_exec_stop();
+  t = elapsed_s(&start, &end);
+  printf("%-24s %6d txn in %8.3f s, %10.1f txn/s, %d failed\n", "two buses, parallel", 2*iters, t, 2*iters/t, rl[0].fails+rl[1].fails);
+}
+
+static void spin_us(uint32_t us) {
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while (elapsed_s(&start, &now) < us*1e-6);
+}
+
+static void count_done(I2CJob *job) {
+  __atomic_add_fetch((int*) job->ctx, 1, __ATOMIC_RELAXED);
+}
+
+// time reads each paired with `work_us` of CPU work, in line and overlapped
+void run_async(I2CDev dev, int iters, uint32_t work_us) {
+  struct timespec start, end;
+  uint8_t *rd;
+  I2CJob *jobs;
+  int completed = 0;
+  int fails = 0;
+  double t;
+
+  if (iters <= 0) {
+    printf("async: %d reads, nothing to run\n", iters);
+    return;
+  }
+  rd = malloc(iters);
+  jobs = calloc(iters, sizeof(I2CJob));
+  if (rd == NULL || jobs == NULL) {
+    printf("async: could not allocate %d jobs\n", iters);
+    free(jobs);
+    free(rd);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i=0; i<iters; i++) {
+    if (i2c_read(dev, &rd[i], 1)) {
+      fails++;
+    }
+    spin_us(work_us);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  t = elapsed_s(&start, &end);
+  printf("%-24s %6d txn in %8.3f s, %10.1f txn/s, %d failed\n", "work in line", iters, t, iters/t, fails);
+
+  fails = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i=0; i<iters; i++) {
+    jobs[i] = (I2CJob) I2C_JOB_READ(dev, &rd[i], 1);
+    jobs[i].done = count_done;
+    jobs[i].ctx = &completed;
+    if (i2c_submit(&jobs[i]) == NULL) {
+      fails++;
+      jobs[i].state = I2C_JOB_DONE;
+      jobs[i].ret = 1;
+      continue;
+    }
+    spin_us(work_us);
+  }
+  for (int i=0; i<iters; i++) {
+    if (i2c_job_wait(&jobs[i]) != 0) {
+      fails++;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  i2c_exec_stop();
+  t = elapsed_s(&start, &end);
+  printf("%-24s %6d txn in %8.3f s, %10.1f txn/s, %d failed, %d callbacks\n", "work overlapped", iters, t, iters/t,
+         fails, completed);
+
+  free(jobs);
+  free(rd);
+}
+
+int run(const char* label, I2CDev dev, int iters) {
+  struct timespec start, end;
+  uint8_t rd;
+  int fails = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i=0; i<iters; i++) {
+    if (i2c_read(dev, &rd, 1)) {
+      fails++;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double t = elapsed_s(&start, &end);
+  printf("%-24s %6d txn in %8.3f s, %10.1f txn/s, %d failed\n", label, iters, t, iters/t, fails);
+  return fails;
+}
+
+int find_dev(char* name) {
+  for (int dev=0; dev<I2C_NUM_DEVS; dev++) {
+    if (strcmp(name, i2c_dev_name(dev)) == 0) {
+      return dev;
+    }
+  }
+  printf("unknown device %s\n", name);
+  return -1;
+}
+
+int main(int argc, char**argv) {
+  int dev = 0;
+  int pdev = -1;
+  int iters = DEFAULT_ITERS;
+  int work_us = 0;
+
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-d") == 0 && i+1 < argc) {
+      dev = find_dev(argv[++i]);
+      if (dev < 0) {
+        usage(argv[0]);
+        return 0;
+      }
+    } else if (strcmp(argv[i], "-p") == 0 && i+1 < argc) {
+      pdev = find_dev(argv[++i]);
+      if (pdev < 0) {
+        usage(argv[0]);
+        return 0;
+      }
+    } else if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      iters = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-w") == 0 && i+1 < argc) {
+      work_us = atoi(argv[++i]);
+    } else {
+      usage(argv[0]);
+      return 0;
+    }
+  }
+
+  printf("benchmarking %d reads from %s\n", iters, i2c_dev_name(dev));
+
+  init_i2c_bus();
+  init_i2c_dev(dev);
+
+  i2c_set_mux_mode(I2C_MUX_USER);
+  i2c_set_mux_verify_period(1);
+  run("user mux, verify all", dev, iters);
+
+  i2c_set_mux_verify_period(BENCH_VERIFY_PERIOD);
+  run("user mux, sampled verify", dev, iters);
+  i2c_set_mux_verify_period(I2C_MUX_VERIFY_PERIOD);
+
+  i2c_set_mux_mode(I2C_MUX_KERNEL);
+  run("kernel mux", dev, iters);
+
+  if (pdev >= 0) {
+    if (i2c_dev_bus(pdev) == i2c_dev_bus(dev)) {
+      printf("%s and %s are on the same bus, skipping parallel run\n", i2c_dev_name(dev), i2c_dev_name(pdev));
+    } else {
+      init_i2c_dev(pdev);
+      i2c_set_mux_mode(I2C_MUX_USER);
+      run_parallel(dev, pdev, iters);
+      close_i2c_dev(pdev);
+    }
+  }
+
+  if (work_us > 0) {
+    i2c_set_mux_mode(I2C_MUX_USER);
+    run_async(dev, iters, work_us);
+  }
+
+  i2c_dump_stats(stdout);
+
+  close_i2c_dev(dev);
+  close_i2c_bus();
+
+  return 0;
+}
@@ -0,0 +1,805 @@
+#define _GNU_SOURCE // ppoll, accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h> // uint8_t, uint16_t
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>   // clock_gettime
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "alpaca_broker.h"
+#include "alpaca_log.h"
+
+/*
+ * I2C bus broker daemon
+ *
+ * Owns the physical i2c buses and runs the transactions of every tool started
+ * with ALPACA_I2C_BROKER set (see alpaca_broker.h). The buses are opened with
+ * `init_i2c_bus` as any tool would, so ALPACA_SIM and ALPACA_TRACE work here
+ * too. The broker is the only master so it tracks the mux channels itself and
+ * never reads a mux back.
+ *
+ * Scheduling, per bus, every time the bus goes idle:
+ *
+ *   - a client holding a session (i2c_lock_dev) on the bus is the only one
+ *     served until it unlocks or disconnects
+ *   - for the grace time (-g) after a PLL class transfer only PLL class
+ *     requests and the client that made the transfer are eligible, a
+ *     reprogram issues its writes back to back and each must find the bus
+ *     free
+ *   - a client of a budgeted class (-b) that has spent more than its share of
+ *     bus time waits until its token bucket is back above zero. The bucket
+ *     fills at the budget share of real time up to BUDGET_BURST_US and is
+ *     charged the measured time of the client's transfers. PLL is never
+ *     budgeted.
+ *   - of the eligible requests the lowest class goes first, oldest first in a
+ *     class, and the other eligible requests of that class for the bus are
+ *     coalesced into the same I2C_RDWR, a STOP after each request and the mux
+ *     selects between them, up to I2C_RDWR_IOCTL_MAX_MSGS messages. Coalescing
+ *     needs an adapter with I2C_FUNC_PROTOCOL_MANGLING. If a coalesced transfer
+ *     fails its requests are rerun one by one so only the failing one sees it.
+ *
+ * Per class statistics are printed on SIGUSR1 and at exit.
+ */
+
+#define MAX_CLIENTS 64
+#define MAX_MUXES 8
+#define MAX_ENDPOINTS (I2C_NUM_BUSES + I2C_NUM_DEVS)
+
+#define DEFAULT_GRACE_US 2000
+#define BUDGET_BURST_US 20000
+#define BUDGET_NONE 100        // a 100% share is no budget
+
+#define REQ_MAX (sizeof(BrokerReq) + BROKER_MAX_MSGS*sizeof(BrokerMsg) + BROKER_MAX_DATA)
+
+#define X(name, dev) dev,
+static I2CSlave devs[] = { I2C_DEVICES_MAP };
+#undef X
+
+// what a handle from BROKER_OPEN addresses
+typedef struct endpoint {
+  const char *path;
+  int bus;
+  uint8_t mux_addr;   // 0xff for the bus itself and devices not behind a mux
+  uint8_t mux_sel;
+} Endpoint;
+
+typedef struct mux_state {
+  int bus;
+  uint8_t addr;
+  uint8_t cur_sel;
+  uint8_t valid;
+} MuxState;
+
+typedef struct bus_state {
+  int *fd;
+  int stop_ok;        // adapter can put a STOP between messages
+  int session;        // client holding the bus, -1 if none
+  uint64_t pll_until; // only PLL class until then
+  int pll_client;     // client the grace time is for, not held off by it
+} BusState;
+
+typedef struct client {
+  int sock;           // -1 for a free slot
+  int pending;        // a request waits to run
+  uint64_t seq;       // arrival order of the pending request
+  uint64_t enq_us;
+  uint8_t held;       // pending request was held off by a grace time or budget
+  int64_t tokens_us;
+  uint64_t refill_us;
+  // the pending request as received and as decoded
+  uint8_t req[REQ_MAX];
+  int req_len;
+  int bus;
+  Endpoint *ep;
+  struct i2c_msg msgs[BROKER_MAX_MSGS];
+  int nmsgs;
+  uint32_t weight;    // bytes on the wire, splits a coalesced transfer's time
+  uint8_t rdata[BROKER_MAX_DATA];
+  int rlen;
+} Client;
+
+typedef struct class_stats {
+  uint64_t requests;
+  uint64_t transfers;   // I2C_RDWR issued, a coalesced one counts once
+  uint64_t coalesced;   // requests that shared a transfer with an earlier one
+  uint64_t held;        // requests held off by a grace time or budget
+  uint64_t wait_us;
+  uint64_t wait_max_us;
+  uint64_t bus_us;
+} ClassStats;
+
+#define REQ(c) ((BrokerReq*) (c)->req)
+
+static const char* class_names[I2C_NUM_PRIOS] = { "pll", "normal", "poll" };
+
+static Endpoint endpoints[MAX_ENDPOINTS];
+static int num_endpoints = 0;
+static MuxState muxes[MAX_MUXES];
+static int num_muxes = 0;
+static BusState buses[I2C_NUM_BUSES] = { { &fd_i2c0, 0, -1, 0, -1 }, { &fd_i2c1, 0, -1, 0, -1 } };
+static Client clients[MAX_CLIENTS];
+static uint64_t next_seq = 0;
+
+static uint32_t grace_us = DEFAULT_GRACE_US;
+static uint32_t budget_pct[I2C_NUM_PRIOS] = { BUDGET_NONE, BUDGET_NONE, 10 };
+static ClassStats stats[I2C_NUM_PRIOS];
+
+static volatile sig_atomic_t quit = 0;
+static volatile sig_atomic_t dump = 0;
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000ull + ts.tv_nsec/1000;
+}
+
+void usage(char* name) {
+  printf("%s [-s <socket path>] [-g <pll grace us>] [-b <class>=<percent of bus time>]\n", name);
+  printf("classes: pll normal poll, defaults -g %d -b poll=%d\n", DEFAULT_GRACE_US, budget_pct[I2C_PRIO_POLL]);
+}
+
+/*
+ * Endpoints and muxes
+ */
+static void add_endpoints() {
+  const char *bus_paths[I2C_NUM_BUSES] = { I2C0_DEV_PATH, I2C1_DEV_PATH };
+
+  // handles 0 and 1 are the buses
+  for (int b=0; b<I2C_NUM_BUSES; b++) {
+    endpoints[num_endpoints++] = (Endpoint) { bus_paths[b], b, 0xff, 0 };
+  }
+
+  // then the mux child adapters, several devices can share one
+  for (int i=0; i<I2C_NUM_DEVS; i++) {
+    int bus = (devs[i].parent_fd == &fd_i2c0) ? 0 : 1;
+    int found = 0;
+
+    if (devs[i].mux_addr == 0xff) {
+      continue;
+    }
+    for (int e=I2C_NUM_BUSES; e<num_endpoints; e++) {
+      found |= (strcmp(endpoints[e].path, devs[i].dev_path) == 0);
+    }
+    if (!found) {
+      endpoints[num_endpoints++] = (Endpoint) { devs[i].dev_path, bus, devs[i].mux_addr, devs[i].mux_sel };
+    }
+
+    found = 0;
+    for (int m=0; m<num_muxes; m++) {
+      found |= (muxes[m].bus == bus && muxes[m].addr == devs[i].mux_addr);
+    }
+    if (!found && num_muxes < MAX_MUXES) {
+      muxes[num_muxes++] = (MuxState) { bus, devs[i].mux_addr, 0, 0 };
+    }
+  }
+}
+
+static int find_endpoint(const char *path) {
+  // a mux child can have the path of a bus on another board (/dev/i2c-1 on the
+  // rfsoc2x2), the platform table wins
+  for (int e=num_endpoints-1; e>=0; e--) {
+    if (strcmp(endpoints[e].path, path) == 0) {
+      return e;
+    }
+  }
+  return -1;
+}
+
+static MuxState* find_mux(int bus, uint8_t addr) {
+  for (int m=0; m<num_muxes; m++) {
+    if (muxes[m].bus == bus && muxes[m].addr == addr) {
+      return &muxes[m];
+    }
+  }
+  return NULL;
+}
+
+static void invalidate_muxes(int bus) {
+  for (int m=0; m<num_muxes; m++) {
+    if (muxes[m].bus == bus) {
+      muxes[m].valid = 0;
+    }
+  }
+}
+
+/*
+ * Replies
+ */
+static void reply(Client *c, int32_t ret, int32_t err, uint64_t funcs, int rlen) {
+  BrokerRep rep = { ret, err, funcs };
+  struct iovec iov[2] = { { &rep, sizeof(rep) }, { c->rdata, rlen } };
+  struct msghdr mh;
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = (rlen > 0) ? 2 : 1;
+  if (sendmsg(c->sock, &mh, MSG_NOSIGNAL) < 0) {
+    LOG_DEBUG("could not reply to client %d\n", (int) (c - clients));
+  }
+}
+
+static void drop_client(Client *c) {
+  int id = c - clients;
+
+  for (int b=0; b<I2C_NUM_BUSES; b++) {
+    if (buses[b].session == id) {
+      buses[b].session = -1;
+    }
+  }
+  close(c->sock);
+  c->sock = -1;
+  c->pending = 0;
+}
+
+/*
+ * Decode a RDWR request in place. The write messages point into the request,
+ * the read messages into `rdata`, ready for the ioctl.
+ */
+static int decode_rdwr(Client *c, BrokerReq *req) {
+  BrokerMsg *bm = (BrokerMsg*) (c->req + sizeof(BrokerReq));
+  uint8_t *wdata = (uint8_t*) &bm[req->nmsgs];
+  int wlen = 0;
+
+  if (req->nmsgs == 0 || req->nmsgs > BROKER_MAX_MSGS
+      || c->req_len < (int) (sizeof(BrokerReq) + req->nmsgs*sizeof(BrokerMsg))) {
+    return -1;
+  }
+  c->nmsgs = req->nmsgs;
+  c->rlen = 0;
+  c->weight = 0;
+  for (int i=0; i<c->nmsgs; i++) {
+    c->msgs[i].addr = bm[i].addr;
+    c->msgs[i].flags = bm[i].flags;
+    c->msgs[i].len = bm[i].len;
+    if (bm[i].flags & I2C_M_RD) {
+      if (c->rlen + bm[i].len > BROKER_MAX_DATA) {
+        return -1;
+      }
+      c->msgs[i].buf = &c->rdata[c->rlen];
+      c->rlen += bm[i].len;
+    } else {
+      c->msgs[i].buf = &wdata[wlen];
+      wlen += bm[i].len;
+    }
+    c->weight += 1 + bm[i].len;
+  }
+  if ((uint8_t*) &wdata[wlen] != c->req + c->req_len) {
+    return -1;
+  }
+  return 0;
+}
+
+// handle what came in from a client, bus work is queued and the rest answered
+static void client_request(Client *c) {
+  BrokerReq *req = REQ(c);
+  unsigned long funcs = 0;
+  int id = c - clients;
+
+  c->req_len = recv(c->sock, c->req, sizeof(c->req), 0);
+  if (c->req_len <= 0) {
+    drop_client(c);
+    return;
+  }
+  if (c->req_len < (int) sizeof(BrokerReq) || req->magic != BROKER_MAGIC || req->prio >= I2C_NUM_PRIOS) {
+    LOG_WARN("bad request from client %d\n", id);
+    drop_client(c);
+    return;
+  }
+
+  switch (req->op) {
+    case BROKER_OPEN:
+      c->req[c->req_len-1] = '\0';
+      req->handle = find_endpoint((char*) (c->req + sizeof(BrokerReq)));
+      reply(c, req->handle, ENOENT, 0, 0);
+      return;
+
+    case BROKER_CLOSE:
+      reply(c, 0, 0, 0, 0);
+      return;
+
+    case BROKER_FUNCS:
+      if (req->handle < 0 || req->handle >= num_endpoints) {
+        reply(c, -1, EBADF, 0, 0);
+        return;
+      }
+      if (i2c_get_transport()->funcs(*buses[endpoints[req->handle].bus].fd, &funcs) < 0) {
+        reply(c, -1, errno, 0, 0);
+        return;
+      }
+      reply(c, 0, 0, funcs, 0);
+      return;
+
+    case BROKER_UNLOCK:
+      if (req->handle >= 0 && req->handle < I2C_NUM_BUSES && buses[req->handle].session == id) {
+        buses[req->handle].session = -1;
+      }
+      reply(c, 0, 0, 0, 0);
+      return;
+
+    case BROKER_LOCK:
+      if (req->handle < 0 || req->handle >= I2C_NUM_BUSES) {
+        reply(c, -1, EINVAL, 0, 0);
+        return;
+      }
+      c->bus = req->handle;
+      c->ep = NULL;
+      c->weight = 0;
+      break;
+
+    case BROKER_RDWR:
+      if (req->handle < 0 || req->handle >= num_endpoints) {
+        reply(c, -1, EBADF, 0, 0);
+        return;
+      }
+      if (decode_rdwr(c, req) < 0) {
+        reply(c, -1, EINVAL, 0, 0);
+        return;
+      }
+      c->ep = &endpoints[req->handle];
+      c->bus = c->ep->bus;
+      break;
+
+    default:
+      reply(c, -1, EINVAL, 0, 0);
+      return;
+  }
+
+  c->pending = 1;
+  c->held = 0;
+  c->seq = next_seq++;
+  c->enq_us = now_us();
+  stats[req->prio].requests++;
+}
+
+/*
+ * Scheduling
+ */
+static void refill(Client *c, uint8_t prio, uint64_t now) {
+  int64_t burst = BUDGET_BURST_US;
+
+  if (budget_pct[prio] >= BUDGET_NONE) {
+    return;
+  }
+  c->tokens_us += (int64_t) ((now - c->refill_us)*budget_pct[prio]/100);
+  c->tokens_us = (c->tokens_us > burst) ? burst : c->tokens_us;
+  c->refill_us = now;
+}
+
+/*
+ * Whether the pending request of `c` may run on its bus now, if not `wake` is
+ * lowered to when it might
+ */
+static int eligible(Client *c, uint64_t now, uint64_t *wake) {
+  BusState *bus = &buses[c->bus];
+  BrokerReq *req = REQ(c);
+  int id = c - clients;
+
+  if (bus->session >= 0) {
+    return bus->session == id && req->op == BROKER_RDWR;
+  }
+
+  if (req->prio != I2C_PRIO_PLL && now < bus->pll_until && bus->pll_client != id) {
+    c->held = 1;
+    *wake = (bus->pll_until < *wake) ? bus->pll_until : *wake;
+    return 0;
+  }
+
+  refill(c, req->prio, now);
+  if (budget_pct[req->prio] < BUDGET_NONE && c->tokens_us < 0) {
+    uint64_t at = now + (budget_pct[req->prio] ? (-c->tokens_us)*100/budget_pct[req->prio] + 1 : 1000000);
+    c->held = 1;
+    *wake = (at < *wake) ? at : *wake;
+    return 0;
+  }
+  return 1;
+}
+
+// a request leaves the queue, `bus_time` is its share of the transfer
+static void account(Client *c, uint64_t start, uint64_t bus_time) {
+  BrokerReq *req = REQ(c);
+  ClassStats *st = &stats[req->prio];
+  uint64_t wait = start - c->enq_us;
+
+  st->wait_us += wait;
+  st->wait_max_us = (wait > st->wait_max_us) ? wait : st->wait_max_us;
+  st->bus_us += bus_time;
+  st->held += c->held;
+  if (budget_pct[req->prio] < BUDGET_NONE) {
+    c->tokens_us -= bus_time;
+  }
+  c->pending = 0;
+}
+
+/*
+ * Add the messages of `c` to a transfer being built, after a channel select if
+ * its device is on another mux channel than `plan` (the mux states the
+ * transfer leaves behind so far) says. Returns the new message count, or -1 if
+ * it does not fit.
+ */
+static int append(Client *c, struct i2c_msg *msgs, int n, MuxState *plan, uint8_t *sel_buf) {
+  Endpoint *ep = c->ep;
+  MuxState *mux = (ep->mux_addr != 0xff) ? find_mux(ep->bus, ep->mux_addr) : NULL;
+  MuxState *p = (mux != NULL) ? &plan[mux - muxes] : NULL;
+  int need = (p != NULL && !(p->valid && p->cur_sel == ep->mux_sel));
+
+  if (n + need + c->nmsgs > I2C_RDWR_IOCTL_MAX_MSGS) {
+    return -1;
+  }
+  if (need) {
+    *sel_buf = ep->mux_sel;
+    msgs[n].addr = ep->mux_addr;
+    msgs[n].flags = I2C_M_STOP;
+    msgs[n].len = 1;
+    msgs[n].buf = sel_buf;
+    n++;
+    p->cur_sel = ep->mux_sel;
+    p->valid = 1;
+  }
+  memcpy(&msgs[n], c->msgs, c->nmsgs*sizeof(struct i2c_msg));
+  return n + c->nmsgs;
+}
+
+// run one request by itself, the select as its own transfer if the adapter
+// cannot STOP between messages
+static int run_one(Client *c) {
+  BusState *bus = &buses[c->bus];
+  Endpoint *ep = c->ep;
+  struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS+1];
+  MuxState plan[MAX_MUXES];
+  uint8_t sel_buf = ep->mux_sel;
+  int n;
+
+  memcpy(plan, muxes, sizeof(plan));
+  n = append(c, msgs, 0, plan, &sel_buf);
+  if (n > c->nmsgs && !bus->stop_ok) {
+    if (i2c_rdwr(*bus->fd, msgs, 1) != 0) {
+      invalidate_muxes(c->bus);
+      return -1;
+    }
+    memmove(msgs, &msgs[1], c->nmsgs*sizeof(struct i2c_msg));
+    n--;
+  }
+
+  if (i2c_rdwr(*bus->fd, msgs, n) != 0) {
+    invalidate_muxes(c->bus);
+    return -1;
+  }
+  memcpy(muxes, plan, sizeof(plan));
+
+  // a client talking to the bus itself may have switched a mux
+  if (ep == &endpoints[c->bus]) {
+    for (int i=0; i<c->nmsgs; i++) {
+      if (!(c->msgs[i].flags & I2C_M_RD) && find_mux(c->bus, c->msgs[i].addr) != NULL) {
+        invalidate_muxes(c->bus);
+      }
+    }
+  }
+  return 0;
+}
+
+// run the next group on a bus, returns 1 if anything ran
+static int dispatch(int b, uint64_t now, uint64_t *wake) {
+  BusState *bus = &buses[b];
+  Client *group[I2C_RDWR_IOCTL_MAX_MSGS];
+  struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+  uint8_t sel_bufs[I2C_RDWR_IOCTL_MAX_MSGS];
+  MuxState plan[MAX_MUXES];
+  I2CMuxStats ms;
+  Client *head = NULL;
+  uint64_t start, end, weight = 0;
+  uint32_t handoffs;
+  int ngroup = 0;
+  int n = 0;
+  int prio;
+
+  // lowest class, then oldest
+  for (int i=0; i<MAX_CLIENTS; i++) {
+    Client *c = &clients[i];
+    if (c->sock < 0 || !c->pending || c->bus != b || !eligible(c, now, wake)) {
+      continue;
+    }
+    if (head == NULL || REQ(c)->prio < REQ(head)->prio
+        || (REQ(c)->prio == REQ(head)->prio && c->seq < head->seq)) {
+      head = c;
+    }
+  }
+  if (head == NULL) {
+    return 0;
+  }
+  prio = REQ(head)->prio;
+  start = now_us();
+
+  if (REQ(head)->op == BROKER_LOCK) {
+    bus->session = head - clients;
+    account(head, start, 0);
+    reply(head, 0, 0, 0, 0);
+    return 1;
+  }
+
+  // coalesce the class's other eligible requests for devices on this bus, in
+  // arrival order
+  group[ngroup++] = head;
+  if (bus->stop_ok && head->ep != &endpoints[b] && bus->session < 0) {
+    for (int i=0; i<MAX_CLIENTS && ngroup < I2C_RDWR_IOCTL_MAX_MSGS; i++) {
+      Client *c = &clients[i];
+      if (c == head || c->sock < 0 || !c->pending || c->bus != b || REQ(c)->op != BROKER_RDWR
+          || REQ(c)->prio != prio || c->ep == &endpoints[b] || !eligible(c, now, wake)) {
+        continue;
+      }
+      group[ngroup++] = c;
+    }
+    for (int i=1; i<ngroup; i++) {
+      for (int j=i; j>0 && group[j]->seq < group[j-1]->seq; j--) {
+        Client *t = group[j];
+        group[j] = group[j-1];
+        group[j-1] = t;
+      }
+    }
+  }
+
+  // tools that bypass the broker still take the lock files, if one had the bus
+  // the muxes are not what we left them
+  i2c_get_mux_stats(&ms);
+  handoffs = ms.handoffs;
+  i2c_lock_buses(1 << b);
+  i2c_get_mux_stats(&ms);
+  if (ms.handoffs != handoffs) {
+    invalidate_muxes(b);
+  }
+
+  if (ngroup > 1) {
+    int fit = 0;
+    memcpy(plan, muxes, sizeof(plan));
+    for (int g=0; g<ngroup; g++) {
+      int m = append(group[g], msgs, n, plan, &sel_bufs[g]);
+      if (m < 0) {
+        break;
+      }
+      n = m;
+      msgs[n-1].flags |= I2C_M_STOP;
+      weight += group[g]->weight;
+      fit++;
+    }
+    ngroup = fit;
+  }
+
+  if (ngroup > 1) {
+    msgs[n-1].flags &= ~I2C_M_STOP;
+    if (i2c_rdwr(*bus->fd, msgs, n) == 0) {
+      end = now_us();
+      i2c_unlock_buses(1 << b);
+      memcpy(muxes, plan, sizeof(plan));
+      stats[prio].transfers++;
+      stats[prio].coalesced += ngroup - 1;
+      for (int g=0; g<ngroup; g++) {
+        account(group[g], start, (end - start)*group[g]->weight/weight);
+        reply(group[g], group[g]->nmsgs, 0, 0, group[g]->rlen);
+      }
+      if (prio == I2C_PRIO_PLL) {
+        bus->pll_until = end + grace_us;
+        bus->pll_client = (ngroup == 1) ? head - clients : -1;
+      }
+      return 1;
+    }
+    invalidate_muxes(b);
+    LOG_DEBUG("coalesced transfer of %d requests failed, running them one by one\n", ngroup);
+  }
+
+  end = start;
+  for (int g=0; g<ngroup; g++) {
+    uint64_t t0 = now_us();
+    int ret = run_one(group[g]);
+    int err = errno;
+    end = now_us();
+    stats[prio].transfers++;
+    account(group[g], start, end - t0);
+    reply(group[g], (ret < 0) ? -1 : group[g]->nmsgs, (ret < 0) ? err : 0, 0, (ret < 0) ? 0 : group[g]->rlen);
+  }
+  i2c_unlock_buses(1 << b);
+  if (prio == I2C_PRIO_PLL) {
+    bus->pll_until = end + grace_us;
+    bus->pll_client = (ngroup == 1) ? head - clients : -1;
+  }
+  return 1;
+}
+
+static void dump_stats(FILE *f) {
+  fprintf(f, "%-7s %9s %9s %9s %9s %11s %11s %11s\n", "class", "requests", "transfers", "coalesced", "held",
+          "avg wait us", "max wait us", "bus ms");
+  for (int p=0; p<I2C_NUM_PRIOS; p++) {
+    ClassStats *st = &stats[p];
+    uint64_t done = st->requests ? st->requests : 1;
+    fprintf(f, "%-7s %9llu %9llu %9llu %9llu %11llu %11llu %11llu\n", class_names[p],
+            (unsigned long long) st->requests, (unsigned long long) st->transfers,
+            (unsigned long long) st->coalesced, (unsigned long long) st->held,
+            (unsigned long long) (st->wait_us/done), (unsigned long long) st->wait_max_us,
+            (unsigned long long) (st->bus_us/1000));
+  }
+  fflush(f);
+}
+
+static void on_signal(int sig) {
+  if (sig == SIGUSR1) {
+    dump = 1;
+  } else {
+    quit = 1;
+  }
+}
+
+static int parse_budget(char *arg) {
+  char *eq = strchr(arg, '=');
+  if (eq == NULL) {
+    return -1;
+  }
+  *eq = '\0';
+  for (int p=I2C_PRIO_NORMAL; p<I2C_NUM_PRIOS; p++) {
+    if (strcmp(arg, class_names[p]) == 0) {
+      budget_pct[p] = atoi(eq+1);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int open_listener(const char *path) {
+  struct sockaddr_un sa;
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+  if (sock < 0) {
+    return -1;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, path, sizeof(sa.sun_path)-1);
+  unlink(path);
+  if (bind(sock, (struct sockaddr*) &sa, sizeof(sa)) < 0 || listen(sock, MAX_CLIENTS) < 0) {
+    close(sock);
+    return -1;
+  }
+  chmod(path, 0666);
+  return sock;
+}
+
+int main(int argc, char**argv) {
+  const char *path = broker_sock_path();
+  struct pollfd pfds[MAX_CLIENTS+1];
+  int owner[MAX_CLIENTS+1];
+  struct sigaction sa;
+  unsigned long funcs;
+  int listener;
+
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+      path = argv[++i];
+    } else if (strcmp(argv[i], "-g") == 0 && i+1 < argc) {
+      grace_us = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-b") == 0 && i+1 < argc) {
+      if (parse_budget(argv[++i]) < 0) {
+        usage(argv[0]);
+        return 0;
+      }
+    } else {
+      usage(argv[0]);
+      return 0;
+    }
+  }
+
+  // the broker itself goes to the buses
+  unsetenv("ALPACA_I2C_BROKER");
+  i2c_set_mux_mode(I2C_MUX_USER);
+  if (init_i2c_bus() != 0) {
+    return 1;
+  }
+  for (int b=0; b<I2C_NUM_BUSES; b++) {
+    if (i2c_get_transport()->funcs(*buses[b].fd, &funcs) == 0) {
+      buses[b].stop_ok = (funcs & I2C_FUNC_PROTOCOL_MANGLING) ? 1 : 0;
+    }
+  }
+  add_endpoints();
+
+  listener = open_listener(path);
+  if (listener < 0) {
+    LOG_ERROR("could not listen on %s\n", path);
+    return 1;
+  }
+  for (int i=0; i<MAX_CLIENTS; i++) {
+    clients[i].sock = -1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  printf("i2c broker on %s (%s), pll grace %u us, budgets normal %u%% poll %u%%\n", path,
+         i2c_get_transport()->name, grace_us, budget_pct[I2C_PRIO_NORMAL], budget_pct[I2C_PRIO_POLL]);
+  fflush(stdout);
+
+  while (!quit) {
+    uint64_t now = now_us();
+    uint64_t wake = UINT64_MAX;
+    struct timespec ts, *tsp = NULL;
+    int ran = 0;
+    int nfds = 0;
+
+    // one group per bus per round so new arrivals are seen in between
+    for (int b=0; b<I2C_NUM_BUSES; b++) {
+      ran |= dispatch(b, now, &wake);
+    }
+
+    if (ran) {
+      ts = (struct timespec) { 0, 0 };
+      tsp = &ts;
+    } else if (wake != UINT64_MAX) {
+      uint64_t dt = (wake > now) ? wake - now : 0;
+      ts = (struct timespec) { dt/1000000, (dt%1000000)*1000 };
+      tsp = &ts;
+    }
+
+    pfds[nfds] = (struct pollfd) { listener, POLLIN, 0 };
+    owner[nfds++] = -1;
+    for (int i=0; i<MAX_CLIENTS; i++) {
+      // a client has one request in flight, read the next once it is answered
+      if (clients[i].sock >= 0 && !clients[i].pending) {
+        pfds[nfds] = (struct pollfd) { clients[i].sock, POLLIN, 0 };
+        owner[nfds++] = i;
+      }
+    }
+
+    if (ppoll(pfds, nfds, tsp, NULL) < 0 && errno != EINTR) {
+      LOG_ERROR("poll failed\n");
+      break;
+    }
+    if (dump) {
+      dump = 0;
+      dump_stats(stdout);
+    }
+
+    for (int f=0; f<nfds; f++) {
+      if (pfds[f].revents == 0) {
+        continue;
+      }
+      if (owner[f] >= 0) {
+        client_request(&clients[owner[f]]);
+        continue;
+      }
+      int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+      if (sock < 0) {
+        continue;
+      }
+      int slot = -1;
+      for (int i=0; i<MAX_CLIENTS && slot < 0; i++) {
+        slot = (clients[i].sock < 0) ? i : -1;
+      }
+      if (slot < 0) {
+        LOG_WARN("too many clients\n");
+        close(sock);
+        continue;
+      }
+      clients[slot].sock = sock;
+      clients[slot].pending = 0;
+      clients[slot].tokens_us = BUDGET_BURST_US;
+      clients[slot].refill_us = now_us();
+    }
+  }
+
+  dump_stats(stdout);
+  for (int i=0; i<MAX_CLIENTS; i++) {
+    if (clients[i].sock >= 0) {
+      close(clients[i].sock);
+    }
+  }
+  close(listener);
+  unlink(path);
+  close_i2c_bus();
+  return 0;
+}
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h> // uint8_t, uint16_t
+#include <unistd.h> // fork, pipe
+#include <time.h>   // clock_gettime
+
+#include <sys/wait.h>
+
+#include "alpaca_i2c_utils.h"
+
+/*
+ * Benchmark cross-process contention on one i2c bus
+ *
+ * Forks one process per device given (-d, all on the same bus and usually
+ * behind the same mux), as when prg_pll, the SFP probes and the status tools
+ * run at once. Each process runs operations of -k back-to-back register reads
+ * from its device, e.g., a readback. The same load is timed three ways:
+ *
+ *   unlocked          no bus locks, as before
+ *   txn lock          the bus lock taken around every transaction
+ *   op lock           the bus lock held across each whole operation
+ *
+ * and the operation latency percentiles, the retries and failures from the
+ * device telemetry and the mux selects and lock handoffs are printed for each.
+ *
+ * Without hardware run it on the simulator with the processes sharing its mux
+ * state, e.g., ALPACA_SIM=1 ALPACA_SIM_I2C_HZ=400000 ALPACA_LOCK_DIR=/tmp.
+ */
+
+#define MAX_PROCS 8
+#define DEFAULT_OPS 200
+#define DEFAULT_OP_LEN 16
+
+typedef enum lock_mode {
+  MODE_UNLOCKED,
+  MODE_TXN_LOCK,
+  MODE_OP_LOCK
+} LockMode;
+
+static const char* mode_names[] = { "unlocked", "txn lock", "op lock" };
+
+// what each child sends back ahead of its operation latencies
+typedef struct proc_result {
+  uint32_t retries;
+  uint32_t failures;     // operations with a failed read
+  uint32_t mismatches;
+  uint32_t sel_writes;
+  uint32_t handoffs;
+} ProcResult;
+
+void usage(char* name) {
+  printf("%s -d <device> -d <device> [-d ...] [-n <ops per process>] [-k <reads per op>]\n", name);
+  printf("devices:\n");
+  for (int i=0; i<I2C_NUM_DEVS; i++) {
+    printf("  %s\n", i2c_dev_name(i));
+  }
+}
+
+int find_dev(char* name) {
+  for (int dev=0; dev<I2C_NUM_DEVS; dev++) {
+    if (strcmp(name, i2c_dev_name(dev)) == 0) {
+      return dev;
+    }
+  }
+  printf("unknown device %s\n", name);
+  return -1;
+}
+
+static uint32_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000ull + ts.tv_nsec/1000;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t*) a;
+  uint32_t y = *(const uint32_t*) b;
+  return (x > y) - (x < y);
+}
+
+// child: run the operations and write the result and latencies to `out`
+static void run_proc(I2CDev dev, LockMode mode, int ops, int op_len, int out) {
+  uint32_t *lat = malloc(ops*sizeof(uint32_t));
+  ProcResult res;
+  I2CDevStats st;
+  I2CMuxStats ms;
+  uint8_t reg = 0;
+  uint8_t rd;
+
+  memset(&res, 0, sizeof(res));
+  i2c_reset_stats();
+  i2c_set_bus_locking(mode != MODE_UNLOCKED);
+
+  for (int o=0; o<ops; o++) {
+    int failed = 0;
+    uint32_t start = now_us();
+
+    if (mode == MODE_OP_LOCK) {
+      i2c_lock_dev(dev);
+    }
+    for (int k=0; k<op_len; k++) {
+      if (i2c_read_regs(dev, &reg, 1, &rd, 1)) {
+        failed = 1;
+      }
+    }
+    if (mode == MODE_OP_LOCK) {
+      i2c_unlock_dev(dev);
+    }
+
+    lat[o] = now_us() - start;
+    res.failures += failed;
+  }
+
+  i2c_get_dev_stats(dev, &st);
+  i2c_get_mux_stats(&ms);
+  res.retries = st.retries;
+  res.mismatches = st.mux_mismatches;
+  res.sel_writes = ms.sel_writes;
+  res.handoffs = ms.handoffs;
+
+  write(out, &res, sizeof(res));
+  write(out, lat, ops*sizeof(uint32_t));
+  free(lat);
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = read(fd, (uint8_t*) buf + got, len - got);
+    if (n <= 0) {
+      return -1;
+    }
+    got += n;
+  }
+  return 0;
+}
+
+static void run_mode(LockMode mode, int *devs, int nprocs, int ops, int op_len) {
+  uint32_t *lat = malloc(nprocs*ops*sizeof(uint32_t));
+  ProcResult total, res;
+  int pipes[MAX_PROCS];
+  pid_t pids[MAX_PROCS];
+  int nlat = 0;
+
+  memset(&total, 0, sizeof(total));
+
+  for (int p=0; p<nprocs; p++) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+      printf("could not create pipe\n");
+      exit(1);
+    }
+    pids[p] = fork();
+    if (pids[p] == 0) {
+      close(fds[0]);
+      run_proc(devs[p], mode, ops, op_len, fds[1]);
+      close(fds[1]);
+      _exit(0);
+    }
+    close(fds[1]);
+    pipes[p] = fds[0];
+  }
+
+  for (int p=0; p<nprocs; p++) {
+    if (read_all(pipes[p], &res, sizeof(res)) == 0 && read_all(pipes[p], &lat[nlat], ops*sizeof(uint32_t)) == 0) {
+      nlat += ops;
+      total.retries += res.retries;
+      total.failures += res.failures;
+      total.mismatches += res.mismatches;
+      total.sel_writes += res.sel_writes;
+      total.handoffs += res.handoffs;
+    } else {
+      printf("lost results from process %d\n", p);
+    }
+    close(pipes[p]);
+    waitpid(pids[p], NULL, 0);
+  }
+
+  if (nlat > 0) {
+    qsort(lat, nlat, sizeof(uint32_t), cmp_u32);
+    printf("%-10s %6d %9u %9u %9u %8u %8u %9u %8u %8u\n", mode_names[mode], nlat,
+           lat[nlat/2], lat[(nlat*99)/100], lat[nlat-1],
+           total.retries, total.mismatches, total.failures, total.sel_writes, total.handoffs);
+  }
+  free(lat);
+}
+
+int main(int argc, char**argv) {
+  int devs[MAX_PROCS];
+  int nprocs = 0;
+  int ops = DEFAULT_OPS;
+  int op_len = DEFAULT_OP_LEN;
+
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-d") == 0 && i+1 < argc && nprocs < MAX_PROCS) {
+      devs[nprocs] = find_dev(argv[++i]);
+      if (devs[nprocs] < 0) {
+        usage(argv[0]);
+        return 0;
+      }
+      nprocs++;
+    } else if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      ops = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-k") == 0 && i+1 < argc) {
+      op_len = atoi(argv[++i]);
+    } else {
+      usage(argv[0]);
+      return 0;
+    }
+  }
+
+  if (nprocs < 2 || ops < 1 || op_len < 1) {
+    usage(argv[0]);
+    return 0;
+  }
+  for (int p=1; p<nprocs; p++) {
+    if (i2c_dev_bus(devs[p]) != i2c_dev_bus(devs[0])) {
+      printf("%s is not on the bus of %s\n", i2c_dev_name(devs[p]), i2c_dev_name(devs[0]));
+      return 0;
+    }
+  }
+
+  init_i2c_bus();
+  for (int p=0; p<nprocs; p++) {
+    init_i2c_dev(devs[p]);
+  }
+
+  printf("%d processes, %d operations of %d reads each\n", nprocs, ops, op_len);
+  printf("%-10s %6s %9s %9s %9s %8s %8s %9s %8s %8s\n", "mode", "ops", "p50 us", "p99 us", "max us",
+         "retries", "mismatch", "failed op", "selects", "handoffs");
+  run_mode(MODE_UNLOCKED, devs, nprocs, ops, op_len);
+  run_mode(MODE_TXN_LOCK, devs, nprocs, ops, op_len);
+  run_mode(MODE_OP_LOCK, devs, nprocs, ops, op_len);
+
+  for (int p=0; p<nprocs; p++) {
+    close_i2c_dev(devs[p]);
+  }
+  close_i2c_bus();
+
+  return 0;
+}
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h> // uint8_t, uint16_t
+#include <unistd.h> // dup, dup2
+#include <time.h>   // clock_gettime
+
+#include <sys/fcntl.h>
+
+#include "alpaca_i2c_utils.h"
+#include "alpaca_rfclks.h"
+
+/*
+ * Benchmark the i2c retry policies under injected faults
+ *
+ * Programs a full LMK plan from a TICS Pro file a number of times under each
+ * retry policy (immediate, linear, exponential and jittered backoff, or the one
+ * given with -r) for the bridge of the platform's LMK, with a fraction of the
+ * transactions made to NACK, lose arbitration or read back corrupted data
+ * (see `i2c_set_fault`). For each policy the mean, median, 99th percentile and
+ * worst time to program the plan are printed with the failed loads and the
+ * retries spent.
+ *
+ * The same seed is used for every policy so each sees the same fault sequence
+ * as long as it makes the same transactions. Best run on the simulator
+ * (ALPACA_SIM=1), on hardware this reprograms the LMK each run.
+ */
+
+#if PLATFORM == ZRF16
+  #define BENCH_LMK_DEV I2C_DEV_LMK_SPI_BRIDGE
+#elif (PLATFORM == ZCU216) | (PLATFORM == ZCU208)
+  #define BENCH_LMK_DEV I2C_DEV_CLK104
+#else
+  #define BENCH_LMK_DEV I2C_DEV_PLL_SPI_BRIDGE
+#endif
+
+#define DEFAULT_RUNS 20
+#define DEFAULT_SEED 1
+#define MAX_POLICIES 4
+
+typedef struct {
+  const char *name;
+  I2CRetryPolicy policy;
+} BenchPolicy;
+
+static BenchPolicy policies[MAX_POLICIES] = {
+  { "immediate",   { I2C_BACKOFF_IMMEDIATE,   8, 0,   0    } },
+  { "linear",      { I2C_BACKOFF_LINEAR,      8, 100, 1000 } },
+  { "exponential", { I2C_BACKOFF_EXPONENTIAL, 8, 100, 4000 } },
+  { "jitter",      { I2C_BACKOFF_JITTER,      8, 100, 4000 } },
+};
+
+void usage(char* name) {
+  printf("%s [-n <runs>] [-nack <fraction>] [-busy <fraction>] [-corrupt <fraction>] [-s <seed>]\n", name);
+  printf("  [-r <backoff>[:tries[:base_us[:max_us]]]] <path/to/lmk/clk/file.txt>\n");
+}
+
+double elapsed_s(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec)*1e-9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+// program the plan `runs` times, prog_pll's progress output is dropped
+void run_policy(BenchPolicy *bp, I2CFault *fault, uint32_t *rp, int runs) {
+  struct timespec start, end;
+  double *t = malloc(sizeof(double)*runs);
+  double sum = 0;
+  int fails = 0;
+  I2CDevStats st;
+  I2CFaultStats fst;
+  int null_fd, out_fd;
+
+  i2c_set_retry_policy(BENCH_LMK_DEV, &bp->policy);
+  i2c_set_fault(fault);
+  i2c_reset_stats();
+
+  fflush(stdout);
+  out_fd = dup(STDOUT_FILENO);
+  null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  for (int i=0; i<runs; i++) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (prog_pll(BENCH_LMK_DEV, LMK_SDO_SS, rp, LMK_REG_CNT, LMK_PKT_SIZE) != RFCLK_SUCCESS) {
+      fails++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    t[i] = elapsed_s(&start, &end);
+    sum += t[i];
+  }
+  fflush(stdout);
+  dup2(out_fd, STDOUT_FILENO);
+  close(out_fd);
+  close(null_fd);
+
+  i2c_get_dev_stats(BENCH_LMK_DEV, &st);
+  i2c_get_fault_stats(&fst);
+  qsort(t, runs, sizeof(double), cmp_double);
+  printf("%-12s mean %8.2f ms, p50 %8.2f ms, p99 %8.2f ms, max %8.2f ms, %3d/%d failed, %5u retries, %u faults\n",
+         bp->name, 1e3*sum/runs, 1e3*t[runs/2], 1e3*t[(99*runs + 99)/100 - 1], 1e3*t[runs-1], fails, runs,
+         st.retries, fst.nacks + fst.busy + fst.corrupted);
+  free(t);
+}
+
+int main(int argc, char**argv) {
+  I2CFault fault = { 0.0, 0.0, 0.0, 0.0, DEFAULT_SEED };
+  BenchPolicy custom = { NULL };
+  char *tcsfile = NULL;
+  int runs = DEFAULT_RUNS;
+  FILE* fileptr;
+  uint32_t* rp;
+
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-nack") == 0 && i+1 < argc) {
+      fault.nack = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-busy") == 0 && i+1 < argc) {
+      fault.busy = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-corrupt") == 0 && i+1 < argc) {
+      fault.corrupt = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+      fault.seed = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-r") == 0 && i+1 < argc) {
+      custom.name = argv[++i];
+      if (i2c_parse_retry_policy(custom.name, &custom.policy) != 0) {
+        printf("bad retry policy %s\n", custom.name);
+        usage(argv[0]);
+        return 0;
+      }
+    } else if (argv[i][0] != '-' && tcsfile == NULL) {
+      tcsfile = argv[i];
+    } else {
+      usage(argv[0]);
+      return 0;
+    }
+  }
+  if (tcsfile == NULL || runs < 1 || fault.seed == 0) {
+    usage(argv[0]);
+    return 0;
+  }
+
+  fileptr = fopen(tcsfile, "r");
+  if (fileptr == NULL) {
+    printf("problem opening %s\n", tcsfile);
+    return 0;
+  }
+  rp = readtcs(fileptr, LMK_REG_CNT, 0);
+  fclose(fileptr);
+  if (rp == NULL) {
+    printf("problem allocating memory for config buffer, or parsing clock file\n");
+    return 0;
+  }
+
+  if (init_i2c_bus() != 0) {
+    free(rp);
+    return 0;
+  }
+  init_i2c_dev(BENCH_LMK_DEV);
+
+  // configure i2c-spi bridge, set SPI clock to 58 kHz as the programming tools do
+  uint8_t spi_config[2] = {0xf0, 0x03};
+  i2c_write(BENCH_LMK_DEV, spi_config, 2);
+
+  printf("programming %d LMK registers %d times per policy, faults: %.3f nack, %.3f busy, %.3f corrupt\n",
+         LMK_REG_CNT, runs, fault.nack, fault.busy, fault.corrupt);
+  if (custom.name != NULL) {
+    run_policy(&custom, &fault, rp, runs);
+  } else {
+    for (int p=0; p<MAX_POLICIES; p++) {
+      run_policy(&policies[p], &fault, rp, runs);
+    }
+  }
+
+  close_i2c_dev(BENCH_LMK_DEV);
+  close_i2c_bus();
+  free(rp);
+
+  return 0;
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h> // uint8_t, uint16_t
+#include <time.h>   // clock_gettime
+
+#include <pthread.h>
+
+#include "alpaca_i2c_utils.h"
+#include "alpaca_topology.h"
+
+/*
+ * Scan the i2c topology of the board
+ *
+ * Probes every address on both buses and behind every mux channel (see
+ * alpaca_topology.h), the two buses at the same time, prints what answered
+ * next to the platform table and saves it to the topology cache the other
+ * tools check device presence against.
+ */
+
+void usage(char* name) {
+  printf("%s [-o <topology cache path>] [-s]\n", name);
+  printf("  -s  scan the buses one after the other\n");
+}
+
+double elapsed_s(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec)*1e-9;
+}
+
+typedef struct {
+  int bus;
+  Topology topo;
+  int ret;
+} BusScan;
+
+void* scan_main(void *arg) {
+  BusScan *s = (BusScan*) arg;
+  s->ret = topo_scan_bus(s->bus, &s->topo);
+  return NULL;
+}
+
+int main(int argc, char**argv) {
+  static BusScan scans[I2C_NUM_BUSES];
+  static Topology topo;
+  struct timespec start, end;
+  pthread_t threads[I2C_NUM_BUSES];
+  int serial = 0;
+
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+      // the presence check at the end reads it back from there too
+      setenv("ALPACA_TOPOLOGY", argv[++i], 1);
+    } else if (strcmp(argv[i], "-s") == 0) {
+      serial = 1;
+    } else {
+      usage(argv[0]);
+      return 0;
+    }
+  }
+
+  if (init_i2c_bus() != 0) {
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int b=0; b<I2C_NUM_BUSES; b++) {
+    scans[b].bus = b;
+    if (serial) {
+      scan_main(&scans[b]);
+    } else if (pthread_create(&threads[b], NULL, scan_main, &scans[b]) != 0) {
+      printf("could not start scan of bus %d, scanning it here\n", b);
+      serial = 1;
+      scan_main(&scans[b]);
+    }
+  }
+  if (!serial) {
+    for (int b=0; b<I2C_NUM_BUSES; b++) {
+      pthread_join(threads[b], NULL);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  memset(&topo, 0, sizeof(topo));
+  topo.platform = scans[0].topo.platform;
+  topo.scanned = scans[0].topo.scanned;
+  for (int b=0; b<I2C_NUM_BUSES; b++) {
+    if (scans[b].ret != 0) {
+      printf("scan of bus %d failed\n", b);
+      continue;
+    }
+    topo_merge(&topo, &scans[b].topo);
+  }
+
+  for (int i=0; i<topo.ndevs; i++) {
+    TopoEntry *e = &topo.devs[i];
+    if (e->mux_addr == TOPO_ROOT) {
+      printf("bus %u                 0x%02x\n", e->bus, e->addr);
+    } else {
+      printf("bus %u mux 0x%02x ch %u  0x%02x\n", e->bus, e->mux_addr, e->channel, e->addr);
+    }
+  }
+  printf("%d devices on %d channels, %u probes in %.3f s (%s)\n", topo.ndevs, topo.nscans, topo.probes,
+         elapsed_s(&start, &end), serial ? "serial" : "parallel");
+
+  close_i2c_bus();
+
+  if (topo_save(&topo, NULL) != 0) {
+    return 1;
+  }
+
+  // the platform table against the scan
+  printf("platform devices:\n");
+  for (int d=0; d<I2C_NUM_DEVS; d++) {
+    int present = topo_dev_present(d);
+    printf("  %-24s %s\n", i2c_dev_name(d), (present > 0) ? "present" : (present == 0) ? "absent" : "unknown");
+  }
+
+  return 0;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h> // uint8_t, uint16_t
+#include <time.h>   // clock_gettime
+
+#include "alpaca_rfclks.h"
+
+/*
+ * Retune an LMX2594 without reloading it
+ *
+ * Takes the frequency fields (N, fractional numerator and denominator,
+ * CHDIV, output muxes) from a TICS Pro LMX file, each overridable on the
+ * command line, and writes only the registers that differ from what the
+ * rfpll was last programmed with followed by R0 to recalibrate the VCO (see
+ * `lmx2594_retune`). The rfpll must have been programmed with a full plan
+ * (prg_rfpll) since its last reset.
+ */
+
+#if PLATFORM == ZRF16
+  #define RETUNE_LMX_DEV I2C_DEV_LMX_SPI_BRIDGE
+#elif (PLATFORM == ZCU216) | (PLATFORM == ZCU208)
+  #define RETUNE_LMX_DEV I2C_DEV_CLK104
+#elif PLATFORM != RFSoC4x2
+  #define RETUNE_LMX_DEV I2C_DEV_PLL_SPI_BRIDGE
+#endif
+
+void usage(char* name) {
+  printf("%s -f <path/to/lmx/clk/file.txt> [-n <N>] [-num <num>] [-den <den>] [-chdiv <code>]\n", name);
+#ifdef I2C_COM_BUS
+  printf("  [-outa <mux>] [-outb <mux>] [-ss <spi sdo select>]\n");
+#else
+  printf("  [-outa <mux>] [-outb <mux>] [-dac]\n");
+#endif
+}
+
+double elapsed_s(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec)*1e-9;
+}
+
+int main(int argc, char**argv) {
+  // the fields given on the command line, applied over the file's
+  LMX2594Freq over = { 0 };
+  uint8_t given[6] = { 0 };
+  LMX2594Freq f;
+  struct timespec start, end;
+  char *tcsfile = NULL;
+  FILE* fileptr;
+  uint32_t* rp;
+  int ret;
+#ifdef I2C_COM_BUS
+  uint8_t spi_sdosel = LMX_SDO_SS224_225;
+#else
+  int dac = 0;
+#endif
+
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-f") == 0 && i+1 < argc) {
+      tcsfile = argv[++i];
+    } else if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      over.n = strtoul(argv[++i], NULL, 0);
+      given[0] = 1;
+    } else if (strcmp(argv[i], "-num") == 0 && i+1 < argc) {
+      over.num = strtoul(argv[++i], NULL, 0);
+      given[1] = 1;
+    } else if (strcmp(argv[i], "-den") == 0 && i+1 < argc) {
+      over.den = strtoul(argv[++i], NULL, 0);
+      given[2] = 1;
+    } else if (strcmp(argv[i], "-chdiv") == 0 && i+1 < argc) {
+      over.chdiv = strtoul(argv[++i], NULL, 0);
+      given[3] = 1;
+    } else if (strcmp(argv[i], "-outa") == 0 && i+1 < argc) {
+      over.outa_mux = strtoul(argv[++i], NULL, 0);
+      given[4] = 1;
+    } else if (strcmp(argv[i], "-outb") == 0 && i+1 < argc) {
+      over.outb_mux = strtoul(argv[++i], NULL, 0);
+      given[5] = 1;
+#ifdef I2C_COM_BUS
+    } else if (strcmp(argv[i], "-ss") == 0 && i+1 < argc) {
+      spi_sdosel = atoi(argv[++i]);
+#else
+    } else if (strcmp(argv[i], "-dac") == 0) {
+      dac = 1;
+#endif
+    } else {
+      usage(argv[0]);
+      return 0;
+    }
+  }
+  if (tcsfile == NULL) {
+    usage(argv[0]);
+    return 0;
+  }
+
+  fileptr = fopen(tcsfile, "r");
+  if (fileptr == NULL) {
+    printf("problem opening %s\n", tcsfile);
+    return 0;
+  }
+  rp = readtcs(fileptr, LMX2594_REG_CNT, 1);
+  fclose(fileptr);
+  if (rp == NULL || lmx2594_get_freq(rp, LMX2594_REG_CNT, &f) != RFCLK_SUCCESS) {
+    printf("problem parsing lmx clock file %s\n", tcsfile);
+    free(rp);
+    return 0;
+  }
+  free(rp);
+
+  f.n = given[0] ? over.n : f.n;
+  f.num = given[1] ? over.num : f.num;
+  f.den = given[2] ? over.den : f.den;
+  f.chdiv = given[3] ? over.chdiv : f.chdiv;
+  f.outa_mux = given[4] ? over.outa_mux : f.outa_mux;
+  f.outb_mux = given[5] ? over.outb_mux : f.outb_mux;
+  printf("N %u, NUM %u, DEN %u, CHDIV %u, OUTA_MUX %u, OUTB_MUX %u\n", f.n, f.num, f.den, f.chdiv, f.outa_mux,
+         f.outb_mux);
+
+#ifdef I2C_COM_BUS
+  if (init_i2c_bus() != 0) {
+    return 1;
+  }
+  init_i2c_dev(RETUNE_LMX_DEV);
+
+  // configure i2c-spi bridge, set SPI clock to 58 kHz as the programming tools do
+  uint8_t spi_config[2] = {0xf0, 0x03};
+  i2c_write(RETUNE_LMX_DEV, spi_config, 2);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ret = lmx2594_retune(RETUNE_LMX_DEV, spi_sdosel, &f);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  close_i2c_dev(RETUNE_LMX_DEV);
+  close_i2c_bus();
+#else
+  spi_dev_t spidev;
+  strcpy(spidev.device, dac ? DAC_RFPLL_SPIDEV : ADC_RFPLL_SPIDEV);
+  spidev.mode = SPI_MODE_0 | SPI_CS_HIGH;
+  spidev.bits = 8;
+  spidev.speed = 500000;
+  spidev.delay = 0;
+  if (init_spi_dev(&spidev) != 0) {
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ret = lmx2594_retune(&spidev, &f);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  close_spi_dev(&spidev);
+#endif
+
+  if (ret != RFCLK_SUCCESS) {
+    printf("retune failed\n");
+    return 1;
+  }
+  printf("retuned in %.2f ms\n", 1e3*elapsed_s(&start, &end));
+  return 0;
+}
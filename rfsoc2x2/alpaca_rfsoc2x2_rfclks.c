@@ -16,7 +16,8 @@
 #include "alpaca_rfclks.h"
 
 void usage(char* name) {
-  printf("%s -lmk|-lmx <path/to/clk/file.txt>\n", name);
+  printf("%s -lmk|-lmx <path/to/clk/file.txt> [-d]\n", name);
+  printf("  -d  only program the registers that changed since the last load\n");
 }
 
 int main(int argc, char**argv) {
@@ -59,6 +60,15 @@ int main(int argc, char**argv) {
     return 0;
   }
 
+  int diff = 0;
+  if (argc > 3) {
+    if (strcmp(argv[3], "-d") != 0) {
+      usage(argv[0]);
+      return 0;
+    }
+    diff = 1;
+  }
+
   /* begin to process clock file */
   fileptr = fopen(tcsfile, "r");
   if (fileptr == NULL) {
@@ -113,11 +123,24 @@ int main(int argc, char**argv) {
   /* program */
   if (pll_type == 0) {
     // configure lmk
-    ret = prog_pll(I2C_DEV_PLL_SPI_BRIDGE, LMK_SDO_SS, rp, prg_cnt, pkt_len);
+    ret = diff ? prog_pll_diff(I2C_DEV_PLL_SPI_BRIDGE, LMK_SDO_SS, pll_type, rp, prg_cnt, pkt_len)
+               : prog_pll(I2C_DEV_PLL_SPI_BRIDGE, LMK_SDO_SS, rp, prg_cnt, pkt_len);
+    if (ret == RFCLK_SUCCESS) {
+      // route the lmk sdo to the bridge and wait for its loops to lock
+      iox_gpio[1] = (iox_config[1] & ~MUX_SEL_BASE) | LMK_MUX_SEL;
+      i2c_write(I2C_DEV_IOX, iox_gpio, 2);
+      ret = lmk0482x_wait_lock(I2C_DEV_PLL_SPI_BRIDGE, LMK_SDO_SS, lmk0482x_plan_plls(rp, prg_cnt),
+                               LMK_LOCK_TIMEOUT_US, NULL);
+    }
   } else {
     // rfsoc2x2 only supports two inputs with one lmx2594 driving adc tiles 224/226
     // despite the SDO slave select macro, this configures the one lmx2594's for both tiles
-    ret = prog_pll(I2C_DEV_PLL_SPI_BRIDGE, LMX_SDO_SS224_225, rp, prg_cnt, pkt_len);
+    ret = diff ? prog_pll_diff(I2C_DEV_PLL_SPI_BRIDGE, LMX_SDO_SS224_225, pll_type, rp, prg_cnt, pkt_len)
+               : prog_pll(I2C_DEV_PLL_SPI_BRIDGE, LMX_SDO_SS224_225, rp, prg_cnt, pkt_len);
+    if (ret == RFCLK_SUCCESS) {
+      // the iox still selects the adc lmx sdo (mux_sel 0) from the init above
+      ret = lmx2594_wait_lock(I2C_DEV_PLL_SPI_BRIDGE, LMX_SDO_SS224_225, rp[prg_cnt-1], LMX_LOCK_TIMEOUT_US, NULL);
+    }
   }
 
   /* readback */
@@ -131,6 +154,13 @@ int main(int argc, char**argv) {
   close_i2c_dev(I2C_DEV_IOX);
   close_i2c_bus();
 
+  // a load that did not lock fails the tool so scripts need not sleep a
+  // worst case before using the clocks
+  if (ret != RFCLK_SUCCESS) {
+    printf("failed to program the rfpll or it did not lock\n");
+    return 1;
+  }
+
   return 0;
 }
 
@@ -68,6 +68,7 @@ int main(int argc, char**argv) {
     printf("i2c could not reset pll\n");
     return ret;
   }
+  rfpll_shadow_clear(i2cdev, spi_sdosel);
 
   close_i2c_dev(i2cdev);
   close_i2c_bus();
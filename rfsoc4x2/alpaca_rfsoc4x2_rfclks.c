@@ -2,16 +2,44 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>   // clock_gettime
 
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
 
 #include "alpaca_rfclks.h"
 
 void usage(char* name) {
-  printf("%s -lmk|-lmx <path/to/clk/file.txt>\n", name);
+  printf("%s -lmk|-lmx <path/to/clk/file.txt> [-s] [-d] [-a none|partial|full]\n", name);
+  printf("  -s  program the ADC and DAC LMX one after the other\n");
+  printf("  -d  only program the registers that changed since the last load\n");
+  printf("  -a  how the LMX reuse the VCO calibration cached for this plan (default partial)\n");
+}
+
+double elapsed_s(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec)*1e-9;
+}
+
+// one rfpll load, the ADC and DAC LMX are programmed from a thread each
+typedef struct {
+  spi_dev_t *spidev;
+  uint8_t pll_type;
+  int diff;
+  int assist;   // LMX_VCO_ASSIST_*
+  uint32_t *rp;
+  int prg_cnt;
+  int pkt_len;
+  int ret;
+  uint32_t lock_us;
+} PllLoad;
+
+void* prog_main(void *arg) {
+  PllLoad *l = (PllLoad*) arg;
+  l->ret = lmx2594_prog_cached(l->spidev, l->rp, l->prg_cnt, l->assist, l->diff, &l->lock_us);
+  return NULL;
 }
 
 int main(int argc, char**argv) {
@@ -54,6 +82,29 @@ int main(int argc, char**argv) {
     return 0;
   }
 
+  int serial = 0;
+  int diff = 0;
+  int assist = LMX_VCO_ASSIST_PARTIAL;
+  for (int i=3; i<argc; i++) {
+    if (strcmp(argv[i], "-s") == 0) {
+      serial = 1;
+    } else if (strcmp(argv[i], "-d") == 0) {
+      diff = 1;
+    } else if (strcmp(argv[i], "-a") == 0 && i+1 < argc && strcmp(argv[i+1], "none") == 0) {
+      assist = LMX_VCO_ASSIST_NONE;
+      i++;
+    } else if (strcmp(argv[i], "-a") == 0 && i+1 < argc && strcmp(argv[i+1], "partial") == 0) {
+      assist = LMX_VCO_ASSIST_PARTIAL;
+      i++;
+    } else if (strcmp(argv[i], "-a") == 0 && i+1 < argc && strcmp(argv[i+1], "full") == 0) {
+      assist = LMX_VCO_ASSIST_FULL;
+      i++;
+    } else {
+      usage(argv[0]);
+      return 0;
+    }
+  }
+
   /* begin to process clock file */
   fileptr = fopen(tcsfile, "r");
   if (fileptr == NULL) {
@@ -95,36 +146,70 @@ int main(int argc, char**argv) {
     // configure lmk
     strcpy(spidev.device, LMK_SPIDEV);
     init_spi_dev(&spidev);
-    ret = prog_pll(&spidev, rp, prg_cnt, pkt_len);
+    ret = diff ? prog_pll_diff(&spidev, pll_type, rp, prg_cnt, pkt_len) : prog_pll(&spidev, rp, prg_cnt, pkt_len);
+    if (ret == RFCLK_SUCCESS) {
+      ret = lmk0482x_wait_lock(&spidev, lmk0482x_plan_plls(rp, prg_cnt), LMK_LOCK_TIMEOUT_US, NULL);
+    }
 
     /* readback */
     get_pll_config(&spidev, pll_type, rp);
 
+    // close spi device
+    close_spi_dev(&spidev);
+
   } else {
-    // rfsoc4x2 has one adc rfpll and one dac rfpll
+    // rfsoc4x2 has one adc rfpll and one dac rfpll, both open at once so one
+    // streams its registers while the other waits out its VCO calibration
+    spi_dev_t dac_spidev = spidev;
+    struct timespec start, end;
+    pthread_t thread;
+
     strcpy(spidev.device, ADC_RFPLL_SPIDEV);
+    strcpy(dac_spidev.device, DAC_RFPLL_SPIDEV);
     init_spi_dev(&spidev);
-    ret = prog_pll(&spidev, rp, prg_cnt, pkt_len);
-    close_spi_dev(&spidev);
+    init_spi_dev(&dac_spidev);
 
-    /* readback */
-    printf("ADC LMX register readback not yet implemented for rfsoc4x2, only LED status is shown\n");
-    printf("rfsoc4x2 does not support register readback, only led status\n");
+    PllLoad loads[2] = {
+      { &spidev, pll_type, diff, assist, rp, prg_cnt, pkt_len, 0, 0 },
+      { &dac_spidev, pll_type, diff, assist, rp, prg_cnt, pkt_len, 0, 0 },
+    };
 
-    // now dac rfpll
-    strcpy(spidev.device, DAC_RFPLL_SPIDEV);
-    init_spi_dev(&spidev);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!serial && pthread_create(&thread, NULL, prog_main, &loads[1]) != 0) {
+      printf("could not start the DAC LMX load, programming it after the ADC LMX\n");
+      serial = 1;
+    }
+    prog_main(&loads[0]);
+    if (serial) {
+      prog_main(&loads[1]);
+    } else {
+      pthread_join(thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ret = (loads[0].ret == RFCLK_SUCCESS) ? loads[1].ret : loads[0].ret;
+    printf("programmed the ADC and DAC LMX2594 in %.2f ms (%s), locked %u us and %u us after their loads\n",
+           1e3*elapsed_s(&start, &end), serial ? "serial" : "parallel", loads[0].lock_us, loads[1].lock_us);
 
     /* readback */
-    printf("DAC LMX register readback not yet implemented for rfsoc4x2, only LED status is shown\n");
-    ret = prog_pll(&spidev, rp, prg_cnt, pkt_len);
+    printf("ADC LMX2594:\n");
+    get_pll_config(&spidev, pll_type, rp);
+    printf("DAC LMX2594:\n");
+    get_pll_config(&dac_spidev, pll_type, rp);
+
+    // close spi devices
+    close_spi_dev(&spidev);
+    close_spi_dev(&dac_spidev);
   }
 
   // release memory from tcs pll config
   free(rp);
 
-  // close spi device
-  close_spi_dev(&spidev);
+  // a load that did not lock fails the tool so scripts need not sleep a
+  // worst case before using the clocks
+  if (ret != RFCLK_SUCCESS) {
+    printf("failed to program the rfpll or it did not lock\n");
+    return 1;
+  }
 
   return 0;
 }
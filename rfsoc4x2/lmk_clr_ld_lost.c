@@ -25,6 +25,9 @@ int main(int argc, char**argv) {
   strcpy(spidev.device, LMK_SPIDEV);
   init_spi_dev(&spidev);
 
+  // the toggle is one operation for other tools, close_spi_dev releases the lock
+  spi_lock_dev(&spidev);
+
   // clear RB_PLL1_LD_LOST by toggle high and then low the CLR_PLL1_LD_LOST bit
   // in register 0x182 (R386)
   uint8_t R386[LMK_PKT_SIZE];
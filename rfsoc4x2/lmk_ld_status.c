@@ -26,6 +26,10 @@ int main(int argc, char**argv) {
   strcpy(spidev.device, LMK_SPIDEV);
   init_spi_dev(&spidev);
 
+  // the readback select and the read must not interleave with other tools,
+  // an early return releases the lock on exit
+  spi_lock_dev(&spidev);
+
   // RFSoC4x2 STATUS_LD2 connected to SDO, configure PLL2_LD_MUX for spi
   // readback (register 0x16E, R366)
   uint8_t R366[LMK_PKT_SIZE];
@@ -59,6 +63,8 @@ int main(int argc, char**argv) {
     return RFCLK_FAILURE;
   }
 
+  spi_unlock_dev(&spidev);
+
   // display lmk config info
   printf("LMK04828 readback status raw register: 0x%06x\n", R386_buf);
   printf("PLL1 LD LOST: %s\n", (R386_buf & 0x4) ? "LOST" : "STABLE");
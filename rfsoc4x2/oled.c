@@ -25,8 +25,6 @@
 #define DATA (1 << 1)
 #define CMD  (0)
 
-#define SLEEP_TIME_uS 10000
-
 // the first byte indicates either a CMD or DATA byte
 #define INIT_LENGTH 28
 uint16_t init_sequence[INIT_LENGTH] = {
@@ -93,7 +91,8 @@ void display_string(spi_dev_t *spidev, char *str) {
     fmt_spi_write_pkt(dc_mode, payload, buffer);
     write_spi_pkt(spidev, buffer, 3);
   }
-  usleep(SLEEP_TIME_uS);
+  // the sequence starts with a clear display
+  spi_settle(spidev);
 
   // TODO handle new line
 #ifdef VERBOSE
@@ -157,6 +156,7 @@ int main(int argc, char* argv[]) {
   oled_spi.delay = 0;
 
   init_spi_dev(&oled_spi);
+  spi_set_timing(&oled_spi, &spi_timing_us2066);
 
   // init oled device
 #ifdef VERBOSE
@@ -66,6 +66,7 @@ int main(int argc, char**argv) {
       close_spi_dev(&spidev);
       return ret;
     }
+    rfpll_shadow_clear(&spidev);
     close_spi_dev(&spidev);
     // now open dac rfpll and reset
     strcpy(spidev.device, DAC_RFPLL_SPIDEV);
@@ -78,6 +79,7 @@ int main(int argc, char**argv) {
     close_spi_dev(&spidev);
     return ret;
   }
+  rfpll_shadow_clear(&spidev);
 
   close_spi_dev(&spidev);
 
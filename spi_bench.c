@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h> // uint8_t, uint16_t
+#include <time.h>   // clock_gettime
+
+#include "alpaca_spi.h"
+#include "alpaca_rfclks.h"
+
+/*
+ * Benchmark an spi register load end to end
+ *
+ * Programs a TICS Pro plan into the LMK or the ADC LMX with the fixed 10 ms
+ * gap after every packet the library used to have (spi_timing_legacy) and
+ * then with the part's own timing profile, and prints the load times.
+ */
+
+#define DEFAULT_RUNS 3
+
+void usage(char* name) {
+  printf("%s -lmk|-lmx <path/to/clk/file.txt> [-n <runs>]\n", name);
+}
+
+double elapsed_s(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec)*1e-9;
+}
+
+void run(spi_dev_t *spidev, const SPITiming *timing, uint32_t *rp, int len, int pkt_len, int runs) {
+  struct timespec start, end;
+  double sum = 0, max = 0;
+  int fails = 0;
+
+  spi_set_timing(spidev, timing);
+  for (int i=0; i<runs; i++) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (prog_pll(spidev, rp, len, pkt_len) != RFCLK_SUCCESS) {
+      fails++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double t = elapsed_s(&start, &end);
+    sum += t;
+    max = (t > max) ? t : max;
+  }
+  printf("%-10s %3d registers, mean %9.2f ms, max %9.2f ms, %d/%d failed\n", timing->name, len,
+         1e3*sum/runs, 1e3*max, fails, runs);
+}
+
+int main(int argc, char**argv) {
+  int pll_type = -1;
+  char *tcsfile = NULL;
+  int runs = DEFAULT_RUNS;
+  FILE* fileptr;
+  uint32_t* rp;
+  spi_dev_t spidev;
+
+  for (int i=1; i<argc; i++) {
+    if ((strcmp(argv[i], "-lmk") == 0 || strcmp(argv[i], "-lmx") == 0) && i+1 < argc) {
+      pll_type = (strcmp(argv[i], "-lmk") == 0) ? 0 : 1;
+      tcsfile = argv[++i];
+    } else if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      runs = atoi(argv[++i]);
+    } else {
+      usage(argv[0]);
+      return 0;
+    }
+  }
+  if (tcsfile == NULL || runs < 1) {
+    usage(argv[0]);
+    return 0;
+  }
+
+  int prg_cnt = (pll_type == 0) ? LMK_REG_CNT : LMX2594_REG_CNT;
+  int pkt_len = (pll_type == 0) ? LMK_PKT_SIZE: LMX_PKT_SIZE;
+
+  fileptr = fopen(tcsfile, "r");
+  if (fileptr == NULL) {
+    printf("problem opening %s\n", tcsfile);
+    return 0;
+  }
+  rp = readtcs(fileptr, prg_cnt, pll_type);
+  fclose(fileptr);
+  if (rp == NULL) {
+    printf("problem allocating memory for config buffer, or parsing clock file\n");
+    return 0;
+  }
+
+  strcpy(spidev.device, (pll_type == 0) ? LMK_SPIDEV : ADC_RFPLL_SPIDEV);
+  spidev.mode = SPI_MODE_0 | SPI_CS_HIGH;
+  spidev.bits = 8;
+  spidev.speed = 500000;
+  spidev.delay = 0;
+  if (init_spi_dev(&spidev) != 0) {
+    free(rp);
+    return 0;
+  }
+
+  const SPITiming *profile = spidev.timing;
+  run(&spidev, &spi_timing_legacy, rp, prg_cnt, pkt_len, runs);
+  run(&spidev, profile, rp, prg_cnt, pkt_len, runs);
+
+  close_spi_dev(&spidev);
+  free(rp);
+
+  return 0;
+}
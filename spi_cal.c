@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h> // uint8_t, uint16_t
+
+#include "alpaca_spi.h"
+#include "alpaca_rfclks.h"
+
+/*
+ * Calibrate the spi clock of the rfplls
+ *
+ * Steps each spidev (the LMK and both LMXs, or the one given with -d) up
+ * through the clock rates below, checking every rate with rounds of register
+ * reads compared with a readback at the base speed (see
+ * `spi_rfpll_calibrate`), and saves the fastest rate that passed to the speed
+ * profile later programming runs start at.
+ * With -n the profile is only printed, not written.
+ */
+
+#define DEFAULT_ITERS 32
+#define BASE_SPEED 500000
+
+static const uint32_t rates[] = {
+  500000, 1000000, 2000000, 4000000, 5000000, 8000000, 10000000, 12500000, 16000000, 20000000,
+  25000000, 30000000, 40000000, 50000000, 60000000, 75000000,
+};
+#define NUM_RATES (sizeof(rates)/sizeof(uint32_t))
+
+void usage(char* name) {
+  printf("%s [-d <spidev>] [-i <rounds per rate>] [-max <hz>] [-n]\n", name);
+}
+
+int calibrate(const char *device, int iters, uint32_t max_hz, int save) {
+  spi_dev_t spidev;
+  uint32_t best;
+  int nrates = 0;
+
+  while (nrates < NUM_RATES && rates[nrates] <= max_hz) {
+    nrates++;
+  }
+
+  strcpy(spidev.device, device);
+  spidev.mode = SPI_MODE_0 | SPI_CS_HIGH;
+  spidev.bits = 8;
+  spidev.speed = BASE_SPEED;
+  spidev.delay = 0;
+  if (init_spi_dev(&spidev) != 0) {
+    return RFCLK_FAILURE;
+  }
+  // calibrate from the base speed, not what an earlier profile says
+  spidev.base_speed = BASE_SPEED;
+  spi_set_speed(&spidev, BASE_SPEED);
+
+  spi_lock_dev(&spidev);
+  int res = spi_rfpll_calibrate(&spidev, rates, nrates, iters, &best);
+  spi_unlock_dev(&spidev);
+  close_spi_dev(&spidev);
+
+  if (res == RFCLK_FAILURE) {
+    printf("%-16s does not read back at %u Hz, not profiled\n", device, BASE_SPEED);
+    return res;
+  }
+  printf("%-16s %9u Hz\n", device, best);
+  if (save) {
+    res = spi_speed_save(device, best);
+  }
+  return res;
+}
+
+int main(int argc, char**argv) {
+  const char *devices[3] = { LMK_SPIDEV, ADC_RFPLL_SPIDEV, DAC_RFPLL_SPIDEV };
+  int ndevices = 3;
+  int iters = DEFAULT_ITERS;
+  uint32_t max_hz = rates[NUM_RATES-1];
+  int save = 1;
+  int ret = 0;
+
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-d") == 0 && i+1 < argc) {
+      devices[0] = argv[++i];
+      ndevices = 1;
+    } else if (strcmp(argv[i], "-i") == 0 && i+1 < argc) {
+      iters = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-max") == 0 && i+1 < argc) {
+      max_hz = strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-n") == 0) {
+      save = 0;
+    } else {
+      usage(argv[0]);
+      return 0;
+    }
+  }
+  if (iters < 1) {
+    usage(argv[0]);
+    return 0;
+  }
+
+  printf("calibrating spi clocks, %d rounds of register readbacks per rate\n", iters);
+  for (int d=0; d<ndevices; d++) {
+    if (calibrate(devices[d], iters, max_hz, save) != RFCLK_SUCCESS) {
+      ret = 1;
+    }
+  }
+
+  return ret;
+}
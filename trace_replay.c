@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h> // uint8_t, uint16_t
+#include <unistd.h>
+#include <time.h>   // clock_gettime, nanosleep
+
+#include <errno.h>
+
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <linux/spi/spidev.h>
+
+#include "alpaca_trace.h"
+#include "alpaca_sim.h"
+#ifdef I2C_COM_BUS
+#include "alpaca_i2c_utils.h"
+#endif
+
+/*
+ * Inspect and replay a bus trace recorded with ALPACA_TRACE
+ *
+ * Without options the trace is profiled offline: for every phase (the span
+ * between trace_phase markers) the number of transfers, the bytes moved, the
+ * wall time and the time spent in the bus system calls are reported. -l lists
+ * every record.
+ *
+ * With -r the transfers are re-issued on the devices named in the trace (or
+ * the ones given with -m) and the replay timing is reported next to the
+ * recorded one, along with failures and reads that returned different data
+ * than recorded. The recorded gaps between transfers (e.g., the wait before
+ * the last LMX2594 register) are kept unless -f is given.
+ *
+ * Transfers go through the library's transport for the platform's bus, i2c or
+ * spidev (streams of the other kind are not replayed), so with ALPACA_SIM=1
+ * in the environment the trace is replayed on the simulated platform.
+ *
+ * Replaying writes registers on real parts, only replay a trace on the board
+ * it was recorded on (or the simulator).
+ */
+
+#define MAX_XFER_DATA 65536
+
+typedef struct {
+  char name[TRACE_REC_DATA+1];
+  uint64_t t_start, t_end;   // recorded span, ns from the trace start
+  uint32_t nxfer;            // bus system calls
+  uint64_t bytes;
+  uint64_t bus_ns;           // recorded time in the bus system calls
+  uint32_t fails;
+  uint64_t r_start, r_end;   // replay span, ns
+  uint64_t r_bus_ns;
+  uint32_t r_fails;
+  uint32_t r_mismatch;       // reads that returned different data
+} Phase;
+
+typedef struct {
+  int nmsgs;
+  int phase;
+  struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+  uint8_t *expect[I2C_RDWR_IOCTL_MAX_MSGS]; // recorded read data
+  uint8_t buf[MAX_XFER_DATA];
+  uint32_t used;
+} I2CGroup;
+
+static TraceHdr *hdr;
+static TraceStream *streams;
+static TraceRec *ring;
+
+static Phase *phases = NULL;
+static int nphases = 0;
+
+static const char *stream_path[TRACE_MAX_STREAMS];
+static int stream_fd[TRACE_MAX_STREAMS];   // -1 for streams not replayed
+static I2CGroup *groups[TRACE_MAX_STREAMS];
+
+#ifdef I2C_COM_BUS
+static const I2CTransport *i2c_bus;
+#else
+static const SPITransport *spi_bus;
+#endif
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+void usage(char* name) {
+  printf("%s [-l] [-r [-f] [-m <stream>=<device>]...] <trace file>\n", name);
+  printf("  -l  list all records\n");
+  printf("  -r  replay the trace on the devices\n");
+  printf("  -f  replay transfers back to back instead of with the recorded gaps\n");
+  printf("  -m  replay stream <stream> on <device>\n");
+}
+
+int load_trace(const char *path) {
+  FILE *f = fopen(path, "rb");
+  long size;
+
+  if (f == NULL) {
+    printf("could not open %s\n", path);
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  hdr = malloc(size);
+  if (size < sizeof(TraceHdr) || fread(hdr, 1, size, f) != size) {
+    printf("could not read %s\n", path);
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  if (hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION || hdr->rec_size != sizeof(TraceRec)) {
+    printf("%s is not a version %d trace\n", path, TRACE_VERSION);
+    return -1;
+  }
+  if (size < sizeof(TraceHdr) + TRACE_MAX_STREAMS*sizeof(TraceStream) + (uint64_t) hdr->nrecs*sizeof(TraceRec)) {
+    printf("%s is truncated\n", path);
+    return -1;
+  }
+
+  streams = (TraceStream*) (hdr + 1);
+  ring = (TraceRec*) (streams + TRACE_MAX_STREAMS);
+  return 0;
+}
+
+// record at ring position `i` with its data gathered from the extension records
+TraceRec* get_rec(uint64_t i, uint8_t *data) {
+  TraceRec *rec = &ring[i % hdr->nrecs];
+  uint32_t total = rec->len;
+  uint32_t copied, n;
+
+  if (rec->type == TRACE_SPI_XFER) {
+    total *= 2;
+  }
+
+  n = (total < TRACE_REC_DATA) ? total : TRACE_REC_DATA;
+  memcpy(data, rec->data, n);
+  for (copied = n, i++; copied < total; copied += n, i++) {
+    TraceExt *ext = (TraceExt*) &ring[i % hdr->nrecs];
+    n = (total - copied < TRACE_EXT_DATA) ? total - copied : TRACE_EXT_DATA;
+    memcpy(data + copied, ext->data, n);
+  }
+  return rec;
+}
+
+Phase* new_phase(const char *name, uint64_t t) {
+  phases = realloc(phases, (nphases+1)*sizeof(Phase));
+  Phase *p = &phases[nphases++];
+  memset(p, 0, sizeof(Phase));
+  strncpy(p->name, name, TRACE_REC_DATA);
+  p->t_start = t;
+  p->t_end = t;
+  return p;
+}
+
+void print_rec(uint64_t i, TraceRec *rec, uint8_t *data) {
+  static const char *types[] = { "none", "i2c", "spi wr", "spi rd", "spi xfer", "phase", "ext" };
+  uint32_t n = rec->len;
+
+  printf("%8llu %12.6f %-8s", (unsigned long long) i, rec->t_ns*1e-9, types[rec->type]);
+  if (rec->type == TRACE_PHASE) {
+    printf(" %.*s\n", rec->len, (char*) data);
+    return;
+  }
+  if (rec->stream != TRACE_NO_STREAM) {
+    printf(" %-16s", streams[rec->stream].path);
+  } else {
+    printf(" %-16s", "?");
+  }
+  if (rec->type == TRACE_I2C) {
+    printf(" 0x%02x %s%s%s", rec->addr, (rec->flags & TRACE_F_READ) ? "rd" : "wr",
+           (rec->flags & TRACE_F_CONT) ? " cont" : "", (rec->flags & TRACE_F_STOP) ? " stop" : "");
+  }
+  printf(" %7.1f us", rec->dur_ns*1e-3);
+  if (rec->flags & TRACE_F_FAIL) {
+    printf(" FAILED (%s)", strerror(rec->err));
+  }
+  printf(" [");
+  if (rec->type == TRACE_SPI_XFER) {
+    n *= 2;
+  }
+  for (uint32_t b=0; b<n && b<16; b++) {
+    printf(" %02x", data[b]);
+  }
+  printf("%s ]\n", (n > 16) ? " ..." : "");
+}
+
+// -1 if the device could not be opened, 0 when opened or not replayed here
+int open_stream(uint8_t s) {
+  const char *path = stream_path[s] ? stream_path[s] : streams[s].path;
+
+  if (stream_fd[s] >= 0) {
+    return 0;
+  }
+
+#ifdef I2C_COM_BUS
+  if (streams[s].spi) {
+    printf("stream %d is a spidev, not replayed on this platform\n", s);
+    return 0;
+  }
+  stream_fd[s] = i2c_bus->open(path);
+#else
+  if (!streams[s].spi) {
+    printf("stream %d is an i2c bus, not replayed on this platform\n", s);
+    return 0;
+  }
+  stream_fd[s] = spi_bus->open(path);
+  if (stream_fd[s] >= 0) {
+    spi_bus->ioctl(stream_fd[s], SPI_IOC_WR_MODE, &streams[s].mode);
+    spi_bus->ioctl(stream_fd[s], SPI_IOC_WR_BITS_PER_WORD, &streams[s].bits);
+    spi_bus->ioctl(stream_fd[s], SPI_IOC_WR_MAX_SPEED_HZ, &streams[s].speed);
+  }
+#endif
+  if (stream_fd[s] < 0) {
+    printf("could not open %s for stream %d\n", path, s);
+    return -1;
+  }
+  return 0;
+}
+
+void close_stream(uint8_t s) {
+  if (stream_fd[s] < 0) {
+    return;
+  }
+#ifdef I2C_COM_BUS
+  i2c_bus->close(stream_fd[s]);
+#else
+  spi_bus->close(stream_fd[s]);
+#endif
+  stream_fd[s] = -1;
+}
+
+void flush_group(uint8_t s) {
+  I2CGroup *g = groups[s];
+  Phase *p;
+  uint64_t start;
+  int ret;
+
+  if (g == NULL || g->nmsgs == 0) {
+    return;
+  }
+  p = &phases[g->phase];
+
+  start = now_ns();
+#ifdef I2C_COM_BUS
+  ret = i2c_bus->rdwr(stream_fd[s], g->msgs, g->nmsgs);
+#else
+  ret = -1;
+#endif
+  p->r_bus_ns += now_ns() - start;
+
+  if (ret < 0) {
+    p->r_fails++;
+  } else {
+    for (int m=0; m<g->nmsgs; m++) {
+      if (g->expect[m] && memcmp(g->msgs[m].buf, g->expect[m], g->msgs[m].len) != 0) {
+        p->r_mismatch++;
+      }
+    }
+  }
+  g->nmsgs = 0;
+  g->used = 0;
+}
+
+// queue an i2c message, messages of one recorded transaction go out together
+void replay_i2c(TraceRec *rec, uint8_t *data, int phase) {
+  uint8_t s = rec->stream;
+  I2CGroup *g;
+
+  if (groups[s] == NULL) {
+    groups[s] = calloc(1, sizeof(I2CGroup));
+  }
+  g = groups[s];
+
+  if (!(rec->flags & TRACE_F_CONT) || g->nmsgs == I2C_RDWR_IOCTL_MAX_MSGS || g->used + 2*rec->len > MAX_XFER_DATA) {
+    flush_group(s);
+  }
+  if (g->nmsgs == 0) {
+    g->phase = phase;
+  }
+
+  struct i2c_msg *msg = &g->msgs[g->nmsgs];
+  msg->addr = rec->addr;
+  msg->flags = ((rec->flags & TRACE_F_READ) ? I2C_M_RD : 0) | ((rec->flags & TRACE_F_STOP) ? I2C_M_STOP : 0);
+  msg->len = rec->len;
+  msg->buf = &g->buf[g->used];
+  if (rec->flags & TRACE_F_READ) {
+    // keep the recorded data behind the read buffer to compare after the transfer
+    g->expect[g->nmsgs] = (rec->flags & TRACE_F_FAIL) ? NULL : &g->buf[g->used + rec->len];
+    memcpy(&g->buf[g->used + rec->len], data, rec->len);
+    g->used += 2*rec->len;
+  } else {
+    g->expect[g->nmsgs] = NULL;
+    memcpy(msg->buf, data, rec->len);
+    g->used += rec->len;
+  }
+  g->nmsgs++;
+}
+
+void replay_spi(TraceRec *rec, uint8_t *data, Phase *p) {
+  static uint8_t rx[MAX_XFER_DATA];
+  uint64_t start = now_ns();
+  int ret;
+
+#ifdef I2C_COM_BUS
+  ret = -1;
+#else
+  int fd = stream_fd[rec->stream];
+  if (rec->type == TRACE_SPI_WR) {
+    ret = spi_bus->write(fd, data, rec->len);
+  } else if (rec->type == TRACE_SPI_RD) {
+    ret = spi_bus->read(fd, rx, rec->len);
+  } else {
+    struct spi_ioc_transfer xfer;
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.tx_buf = (unsigned long) data;
+    xfer.rx_buf = (unsigned long) rx;
+    xfer.len = rec->len;
+    xfer.speed_hz = streams[rec->stream].speed;
+    xfer.bits_per_word = streams[rec->stream].bits;
+    ret = spi_bus->ioctl(fd, SPI_IOC_MESSAGE(1), &xfer);
+  }
+#endif
+  p->r_bus_ns += now_ns() - start;
+
+  if (ret < 0) {
+    p->r_fails++;
+  } else if (rec->type == TRACE_SPI_RD && !(rec->flags & TRACE_F_FAIL)) {
+    p->r_mismatch += (memcmp(rx, data, rec->len) != 0);
+  } else if (rec->type == TRACE_SPI_XFER && !(rec->flags & TRACE_F_FAIL)) {
+    p->r_mismatch += (memcmp(rx, data + rec->len, rec->len) != 0);
+  }
+}
+
+void report(int replayed) {
+  printf("\n%-4s %-24s %8s %10s %12s %12s %6s", "#", "phase", "xfers", "bytes", "time (ms)", "bus (ms)", "fails");
+  if (replayed) {
+    printf(" %12s %12s %6s %8s", "replay (ms)", "bus (ms)", "fails", "mismatch");
+  }
+  printf("\n");
+
+  for (int i=0; i<nphases; i++) {
+    Phase *p = &phases[i];
+    if (p->nxfer == 0 && strcmp(p->name, "(none)") == 0) {
+      continue;
+    }
+    printf("%-4d %-24s %8u %10llu %12.3f %12.3f %6u", i, p->name, p->nxfer, (unsigned long long) p->bytes,
+           (p->t_end - p->t_start)*1e-6, p->bus_ns*1e-6, p->fails);
+    if (replayed) {
+      printf(" %12.3f %12.3f %6u %8u", (p->r_end - p->r_start)*1e-6, p->r_bus_ns*1e-6, p->r_fails, p->r_mismatch);
+    }
+    printf("\n");
+  }
+}
+
+int main(int argc, char**argv) {
+  static uint8_t data[2*MAX_XFER_DATA];
+  const char *path = NULL;
+  int list = 0;
+  int replay = 0;
+  int fast = 0;
+  uint64_t first, i;
+  uint64_t r_t0 = 0, t0 = 0;
+  Phase *cur;
+
+  for (int s=0; s<TRACE_MAX_STREAMS; s++) {
+    stream_path[s] = NULL;
+    stream_fd[s] = -1;
+  }
+
+  for (int a=1; a<argc; a++) {
+    if (strcmp(argv[a], "-l") == 0) {
+      list = 1;
+    } else if (strcmp(argv[a], "-r") == 0) {
+      replay = 1;
+    } else if (strcmp(argv[a], "-f") == 0) {
+      fast = 1;
+    } else if (strcmp(argv[a], "-m") == 0 && a+1 < argc) {
+      char *eq = strchr(argv[++a], '=');
+      int s = atoi(argv[a]);
+      if (eq == NULL || s < 0 || s >= TRACE_MAX_STREAMS) {
+        usage(argv[0]);
+        return 0;
+      }
+      stream_path[s] = eq+1;
+    } else if (argv[a][0] != '-' && path == NULL) {
+      path = argv[a];
+    } else {
+      usage(argv[0]);
+      return 0;
+    }
+  }
+  if (path == NULL) {
+    usage(argv[0]);
+    return 0;
+  }
+
+  if (load_trace(path) < 0) {
+    return 1;
+  }
+
+  // the platform's transport, ALPACA_SIM in the environment selects the simulator
+#ifdef I2C_COM_BUS
+  if (sim_enabled()) {
+    i2c_set_transport(&i2c_sim_transport);
+  }
+  i2c_bus = i2c_get_transport();
+#else
+  if (sim_enabled()) {
+    spi_set_transport(&spi_sim_transport);
+  }
+  spi_bus = spi_get_transport();
+#endif
+
+  printf("trace %s: %llu records", path, (unsigned long long) hdr->head);
+  if (hdr->head > hdr->nrecs) {
+    printf(", the oldest %llu were overwritten", (unsigned long long) (hdr->head - hdr->nrecs));
+  }
+  printf("\nstreams:\n");
+  for (int s=0; s<TRACE_MAX_STREAMS && streams[s].path[0]; s++) {
+    printf("  %2d %-20s", s, streams[s].path);
+    if (streams[s].spi) {
+      printf(" spi mode %d, %d bits, %u Hz", streams[s].mode, streams[s].bits, streams[s].speed);
+    }
+    if (stream_path[s]) {
+      printf(" -> replayed on %s", stream_path[s]);
+    }
+    printf("\n");
+    if (replay && open_stream(s) < 0) {
+      return 1;
+    }
+  }
+
+  // after a wrap the ring can start in the middle of a record's extensions
+  first = (hdr->head > hdr->nrecs) ? hdr->head - hdr->nrecs : 0;
+  while (first < hdr->head && ring[first % hdr->nrecs].type == TRACE_EXT) {
+    first++;
+  }
+
+  cur = new_phase("(none)", (first < hdr->head) ? ring[first % hdr->nrecs].t_ns : 0);
+  if (replay) {
+    r_t0 = now_ns();
+    cur->r_start = r_t0;
+    t0 = cur->t_start;
+  }
+
+  for (i = first; i < hdr->head; i += 1 + ring[i % hdr->nrecs].next) {
+    TraceRec *rec = get_rec(i, data);
+
+    if (rec->type == TRACE_NONE || rec->type == TRACE_EXT || rec->type > TRACE_EXT) {
+      continue;
+    }
+    if (list) {
+      print_rec(i, rec, data);
+    }
+
+    if (replay && !fast) {
+      // keep the recorded spacing from the start of the trace
+      uint64_t due = r_t0 + (rec->t_ns - t0);
+      uint64_t now = now_ns();
+      if (due > now) {
+        struct timespec ts = { (due - now)/1000000000ull, (due - now)%1000000000ull };
+        nanosleep(&ts, NULL);
+      }
+    }
+
+    if (rec->type == TRACE_PHASE) {
+      // a transaction in flight on a stream belongs to the phase it started in
+      if (replay) {
+        for (int s=0; s<TRACE_MAX_STREAMS; s++) {
+          flush_group(s);
+        }
+      }
+      char name[TRACE_REC_DATA+1];
+      snprintf(name, sizeof(name), "%.*s", rec->len, (char*) data);
+      cur->t_end = rec->t_ns;
+      cur = new_phase(rec->len ? name : "(none)", rec->t_ns);
+      if (replay) {
+        phases[nphases-2].r_end = now_ns();
+        cur->r_start = now_ns();
+      }
+      continue;
+    }
+
+    // every record of an i2c transaction carries the same system call time
+    if (!(rec->flags & TRACE_F_CONT)) {
+      cur->nxfer++;
+      cur->bus_ns += rec->dur_ns;
+      cur->fails += (rec->flags & TRACE_F_FAIL) ? 1 : 0;
+    }
+    cur->bytes += rec->len;
+    cur->t_end = rec->t_ns + rec->dur_ns;
+
+    if (replay && rec->stream != TRACE_NO_STREAM && stream_fd[rec->stream] >= 0) {
+      if (rec->type == TRACE_I2C) {
+        replay_i2c(rec, data, cur - phases);
+      } else {
+        replay_spi(rec, data, cur);
+      }
+    }
+  }
+
+  if (replay) {
+    for (int s=0; s<TRACE_MAX_STREAMS; s++) {
+      flush_group(s);
+      close_stream(s);
+    }
+    cur->r_end = now_ns();
+  }
+
+  report(replay);
+  return 0;
+}
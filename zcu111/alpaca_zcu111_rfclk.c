@@ -15,7 +15,8 @@
 #include "alpaca_rfclks.h"
 
 void usage(char* name) {
-  printf("%s -lmk|-lmx <path/to/clk/file.txt>\n", name);
+  printf("%s -lmk|-lmx <path/to/clk/file.txt> [-d]\n", name);
+  printf("  -d  only program the registers that changed since the last load\n");
 }
 
 int main(int argc, char**argv) {
@@ -58,6 +59,15 @@ int main(int argc, char**argv) {
     return 0;
   }
 
+  int diff = 0;
+  if (argc > 3) {
+    if (strcmp(argv[3], "-d") != 0) {
+      usage(argv[0]);
+      return 0;
+    }
+    diff = 1;
+  }
+
   /* begin to process clock file */
   fileptr = fopen(tcsfile, "r");
   if (fileptr == NULL) {
@@ -112,12 +122,26 @@ int main(int argc, char**argv) {
   /* program */
   if (pll_type == 0) {
     // configure lmk
-    ret = prog_pll(I2C_DEV_PLL_SPI_BRIDGE, LMK_SDO_SS, rp, prg_cnt, pkt_len);
+    ret = diff ? prog_pll_diff(I2C_DEV_PLL_SPI_BRIDGE, LMK_SDO_SS, pll_type, rp, prg_cnt, pkt_len)
+               : prog_pll(I2C_DEV_PLL_SPI_BRIDGE, LMK_SDO_SS, rp, prg_cnt, pkt_len);
   } else {
     // configure adc lmx2594's to all 4 adc tiles 224-227 and dac tiles 228/229
-    ret = prog_pll(I2C_DEV_PLL_SPI_BRIDGE, LMX_SDO_SS224_225, rp, prg_cnt, pkt_len);
-    ret = prog_pll(I2C_DEV_PLL_SPI_BRIDGE, LMX_SDO_SS226_227, rp, prg_cnt, pkt_len);
-    ret = prog_pll(I2C_DEV_PLL_SPI_BRIDGE, LMX_SDO_SS228_229, rp, prg_cnt, pkt_len);
+    ret = diff ? prog_pll_diff(I2C_DEV_PLL_SPI_BRIDGE, LMX_SDO_SS224_225, pll_type, rp, prg_cnt, pkt_len)
+               : prog_pll(I2C_DEV_PLL_SPI_BRIDGE, LMX_SDO_SS224_225, rp, prg_cnt, pkt_len);
+    ret |= diff ? prog_pll_diff(I2C_DEV_PLL_SPI_BRIDGE, LMX_SDO_SS226_227, pll_type, rp, prg_cnt, pkt_len)
+                : prog_pll(I2C_DEV_PLL_SPI_BRIDGE, LMX_SDO_SS226_227, rp, prg_cnt, pkt_len);
+    ret |= diff ? prog_pll_diff(I2C_DEV_PLL_SPI_BRIDGE, LMX_SDO_SS228_229, pll_type, rp, prg_cnt, pkt_len)
+                : prog_pll(I2C_DEV_PLL_SPI_BRIDGE, LMX_SDO_SS228_229, rp, prg_cnt, pkt_len);
+
+    // the three calibrate together, then each one's sdo is routed to the
+    // bridge in turn to confirm it locked (the lmk04208 has no lock readback)
+    const uint8_t sdo_ss[3] = { LMX_SDO_SS224_225, LMX_SDO_SS226_227, LMX_SDO_SS228_229 };
+    const uint8_t mux_sel[3] = { LMX_MUX_SEL_224_225, LMX_MUX_SEL_226_227, LMX_MUX_SEL_228_229 };
+    for (int i=0; i<3 && ret == RFCLK_SUCCESS; i++) {
+      iox_gpio[1] = (iox_config[1] & ~MUX_SEL_BASE) | mux_sel[i];
+      i2c_write(I2C_DEV_IOX, iox_gpio, 2);
+      ret = lmx2594_wait_lock(I2C_DEV_PLL_SPI_BRIDGE, sdo_ss[i], rp[prg_cnt-1], LMX_LOCK_TIMEOUT_US, NULL);
+    }
   }
 
   /* readback */
@@ -133,6 +157,13 @@ int main(int argc, char**argv) {
   close_i2c_dev(I2C_DEV_IOX);
   close_i2c_bus();
 
+  // a load that did not lock fails the tool so scripts need not sleep a
+  // worst case before using the clocks
+  if (ret != RFCLK_SUCCESS) {
+    printf("failed to program the rfpll or it did not lock\n");
+    return 1;
+  }
+
   return 0;
 }
 
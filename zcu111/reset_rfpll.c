@@ -64,6 +64,7 @@ int main(int argc, char**argv) {
       printf("i2c could not reset lmk pll\n");
       return ret;
     }
+    rfpll_shadow_clear(i2cdev, spi_sdosel);
   } else {
     rst_pkt = LMX2594_RST_VAL;
 
@@ -75,6 +76,7 @@ int main(int argc, char**argv) {
       printf("i2c could not reset tile 224/225 lmx pll\n");
       return ret;
     }
+    rfpll_shadow_clear(i2cdev, spi_sdosel);
 
     //lmx for tiles 226/227
     spi_sdosel = LMX_SDO_SS226_227;
@@ -84,6 +86,7 @@ int main(int argc, char**argv) {
       printf("i2c could not reset tile 226/227 lmx pll\n");
       return ret;
     }
+    rfpll_shadow_clear(i2cdev, spi_sdosel);
 
     //lmx for tiles 228/229
     spi_sdosel = LMX_SDO_SS228_229;
@@ -93,6 +96,7 @@ int main(int argc, char**argv) {
       printf("i2c could not reset tile 226/227 lmx pll\n");
       return ret;
     }
+    rfpll_shadow_clear(i2cdev, spi_sdosel);
   }
 
   close_i2c_dev(i2cdev);
@@ -4,6 +4,7 @@
 #include <unistd.h> // usleep
 
 #include "alpaca_i2c_utils.h"
+#include "alpaca_trace.h"
 #include "phytest_idt8a34001_regs.h"
 
 int main() {
@@ -14,10 +15,30 @@ int main() {
   init_i2c_dev(I2C_DEV_8A34001);
 
   printf("writing config to 8a34001...\n");
-  for (int i = 0; i < IDT8A34001_NUM_VALUES; i++) {
-    i2c_write(I2C_DEV_8A34001, idt_values[i], idt_lengths[i]);
+  int failed;
+  // the page register writes are only good while no other tool uses the chip
+  i2c_lock_dev(I2C_DEV_8A34001);
+  trace_phase("8a34001");
+  i2c_batch_begin(I2C_DEV_8A34001);
+  // page register of the 8A34001, a resend restores the page first
+  i2c_batch_page_reg(0xfc);
+  int res = 0;
+  for (int i = 0; i < IDT8A34001_NUM_VALUES && res == 0; i++) {
+    res = i2c_batch_add(idt_values[i], idt_lengths[i]);
+    if (res) {
+      i2c_batch_commit(&failed);
+      printf("failed queueing config value %d, batch message %d\n", i, failed);
+    }
   }
-  printf("should be programmed...\n");
+  if (res == 0) {
+    if (i2c_batch_commit(&failed)) {
+      printf("failed writing config value %d\n", failed);
+    } else {
+      printf("should be programmed...\n");
+    }
+  }
+  trace_phase_end();
+  i2c_unlock_dev(I2C_DEV_8A34001);
 
   close_i2c_dev(I2C_DEV_8A34001);
   close_i2c_bus();
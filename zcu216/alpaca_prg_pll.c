@@ -2,7 +2,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h> // uint8_t, uint16_t
-#include <unistd.h> // usleep 
 
 #include <errno.h>
 #include <assert.h>
@@ -15,7 +14,8 @@
 #include "alpaca_rfclks.h"
 
 void usage(char* name) {
-  printf("%s -lmk|-lmx <path/to/clk/file.txt>\n", name);
+  printf("%s -lmk|-lmx <path/to/clk/file.txt> [-d]\n", name);
+  printf("  -d  only program the registers that changed since the last load\n");
 }
 
 int main(int argc, char**argv) {
@@ -58,6 +58,15 @@ int main(int argc, char**argv) {
     return 0;
   }
 
+  int diff = 0;
+  if (argc > 3) {
+    if (strcmp(argv[3], "-d") != 0) {
+      usage(argv[0]);
+      return 0;
+    }
+    diff = 1;
+  }
+
   /* begin to process clock file */
   fileptr = fopen(tcsfile, "r");
   if (fileptr == NULL) {
@@ -93,9 +102,9 @@ int main(int argc, char**argv) {
   // init fabric gpio for SDIO readback (no IO Expander on zcu216/208)
   init_clk104_gpio(510);
 
-  // default init sdo mux to lmk
+  // default init sdo mux to lmk, the select is driven by the time the gpio
+  // writes return
   ret = set_sdo_mux(LMK_MUX_SEL);
-  usleep(0.5e6);
   if (ret == RFCLK_FAILURE) {
     printf("gpio sdo mux not set correctly, errorno: %d\n", ret);
     return 0;
@@ -108,10 +117,18 @@ int main(int argc, char**argv) {
   /* program */
   if (pll_type == 0) {
     // configure clk104 lmk (is an optional ref. clk input to tile 226)
-    ret = prog_pll(I2C_DEV_CLK104, LMK_SDO_SS, rp, prg_cnt, pkt_len);
+    ret = diff ? prog_pll_diff(I2C_DEV_CLK104, LMK_SDO_SS, pll_type, rp, prg_cnt, pkt_len)
+               : prog_pll(I2C_DEV_CLK104, LMK_SDO_SS, rp, prg_cnt, pkt_len);
+    if (ret == RFCLK_SUCCESS) {
+      ret = lmk0482x_wait_lock(I2C_DEV_CLK104, LMK_SDO_SS, lmk0482x_plan_plls(rp, prg_cnt), LMK_LOCK_TIMEOUT_US, NULL);
+    }
   } else {
     // configure clk104 adc lmx2594 to tile 225
-    ret = prog_pll(I2C_DEV_CLK104, LMX_SDO_SS224_225, rp, prg_cnt, pkt_len);
+    ret = diff ? prog_pll_diff(I2C_DEV_CLK104, LMX_SDO_SS224_225, pll_type, rp, prg_cnt, pkt_len)
+               : prog_pll(I2C_DEV_CLK104, LMX_SDO_SS224_225, rp, prg_cnt, pkt_len);
+    if (ret == RFCLK_SUCCESS && set_sdo_mux(LMX_MUX_SEL_224_225) == RFCLK_SUCCESS) {
+      ret = lmx2594_wait_lock(I2C_DEV_CLK104, LMX_SDO_SS224_225, rp[prg_cnt-1], LMX_LOCK_TIMEOUT_US, NULL);
+    }
   }
 
   /* readback */
@@ -124,6 +141,13 @@ int main(int argc, char**argv) {
   close_i2c_dev(I2C_DEV_CLK104);
   close_i2c_bus();
 
+  // a load that did not lock fails the tool so scripts need not sleep a
+  // worst case before using the clocks
+  if (ret != RFCLK_SUCCESS) {
+    printf("failed to program the rfpll or it did not lock\n");
+    return 1;
+  }
+
   return 0;
 
 }
@@ -43,6 +43,9 @@ int main(int argc, char**argv) {
   init_i2c_bus();
   // init spi bridge
   init_i2c_dev(i2cdev);
+
+  // keep other tools off the bus until done, an early return releases it on exit
+  i2c_lock_dev(i2cdev);
   // init fabric gpio for SDIO readback (no IO Expander on zcu216/208)
   init_clk104_gpio(510);
 
@@ -69,7 +72,9 @@ int main(int argc, char**argv) {
     printf("i2c could not reset pll\n");
     return ret;
   }
+  rfpll_shadow_clear(i2cdev, spi_sdosel);
 
+  i2c_unlock_dev(i2cdev);
   close_i2c_dev(i2cdev);
   close_i2c_bus();
 
@@ -1,14 +1,21 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h> // uint8_t, uint16_t
 #include <unistd.h> // usleep
 
 #include "alpaca_i2c_utils.h"
+#include "alpaca_topology.h"
 
 // i2c result values
 #define SUCCESS 0
 #define FAILURE 1
 
+// the A0h id block does not change while a module is plugged in, the A2h
+// status is refreshed at most this often however often it is asked for
+#define SFP_STATUS_TTL_US 100000
+#define SFP_POLL_INTERVAL_US 20000
+
 // Offsets within SFF status block
 enum {
     SFF_ID = 0,
@@ -36,23 +43,13 @@ static const SfpStatus sfp_st[] = {
 
 // read A2 status
 uint16_t get_sfp_status(I2CDev dev) {
-  // Read status byte
-  // Set pointer to SFF status register (see SFF-8742 spec for bit definitions)
-  uint8_t ret = FAILURE;
-  uint8_t sff_status_addr = SFF_STATUS;
+  // Read status byte (see SFF-8742 spec for bit definitions), served from the
+  // A2h register cache while it is fresh
   uint8_t sfp_status;
 
-  ret = i2c_write(I2C_DEV_SFP0_MOD, &sff_status_addr, sizeof(sff_status_addr));
-  if (ret==FAILURE) {
-    printf("failed to write sfp status\n");
-    return 256; // greater than 255, uint8_t, to indicate error
-  }
-
-  // Read status byte
-  ret = i2c_read(I2C_DEV_SFP0_MOD, &sfp_status, sizeof(sfp_status));
-  if (ret==FAILURE) {
+  if (i2c_read_cached(dev, SFF_STATUS, &sfp_status, sizeof(sfp_status)) == FAILURE) {
     printf("failed to read sfp status\n");
-    return 256;
+    return 256; // greater than 255, uint8_t, to indicate error
   }
 
   // Decode SFF Status
@@ -70,24 +67,51 @@ uint16_t get_sfp_status(I2CDev dev) {
   return sfp_status;
 }
 
-int main() {
-  uint8_t i2c_ret;
+void usage(char* name) {
+  printf("%s [-n <status polls>]\n", name);
+}
+
+int main(int argc, char**argv) {
+  int polls = 1;
   I2CDev sfp_tcvr[4] = {I2C_DEV_SFP0, I2C_DEV_SFP1, I2C_DEV_SFP2, I2C_DEV_SFP3};
   I2CDev sfp_mods[4] = {I2C_DEV_SFP0_MOD, I2C_DEV_SFP1_MOD, I2C_DEV_SFP2_MOD, I2C_DEV_SFP3_MOD};
 
+  if (argc == 3 && strcmp(argv[1], "-n") == 0) {
+    polls = atoi(argv[2]);
+  } else if (argc != 1) {
+    usage(argv[0]);
+    return 0;
+  }
+
   printf("****** ZCU216 probe zsfp+ cages ******\n");
   printf("opening i2c bus...\n");
   init_i2c_bus();
   for (uint8_t i=0; i<4; i++) {
     init_i2c_dev(sfp_tcvr[i]);
     init_i2c_dev(sfp_mods[i]);
+    i2c_cache_enable(sfp_tcvr[i], 256, I2C_CACHE_WINDOW, 0);
+    i2c_cache_enable(sfp_mods[i], 256, I2C_CACHE_WINDOW, SFP_STATUS_TTL_US);
   }
 
+  // background monitoring, the bus broker runs pll programming ahead of it
+  i2c_set_priority(I2C_PRIO_POLL);
+
+  // each cage's pointer writes and reads must not interleave with other
+  // tools, the bus is held per cage and released between polls
   uint8_t addr = 0;
   uint8_t sfp_found = 0;
   printf("checking for transceivers...\n");
   for (uint8_t i=0; i<4; i++) {
-    if (SUCCESS==i2c_write(sfp_tcvr[i], &addr, 1)) {
+    // a module the topology cache from i2c_scan saw is taken as present
+    // without touching the bus. The cages are hot-plug, a module may have gone
+    // in since the scan, so one the cache lists as absent is still probed
+    int present = topo_dev_present(sfp_tcvr[i]);
+    if (present <= 0) {
+      i2c_lock_dev(sfp_tcvr[i]);
+      present = (SUCCESS == i2c_write(sfp_tcvr[i], &addr, 1));
+      i2c_unlock_dev(sfp_tcvr[i]);
+    }
+    if (present) {
       printf("SFP%u found...\n", i);
       sfp_found = sfp_found | (1 << i);
     } else {
@@ -97,29 +121,37 @@ int main() {
   printf("sfp_found = %u\n", sfp_found);
 
   /* */
-  uint8_t buf[256]; 
-  uint8_t vendor[17];
-  uint8_t partno[17];
+  uint8_t type;
+  uint8_t vendor[17] = { 0 };
   const size_t vendor_len = 16;
 
-  // read sfp SFF-8742 A0 id block for cages 0-3
+  // read sfp SFF-8742 A0 id block for cages 0-3, both fields come from one
+  // block read of the first cache window
   printf("reading module vendor info...\n");
   for (uint8_t i=0; i<4; i++) {
-    if (sfp_found && (1<<i)) {
-      i2c_read(sfp_tcvr[i], buf, sizeof(buf));
-      memcpy(vendor, &buf[SFF_VENDOR], vendor_len);
-      printf("****SFP%u*****\nType: %x\nVendor: %s\n", i, buf[0], vendor);
+    if (sfp_found & (1<<i)) {
+      i2c_lock_dev(sfp_tcvr[i]);
+      i2c_read_cached(sfp_tcvr[i], SFF_ID, &type, 1);
+      i2c_read_cached(sfp_tcvr[i], SFF_VENDOR, vendor, vendor_len);
+      i2c_unlock_dev(sfp_tcvr[i]);
+      printf("****SFP%u*****\nType: %x\nVendor: %s\n", i, type, vendor);
     }
   }
 
   // read sfp SFF-8742 A2 status for cages 0-3
-  printf("reading module status...\n");
-  uint8_t sfp_status;
-  for (uint8_t i=0; i<4; i++) {
-    if (sfp_found && (1<<i)) {
-      sfp_status = get_sfp_status(sfp_mods[i]);
-    } else {
-      printf("SFP%u was not found, cannot read status\n", i);
+  for (int p=0; p<polls; p++) {
+    printf("reading module status...\n");
+    for (uint8_t i=0; i<4; i++) {
+      if (sfp_found & (1<<i)) {
+        i2c_lock_dev(sfp_mods[i]);
+        get_sfp_status(sfp_mods[i]);
+        i2c_unlock_dev(sfp_mods[i]);
+      } else {
+        printf("SFP%u was not found, cannot read status\n", i);
+      }
+    }
+    if (p < polls-1) {
+      usleep(SFP_POLL_INTERVAL_US);
     }
   }
 
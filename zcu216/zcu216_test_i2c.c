@@ -4,6 +4,7 @@
 #include <unistd.h> // usleep
 
 #include "alpaca_i2c_utils.h"
+#include "alpaca_trace.h"
 #include "idt8a34001_regs.h"
 
 int main() {
@@ -17,11 +18,9 @@ int main() {
 
   // example usage reading the mac address from the eeprom
   uint8_t mac_addr[6] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06};
-  // from m24128-br data sheet the eeprom is expecting two bytes to address a
-  // register. We set then 0x0020 as the offset and then read 6 bytes
-  uint8_t mac_offset[2] = {0x0, 0x20};
-
-  i2c_read_regs(I2C_DEV_EEPROM, mac_offset, 2,  mac_addr, 6);
+  // the mac address is 6 bytes at offset 0x0020, the m24128 geometry (two
+  // address bytes, 64 byte pages) comes from PLATFORM_I2C_EEPROMS
+  i2c_eeprom_read(I2C_DEV_EEPROM, 0x20, mac_addr, 6);
 
   for (int i=0; i<6; i++) {
     if(i) {
@@ -32,9 +31,13 @@ int main() {
   }
   printf("\n");
 
-  // exmple writing to eeprom and reading back
-  uint8_t msg[8] = {0x0, 0xf0, 0x74, 0x65, 0x61, 0x70, 0x6f, 0x74};
-  i2c_write(I2C_DEV_EEPROM, msg, 8);
+  // exmple writing to eeprom and reading back, the write returns once the
+  // eeprom has committed it
+  uint8_t msg[6] = {0x74, 0x65, 0x61, 0x70, 0x6f, 0x74};
+  uint8_t readback[7] = {0};
+  i2c_eeprom_write(I2C_DEV_EEPROM, 0xf0, msg, 6);
+  i2c_eeprom_read(I2C_DEV_EEPROM, 0xf0, readback, 6);
+  printf("eeprom at 0x00f0: %s\n", readback);
 
   // example usage reading from the 8a34001
   init_i2c_dev(I2C_DEV_8A34001);
@@ -95,10 +98,27 @@ int main() {
 
   printf("writing config to 8a34001...\n");
   // now lets program the 8a34001...
-  for (int i = 0; i < IDT8A34001_NUM_VALUES; i++) {
-    i2c_write(I2C_DEV_8A34001, idt_values[i], idt_lengths[i]);
+  int failed;
+  trace_phase("8a34001");
+  i2c_batch_begin(I2C_DEV_8A34001);
+  // page register of the 8A34001, a resend restores the page first
+  i2c_batch_page_reg(0xfc);
+  int res = 0;
+  for (int i = 0; i < IDT8A34001_NUM_VALUES && res == 0; i++) {
+    res = i2c_batch_add(idt_values[i], idt_lengths[i]);
+    if (res) {
+      i2c_batch_commit(&failed);
+      printf("failed queueing config value %d, batch message %d\n", i, failed);
+    }
+  }
+  if (res == 0) {
+    if (i2c_batch_commit(&failed)) {
+      printf("failed writing config value %d\n", failed);
+    } else {
+      printf("should be programmed...\n");
+    }
   }
-  printf("should be programmed...\n");
+  trace_phase_end();
 
   close_i2c_dev(I2C_DEV_EEPROM);
   close_i2c_dev(I2C_DEV_8A34001);
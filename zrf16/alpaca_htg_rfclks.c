@@ -16,9 +16,16 @@
 #include "alpaca_rfclks.h"
 
 void usage(char* name) {
-  printf("%s -lmk|-lmx <path/to/clk/file.txt>\n", name);
+  printf("%s -lmk|-lmx <path/to/clk/file.txt> [-d] [-a none|partial|full]\n", name);
+  printf("  -d  only program the registers that changed since the last load\n");
+  printf("  -a  how the LMX reuse the VCO calibration cached for this plan (default partial)\n");
 }
 
+// the four lmx2594's, their sdo select on the bridge and sdo mux select on the iox
+static const uint8_t lmx_sdo_ss[4] = { LMX_SDO_SS224_225, LMX_SDO_SS226_227, LMX_SDO_SS228_229, LMX_SDO_SS230_231 };
+static const uint8_t lmx_mux_sel[4] = { LMX_MUX_SEL_224_225, LMX_MUX_SEL_226_227, LMX_MUX_SEL_228_229,
+                                        LMX_MUX_SEL_230_231 };
+
 int main(int argc, char**argv) {
 
   // file data
@@ -59,6 +66,26 @@ int main(int argc, char**argv) {
     return 0;
   }
 
+  int diff = 0;
+  int assist = LMX_VCO_ASSIST_PARTIAL;
+  for (int i=3; i<argc; i++) {
+    if (strcmp(argv[i], "-d") == 0) {
+      diff = 1;
+    } else if (strcmp(argv[i], "-a") == 0 && i+1 < argc && strcmp(argv[i+1], "none") == 0) {
+      assist = LMX_VCO_ASSIST_NONE;
+      i++;
+    } else if (strcmp(argv[i], "-a") == 0 && i+1 < argc && strcmp(argv[i+1], "partial") == 0) {
+      assist = LMX_VCO_ASSIST_PARTIAL;
+      i++;
+    } else if (strcmp(argv[i], "-a") == 0 && i+1 < argc && strcmp(argv[i+1], "full") == 0) {
+      assist = LMX_VCO_ASSIST_FULL;
+      i++;
+    } else {
+      usage(argv[0]);
+      return 0;
+    }
+  }
+
   /* begin to process clock file */
   fileptr = fopen(tcsfile, "r");
   if (fileptr == NULL) {
@@ -115,13 +142,19 @@ int main(int argc, char**argv) {
   /* program */
   if (pll_type == 0) {
     // configure lmk
-    ret = prog_pll(I2C_DEV_LMK_SPI_BRIDGE, LMK_SDO_SS, rp, prg_cnt, pkt_len);
+    ret = diff ? prog_pll_diff(I2C_DEV_LMK_SPI_BRIDGE, LMK_SDO_SS, pll_type, rp, prg_cnt, pkt_len)
+               : prog_pll(I2C_DEV_LMK_SPI_BRIDGE, LMK_SDO_SS, rp, prg_cnt, pkt_len);
   } else {
-    // configure adc lmx2594's to all 4 adc tiles 224/225 and 226/227
-    ret = prog_pll(I2C_DEV_LMX_SPI_BRIDGE, LMX_SDO_SS224_225, rp, prg_cnt, pkt_len);
-    ret = prog_pll(I2C_DEV_LMX_SPI_BRIDGE, LMX_SDO_SS226_227, rp, prg_cnt, pkt_len);
-    ret = prog_pll(I2C_DEV_LMX_SPI_BRIDGE, LMX_SDO_SS228_229, rp, prg_cnt, pkt_len);
-    ret = prog_pll(I2C_DEV_LMX_SPI_BRIDGE, LMX_SDO_SS230_231, rp, prg_cnt, pkt_len);
+    // configure adc lmx2594's to all 4 adc tiles 224/225 and 226/227 and the
+    // dac tiles, each one's sdo routed to the bridge so its lock and VCO
+    // calibration can be read back
+    uint32_t lock_us;
+    ret = RFCLK_SUCCESS;
+    for (int i=0; i<4; i++) {
+      iox_gpio[1] = (iox_config[1] & ~MUX_SEL_BASE) | lmx_mux_sel[i];
+      i2c_write(I2C_DEV_IOX, iox_gpio, 2);
+      ret |= lmx2594_prog_cached(I2C_DEV_LMX_SPI_BRIDGE, lmx_sdo_ss[i], rp, prg_cnt, assist, diff, &lock_us);
+    }
   }
 
   /* readback */
@@ -138,6 +171,13 @@ int main(int argc, char**argv) {
   close_i2c_dev(I2C_DEV_IOX);
   close_i2c_bus();
 
+  // the lmx loads wait for lock, one that did not lock fails the tool (the
+  // lmk04832 status cannot be read back on this board)
+  if (ret != RFCLK_SUCCESS) {
+    printf("failed to program the rfpll or it did not lock\n");
+    return 1;
+  }
+
   return 0;
 }
 
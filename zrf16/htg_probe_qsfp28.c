@@ -4,6 +4,7 @@
 #include <unistd.h> // usleep
 
 #include "alpaca_i2c_utils.h"
+#include "alpaca_topology.h"
 
 // Offsets within SFF status block
 enum {
@@ -40,17 +41,38 @@ int main() {
   init_i2c_dev(I2C_DEV_QSFP28_B);
   init_i2c_dev(I2C_DEV_QSFP28_B_MOD);
 
+  // the id fields below come out of one block read per module
+  i2c_cache_enable(I2C_DEV_QSFP28_A, 256, I2C_CACHE_WINDOW, 0);
+  i2c_cache_enable(I2C_DEV_QSFP28_B, 256, I2C_CACHE_WINDOW, 0);
+
+  // background monitoring, the bus broker runs pll programming ahead of it
+  i2c_set_priority(I2C_PRIO_POLL);
+
+  // the pointer writes and reads below must not interleave with other tools
+  i2c_lock_dev(I2C_DEV_QSFP28_A);
+
   uint8_t addr = 0;
   int8_t qsfp28a_found = 0;
   int8_t qsfp28b_found = 0;
-  if (i2c_write(I2C_DEV_QSFP28_A, &addr, 1)) {
+  // a module the topology cache from i2c_scan saw is taken as present without
+  // touching the bus. The cages are hot-plug, a module may have gone in since
+  // the scan, so one the cache lists as absent is still probed
+  int a_present = topo_dev_present(I2C_DEV_QSFP28_A);
+  int b_present = topo_dev_present(I2C_DEV_QSFP28_B);
+  if (a_present <= 0) {
+    a_present = (i2c_write(I2C_DEV_QSFP28_A, &addr, 1) == 0);
+  }
+  if (b_present <= 0) {
+    b_present = (i2c_write(I2C_DEV_QSFP28_B, &addr, 1) == 0);
+  }
+  if (a_present) {
     printf("QSFP28_A found...\n");
     qsfp28a_found = 1;
   } else {
     printf("QSFP28_A not found...\n");
   }
 
-  if (i2c_write(I2C_DEV_QSFP28_B, &addr, 1)) {
+  if (b_present) {
     printf("QSFP28_B found...\n");
     qsfp28b_found = 1;
   } else {
@@ -58,26 +80,26 @@ int main() {
   }
 
   /* */
-  uint8_t buf[256]; 
-  uint8_t vendor[17];
-  uint8_t partno[17];
+  uint8_t type;
+  uint8_t vendor[17] = { 0 };
   const size_t vendor_len = 16;
 
   // read from qsfp28 a
   if (qsfp28a_found) {
-    i2c_read(I2C_DEV_QSFP28_A, buf, sizeof(buf));
-    memcpy(vendor, &buf[SFF_VENDOR], vendor_len);
-    printf("\n\n****QSFP28 A*****\nType: %x\nVendor: %s\n", buf[0], vendor);
+    i2c_read_cached(I2C_DEV_QSFP28_A, SFF_ID, &type, 1);
+    i2c_read_cached(I2C_DEV_QSFP28_A, SFF_VENDOR, vendor, vendor_len);
+    printf("\n\n****QSFP28 A*****\nType: %x\nVendor: %s\n", type, vendor);
   }
 
   // read from qsfp28 b
   if (qsfp28b_found) {
-    i2c_read(I2C_DEV_QSFP28_B, buf, sizeof(buf));
-    memcpy(vendor, &buf[SFF_VENDOR], vendor_len); 
-    printf("\n\n****QSFP28 B*****\nType: %x\nVendor: %s\n", buf[0], vendor);
+    i2c_read_cached(I2C_DEV_QSFP28_B, SFF_ID, &type, 1);
+    i2c_read_cached(I2C_DEV_QSFP28_B, SFF_VENDOR, vendor, vendor_len);
+    printf("\n\n****QSFP28 B*****\nType: %x\nVendor: %s\n", type, vendor);
   }
 
   /* */
+  i2c_unlock_dev(I2C_DEV_QSFP28_A);
   close_i2c_dev(I2C_DEV_QSFP28_A);
   close_i2c_dev(I2C_DEV_QSFP28_A_MOD);
   close_i2c_dev(I2C_DEV_QSFP28_B);
@@ -45,6 +45,9 @@ int main(int argc, char**argv) {
   // init spi bridge
   init_i2c_dev(i2cdev);
 
+  // keep other tools off the bus until done, an early return releases it on exit
+  i2c_lock_dev(i2cdev);
+
   // configure spi device
   uint8_t spi_config[2] = {0xf0, 0x03}; // spi bridge configuration packet
   ret = i2c_write(i2cdev, spi_config, 2);
@@ -64,6 +67,7 @@ int main(int argc, char**argv) {
       printf("i2c could not reset lmk pll\n");
       return ret;
     }
+    rfpll_shadow_clear(i2cdev, spi_sdosel);
   } else {
     rst_pkt = LMX2594_RST_VAL;
 
@@ -75,6 +79,7 @@ int main(int argc, char**argv) {
       printf("i2c could not reset tile 224/225 lmx pll\n");
       return ret;
     }
+    rfpll_shadow_clear(i2cdev, spi_sdosel);
 
     //lmx for tiles 226/227
     spi_sdosel = LMX_SDO_SS226_227;
@@ -84,8 +89,10 @@ int main(int argc, char**argv) {
       printf("i2c could not reset tile 226/227 lmx pll\n");
       return ret;
     }
+    rfpll_shadow_clear(i2cdev, spi_sdosel);
   }
 
+  i2c_unlock_dev(i2cdev);
   close_i2c_dev(i2cdev);
   close_i2c_bus();
 
@@ -3,6 +3,7 @@
 #include <unistd.h> // usleep
 
 #include "alpaca_i2c_utils.h"
+#include "alpaca_trace.h"
 
 #define SI5341_REG_CNT 387
 
@@ -425,6 +426,10 @@ int main() {
   init_i2c_bus();
   init_i2c_dev(I2C_DEV_SI5341);
 
+  // the page register writes are only good while no other tool uses the chip,
+  // an early return releases the lock on exit
+  i2c_lock_dev(I2C_DEV_SI5341);
+
   uint8_t idreg = 0x02;
   uint8_t rdbuf[2] = {0xff, 0xff};
 
@@ -444,6 +449,13 @@ int main() {
   printf("writing configuration...\n");
   uint8_t curpage = 0xff;
   uint8_t pkt[2] = {0x0, 0x0};
+  int failed;
+
+  // page and register writes are queued and sent in batches, a resend
+  // after a failure first rewrites the page (register 0x01) it started on
+  trace_phase("si5341");
+  i2c_batch_begin(I2C_DEV_SI5341);
+  i2c_batch_page_reg(0x01);
 
   for (int i=0; i<SI5341_REG_CNT; i++) {
     si_reg_t reg = si5341_reg_156M25[i];
@@ -454,9 +466,10 @@ int main() {
       printf("new page, updating page to 0x%02x from 0x%02x\n", regpage, curpage);
       pkt[0] = 0x01; // address of page register
       pkt[1] = regpage;
-      res = i2c_write(I2C_DEV_SI5341, pkt, 2);
+      res = i2c_batch_add(pkt, 2);
       if (res) {
-        printf("\nERROR: failed to update page to 0x%02x\n", regpage);
+        i2c_batch_commit(&failed);
+        printf("\nERROR: failed to update page to 0x%02x, batch message %d\n", regpage, failed);
         return res;
       }
       // update page value
@@ -470,15 +483,24 @@ int main() {
     printf("\t{0x%04x, 0x%02x}, pg: 0x%02x, pkt: {0x%02x, 0x%02x}\n", reg.address, reg.value, curpage, pkt[0], pkt[1]);
 
     // write reg data
-    res = i2c_write(I2C_DEV_SI5341, pkt, 2);
+    res = i2c_batch_add(pkt, 2);
     if (res) {
-      printf("\nERROR: failed writing data; reg=0x%04x, data=0x%02x\n", reg.address, reg.value);
+      i2c_batch_commit(&failed);
+      printf("\nERROR: failed writing data; reg=0x%04x, data=0x%02x, batch message %d\n", reg.address, reg.value, failed);
       return res;
     }
 
   }
 
+  res = i2c_batch_commit(&failed);
+  trace_phase_end();
+  if (res) {
+    printf("\nERROR: failed writing configuration, batch message %d\n", failed);
+    return res;
+  }
+
   //close
+  i2c_unlock_dev(I2C_DEV_SI5341);
   close_i2c_dev(I2C_DEV_SI5341);
   close_i2c_bus();
 